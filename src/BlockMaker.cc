@@ -572,7 +572,8 @@ void BlockMaker::consumeSovledShare(rd_kafka_message_t *rkmessage) {
   }
 
   // submit to bitcoind
-  LOG(INFO) << "submit block: " << newblk.GetHash().ToString();
+  LOG(INFO) << "submit block: " << newblk.GetHash().ToString()
+  << ", nVersion: " << Strings::Format("%08x", (uint32_t)newblk.nVersion);
   const string blockHex = EncodeHexBlock(newblk);
   submitBlockNonBlocking(blockHex);  // using thread
 
@@ -22,6 +22,7 @@
  THE SOFTWARE.
  */
 #include "Kafka.h"
+#include "Utils.h"
 
 #include "Common.h"
 #include <glog/logging.h>
@@ -341,7 +342,8 @@ rd_kafka_message_t *KafkaHighLevelConsumer::consumer(int timeout_ms) {
 ///////////////////////////////// KafkaProducer ////////////////////////////////
 KafkaProducer::KafkaProducer(const char *brokers, const char *topic, int partition):
 brokers_(brokers), topicStr_(topic), partition_(partition), conf_(rd_kafka_conf_new()),
-producer_(nullptr), topic_(nullptr)
+producer_(nullptr), topic_(nullptr),
+deliveryCallback_(nullptr), deliveryCallbackArg_(nullptr), isPolling_(false)
 {
   rd_kafka_conf_set_log_cb(conf_, kafkaLogger);  // set logger
   LOG(INFO) << "producer librdkafka version: " << rd_kafka_version_str();
@@ -368,6 +370,11 @@ producer_(nullptr), topic_(nullptr)
 }
 
 KafkaProducer::~KafkaProducer() {
+  if (pollThread_.joinable()) {
+    isPolling_ = false;
+    pollThread_.join();
+  }
+
   /* Poll to handle delivery reports */
   rd_kafka_poll(producer_, 0);
 
@@ -379,9 +386,38 @@ KafkaProducer::~KafkaProducer() {
   rd_kafka_destroy(producer_);     // Destroy the handle
 }
 
+void KafkaProducer::setDeliveryCallback(DeliveryCallback callback, void *arg) {
+  deliveryCallback_    = callback;
+  deliveryCallbackArg_ = arg;
+}
+
+void KafkaProducer::deliveryReport(rd_kafka_t *rk,
+                                   const rd_kafka_message_t *msg,
+                                   void *opaque) {
+  KafkaProducer *producer = static_cast<KafkaProducer *>(opaque);
+  // the produce time is the message's opaque
+  if (msg->err || msg->_private == nullptr) {
+    return;
+  }
+  const int64_t produceTime = (int64_t)(intptr_t)msg->_private;
+  producer->deliveryCallback_(getMonotonicTimeUs() - produceTime,
+                              producer->deliveryCallbackArg_);
+}
+
+void KafkaProducer::runPoll() {
+  while (isPolling_) {
+    rd_kafka_poll(producer_, 100);
+  }
+}
+
 bool KafkaProducer::setup(const std::map<string, string> *options) {
   char errstr[1024];
 
+  if (deliveryCallback_ != nullptr) {
+    rd_kafka_conf_set_dr_msg_cb(conf_, KafkaProducer::deliveryReport);
+    rd_kafka_conf_set_opaque(conf_, this);
+  }
+
   // rdkafka options:
   if (options != nullptr) {
     // merge options
@@ -426,6 +462,10 @@ bool KafkaProducer::setup(const std::map<string, string> *options) {
   topic_ = rd_kafka_topic_new(producer_, topicStr_.c_str(), topicConf);
   topicConf = NULL; /* Now owned by topic */
 
+  if (deliveryCallback_ != nullptr) {
+    isPolling_  = true;
+    pollThread_ = thread(&KafkaProducer::runPoll, this);
+  }
   return true;
 }
 
@@ -450,15 +490,20 @@ bool KafkaProducer::checkAlive() {
 }
 
 
-void KafkaProducer::produce(const void *payload, size_t len) {
+void KafkaProducer::produce(const void *payload, size_t len,
+                            const bool isTimed) {
   // rd_kafka_produce() is non-blocking
   // Returns 0 on success or -1 on error
+  void *msgOpaque = NULL;
+  if (isTimed && deliveryCallback_ != nullptr) {
+    msgOpaque = (void *)(intptr_t)getMonotonicTimeUs();
+  }
   int res = rd_kafka_produce(topic_, partition_, RD_KAFKA_MSG_F_COPY,
                              (void *)payload, len,
                              NULL, 0,  /* Optional key and its length */
                              /* Message opaque, provided in delivery report
                               * callback as msg_opaque. */
-                             NULL);
+                             msgOpaque);
   if (res == -1) {
     LOG(ERROR) << "produce to topic [ " << rd_kafka_topic_name(topic_)
     << "]: " << rd_kafka_err2str(rd_kafka_errno2err(errno));
@@ -147,13 +147,32 @@ class KafkaProducer {
   rd_kafka_t       *producer_;
   rd_kafka_topic_t *topic_;
 
+public:
+  // microseconds from produce() to the delivery report of a message
+  typedef void (*DeliveryCallback)(const int64_t latencyUs, void *arg);
+
+private:
+  DeliveryCallback deliveryCallback_;
+  void *deliveryCallbackArg_;
+  // serves the delivery reports, the threads which produce don't poll
+  thread pollThread_;
+  atomic<bool> isPolling_;
+
+  // rd_kafka_conf_set_dr_msg_cb()
+  static void deliveryReport(rd_kafka_t *rk, const rd_kafka_message_t *msg,
+                             void *opaque);
+  void runPoll();
+
 public:
   KafkaProducer(const char *brokers, const char *topic, int partition);
   ~KafkaProducer();
 
+  // call it before setup(). the reports are served by a thread of the
+  // producer, only the messages produced with isTimed reach the callback
+  void setDeliveryCallback(DeliveryCallback callback, void *arg);
   bool setup(const std::map<string, string> *options=nullptr);
   bool checkAlive();
-  void produce(const void *payload, size_t len);
+  void produce(const void *payload, size_t len, const bool isTimed = false);
 };
 
 #endif
@@ -215,7 +215,8 @@ string MySQLConnection::getVariable(const char *name) {
 }
 
 bool multiInsert(MySQLConnection &db, const string &table,
-                 const string &fields, const vector<string> &values) {
+                 const string &fields, const vector<string> &values,
+                 const string &onDuplicate) {
   string sqlPrefix = Strings::Format("INSERT INTO `%s`(%s) VALUES ",
                                      table.c_str(), fields.c_str());
 
@@ -230,6 +231,7 @@ bool multiInsert(MySQLConnection &db, const string &table,
     // notice: you need to make sure mysql.max_allowed_packet is over than 16MB
     if (sql.length() >= 16*1024*1024) {
       sql.resize(sql.length() - 1);
+      sql += onDuplicate;
       if (!db.execute(sql.c_str())) {
         return false;
       }
@@ -239,6 +241,7 @@ bool multiInsert(MySQLConnection &db, const string &table,
 
   if (sql.length() > sqlPrefix.length()) {
     sql.resize(sql.length() - 1);
+    sql += onDuplicate;
     if (!db.execute(sql.c_str())) {
       return false;
     }
@@ -123,7 +123,9 @@ public:
   string getVariable(const char *name);
 };
 
+// onDuplicate: appended to every statement, eg. "ON DUPLICATE KEY UPDATE ..."
 bool multiInsert(MySQLConnection &db, const string &table,
-                 const string &fields, const vector<string> &values);
+                 const string &fields, const vector<string> &values,
+                 const string &onDuplicate = "");
 
 #endif
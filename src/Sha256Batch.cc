@@ -0,0 +1,590 @@
+/*
+ The MIT License (MIT)
+
+ Copyright (c) [2016] [BTC.COM]
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+#include "Sha256Batch.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define SHA256_BATCH_X86
+  #include <cpuid.h>
+  #include <immintrin.h>
+#endif
+
+static const uint32_t kSHA256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t kSHA256IV[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// the 2nd block of a 64 bytes message
+static const uint8_t kPadding64[64] = {
+  0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00  // 512 bits
+};
+
+static inline uint32_t readBE32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] <<  8) |  (uint32_t)p[3];
+}
+
+static inline void writeBE32(uint8_t *p, const uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >>  8);
+  p[3] = (uint8_t)v;
+}
+
+static inline void writeBE64(uint8_t *p, const uint64_t v) {
+  writeBE32(p,     (uint32_t)(v >> 32));
+  writeBE32(p + 4, (uint32_t)v);
+}
+
+static inline uint32_t ror32(const uint32_t x, const int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline void writeDigest(uint8_t *out, const uint32_t *state) {
+  for (int i = 0; i < 8; i++) {
+    writeBE32(out + i * 4, state[i]);
+  }
+}
+
+
+//////////////////////////////////// scalar ////////////////////////////////////
+static void transformScalar(uint32_t *s, const uint8_t *block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = readBE32(block + i * 4);
+  }
+  for (int i = 16; i < 64; i++) {
+    const uint32_t s0 = ror32(w[i-15], 7) ^ ror32(w[i-15], 18) ^ (w[i-15] >> 3);
+    const uint32_t s1 = ror32(w[i-2], 17) ^ ror32(w[i-2],  19) ^ (w[i-2] >> 10);
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  }
+
+  uint32_t a = s[0], b = s[1], c = s[2], d = s[3];
+  uint32_t e = s[4], f = s[5], g = s[6], h = s[7];
+  for (int i = 0; i < 64; i++) {
+    const uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +
+                        ((e & f) ^ (~e & g)) + kSHA256K[i] + w[i];
+    const uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +
+                        ((a & b) | (c & (a | b)));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+  s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+
+#ifdef SHA256_BATCH_X86
+//////////////////////////////////// SHA-NI ////////////////////////////////////
+//
+// 4 rounds per group. msgs[] is a ring of the message words W[4g .. 4g+3],
+// the schedule of the next groups is computed along with the rounds.
+//
+#define SHANI_QROUND(g, Mg, Mprev, Mnext, Mafter3)                           \
+  do {                                                                       \
+    msg = _mm_add_epi32(Mg, _mm_loadu_si128((const __m128i *)&kSHA256K[4*(g)])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                     \
+    if ((g) >= 3 && (g) <= 14) {                                             \
+      tmp   = _mm_alignr_epi8(Mg, Mprev, 4);                                 \
+      Mnext = _mm_add_epi32(Mnext, tmp);                                     \
+      Mnext = _mm_sha256msg2_epu32(Mnext, Mg);                               \
+    }                                                                        \
+    msg = _mm_shuffle_epi32(msg, 0x0E);                                      \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);                     \
+    if ((g) >= 1 && (g) <= 12) {                                             \
+      Mafter3 = _mm_sha256msg1_epu32(Mafter3, Mg);                           \
+    }                                                                        \
+  } while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void transformShaNi(uint32_t *s, const uint8_t *block) {
+  const __m128i kMask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                       0x0405060700010203ULL);
+  __m128i state0, state1, msg, tmp;
+  __m128i m0, m1, m2, m3;
+
+  // ABCD EFGH -> ABEF CDGH
+  tmp    = _mm_loadu_si128((const __m128i *)&s[0]);
+  state1 = _mm_loadu_si128((const __m128i *)&s[4]);
+  tmp    = _mm_shuffle_epi32(tmp, 0xB1);          // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);       // EFGH
+  state0 = _mm_alignr_epi8(tmp, state1, 8);       // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);    // CDGH
+
+  const __m128i abefSave = state0;
+  const __m128i cdghSave = state1;
+
+  m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(block +  0)), kMask);
+  m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(block + 16)), kMask);
+  m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(block + 32)), kMask);
+  m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(block + 48)), kMask);
+
+  SHANI_QROUND( 0, m0, m3, m1, m3);
+  SHANI_QROUND( 1, m1, m0, m2, m0);
+  SHANI_QROUND( 2, m2, m1, m3, m1);
+  SHANI_QROUND( 3, m3, m2, m0, m2);
+  SHANI_QROUND( 4, m0, m3, m1, m3);
+  SHANI_QROUND( 5, m1, m0, m2, m0);
+  SHANI_QROUND( 6, m2, m1, m3, m1);
+  SHANI_QROUND( 7, m3, m2, m0, m2);
+  SHANI_QROUND( 8, m0, m3, m1, m3);
+  SHANI_QROUND( 9, m1, m0, m2, m0);
+  SHANI_QROUND(10, m2, m1, m3, m1);
+  SHANI_QROUND(11, m3, m2, m0, m2);
+  SHANI_QROUND(12, m0, m3, m1, m3);
+  SHANI_QROUND(13, m1, m0, m2, m0);
+  SHANI_QROUND(14, m2, m1, m3, m1);
+  SHANI_QROUND(15, m3, m2, m0, m2);
+
+  state0 = _mm_add_epi32(state0, abefSave);
+  state1 = _mm_add_epi32(state1, cdghSave);
+
+  // ABEF CDGH -> ABCD EFGH
+  tmp    = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);       // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);    // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);       // ABEF
+
+  _mm_storeu_si128((__m128i *)&s[0], state0);
+  _mm_storeu_si128((__m128i *)&s[4], state1);
+}
+
+#undef SHANI_QROUND
+
+
+///////////////////////////////////// AVX2 /////////////////////////////////////
+#define AVX2_ROR(x, n) \
+  _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+__attribute__((target("avx2")))
+static void transform8Avx2(uint32_t *const *s, const uint8_t *const *blocks) {
+  __m256i w[16];
+  for (int i = 0; i < 16; i++) {
+    w[i] = _mm256_set_epi32(readBE32(blocks[7] + i * 4), readBE32(blocks[6] + i * 4),
+                            readBE32(blocks[5] + i * 4), readBE32(blocks[4] + i * 4),
+                            readBE32(blocks[3] + i * 4), readBE32(blocks[2] + i * 4),
+                            readBE32(blocks[1] + i * 4), readBE32(blocks[0] + i * 4));
+  }
+
+  __m256i v[8];
+  for (int j = 0; j < 8; j++) {
+    v[j] = _mm256_set_epi32(s[7][j], s[6][j], s[5][j], s[4][j],
+                            s[3][j], s[2][j], s[1][j], s[0][j]);
+  }
+  __m256i a = v[0], b = v[1], c = v[2], d = v[3];
+  __m256i e = v[4], f = v[5], g = v[6], h = v[7];
+
+  for (int i = 0; i < 64; i++) {
+    __m256i wi;
+    if (i < 16) {
+      wi = w[i];
+    } else {
+      const __m256i w15 = w[(i - 15) & 15];
+      const __m256i w2  = w[(i - 2)  & 15];
+      const __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(w15, 7),
+                                                           AVX2_ROR(w15, 18)),
+                                          _mm256_srli_epi32(w15, 3));
+      const __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(w2, 17),
+                                                           AVX2_ROR(w2, 19)),
+                                          _mm256_srli_epi32(w2, 10));
+      wi = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0),
+                            _mm256_add_epi32(w[(i - 7) & 15], s1));
+      w[i & 15] = wi;
+    }
+
+    const __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(e, 6),
+                                                             AVX2_ROR(e, 11)),
+                                            AVX2_ROR(e, 25));
+    const __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                        _mm256_andnot_si256(e, g));
+    const __m256i t1 = _mm256_add_epi32(
+        _mm256_add_epi32(_mm256_add_epi32(h, sigma1), ch),
+        _mm256_add_epi32(_mm256_set1_epi32(kSHA256K[i]), wi));
+    const __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(a, 2),
+                                                             AVX2_ROR(a, 13)),
+                                            AVX2_ROR(a, 22));
+    const __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+                                        _mm256_and_si256(c, _mm256_or_si256(a, b)));
+    const __m256i t2 = _mm256_add_epi32(sigma0, maj);
+
+    h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+    d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+  }
+
+  v[0] = _mm256_add_epi32(v[0], a); v[1] = _mm256_add_epi32(v[1], b);
+  v[2] = _mm256_add_epi32(v[2], c); v[3] = _mm256_add_epi32(v[3], d);
+  v[4] = _mm256_add_epi32(v[4], e); v[5] = _mm256_add_epi32(v[5], f);
+  v[6] = _mm256_add_epi32(v[6], g); v[7] = _mm256_add_epi32(v[7], h);
+
+  uint32_t out[8][8];  // [word][lane]
+  for (int j = 0; j < 8; j++) {
+    _mm256_storeu_si256((__m256i *)out[j], v[j]);
+  }
+  for (int lane = 0; lane < 8; lane++) {
+    for (int j = 0; j < 8; j++) {
+      s[lane][j] = out[j][lane];
+    }
+  }
+}
+
+#undef AVX2_ROR
+#endif  // SHA256_BATCH_X86
+
+
+////////////////////////////////// SHA256Batch /////////////////////////////////
+static SHA256Batch::Impl detectImpl() {
+#ifdef SHA256_BATCH_X86
+  if (SHA256Batch::isImplSupported(SHA256Batch::IMPL_SHANI)) {
+    return SHA256Batch::IMPL_SHANI;
+  }
+  if (SHA256Batch::isImplSupported(SHA256Batch::IMPL_AVX2)) {
+    return SHA256Batch::IMPL_AVX2;
+  }
+#endif
+  return SHA256Batch::IMPL_SCALAR;
+}
+
+static SHA256Batch::Impl gSHA256BatchImpl = detectImpl();
+
+const size_t SHA256Batch::kMaxBatchSize_;
+
+bool SHA256Batch::isImplSupported(const Impl impl) {
+  if (impl == IMPL_SCALAR) {
+    return true;
+  }
+#ifdef SHA256_BATCH_X86
+  uint32_t eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  const bool hasSSSE3  = (ecx & (1u <<  9)) != 0;
+  const bool hasSSE41  = (ecx & (1u << 19)) != 0;
+  const bool hasOSXSAVE = (ecx & (1u << 27)) != 0;
+  const bool hasAVX    = (ecx & (1u << 28)) != 0;
+
+  uint32_t ebx7 = 0;
+  if (__get_cpuid_max(0, nullptr) >= 7) {
+    __cpuid_count(7, 0, eax, ebx7, ecx, edx);
+  }
+
+  if (impl == IMPL_SHANI) {
+    return hasSSSE3 && hasSSE41 && (ebx7 & (1u << 29)) != 0;
+  }
+  if (impl == IMPL_AVX2) {
+    if (!hasAVX || !hasOSXSAVE || (ebx7 & (1u << 5)) == 0) {
+      return false;
+    }
+    // the OS must save the YMM registers
+    uint32_t xcr0Lo, xcr0Hi;
+    __asm__ ("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+    return (xcr0Lo & 0x6) == 0x6;
+  }
+#endif
+  return false;
+}
+
+bool SHA256Batch::setImpl(const Impl impl) {
+  if (!isImplSupported(impl)) {
+    return false;
+  }
+  gSHA256BatchImpl = impl;
+  return true;
+}
+
+SHA256Batch::Impl SHA256Batch::getImpl() {
+  return gSHA256BatchImpl;
+}
+
+const char *SHA256Batch::getImplName() {
+  switch (gSHA256BatchImpl) {
+    case IMPL_SHANI:
+      return "sha-ni";
+    case IMPL_AVX2:
+      return "avx2-8way";
+    default:
+      return "scalar";
+  }
+}
+
+// single buffer transform
+static inline void transformOne(uint32_t *s, const uint8_t *block) {
+#ifdef SHA256_BATCH_X86
+  if (gSHA256BatchImpl == SHA256Batch::IMPL_SHANI) {
+    transformShaNi(s, block);
+    return;
+  }
+#endif
+  transformScalar(s, block);
+}
+
+void SHA256Batch::transform(uint32_t *const *states,
+                            const uint8_t *const *blocks, const size_t n) {
+  size_t i = 0;
+
+#ifdef SHA256_BATCH_X86
+  if (gSHA256BatchImpl == IMPL_AVX2) {
+    for (; i + 8 <= n; i += 8) {
+      transform8Avx2(states + i, blocks + i);
+    }
+    //
+    // the rest: fill the lanes with a dummy state, still faster than
+    // scalar when more than 2 lanes are used.
+    //
+    if (n - i > 2) {
+      uint32_t dummyState[8];
+      uint32_t *s[8];
+      const uint8_t *b[8];
+      for (size_t j = 0; j < 8; j++) {
+        s[j] = (i + j < n) ? states[i + j] : dummyState;
+        b[j] = (i + j < n) ? blocks[i + j] : blocks[i];
+      }
+      memcpy(dummyState, kSHA256IV, sizeof(dummyState));
+      transform8Avx2(s, b);
+      i = n;
+    }
+  }
+#endif
+
+  for (; i < n; i++) {
+    transformOne(states[i], blocks[i]);
+  }
+}
+
+
+//////////////////////////////// SHA256Midstate ////////////////////////////////
+void SHA256Midstate::reset() {
+  memcpy(state_, kSHA256IV, sizeof(state_));
+  memset(buf_, 0, sizeof(buf_));
+  bufLen_ = 0;
+  length_ = 0;
+}
+
+void SHA256Midstate::write(const uint8_t *data, size_t len) {
+  length_ += len;
+
+  if (bufLen_ > 0) {
+    const size_t n = std::min(len, (size_t)(64 - bufLen_));
+    memcpy(buf_ + bufLen_, data, n);
+    bufLen_ += n;
+    data    += n;
+    len     -= n;
+    if (bufLen_ < 64) {
+      return;
+    }
+    transformOne(state_, buf_);
+    bufLen_ = 0;
+  }
+
+  while (len >= 64) {
+    transformOne(state_, data);
+    data += 64;
+    len  -= 64;
+  }
+
+  memcpy(buf_, data, len);
+  bufLen_ = len;
+}
+
+void SHA256Midstate::finalize(uint8_t hash[32]) const {
+  uint32_t state[8];
+  uint8_t  blocks[128];
+  memcpy(state, state_, sizeof(state));
+  memset(blocks, 0, sizeof(blocks));
+  memcpy(blocks, buf_, bufLen_);
+  blocks[bufLen_] = 0x80;
+
+  const size_t nBlocks = (bufLen_ + 9 > 64) ? 2 : 1;
+  writeBE64(blocks + nBlocks * 64 - 8, length_ * 8);
+  for (size_t i = 0; i < nBlocks; i++) {
+    transformOne(state, blocks + i * 64);
+  }
+  writeDigest(hash, state);
+}
+
+
+////////////////////////////////// SHA256Batch /////////////////////////////////
+//
+// states[i] hold SHA256(x), replace them with SHA256(SHA256(x))
+//
+static void sha256OfDigests(uint32_t (*states)[8], uint32_t **statePtrs,
+                            const uint8_t **blockPtrs, uint8_t (*blocks)[64],
+                            const size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint8_t *p = blocks[i];
+    writeDigest(p, states[i]);
+    memset(p + 32, 0, 32);
+    p[32] = 0x80;
+    p[62] = 0x01;  // 256 bits
+    memcpy(states[i], kSHA256IV, sizeof(states[i]));
+    statePtrs[i] = states[i];
+    blockPtrs[i] = p;
+  }
+  SHA256Batch::transform(statePtrs, blockPtrs, n);
+}
+
+static void hashSharesBatch(ShareHashItem *items, const size_t n) {
+  uint32_t       states[SHA256Batch::kMaxBatchSize_][8];
+  uint8_t        blocks[SHA256Batch::kMaxBatchSize_][64];
+  uint32_t      *statePtrs[SHA256Batch::kMaxBatchSize_];
+  const uint8_t *blockPtrs[SHA256Batch::kMaxBatchSize_];
+  uint32_t       nBlocks[SHA256Batch::kMaxBatchSize_];
+  size_t         offsets[SHA256Batch::kMaxBatchSize_];
+
+  //
+  // 1. coinbase: continue from the prefix's midstate with the padded tail
+  //
+  static thread_local std::vector<uint8_t> tails;
+  size_t total = 0;
+  uint32_t maxBlocks = 0;
+  for (size_t i = 0; i < n; i++) {
+    const SHA256Midstate *prefix = items[i].coinbasePrefix_;
+    const size_t len = prefix->bufLen_ + 8 + items[i].coinbase2Len_;
+    nBlocks[i] = (uint32_t)((len + 9 + 63) / 64);
+    offsets[i] = total;
+    total += nBlocks[i] * 64;
+    maxBlocks = std::max(maxBlocks, nBlocks[i]);
+  }
+  if (tails.size() < total) {
+    tails.resize(total);
+  }
+  for (size_t i = 0; i < n; i++) {
+    const SHA256Midstate *prefix = items[i].coinbasePrefix_;
+    uint8_t *p = tails.data() + offsets[i];
+    size_t len = 0;
+    memcpy(p + len, prefix->buf_, prefix->bufLen_);
+    len += prefix->bufLen_;
+    memcpy(p + len, items[i].extraNonce2_, 8);
+    len += 8;
+    memcpy(p + len, items[i].coinbase2_, items[i].coinbase2Len_);
+    len += items[i].coinbase2Len_;
+    memset(p + len, 0, nBlocks[i] * 64 - len);
+    p[len] = 0x80;
+    writeBE64(p + nBlocks[i] * 64 - 8,
+              (prefix->length_ + 8 + items[i].coinbase2Len_) * 8);
+
+    memcpy(states[i], prefix->state_, sizeof(states[i]));
+  }
+  for (uint32_t r = 0; r < maxBlocks; r++) {
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (r < nBlocks[i]) {
+        statePtrs[m] = states[i];
+        blockPtrs[m] = tails.data() + offsets[i] + r * 64;
+        m++;
+      }
+    }
+    SHA256Batch::transform(statePtrs, blockPtrs, m);
+  }
+  sha256OfDigests(states, statePtrs, blockPtrs, blocks, n);
+
+  //
+  // 2. merkle branch: SHA256d(hash + step), 64 bytes message
+  //
+  uint32_t maxSteps = 0;
+  for (size_t i = 0; i < n; i++) {
+    maxSteps = std::max(maxSteps, items[i].merkleBranchSize_);
+  }
+  for (uint32_t k = 0; k < maxSteps; k++) {
+    size_t m = 0;
+    size_t active[SHA256Batch::kMaxBatchSize_];
+    for (size_t i = 0; i < n; i++) {
+      if (k < items[i].merkleBranchSize_) {
+        active[m++] = i;
+      }
+    }
+    for (size_t j = 0; j < m; j++) {
+      const size_t i = active[j];
+      writeDigest(blocks[i], states[i]);
+      memcpy(blocks[i] + 32, items[i].merkleBranch_[k].begin(), 32);
+      memcpy(states[i], kSHA256IV, sizeof(states[i]));
+      statePtrs[j] = states[i];
+      blockPtrs[j] = blocks[i];
+    }
+    SHA256Batch::transform(statePtrs, blockPtrs, m);
+    for (size_t j = 0; j < m; j++) {
+      blockPtrs[j] = kPadding64;
+    }
+    SHA256Batch::transform(statePtrs, blockPtrs, m);
+
+    // second SHA256 of the active ones
+    for (size_t j = 0; j < m; j++) {
+      const size_t i = active[j];
+      uint8_t *p = blocks[i];
+      writeDigest(p, states[i]);
+      memset(p + 32, 0, 32);
+      p[32] = 0x80;
+      p[62] = 0x01;  // 256 bits
+      memcpy(states[i], kSHA256IV, sizeof(states[i]));
+      blockPtrs[j] = p;
+    }
+    SHA256Batch::transform(statePtrs, blockPtrs, m);
+  }
+
+  //
+  // 3. block header, 80 bytes
+  //
+  for (size_t i = 0; i < n; i++) {
+    writeDigest(items[i].header_ + 36, states[i]);  // hashMerkleRoot
+    memcpy(states[i], kSHA256IV, sizeof(states[i]));
+    statePtrs[i] = states[i];
+    blockPtrs[i] = items[i].header_;
+  }
+  SHA256Batch::transform(statePtrs, blockPtrs, n);
+  for (size_t i = 0; i < n; i++) {
+    uint8_t *p = blocks[i];
+    memcpy(p, items[i].header_ + 64, 16);
+    memset(p + 16, 0, 48);
+    p[16] = 0x80;
+    p[62] = 0x02;  // 640 bits
+    p[63] = 0x80;
+    blockPtrs[i] = p;
+  }
+  SHA256Batch::transform(statePtrs, blockPtrs, n);
+  sha256OfDigests(states, statePtrs, blockPtrs, blocks, n);
+
+  for (size_t i = 0; i < n; i++) {
+    writeDigest(items[i].hash_.begin(), states[i]);
+  }
+}
+
+void SHA256Batch::hashShares(ShareHashItem *items, const size_t n) {
+  for (size_t i = 0; i < n; i += kMaxBatchSize_) {
+    hashSharesBatch(items + i, std::min(kMaxBatchSize_, n - i));
+  }
+}
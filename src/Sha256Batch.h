@@ -0,0 +1,105 @@
+/*
+ The MIT License (MIT)
+
+ Copyright (c) [2016] [BTC.COM]
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+#ifndef SHA256_BATCH_H_
+#define SHA256_BATCH_H_
+
+#include "Common.h"
+
+#include <uint256.h>
+
+
+//////////////////////////////// SHA256Midstate ////////////////////////////////
+//
+// SHA256 state after hashing a prefix. the prefix's tail which is not a whole
+// block yet is kept in buf_, so the state can be continued with any data.
+//
+struct SHA256Midstate {
+  uint32_t state_[8];
+  uint8_t  buf_[64];
+  uint32_t bufLen_;
+  uint64_t length_;  // bytes of the whole prefix
+
+  SHA256Midstate() { reset(); }
+
+  void reset();
+  void write(const uint8_t *data, size_t len);
+  // SHA256 of the prefix, use for testing
+  void finalize(uint8_t hash[32]) const;
+};
+
+
+///////////////////////////////// ShareHashItem ////////////////////////////////
+//
+// one share to hash:
+//   coinbase   = coinbasePrefix_ + extraNonce2_ + coinbase2_
+//   merkleRoot = SHA256d(... SHA256d(SHA256d(coinbase) + branch[0]) ...)
+//   hash_      = SHA256d(header_), merkleRoot is written into header_
+//
+struct ShareHashItem {
+  const SHA256Midstate *coinbasePrefix_;
+  uint8_t  extraNonce2_[8];     // as it is in the coinbase, big-endian
+  const uint8_t *coinbase2_;
+  uint32_t coinbase2Len_;
+  const uint256 *merkleBranch_;
+  uint32_t merkleBranchSize_;
+
+  uint8_t  header_[80];         // serialized CBlockHeader
+  uint256  hash_;               // output: block hash
+};
+
+
+////////////////////////////////// SHA256Batch /////////////////////////////////
+//
+// Multi-buffer SHA256. Independent messages are hashed in lanes, so the
+// SIMD units are used even though every single SHA256 is sequential.
+// The kernel is selected at runtime: SHA-NI > AVX2 (8 lanes) > scalar.
+//
+class SHA256Batch {
+public:
+  enum Impl {
+    IMPL_SCALAR = 0,
+    IMPL_SHANI  = 1,
+    IMPL_AVX2   = 2
+  };
+
+  // max items of one hashShares() call, larger batches are split
+  static const size_t kMaxBatchSize_ = 256;
+
+  static bool isImplSupported(const Impl impl);
+  // return false if the cpu doesn't support it
+  static bool setImpl(const Impl impl);
+  static Impl getImpl();
+  static const char *getImplName();
+
+  //
+  // compress one 64 bytes block into each state, states[i] are 8 words
+  //
+  static void transform(uint32_t *const *states, const uint8_t *const *blocks,
+                        const size_t n);
+
+  // hash the shares in lanes, items are independent of each other
+  static void hashShares(ShareHashItem *items, const size_t n);
+};
+
+#endif
@@ -53,6 +53,90 @@ string getStatsFilePath(const string &dataDir, time_t ts) {
                          date("%F", ts).c_str());
 }
 
+
+/////////////////////////////// LatencyHistogram ///////////////////////////////
+LatencyHistogram::LatencyHistogram() {
+  reset();
+}
+
+int32_t LatencyHistogram::getBucketIdx(const uint64_t value) {
+  if (value == 0) {
+    return 0;
+  }
+  const int32_t idx = 64 - __builtin_clzll(value);
+  return std::min(idx, kBuckets_ - 1);
+}
+
+void LatencyHistogram::record(const uint64_t value) {
+  buckets_[getBucketIdx(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+
+  uint64_t curMax = max_.load(std::memory_order_relaxed);
+  while (value > curMax &&
+         !max_.compare_exchange_weak(curMax, value, std::memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::reset() {
+  for (int32_t i = 0; i < kBuckets_; i++) {
+    buckets_[i] = 0;
+  }
+  count_ = 0;
+  sum_   = 0;
+  max_   = 0;
+}
+
+uint64_t LatencyHistogram::getCount() const {
+  return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getMax() const {
+  return max_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::getMean() const {
+  const uint64_t count = getCount();
+  return count == 0 ? 0 : sum_.load(std::memory_order_relaxed) / count;
+}
+
+uint64_t LatencyHistogram::getPercentile(const double p) const {
+  uint64_t counts[kBuckets_];
+  uint64_t total = 0;
+  for (int32_t i = 0; i < kBuckets_; i++) {
+    counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  // rank of the percentile, start from 1
+  const uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p * total + 0.5));
+  uint64_t acc = 0;
+  for (int32_t i = 0; i < kBuckets_; i++) {
+    acc += counts[i];
+    if (acc >= rank) {
+      // the last bucket is unbounded, the max value is the best bound we have
+      if (i == 0) {
+        return 0;
+      }
+      if (i == kBuckets_ - 1) {
+        return getMax();
+      }
+      return std::min<uint64_t>((1ull << i) - 1, getMax());
+    }
+  }
+  return getMax();
+}
+
+string LatencyHistogram::toString() const {
+  return Strings::Format("count: %" PRIu64", mean: %" PRIu64", p50: %" PRIu64
+                         ", p90: %" PRIu64", p99: %" PRIu64", max: %" PRIu64,
+                         getCount(), getMean(), getPercentile(0.5),
+                         getPercentile(0.9), getPercentile(0.99), getMax());
+}
+
 ////////////////////////////////  WorkerShares  ////////////////////////////////
 WorkerShares::WorkerShares(const int64_t workerId, const int32_t userId):
 workerId_(workerId), userId_(userId), acceptCount_(0),
@@ -456,19 +540,21 @@ void StatsServer::consumeShareLog(rd_kafka_message_t *rkmessage) {
     return;
   }
 
-  Share share;
-  if (rkmessage->len != sizeof(Share)) {
-    LOG(ERROR) << "sharelog message size(" << rkmessage->len << ") is not: " << sizeof(Share);
+  // one share or a batch of shares, see ShareLogBatch
+  shareLogBuf_.clear();
+  if (!ShareLogBatch::decode((const uint8_t *)rkmessage->payload,
+                             rkmessage->len, shareLogBuf_)) {
+    LOG(ERROR) << "invalid sharelog message, size: " << rkmessage->len;
     return;
   }
-  memcpy((uint8_t *)&share, (const uint8_t *)rkmessage->payload, rkmessage->len);
 
-  if (!share.isValid()) {
-    LOG(ERROR) << "invalid share: " << share.toString();
-    return;
+  for (const auto &share : shareLogBuf_) {
+    if (!share.isValid()) {
+      LOG(ERROR) << "invalid share: " << share.toString();
+      continue;
+    }
+    processShare(share);
   }
-
-  processShare(share);
 }
 
 bool StatsServer::setupThreadConsume() {
@@ -661,79 +747,56 @@ void StatsServer::consumeCommonEvents(rd_kafka_message_t *rkmessage) {
   }
 
   // update worker status
-  if (r["type"].str() == "worker_update") {
-    // check fields
-    if (r["content"]["user_id"].type()     != Utilities::JS::type::Int ||
-        r["content"]["worker_id"].type()   != Utilities::JS::type::Int ||
-        r["content"]["worker_name"].type() != Utilities::JS::type::Str ||
-        r["content"]["miner_agent"].type() != Utilities::JS::type::Str) {
-      LOG(ERROR) << "common event `worker_update` missing some fields";
+  const string type = r["type"].str();
+  if (type == "worker_update" || type == "worker_update_batch") {
+    WorkerUpdateBatch workers;
+    JsonNode content = r["content"];
+    if (!workers.addEvent(type, content)) {
+      LOG(ERROR) << "common event `" << type << "` missing some fields";
       return;
     }
-
-    int32_t userId    = r["content"]["user_id"].int32();
-    int64_t workerId  = r["content"]["worker_id"].int64();
-    string workerName = filterWorkerName(r["content"]["worker_name"].str());
-    string minerAgent = filterWorkerName(r["content"]["miner_agent"].str());
-
-    updateWorkerStatus(userId, workerId, workerName.c_str(), minerAgent.c_str());
+    updateWorkerStatus(workers);
   }
 
 }
 
-bool StatsServer::updateWorkerStatus(const int32_t userId, const int64_t workerId,
-                                     const char *workerName, const char *minerAgent) {
-  string sql;
-  char **row = nullptr;
-  MySQLResult res;
+bool StatsServer::updateWorkerStatus(const WorkerUpdateBatch &workers) {
+  if (workers.empty()) {
+    return true;
+  }
   const string nowStr = date("%F %T");
 
-  // find the miner
-  sql = Strings::Format("SELECT `group_id`,`worker_name` FROM `mining_workers` "
-                        " WHERE `puid`=%d AND `worker_id`= %" PRId64"",
-                        userId, workerId);
-  poolDBCommonEvents_.query(sql, res);
-
-  if (res.numRows() != 0 && (row = res.nextRow()) != nullptr) {
-    const int32_t groupId = atoi(row[0]);
-
-    // group Id == 0: means the miner's status is 'deleted'
-    // we need to move from 'deleted' group to 'default' group.
-    sql = Strings::Format("UPDATE `mining_workers` SET `group_id`=%d, "
-                          " `worker_name`=\"%s\", `miner_agent`=\"%s\", "
-                          " `updated_at`=\"%s\" "
-                          " WHERE `puid`=%d AND `worker_id`= %" PRId64"",
-                          groupId == 0 ? userId * -1 : groupId,
-                          workerName, minerAgent,
-                          nowStr.c_str(),
-                          userId, workerId);
-    if (poolDBCommonEvents_.execute(sql) == false) {
-      LOG(ERROR) << "update worker status failure";
-      return false;
-    }
-  }
-  else {
-    // we have to use 'ON DUPLICATE KEY UPDATE', because 'statshttpd' may insert
-    // items to table.mining_workers between we 'select' and 'insert' gap.
-    // 'statshttpd' will always set an empty 'worker_name'.
-    sql = Strings::Format("INSERT INTO `mining_workers`(`puid`,`worker_id`,"
-                          " `group_id`,`worker_name`,`miner_agent`,"
-                          " `created_at`,`updated_at`) "
-                          " VALUES(%d,%" PRId64",%d,\"%s\",\"%s\",\"%s\",\"%s\")"
-                          " ON DUPLICATE KEY UPDATE "
-                          " `worker_name`= \"%s\",`miner_agent`=\"%s\",`updated_at`=\"%s\" ",
-                          userId, workerId,
-                          userId * -1,  // default group id
-                          workerName, minerAgent,
-                          nowStr.c_str(), nowStr.c_str(),
-                          workerName, minerAgent,
-                          nowStr.c_str());
-    if (poolDBCommonEvents_.execute(sql) == false) {
-      LOG(ERROR) << "insert worker name failure";
-      return false;
-    }
+  //
+  // one statement for all of the workers. we have to use 'ON DUPLICATE KEY
+  // UPDATE', because 'statshttpd' may insert items to table.mining_workers
+  // at any time, and it will always set an empty 'worker_name'.
+  // group Id == 0: means the miner's status is 'deleted', we need to move
+  // it from 'deleted' group to 'default' group (userId * -1).
+  //
+  const string fields = "`puid`,`worker_id`,`group_id`,`worker_name`,"
+                        "`miner_agent`,`created_at`,`updated_at`";
+  const string onDuplicate = " ON DUPLICATE KEY UPDATE "
+  " `group_id`=IF(`group_id`=0,VALUES(`group_id`),`group_id`),"
+  " `worker_name`=VALUES(`worker_name`),`miner_agent`=VALUES(`miner_agent`),"
+  " `updated_at`=VALUES(`updated_at`)";
+
+  vector<string> values;
+  values.reserve(workers.size());
+  for (const auto &item : workers.getItems()) {
+    values.push_back(Strings::Format("%d,%" PRId64",%d,\"%s\",\"%s\",\"%s\",\"%s\"",
+                                     item.userId_, item.workerId_,
+                                     item.userId_ * -1,  // default group id
+                                     item.workerName_.c_str(),
+                                     item.minerAgent_.c_str(),
+                                     nowStr.c_str(), nowStr.c_str()));
   }
 
+  if (!multiInsert(poolDBCommonEvents_, "mining_workers", fields, values,
+                   onDuplicate)) {
+    LOG(ERROR) << "update worker status failure, workers: " << workers.size();
+    return false;
+  }
+  DLOG(INFO) << "update worker status, workers: " << workers.size();
   return true;
 }
 
@@ -1052,21 +1115,23 @@ void ShareLogWriter::consumeShareLog(rd_kafka_message_t *rkmessage) {
     return;
   }
 
-  if (rkmessage->len != sizeof(Share)) {
-    LOG(ERROR) << "sharelog message size(" << rkmessage->len << ") is not: " << sizeof(Share);
+  // one share or a batch of shares, see ShareLogBatch
+  const size_t oldSize = shares_.size();
+  if (!ShareLogBatch::decode((const uint8_t *)rkmessage->payload,
+                             rkmessage->len, shares_)) {
+    LOG(ERROR) << "invalid sharelog message, size: " << rkmessage->len;
     return;
   }
 
-  shares_.push_back(Share());
-  Share *share = &(*shares_.rbegin());
-
-  memcpy((uint8_t *)share, (const uint8_t *)rkmessage->payload, rkmessage->len);
-
-  if (!share->isValid()) {
-    LOG(ERROR) << "invalid share: " << share->toString();
-    shares_.pop_back();
-    return;
-  }
+  auto itr = std::remove_if(shares_.begin() + oldSize, shares_.end(),
+                            [](const Share &share) {
+    if (!share.isValid()) {
+      LOG(ERROR) << "invalid share: " << share.toString();
+      return true;
+    }
+    return false;
+  });
+  shares_.erase(itr, shares_.end());
 }
 
 void ShareLogWriter::tryCloseOldHanders() {
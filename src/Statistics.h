@@ -37,18 +37,76 @@
 
 #include <string.h>
 #include <pthread.h>
+#include <algorithm>
 #include <memory>
+#include <type_traits>
 
 #define STATS_SLIDING_WINDOW_SECONDS 3600
 
 
+/////////////////////////////// LatencyHistogram ///////////////////////////////
+// thread safe, lock free
+//
+// log2 buckets: bucket 0 counts value 0, bucket i counts [2^(i-1), 2^i).
+// unit of the values is up to the caller, usually microseconds.
+//
+class LatencyHistogram {
+public:
+  static const int32_t kBuckets_ = 40;
+
+private:
+  atomic<uint64_t> buckets_[kBuckets_];
+  atomic<uint64_t> count_;
+  atomic<uint64_t> sum_;
+  atomic<uint64_t> max_;
+
+public:
+  LatencyHistogram();
+
+  static int32_t getBucketIdx(const uint64_t value);
+
+  void record(const uint64_t value);
+  void reset();
+
+  uint64_t getCount() const;
+  uint64_t getMax() const;
+  uint64_t getMean() const;
+  // upper bound of the bucket which contains the percentile, p: [0, 1]
+  uint64_t getPercentile(const double p) const;
+
+  // count: xx, mean: xx, p50: xx, p90: xx, p99: xx, max: xx
+  string toString() const;
+};
+
+
 ////////////////////////////////// StatsWindow /////////////////////////////////
 // none thread safe
+//
+// besides the ring of elements, a ring of running sums is kept:
+//   cums_[i % windowSize_] = elements[startRingIdx_] + ... + elements[i]
+// for i in (maxRingIdx_ - windowSize_, maxRingIdx_], and expiredCum_ is the
+// running sum at (maxRingIdx_ - windowSize_), so any span inside the window is
+// the difference of two running sums. insert() of the latest index is O(1), a
+// late index costs O(maxRingIdx_ - ringIdx).
+//
+// for floating T, mapMultiply()/mapDivide() only change scale_, elements are
+// stored divided by it. for integer T they stay eager because each element
+// should be truncated on its own.
+//
 template <typename T>
 class StatsWindow {
   int64_t maxRingIdx_;  // max ring idx
+  int64_t startRingIdx_;  // elements before it have never been inserted
   int32_t windowSize_;
   std::vector<T> elements_;
+  std::vector<T> cums_;
+  T expiredCum_;
+  T scale_;
+
+  void advance();
+  T getCum(const int64_t ringIdx) const;
+  void rebuildCums();
+  void applyScale();
 
 public:
   StatsWindow(const int windowSize);
@@ -71,28 +129,106 @@ public:
 
 template <typename T>
 StatsWindow<T>::StatsWindow(const int windowSize)
-:maxRingIdx_(-1), windowSize_(windowSize), elements_(windowSize) {
+:maxRingIdx_(-1), startRingIdx_(0), windowSize_(windowSize),
+elements_(windowSize), cums_(windowSize), expiredCum_(0), scale_(1) {
+}
+
+template <typename T>
+void StatsWindow<T>::advance() {
+  const int32_t slot = (maxRingIdx_ + 1) % windowSize_;
+  const T cur = cums_[maxRingIdx_ % windowSize_];
+
+  expiredCum_ = cums_[slot];  // the slot is going to be reused
+  maxRingIdx_++;
+  elements_[slot] = 0;  // reset
+  cums_[slot] = cur;
+
+  // rebase once per round, keeps the running sums as small as the window
+  if (slot == windowSize_ - 1) {
+    for (int32_t i = 0; i < windowSize_; i++) {
+      cums_[i] -= expiredCum_;
+    }
+    expiredCum_ = 0;
+  }
+}
+
+template <typename T>
+T StatsWindow<T>::getCum(const int64_t ringIdx) const {
+  if (ringIdx <= maxRingIdx_ - windowSize_) {
+    return expiredCum_;
+  }
+  if (ringIdx < startRingIdx_) {
+    return 0;
+  }
+  return cums_[ringIdx % windowSize_];
+}
+
+template <typename T>
+void StatsWindow<T>::rebuildCums() {
+  T cum = 0;
+  expiredCum_ = 0;
+  if (maxRingIdx_ == -1) {
+    std::fill(cums_.begin(), cums_.end(), 0);
+    return;
+  }
+  for (int64_t i = std::max(maxRingIdx_ - windowSize_ + 1, startRingIdx_);
+       i <= maxRingIdx_; i++) {
+    cum += elements_[i % windowSize_];
+    cums_[i % windowSize_] = cum;
+  }
+}
+
+template <typename T>
+void StatsWindow<T>::applyScale() {
+  for (int32_t i = 0; i < windowSize_; i++) {
+    elements_[i] *= scale_;
+  }
+  scale_ = 1;
+  rebuildCums();
 }
 
 template <typename T>
 void StatsWindow<T>::mapMultiply(const T val) {
+  if (std::is_floating_point<T>::value && val != 0) {
+    scale_ *= val;
+    // don't let the stored elements overflow or lose precision
+    if (scale_ > 4294967296.0 || scale_ < 1.0 / 4294967296.0) {
+      applyScale();
+    }
+    return;
+  }
   for (int32_t i = 0; i < windowSize_; i++) {
     elements_[i] *= val;
   }
+  scale_ = 1;
+  rebuildCums();
 }
 
 template <typename T>
 void StatsWindow<T>::mapDivide(const T val) {
+  if (std::is_floating_point<T>::value) {
+    scale_ /= val;
+    if (scale_ > 4294967296.0 || scale_ < 1.0 / 4294967296.0) {
+      applyScale();
+    }
+    return;
+  }
   for (int32_t i = 0; i < windowSize_; i++) {
     elements_[i] /= val;
   }
+  rebuildCums();
 }
 
 template <typename T>
 void StatsWindow<T>::clear() {
-  maxRingIdx_ = -1;
+  maxRingIdx_   = -1;
+  startRingIdx_ = 0;
   elements_.clear();
   elements_.resize(windowSize_);
+  cums_.clear();
+  cums_.resize(windowSize_);
+  expiredCum_ = 0;
+  scale_      = 1;
 }
 
 template <typename T>
@@ -104,21 +240,29 @@ bool StatsWindow<T>::insert(const int64_t curRingIdx, const T val) {
   if (maxRingIdx_ == -1/* first insert */ ||
       curRingIdx - maxRingIdx_ > windowSize_/* all data expired */) {
     clear();
-    maxRingIdx_ = curRingIdx;
+    maxRingIdx_   = curRingIdx;
+    startRingIdx_ = curRingIdx;
   }
 
   while (maxRingIdx_ < curRingIdx) {
-    maxRingIdx_++;
-    elements_[maxRingIdx_ % windowSize_] = 0;  // reset
+    advance();
   }
 
-  elements_[curRingIdx % windowSize_] += val;
+  const T v = val / scale_;
+  elements_[curRingIdx % windowSize_] += v;
+
+  // (maxRingIdx_ - windowSize_) shares its slot with maxRingIdx_
+  const int64_t from = (curRingIdx > maxRingIdx_ - windowSize_) ?
+                       curRingIdx : maxRingIdx_;
+  startRingIdx_ = std::min(startRingIdx_, from);
+  for (int64_t i = from; i <= maxRingIdx_; i++) {
+    cums_[i % windowSize_] += v;
+  }
   return true;
 }
 
 template <typename T>
 T StatsWindow<T>::sum(int64_t beginRingIdx, int len) {
-  T sum = 0;
   len = std::min(len, windowSize_);
   if (len <= 0 || beginRingIdx - len >= maxRingIdx_) {
     return 0;
@@ -127,11 +271,18 @@ T StatsWindow<T>::sum(int64_t beginRingIdx, int len) {
   if (beginRingIdx > maxRingIdx_) {
     beginRingIdx = maxRingIdx_;
   }
+
+  if (endRingIdx >= maxRingIdx_ - windowSize_) {
+    return (getCum(beginRingIdx) - getCum(endRingIdx)) * scale_;
+  }
+
+  // the span is older than the window, walk the slots as they are
+  T sum = 0;
   while (beginRingIdx > endRingIdx) {
     sum += elements_[beginRingIdx % windowSize_];
     beginRingIdx--;
   }
-  return sum;
+  return sum * scale_;
 }
 
 template <typename T>
@@ -140,6 +291,222 @@ T StatsWindow<T>::sum(int64_t beginRingIdx) {
 }
 
 
+/////////////////////////////// FixedStatsWindow ///////////////////////////////
+// none thread safe
+//
+// StatsWindow without any allocation, the elements and the running sums are
+// in the object, for the small windows kept by every session. the same running
+// sums and lazy scale as StatsWindow, see it.
+//
+template <typename T, int32_t N>
+class FixedStatsWindow {
+  int64_t maxRingIdx_;  // max ring idx
+  int64_t startRingIdx_;  // elements before it have never been inserted
+  T elements_[N];
+  T cums_[N];
+  T expiredCum_;
+  T scale_;
+
+  void advance();
+  T getCum(const int64_t ringIdx) const;
+  void rebuildCums();
+  void applyScale();
+
+public:
+  FixedStatsWindow() { clear(); }
+
+  void clear();
+
+  bool insert(const int64_t ringIdx, const T val);
+
+  T sum(int64_t beginRingIdx, int len) const;
+  T sum(int64_t beginRingIdx) const { return sum(beginRingIdx, N); }
+
+  void mapMultiply(const T val);
+  void mapDivide  (const T val);
+
+  // the scaled slots, for the state of a session handed over by hot restart.
+  // writer: put(v), reader: get(v) returns false if there is no more
+  template <typename Writer> void save(Writer &writer) const;
+  template <typename Reader> bool restore(Reader &reader);
+};
+
+//----------------------
+
+template <typename T, int32_t N>
+void FixedStatsWindow<T, N>::advance() {
+  const int32_t slot = (maxRingIdx_ + 1) % N;
+  const T cur = cums_[maxRingIdx_ % N];
+
+  expiredCum_ = cums_[slot];  // the slot is going to be reused
+  maxRingIdx_++;
+  elements_[slot] = 0;  // reset
+  cums_[slot] = cur;
+
+  // rebase once per round, keeps the running sums as small as the window
+  if (slot == N - 1) {
+    for (int32_t i = 0; i < N; i++) {
+      cums_[i] -= expiredCum_;
+    }
+    expiredCum_ = 0;
+  }
+}
+
+template <typename T, int32_t N>
+T FixedStatsWindow<T, N>::getCum(const int64_t ringIdx) const {
+  if (ringIdx <= maxRingIdx_ - N) {
+    return expiredCum_;
+  }
+  if (ringIdx < startRingIdx_) {
+    return 0;
+  }
+  return cums_[ringIdx % N];
+}
+
+template <typename T, int32_t N>
+void FixedStatsWindow<T, N>::rebuildCums() {
+  T cum = 0;
+  expiredCum_ = 0;
+  if (maxRingIdx_ == -1) {
+    std::fill(cums_, cums_ + N, (T)0);
+    return;
+  }
+  for (int64_t i = std::max(maxRingIdx_ - N + 1, startRingIdx_);
+       i <= maxRingIdx_; i++) {
+    cum += elements_[i % N];
+    cums_[i % N] = cum;
+  }
+}
+
+template <typename T, int32_t N>
+void FixedStatsWindow<T, N>::applyScale() {
+  for (int32_t i = 0; i < N; i++) {
+    elements_[i] *= scale_;
+  }
+  scale_ = 1;
+  rebuildCums();
+}
+
+template <typename T, int32_t N>
+void FixedStatsWindow<T, N>::clear() {
+  maxRingIdx_   = -1;
+  startRingIdx_ = 0;
+  std::fill(elements_, elements_ + N, (T)0);
+  std::fill(cums_, cums_ + N, (T)0);
+  expiredCum_ = 0;
+  scale_      = 1;
+}
+
+template <typename T, int32_t N>
+bool FixedStatsWindow<T, N>::insert(const int64_t ringIdx, const T val) {
+  if (maxRingIdx_ > ringIdx + N) {  // too small index, drop it
+    return false;
+  }
+  if (maxRingIdx_ == -1 || ringIdx - maxRingIdx_ > N) {
+    clear();
+    maxRingIdx_   = ringIdx;
+    startRingIdx_ = ringIdx;
+  }
+  while (maxRingIdx_ < ringIdx) {
+    advance();
+  }
+
+  const T v = val / scale_;
+  elements_[ringIdx % N] += v;
+
+  // (maxRingIdx_ - N) shares its slot with maxRingIdx_
+  const int64_t from = (ringIdx > maxRingIdx_ - N) ? ringIdx : maxRingIdx_;
+  startRingIdx_ = std::min(startRingIdx_, from);
+  for (int64_t i = from; i <= maxRingIdx_; i++) {
+    cums_[i % N] += v;
+  }
+  return true;
+}
+
+template <typename T, int32_t N>
+T FixedStatsWindow<T, N>::sum(int64_t beginRingIdx, int len) const {
+  len = std::min(len, (int)N);
+  if (len <= 0 || beginRingIdx - len >= maxRingIdx_) {
+    return 0;
+  }
+  int64_t endRingIdx = beginRingIdx - len;
+  if (beginRingIdx > maxRingIdx_) {
+    beginRingIdx = maxRingIdx_;
+  }
+
+  if (endRingIdx >= maxRingIdx_ - N) {
+    return (getCum(beginRingIdx) - getCum(endRingIdx)) * scale_;
+  }
+
+  // the span is older than the window, walk the slots as they are
+  T sum = 0;
+  while (beginRingIdx > endRingIdx) {
+    sum += elements_[beginRingIdx % N];
+    beginRingIdx--;
+  }
+  return sum * scale_;
+}
+
+template <typename T, int32_t N>
+void FixedStatsWindow<T, N>::mapMultiply(const T val) {
+  if (std::is_floating_point<T>::value && val != 0) {
+    scale_ *= val;
+    // don't let the stored elements overflow or lose precision
+    if (scale_ > 4294967296.0 || scale_ < 1.0 / 4294967296.0) {
+      applyScale();
+    }
+    return;
+  }
+  for (int32_t i = 0; i < N; i++) {
+    elements_[i] *= val;
+  }
+  scale_ = 1;
+  rebuildCums();
+}
+
+template <typename T, int32_t N>
+void FixedStatsWindow<T, N>::mapDivide(const T val) {
+  if (std::is_floating_point<T>::value) {
+    scale_ /= val;
+    if (scale_ > 4294967296.0 || scale_ < 1.0 / 4294967296.0) {
+      applyScale();
+    }
+    return;
+  }
+  for (int32_t i = 0; i < N; i++) {
+    elements_[i] /= val;
+  }
+  rebuildCums();
+}
+
+template <typename T, int32_t N>
+template <typename Writer>
+void FixedStatsWindow<T, N>::save(Writer &writer) const {
+  writer.put(maxRingIdx_);
+  for (int32_t i = 0; i < N; i++) {
+    writer.put((T)(elements_[i] * scale_));
+  }
+}
+
+template <typename T, int32_t N>
+template <typename Reader>
+bool FixedStatsWindow<T, N>::restore(Reader &reader) {
+  clear();
+  if (!reader.get(maxRingIdx_)) {
+    return false;
+  }
+  for (int32_t i = 0; i < N; i++) {
+    if (!reader.get(elements_[i])) {
+      return false;
+    }
+  }
+  // the slots out of the window are zero, so the sums can start at it
+  startRingIdx_ = std::max<int64_t>(maxRingIdx_ - N + 1, 0);
+  rebuildCums();
+  return true;
+}
+
+
 ///////////////////////////////  WorkerStatus  /////////////////////////////////
 // some miners use the same userName & workerName in different meachines, they
 // will be the same StatsWorkerItem, the unique key is (userId_ + workId_)
@@ -265,6 +632,7 @@ class StatsServer {
 
   KafkaConsumer kafkaConsumer_;  // consume topic: 'ShareLog'
   thread threadConsume_;
+  vector<Share> shareLogBuf_;    // shares of the consuming message
 
   KafkaConsumer kafkaConsumerCommonEvents_;  // consume topic: 'CommonEvents'
   thread threadConsumeCommonEvents_;
@@ -290,8 +658,7 @@ class StatsServer {
 
   void runThreadConsumeCommonEvents();
   void consumeCommonEvents(rd_kafka_message_t *rkmessage);
-  bool updateWorkerStatus(const int32_t userId, const int64_t workerId,
-                          const char *workerName, const char *minerAgent);
+  bool updateWorkerStatus(const WorkerUpdateBatch &workers);
 
   void _processShare(WorkerKey &key1, WorkerKey &key2, const Share &share);
   void processShare(const Share &share);
@@ -85,12 +85,619 @@ const char * StratumError::toString(int err) {
       return "Time too old";
     case TIME_TOO_NEW:
       return "Time too new";
+    case ILLEGAL_VERMASK:
+      return "Invalid version mask";
 
     case UNKNOWN: default:
       return "Unknown";
   }
 }
 
+///////////////////////////////// MiningSubmit /////////////////////////////////
+static inline const char *skipJsonSpaces(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+    p++;
+  }
+  return p;
+}
+
+// p is at the opening quote, return the closing quote.
+// nullptr if not closed or there is an escape
+static inline const char *scanJsonString(const char *p, const char *end) {
+  for (p++; p < end; p++) {
+    if (*p == '"') {
+      return p;
+    }
+    if (*p == '\\') {
+      return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+static inline const char *scanJsonDigits(const char *p, const char *end) {
+  const char *begin = p;
+  while (p < end && *p >= '0' && *p <= '9') {
+    p++;
+  }
+  return (p == begin) ? nullptr : p;
+}
+
+// skip a value of an unknown key: string without escape, number, literal
+static const char *skipJsonSimpleValue(const char *p, const char *end) {
+  if (*p == '"') {
+    p = scanJsonString(p, end);
+    return (p == nullptr) ? nullptr : p + 1;
+  }
+
+  if (*p == '-' || (*p >= '0' && *p <= '9')) {
+    if (*p == '-') { p++; }
+    if ((p = scanJsonDigits(p, end)) == nullptr) { return nullptr; }
+    if (p < end && *p == '.') {
+      if ((p = scanJsonDigits(p + 1, end)) == nullptr) { return nullptr; }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+      p++;
+      if (p < end && (*p == '+' || *p == '-')) { p++; }
+      if ((p = scanJsonDigits(p, end)) == nullptr) { return nullptr; }
+    }
+    return p;
+  }
+
+  static const char *literals[] = {"true", "false", "null"};
+  for (const char *literal : literals) {
+    const size_t len = strlen(literal);
+    if ((size_t)(end - p) >= len && memcmp(p, literal, len) == 0) {
+      return p + len;
+    }
+  }
+  return nullptr;
+}
+
+bool MiningSubmit::parse(const char *p, const char *end) {
+  bool hasId = false, hasMethod = false, hasParams = false;
+
+  p = skipJsonSpaces(p, end);
+  if (p >= end || *p != '{') {
+    return false;
+  }
+  p++;
+
+  while (true) {
+    // key
+    p = skipJsonSpaces(p, end);
+    if (p >= end || *p != '"') {
+      return false;
+    }
+    const char *keyEnd = scanJsonString(p, end);
+    if (keyEnd == nullptr) {
+      return false;
+    }
+    const char *key = p + 1;
+    const size_t keyLen = keyEnd - key;
+
+    p = skipJsonSpaces(keyEnd + 1, end);
+    if (p >= end || *p != ':') {
+      return false;
+    }
+    p = skipJsonSpaces(p + 1, end);
+    if (p >= end) {
+      return false;
+    }
+
+    // value
+    if (keyLen == 2 && memcmp(key, "id", 2) == 0) {
+      if (hasId) { return false; }
+      hasId = true;
+
+      if (*p == '"') {
+        const char *idEnd = scanJsonString(p, end);
+        if (idEnd == nullptr) { return false; }
+        id_    = p + 1;
+        idLen_ = idEnd - id_;
+        isIdString_ = true;
+        p = idEnd + 1;
+      }
+      else if (*p == 'n') {
+        if (end - p < 4 || memcmp(p, "null", 4) != 0) { return false; }
+        id_    = nullptr;
+        idLen_ = 0;
+        isIdString_ = false;
+        p += 4;
+      }
+      else {
+        const char *idBegin = p;
+        if (*p == '-') { p++; }
+        if ((p = scanJsonDigits(p, end)) == nullptr) { return false; }
+        id_    = idBegin;
+        idLen_ = p - idBegin;
+        isIdString_ = false;
+      }
+    }
+    else if (keyLen == 6 && memcmp(key, "method", 6) == 0) {
+      if (hasMethod || *p != '"') { return false; }
+      hasMethod = true;
+
+      const char *methodEnd = scanJsonString(p, end);
+      if (methodEnd == nullptr || methodEnd - p - 1 != 13 ||
+          memcmp(p + 1, "mining.submit", 13) != 0) {
+        return false;
+      }
+      p = methodEnd + 1;
+    }
+    else if (keyLen == 6 && memcmp(key, "params", 6) == 0) {
+      if (hasParams || *p != '[') { return false; }
+      hasParams = true;
+
+      // all params are strings, the ones after version bits are ignored
+      size_t n = 0;
+      params_[5] = nullptr;
+      p++;
+      while (true) {
+        p = skipJsonSpaces(p, end);
+        if (p >= end || *p != '"') { return false; }
+        const char *paramEnd = scanJsonString(p, end);
+        if (paramEnd == nullptr) { return false; }
+        if (n < 6) {
+          params_[n] = p + 1;
+        }
+        n++;
+
+        p = skipJsonSpaces(paramEnd + 1, end);
+        if (p >= end) { return false; }
+        if (*p == ',') { p++; continue; }
+        if (*p == ']') { p++; break; }
+        return false;
+      }
+      if (n < 5) {
+        return false;
+      }
+    }
+    else {
+      if ((p = skipJsonSimpleValue(p, end)) == nullptr) {
+        return false;
+      }
+    }
+
+    p = skipJsonSpaces(p, end);
+    if (p >= end) {
+      return false;
+    }
+    if (*p == ',') { p++; continue; }
+    if (*p == '}') { p++; break; }
+    return false;
+  }
+
+  // nothing but spaces after the object
+  if (skipJsonSpaces(p, end) != end) {
+    return false;
+  }
+  return hasId && hasMethod && hasParams;
+}
+
+void MiningSubmit::getIdStr(string &idStr) const {
+  if (id_ == nullptr) {
+    idStr.assign("null");
+  } else if (isIdString_) {
+    idStr.assign(1, '"');
+    idStr.append(id_, idLen_);
+    idStr.push_back('"');
+  } else {
+    idStr.assign(id_, idLen_);
+  }
+}
+
+//////////////////////////////// BinaryStratum /////////////////////////////////
+const uint8_t BinaryStratum::kVersion_;
+const size_t  BinaryStratum::kHeaderSize_;
+const size_t  BinaryStratum::kMaxFrameSize_;
+const size_t  BinaryStratum::kMaxAgentLen_;
+const size_t  BinaryStratum::kNotifySessionOffset_;
+const size_t  BinaryStratum::kNotifySessionSize_;
+
+// sizes of the fixed messages, header included
+static const size_t kBinSubscribeMinSize     = 4 + 1 + 4;
+static const size_t kBinAuthorizeMinSize     = 4 + 1;
+static const size_t kBinSubmitSize           = 4 + 1 + 8 + 4 + 4 + 4;
+static const size_t kBinSubscribeResultSize  = 4 + 1 + 4 + 1 + 4;
+static const size_t kBinResultSize           = 4 + 1;
+static const size_t kBinSetDiffSize          = 4 + 8;
+static const size_t kBinNotifyMinSize        = 4 + 1 + 1 + 32 + 4 + 4 + 4 + 2 + 2 + 1;
+
+// reserves the header, it's written by finishBinFrame()
+static inline size_t beginBinFrame(const uint8_t cmd, string &out) {
+  const size_t begin = out.size();
+  out.push_back((char)CMD_MAGIC_NUMBER);
+  out.push_back((char)cmd);
+  out.append(2, '\0');
+  return begin;
+}
+
+static inline bool finishBinFrame(const size_t begin, string &out) {
+  const size_t len = out.size() - begin;
+  if (len > BinaryStratum::kMaxFrameSize_) {
+    out.resize(begin);
+    return false;
+  }
+  const uint16_t len16 = (uint16_t)len;
+  memcpy(&out[begin + 2], &len16, 2);
+  return true;
+}
+
+template <typename T>
+static inline void appendBin(const T &v, string &out) {
+  out.append((const char *)&v, sizeof(T));
+}
+
+template <typename T>
+static inline T readBin(const uint8_t *p) {
+  T v;
+  memcpy(&v, p, sizeof(T));
+  return v;
+}
+
+// the frame header of a message of the type
+static inline bool checkBinFrame(const uint8_t *p, const size_t len,
+                                 const uint8_t cmd) {
+  uint8_t frameCmd;
+  uint16_t frameLen;
+  return len >= BinaryStratum::kHeaderSize_ &&
+         BinaryStratum::parseHeader(p, &frameCmd, &frameLen) &&
+         frameCmd == cmd && frameLen == len;
+}
+
+bool BinaryStratum::parseHeader(const uint8_t *p, uint8_t *cmd, uint16_t *len) {
+  if (p[0] != CMD_MAGIC_NUMBER) {
+    return false;
+  }
+  *cmd = p[1];
+  *len = readBin<uint16_t>(p + 2);
+  return *len >= kHeaderSize_;
+}
+
+bool BinaryStratum::encode(const Subscribe &m, string &out) {
+  const size_t begin = beginBinFrame(CMD_BIN_SUBSCRIBE, out);
+  appendBin(m.version_, out);
+  appendBin(m.versionMask_, out);
+  out.append(m.clientAgent_, 0, kMaxAgentLen_);
+  return finishBinFrame(begin, out);
+}
+
+bool BinaryStratum::encode(const Authorize &m, string &out) {
+  if (m.fullName_.size() > 255) {
+    return false;
+  }
+  const size_t begin = beginBinFrame(CMD_BIN_AUTHORIZE, out);
+  appendBin((uint8_t)m.fullName_.size(), out);
+  out.append(m.fullName_);
+  out.append(m.password_);
+  return finishBinFrame(begin, out);
+}
+
+bool BinaryStratum::encode(const Submit &m, string &out) {
+  const size_t begin = beginBinFrame(CMD_BIN_SUBMIT, out);
+  appendBin(m.shortJobId_,  out);
+  appendBin(m.extraNonce2_, out);
+  appendBin(m.nTime_,       out);
+  appendBin(m.nonce_,       out);
+  appendBin(m.versionBits_, out);
+  return finishBinFrame(begin, out);
+}
+
+bool BinaryStratum::encode(const SubscribeResult &m, string &out) {
+  const size_t begin = beginBinFrame(CMD_BIN_SUBSCRIBE_RESULT, out);
+  appendBin(m.error_,           out);
+  appendBin(m.extraNonce1_,     out);
+  appendBin(m.extraNonce2Size_, out);
+  appendBin(m.versionMask_,     out);
+  return finishBinFrame(begin, out);
+}
+
+bool BinaryStratum::encode(const Result &m, string &out) {
+  const size_t begin = beginBinFrame(CMD_BIN_RESULT, out);
+  appendBin(m.error_, out);
+  return finishBinFrame(begin, out);
+}
+
+bool BinaryStratum::encode(const SetDiff &m, string &out) {
+  const size_t begin = beginBinFrame(CMD_BIN_SET_DIFF, out);
+  appendBin(m.difficulty_, out);
+  return finishBinFrame(begin, out);
+}
+
+bool BinaryStratum::encode(const Notify &m, string &out) {
+  if (m.coinbase1_.size() > 0xFFFF || m.coinbase2_.size() > 0xFFFF ||
+      m.merkleBranch_.size() > 0xFF) {
+    return false;
+  }
+  const size_t begin = beginBinFrame(CMD_BIN_NOTIFY, out);
+  appendBin(m.shortJobId_, out);
+  appendBin((uint8_t)(m.isClean_ ? 1 : 0), out);
+  out.append((const char *)m.prevHash_.begin(), 32);
+  appendBin(m.nVersion_, out);
+  appendBin(m.nBits_,    out);
+  appendBin(m.nTime_,    out);
+  appendBin((uint16_t)m.coinbase1_.size(), out);
+  out.append(m.coinbase1_);
+  appendBin((uint16_t)m.coinbase2_.size(), out);
+  out.append(m.coinbase2_);
+  appendBin((uint8_t)m.merkleBranch_.size(), out);
+  for (const uint256 &step : m.merkleBranch_) {
+    out.append((const char *)step.begin(), 32);
+  }
+  return finishBinFrame(begin, out);
+}
+
+bool BinaryStratum::decode(const uint8_t *p, const size_t len, Subscribe &m) {
+  if (len < kBinSubscribeMinSize || !checkBinFrame(p, len, CMD_BIN_SUBSCRIBE)) {
+    return false;
+  }
+  m.version_     = p[4];
+  m.versionMask_ = readBin<uint32_t>(p + 5);
+  m.clientAgent_.assign((const char *)p + 9,
+                        std::min(len - kBinSubscribeMinSize, kMaxAgentLen_));
+  return true;
+}
+
+bool BinaryStratum::decode(const uint8_t *p, const size_t len, Authorize &m) {
+  if (len < kBinAuthorizeMinSize || !checkBinFrame(p, len, CMD_BIN_AUTHORIZE)) {
+    return false;
+  }
+  const size_t nameLen = p[4];
+  if (kBinAuthorizeMinSize + nameLen > len) {
+    return false;
+  }
+  m.fullName_.assign((const char *)p + 5, nameLen);
+  m.password_.assign((const char *)p + 5 + nameLen,
+                     len - kBinAuthorizeMinSize - nameLen);
+  return true;
+}
+
+bool BinaryStratum::decode(const uint8_t *p, const size_t len, Submit &m) {
+  if (len != kBinSubmitSize || !checkBinFrame(p, len, CMD_BIN_SUBMIT)) {
+    return false;
+  }
+  m.shortJobId_  = p[4];
+  m.extraNonce2_ = readBin<uint64_t>(p + 5);
+  m.nTime_       = readBin<uint32_t>(p + 13);
+  m.nonce_       = readBin<uint32_t>(p + 17);
+  m.versionBits_ = readBin<uint32_t>(p + 21);
+  return true;
+}
+
+bool BinaryStratum::decode(const uint8_t *p, const size_t len,
+                           SubscribeResult &m) {
+  if (len != kBinSubscribeResultSize ||
+      !checkBinFrame(p, len, CMD_BIN_SUBSCRIBE_RESULT)) {
+    return false;
+  }
+  m.error_           = p[4];
+  m.extraNonce1_     = readBin<uint32_t>(p + 5);
+  m.extraNonce2Size_ = p[9];
+  m.versionMask_     = readBin<uint32_t>(p + 10);
+  return true;
+}
+
+bool BinaryStratum::decode(const uint8_t *p, const size_t len, Result &m) {
+  if (len != kBinResultSize || !checkBinFrame(p, len, CMD_BIN_RESULT)) {
+    return false;
+  }
+  m.error_ = p[4];
+  return true;
+}
+
+bool BinaryStratum::decode(const uint8_t *p, const size_t len, SetDiff &m) {
+  if (len != kBinSetDiffSize || !checkBinFrame(p, len, CMD_BIN_SET_DIFF)) {
+    return false;
+  }
+  m.difficulty_ = readBin<uint64_t>(p + 4);
+  return true;
+}
+
+bool BinaryStratum::decode(const uint8_t *p, const size_t len, Notify &m) {
+  if (len < kBinNotifyMinSize || !checkBinFrame(p, len, CMD_BIN_NOTIFY)) {
+    return false;
+  }
+  const uint8_t *end = p + len;
+  m.shortJobId_ = p[4];
+  m.isClean_    = (p[5] != 0);
+  memcpy(m.prevHash_.begin(), p + 6, 32);
+  m.nVersion_   = readBin<int32_t> (p + 38);
+  m.nBits_      = readBin<uint32_t>(p + 42);
+  m.nTime_      = readBin<uint32_t>(p + 46);
+  p += 50;
+
+  // the variable parts, the rest of kBinNotifyMinSize is checked with them
+  const size_t cb1Len = readBin<uint16_t>(p);
+  p += 2;
+  if ((size_t)(end - p) < cb1Len + 2 + 1) {
+    return false;
+  }
+  m.coinbase1_.assign((const char *)p, cb1Len);
+  p += cb1Len;
+
+  const size_t cb2Len = readBin<uint16_t>(p);
+  p += 2;
+  if ((size_t)(end - p) < cb2Len + 1) {
+    return false;
+  }
+  m.coinbase2_.assign((const char *)p, cb2Len);
+  p += cb2Len;
+
+  const size_t branchNum = *p++;
+  if ((size_t)(end - p) != branchNum * 32) {
+    return false;
+  }
+  m.merkleBranch_.resize(branchNum);
+  for (size_t i = 0; i < branchNum; i++, p += 32) {
+    memcpy(m.merkleBranch_[i].begin(), p, 32);
+  }
+  return true;
+}
+
+//////////////////////////////// ShareLogBatch /////////////////////////////////
+const uint32_t ShareLogBatch::kMagic_;
+const uint16_t ShareLogBatch::kVersion_;
+const size_t   ShareLogBatch::kHeaderSize_;
+const uint16_t ShareLogBatch::kMaxCount_;
+
+ShareLogBatch::ShareLogBatch(): count_(0) {
+}
+
+void ShareLogBatch::add(const Share &share) {
+  assert(count_ < kMaxCount_);
+  if (buf_.empty()) {
+    buf_.resize(kHeaderSize_);  // the header is written in getMessage()
+  }
+  buf_.append((const char *)&share, sizeof(Share));
+  count_++;
+}
+
+void ShareLogBatch::clear() {
+  buf_.clear();
+  count_ = 0;
+}
+
+const string &ShareLogBatch::getMessage() {
+  if (buf_.empty()) {
+    buf_.resize(kHeaderSize_);
+  }
+  char *p = &buf_[0];
+  memcpy(p,     &kMagic_,   4);
+  memcpy(p + 4, &kVersion_, 2);
+  memcpy(p + 6, &count_,    2);
+  return buf_;
+}
+
+bool ShareLogBatch::decode(const uint8_t *payload, const size_t len,
+                           vector<Share> &shares) {
+  if (len == sizeof(Share)) {
+    shares.push_back(Share());
+    memcpy((uint8_t *)&shares.back(), payload, sizeof(Share));
+    return true;
+  }
+
+  if (len < kHeaderSize_) {
+    return false;
+  }
+  uint32_t magic;
+  uint16_t version, count;
+  memcpy(&magic,   payload,     4);
+  memcpy(&version, payload + 4, 2);
+  memcpy(&count,   payload + 6, 2);
+  if (magic != kMagic_ || version != kVersion_ ||
+      len != kHeaderSize_ + (size_t)count * sizeof(Share)) {
+    return false;
+  }
+
+  const size_t oldSize = shares.size();
+  shares.resize(oldSize + count);
+  if (count > 0) {
+    memcpy((uint8_t *)&shares[oldSize], payload + kHeaderSize_,
+           (size_t)count * sizeof(Share));
+  }
+  return true;
+}
+
+/////////////////////////////// WorkerUpdateBatch //////////////////////////////
+const size_t WorkerUpdateBatch::kMaxEventSize_;
+
+void WorkerUpdateBatch::add(const int32_t userId, const int64_t workerId,
+                            const string &workerName, const string &minerAgent) {
+  const auto key = std::make_pair(userId, workerId);
+  auto itr = index_.find(key);
+  if (itr == index_.end()) {
+    itr = index_.insert(std::make_pair(key, items_.size())).first;
+    items_.push_back(Item());
+  }
+
+  Item &item = items_[itr->second];
+  item.userId_     = userId;
+  item.workerId_   = workerId;
+  item.workerName_ = workerName;
+  item.minerAgent_ = minerAgent;
+}
+
+void WorkerUpdateBatch::clear() {
+  items_.clear();
+  index_.clear();
+}
+
+void WorkerUpdateBatch::getEvents(const size_t maxSize,
+                                  vector<string> &events) const {
+  const string nowStr = date("%F %T");
+  const size_t n = std::max(maxSize, (size_t)1);
+
+  for (size_t begin = 0; begin < items_.size(); begin += n) {
+    const size_t end = std::min(begin + n, items_.size());
+
+    if (n == 1) {
+      const Item &item = items_[begin];
+      events.push_back(Strings::Format("{\"created_at\":\"%s\","
+                                       "\"type\":\"worker_update\","
+                                       "\"content\":{"
+                                           "\"user_id\":%d,"
+                                           "\"worker_id\":%" PRId64","
+                                           "\"worker_name\":\"%s\","
+                                           "\"miner_agent\":\"%s\""
+                                       "}}",
+                                       nowStr.c_str(),
+                                       item.userId_, item.workerId_,
+                                       item.workerName_.c_str(),
+                                       item.minerAgent_.c_str()));
+      continue;
+    }
+
+    string event = Strings::Format("{\"created_at\":\"%s\","
+                                   "\"type\":\"worker_update_batch\","
+                                   "\"content\":{\"workers\":[",
+                                   nowStr.c_str());
+    for (size_t i = begin; i < end; i++) {
+      const Item &item = items_[i];
+      event += Strings::Format("%s{\"user_id\":%d,"
+                               "\"worker_id\":%" PRId64","
+                               "\"worker_name\":\"%s\","
+                               "\"miner_agent\":\"%s\"}",
+                               i == begin ? "" : ",",
+                               item.userId_, item.workerId_,
+                               item.workerName_.c_str(),
+                               item.minerAgent_.c_str());
+    }
+    event += "]}}";
+    events.push_back(event);
+  }
+}
+
+bool WorkerUpdateBatch::addEvent(const string &type, JsonNode &content) {
+  vector<JsonNode> single;
+  vector<JsonNode> *workers = nullptr;
+
+  if (type == "worker_update") {
+    single.push_back(content);
+    workers = &single;
+  }
+  else if (type == "worker_update_batch" &&
+           content["workers"].type() == Utilities::JS::type::Array) {
+    workers = &content["workers"].array();
+  }
+  else {
+    return false;
+  }
+
+  for (auto &w : *workers) {
+    if (w["user_id"].type()     != Utilities::JS::type::Int ||
+        w["worker_id"].type()   != Utilities::JS::type::Int ||
+        w["worker_name"].type() != Utilities::JS::type::Str ||
+        w["miner_agent"].type() != Utilities::JS::type::Str) {
+      return false;
+    }
+    add(w["user_id"].int32(), w["worker_id"].int64(),
+        filterWorkerName(w["worker_name"].str()),
+        filterWorkerName(w["miner_agent"].str()));
+  }
+  return true;
+}
+
 //////////////////////////////// StratumWorker ////////////////////////////////
 StratumWorker::StratumWorker(): userId_(0), workerHashId_(0) {}
 
@@ -98,7 +705,6 @@ void StratumWorker::reset() {
   userId_ = 0;
   workerHashId_ = 0;
 
-  fullName_.clear();
   userName_.clear();
   workerName_.clear();
 }
@@ -117,9 +723,9 @@ void StratumWorker::setUserIDAndNames(const int32_t userId, const string &fullNa
 
   auto pos = fullName.find(".");
   if (pos == fullName.npos) {
-    userName_   = fullName;
+    userName_   = InternedString(fullName);
   } else {
-    userName_   = fullName.substr(0, pos);
+    userName_   = InternedString(fullName.substr(0, pos));
     workerName_ = fullName.substr(pos+1);
   }
 
@@ -136,7 +742,13 @@ void StratumWorker::setUserIDAndNames(const int32_t userId, const string &fullNa
   }
 
   workerHashId_ = calcWorkerId(workerName_);
-  fullName_ = userName_ + "." + workerName_;
+}
+
+string StratumWorker::getFullName() const {
+  if (userName_.empty() && workerName_.empty()) {
+    return string();  // not authorized yet
+  }
+  return userName_.str() + "." + workerName_;
 }
 
 int64_t StratumWorker::calcWorkerId(const string &workerName) {
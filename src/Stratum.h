@@ -189,21 +189,239 @@ public:
     INVALID_USERNAME = 29,
     INTERNAL_ERROR   = 30,
     TIME_TOO_OLD     = 31,
-    TIME_TOO_NEW     = 32
+    TIME_TOO_NEW     = 32,
+    ILLEGAL_VERMASK  = 33
   };
   static const char * toString(int err);
 };
 
 
 
+///////////////////////////////// MiningSubmit /////////////////////////////////
+//
+// "mining.submit" request in the common shape, parsed without allocation:
+//   {"params":["<worker>","<job id>","<extranonce2>","<ntime>","<nonce>"
+//              (,"<version bits>")],
+//    "id":<int|string|null>,"method":"mining.submit"}
+// keys may be in any order, unknown keys with simple values are skipped.
+// the pointers point into the line, the param strings end with '"'.
+//
+class MiningSubmit {
+public:
+  const char *id_;         // nullptr if id is null
+  size_t      idLen_;
+  bool        isIdString_;
+  // worker name, job id, extranonce2, ntime, nonce, version bits (BIP310).
+  // params_[5] is nullptr if the miner doesn't roll the version.
+  const char *params_[6];
+
+  // return false if it's not in the common shape, use JsonNode then
+  bool parse(const char *begin, const char *end);
+  // the same as the idStr made from JsonNode
+  void getIdStr(string &idStr) const;
+};
+
+
+
+//////////////////////////////// BinaryStratum /////////////////////////////////
+//
+// compact binary stratum for miners & proxies, framed like the ex-messages
+// of btcagent:
+//   | magic_number(1) | cmd(1) | len(2) | body |
+// len includes the 4 bytes header. integers are little-endian, fields are at
+// fixed offsets. a session speaks it if its first message is
+// CMD_BIN_SUBSCRIBE, and doesn't read json lines then.
+//
+// Miner -> Pool
+//   SUBSCRIBE       : | protocol version(1) | version mask(4) | client agent |
+//   AUTHORIZE       : | name len(1) | user.worker | password |
+//   SUBMIT          : | short job id(1) | extranonce2(8) | ntime(4) | nonce(4)
+//                     | version bits(4) |
+// Pool -> Miner
+//   SUBSCRIBE_RESULT: | error(1) | extranonce1(4) | extranonce2 size(1)
+//                     | version mask(4) |
+//   RESULT          : | error(1) |, answers AUTHORIZE & SUBMIT in order
+//   SET_DIFF        : | difficulty(8) |
+//   NOTIFY          : | short job id(1) | clean(1) | prev hash(32)
+//                     | version(4) | bits(4) | ntime(4)
+//                     | coinbase1 len(2) | coinbase1 | coinbase2 len(2)
+//                     | coinbase2 | merkle branch num(1) | merkle branch |
+//
+// error is StratumError. version mask is of BIP310, 0: no version rolling.
+// extranonce2 is put into the coinbase big-endian, the same as the hex of
+// mining.submit. prev hash & merkle branch are in the byte order of the
+// block header.
+//
+#define CMD_MAGIC_NUMBER          0x7Fu
+// types, 0x01 ~ 0x0F are used by btcagent
+#define CMD_BIN_SUBSCRIBE         0x10u  // Miner -> Pool
+#define CMD_BIN_AUTHORIZE         0x11u  // Miner -> Pool
+#define CMD_BIN_SUBMIT            0x12u  // Miner -> Pool
+#define CMD_BIN_SUBSCRIBE_RESULT  0x13u  // Pool  -> Miner
+#define CMD_BIN_RESULT            0x14u  // Pool  -> Miner
+#define CMD_BIN_SET_DIFF          0x15u  // Pool  -> Miner
+#define CMD_BIN_NOTIFY            0x16u  // Pool  -> Miner
+
+class BinaryStratum {
+public:
+  static const uint8_t kVersion_     = 1;
+  static const size_t  kHeaderSize_  = 4;
+  static const size_t  kMaxFrameSize_ = 65535;
+  static const size_t  kMaxAgentLen_ = 64;
+
+  // the bytes of a session in NOTIFY, the others are the same for all
+  // sessions: | header | short job id | clean | ... |
+  static const size_t  kNotifySessionOffset_ = 4;
+  static const size_t  kNotifySessionSize_   = 2;
+
+  struct Subscribe {
+    uint8_t  version_;
+    uint32_t versionMask_;
+    string   clientAgent_;
+  };
+  struct Authorize {
+    string fullName_;
+    string password_;
+  };
+  struct Submit {
+    uint8_t  shortJobId_;
+    uint64_t extraNonce2_;
+    uint32_t nTime_;
+    uint32_t nonce_;
+    uint32_t versionBits_;
+  };
+  struct SubscribeResult {
+    uint8_t  error_;
+    uint32_t extraNonce1_;
+    uint8_t  extraNonce2Size_;
+    uint32_t versionMask_;
+  };
+  struct Result {
+    uint8_t error_;
+  };
+  struct SetDiff {
+    uint64_t difficulty_;
+  };
+  struct Notify {
+    uint8_t  shortJobId_;
+    bool     isClean_;
+    uint256  prevHash_;
+    int32_t  nVersion_;
+    uint32_t nBits_;
+    uint32_t nTime_;
+    string   coinbase1_;  // binary
+    string   coinbase2_;  // binary
+    vector<uint256> merkleBranch_;
+  };
+
+  // return false if p isn't a frame header, p has kHeaderSize_ bytes
+  static bool parseHeader(const uint8_t *p, uint8_t *cmd, uint16_t *len);
+
+  // the frame is appended to out, return false if it's too large
+  static bool encode(const Subscribe       &m, string &out);
+  static bool encode(const Authorize       &m, string &out);
+  static bool encode(const Submit          &m, string &out);
+  static bool encode(const SubscribeResult &m, string &out);
+  static bool encode(const Result          &m, string &out);
+  static bool encode(const SetDiff         &m, string &out);
+  static bool encode(const Notify          &m, string &out);
+
+  // p is a whole frame, return false if it's not a valid message of the type
+  static bool decode(const uint8_t *p, const size_t len, Subscribe       &m);
+  static bool decode(const uint8_t *p, const size_t len, Authorize       &m);
+  static bool decode(const uint8_t *p, const size_t len, Submit          &m);
+  static bool decode(const uint8_t *p, const size_t len, SubscribeResult &m);
+  static bool decode(const uint8_t *p, const size_t len, Result          &m);
+  static bool decode(const uint8_t *p, const size_t len, SetDiff         &m);
+  static bool decode(const uint8_t *p, const size_t len, Notify          &m);
+};
+
+
+
+//////////////////////////////// ShareLogBatch /////////////////////////////////
+//
+// a message of kafka topic 'ShareLog' is one of:
+//   1. one Share, sizeof(Share) bytes. the old format
+//   2. | magic(4) | version(2) | count(2) | count * Share |
+// the length of format 2 is never sizeof(Share), so consumers accept both.
+//
+class ShareLogBatch {
+  string   buf_;
+  uint16_t count_;
+
+public:
+  static const uint32_t kMagic_      = 0x42474c53u;  // "SLGB"
+  static const uint16_t kVersion_    = 1;
+  static const size_t   kHeaderSize_ = 8;
+  // 8 + 4096 * 48 bytes, far below kafka's default message.max.bytes
+  static const uint16_t kMaxCount_   = 4096;
+
+  ShareLogBatch();
+
+  void add(const Share &share);
+  void clear();
+  uint16_t count() const { return count_; }
+  bool empty() const { return count_ == 0; }
+
+  // the message of format 2, valid until the next add() or clear()
+  const string &getMessage();
+
+  // shares are appended, return false if the message is invalid
+  static bool decode(const uint8_t *payload, const size_t len,
+                     vector<Share> &shares);
+};
+
+
+
+/////////////////////////////// WorkerUpdateBatch //////////////////////////////
+//
+// worker names of the common events, deduplicated by (userId, workerId) and
+// the latest one wins. a batch is sent as one event:
+//   {"created_at":"...","type":"worker_update_batch","content":{"workers":[
+//     {"user_id":1,"worker_id":2,"worker_name":"...","miner_agent":"..."},...]}}
+// or as one 'worker_update' event per worker, the old format.
+//
+class WorkerUpdateBatch {
+public:
+  struct Item {
+    int32_t userId_;
+    int64_t workerId_;
+    string  workerName_;
+    string  minerAgent_;
+  };
+
+private:
+  vector<Item> items_;
+  std::map<std::pair<int32_t, int64_t>, size_t> index_;  // index of items_
+
+public:
+  // max workers of one event, about 100 bytes each
+  static const size_t kMaxEventSize_ = 1000;
+
+  void add(const int32_t userId, const int64_t workerId,
+           const string &workerName, const string &minerAgent);
+  void clear();
+  size_t size() const { return items_.size(); }
+  bool empty() const { return items_.empty(); }
+  const vector<Item> &getItems() const { return items_; }
+
+  // events of at most maxSize workers, 1 makes 'worker_update' events
+  void getEvents(const size_t maxSize, vector<string> &events) const;
+
+  // add the workers of a 'worker_update' or 'worker_update_batch' event,
+  // the names are filtered. return false if it's invalid
+  bool addEvent(const string &type, JsonNode &content);
+};
+
+
+
 //////////////////////////////// StratumWorker ////////////////////////////////
 class StratumWorker {
 public:
   int32_t userId_;
   int64_t workerHashId_;  // substr(0, 8, HASH(wokerName))
 
-  string fullName_;    // fullName = username.workername
-  string userName_;
+  InternedString userName_;  // shared by the workers of the user
   string workerName_;  // workername, max is: 20
 
   void reset();
@@ -212,6 +430,8 @@ public:
   StratumWorker();
   void setUserIDAndNames(const int32_t userId, const string &fullName);
   string getUserName(const string &fullName) const ;
+  // fullName = username.workername
+  string getFullName() const;
 
   static int64_t calcWorkerId(const string &workerName);
 };
@@ -23,15 +23,20 @@
  */
 #include "StratumClient.h"
 #include "Utils.h"
+#include "Stratum.h"
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <algorithm>
 
 ///////////////////////////////// StratumClient ////////////////////////////////
 StratumClient::StratumClient(struct event_base* base,
-                             const string &workerFullName)
-: workerFullName_(workerFullName), isMining_(false)
+                             const string &workerFullName,
+                             StratumClientWrapper *wrapper,
+                             const bool isBinary)
+: wrapper_(wrapper), workerFullName_(workerFullName), isMining_(false),
+isBinary_(isBinary), latestShortJobId_(0), versionMask_(0)
 {
   inBuf_ = evbuffer_new();
   bev_ = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE|BEV_OPT_THREADSAFE);
@@ -65,16 +70,147 @@ bool StratumClient::connect(struct sockaddr_in &sin) {
   return false;
 }
 
+void StratumClient::sendSubscribe() {
+  if (isBinary_) {
+    BinaryStratum::Subscribe subscribe;
+    subscribe.version_     = BinaryStratum::kVersion_;
+    subscribe.versionMask_ = 0xFFFFFFFFu;
+    subscribe.clientAgent_ = "__simulator__/0.1";
+    string s;
+    BinaryStratum::encode(subscribe, s);
+    sendData(s);
+    return;
+  }
+  sendData("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[\"__simulator__/0.1\"]}\n");
+}
+
 void StratumClient::readBuf(struct evbuffer *buf) {
+  if (wrapper_ != nullptr) {
+    wrapper_->onClientRecv(evbuffer_get_length(buf));
+  }
   // moves all data from src to the end of dst
   evbuffer_add_buffer(inBuf_, buf);
 
+  if (isBinary_) {
+    string message;
+    while (tryReadBinMessage(message)) {
+      handleBinMessage(message);
+    }
+    return;
+  }
+
   string line;
   while (tryReadLine(line)) {
     handleLine(line);
   }
 }
 
+bool StratumClient::tryReadBinMessage(string &message) {
+  uint8_t header[BinaryStratum::kHeaderSize_];
+  if (evbuffer_copyout(inBuf_, header, sizeof(header)) < (ssize_t)sizeof(header)) {
+    return false;
+  }
+  uint8_t cmd;
+  uint16_t len;
+  if (!BinaryStratum::parseHeader(header, &cmd, &len)) {
+    LOG(ERROR) << "invalid binary stratum message, drop the input";
+    evbuffer_drain(inBuf_, evbuffer_get_length(inBuf_));
+    return false;
+  }
+  if (evbuffer_get_length(inBuf_) < len) {
+    return false;
+  }
+  message.resize(len);
+  evbuffer_remove(inBuf_, (void *)message.data(), message.size());
+  return true;
+}
+
+void StratumClient::handleBinMessage(const string &message) {
+  const uint8_t *p = (const uint8_t *)message.data();
+  const size_t len = message.size();
+
+  switch (p[1]) {
+    case CMD_BIN_NOTIFY: {
+      BinaryStratum::Notify notify;
+      if (!BinaryStratum::decode(p, len, notify)) {
+        LOG(ERROR) << "invalid binary notify";
+        return;
+      }
+      latestShortJobId_ = notify.shortJobId_;
+      DLOG(INFO) << "latestShortJobId_: " << (int)latestShortJobId_;
+      onNotify();
+      break;
+    }
+    case CMD_BIN_SET_DIFF: {
+      BinaryStratum::SetDiff setDiff;
+      if (BinaryStratum::decode(p, len, setDiff)) {
+        latestDiff_ = setDiff.difficulty_;
+        DLOG(INFO) << "latestDiff_: " << latestDiff_;
+      }
+      break;
+    }
+    case CMD_BIN_SUBSCRIBE_RESULT: {
+      BinaryStratum::SubscribeResult result;
+      if (state_ != CONNECTED || !BinaryStratum::decode(p, len, result) ||
+          result.error_ != StratumError::NO_ERROR) {
+        LOG(ERROR) << "binary subscribe failure";
+        return;
+      }
+      extraNonce1_     = result.extraNonce1_;
+      extraNonce2Size_ = result.extraNonce2Size_;
+      versionMask_     = result.versionMask_;
+
+      state_ = SUBSCRIBED;
+      BinaryStratum::Authorize authorize;
+      authorize.fullName_ = workerFullName_;
+      string s;
+      BinaryStratum::encode(authorize, s);
+      sendData(s);
+      break;
+    }
+    case CMD_BIN_RESULT: {
+      BinaryStratum::Result result;
+      if (!BinaryStratum::decode(p, len, result)) {
+        break;
+      }
+      if (state_ == SUBSCRIBED && result.error_ == StratumError::NO_ERROR) {
+        state_ = AUTHENTICATED;
+      } else if (state_ == AUTHENTICATED &&
+                 result.error_ != StratumError::NO_ERROR) {
+        onReject();
+      }
+      break;
+    }
+    default:
+      LOG(ERROR) << "unknown binary stratum message, type: " << (int)p[1];
+      break;
+  }
+}
+
+void StratumClient::onReject() {
+  if (wrapper_ != nullptr) {
+    wrapper_->onClientReject();
+  }
+}
+
+void StratumClient::onDisconnect() {
+  if (wrapper_ != nullptr) {
+    wrapper_->onClientDisconnect();
+  }
+}
+
+void StratumClient::onNotify() {
+  if (wrapper_ != nullptr) {
+    wrapper_->onClientNotify();
+  }
+  if (!isMining_) {
+    isMining_ = true;
+    if (wrapper_ != nullptr) {
+      wrapper_->onClientMining();
+    }
+  }
+}
+
 bool StratumClient::tryReadLine(string &line) {
   line.clear();
   
@@ -111,6 +247,7 @@ void StratumClient::handleLine(const string &line) {
     if (jmethod.str() == "mining.notify") {
       latestJobId_ = jparamsArr[0].str();
       DLOG(INFO) << "latestJobId_: " << latestJobId_;
+      onNotify();
     }
     else if (jmethod.str() == "mining.set_difficulty") {
       latestDiff_ = jparamsArr[0].uint64();
@@ -131,6 +268,7 @@ void StratumClient::handleLine(const string &line) {
         jresult.type() != Utilities::JS::type::Bool ||
         jresult.boolean() != true) {
 //      LOG(ERROR) << "json result is null, err: " << jerror.str() << ", line: " << line;
+      onReject();
     }
     return;
   }
@@ -174,6 +312,21 @@ void StratumClient::submitShare() {
     return;
 
   extraNonce2_++;
+
+  if (isBinary_) {
+    BinaryStratum::Submit submit;
+    submit.shortJobId_  = latestShortJobId_;
+    submit.extraNonce2_ = extraNonce2_;
+    submit.nTime_       = (uint32_t)time(nullptr);
+    submit.nonce_       = (uint32_t)time(nullptr);
+    // roll the lowest bit of the mask
+    submit.versionBits_ = (extraNonce2_ & 1) ? (versionMask_ & (0u - versionMask_)) : 0u;
+    string s;
+    BinaryStratum::encode(submit, s);
+    sendData(s);
+    return;
+  }
+
   string extraNonce2Str;
   // little-endian
   Bin2Hex((uint8_t *)&extraNonce2_, extraNonce2Size_, extraNonce2Str);
@@ -195,7 +348,9 @@ void StratumClient::sendData(const char *data, size_t len) {
   bufferevent_lock(bev_);
   bufferevent_write(bev_, data, len);
   bufferevent_unlock(bev_);
-  DLOG(INFO) << "send(" << len << "): " << data;
+  if (!isBinary_) {
+    DLOG(INFO) << "send(" << len << "): " << data;
+  }
 }
 
 
@@ -207,7 +362,10 @@ StratumClientWrapper::StratumClientWrapper(const char *host,
                                            const string &userName,
                                            const string &minerNamePrefix)
 : running_(true), base_(event_base_new()), numConnections_(numConnections),
-userName_(userName), minerNamePrefix_(minerNamePrefix)
+userName_(userName), minerNamePrefix_(minerNamePrefix),
+startTime_(0), allMiningTime_(0), miningNum_(0),
+isStopWhenAllMining_(false), timeoutSeconds_(0), isBinary_(false),
+disconnectsNum_(0), rejectsNum_(0)
 {
   memset(&sin_, 0, sizeof(sin_));
   sin_.sin_family = AF_INET;
@@ -241,19 +399,105 @@ void StratumClientWrapper::stop() {
   LOG(INFO) << "StratumClientWrapper::stop...";
 }
 
+void StratumClientWrapper::setStopCondition(const bool isStopWhenAllMining,
+                                            const int32_t timeoutSeconds) {
+  isStopWhenAllMining_ = isStopWhenAllMining;
+  timeoutSeconds_      = timeoutSeconds;
+}
+
+void StratumClientWrapper::setBinaryProtocol(const bool isBinary) {
+  isBinary_ = isBinary;
+}
+
+void StratumClientWrapper::onClientMining() {
+  miningNum_++;
+
+  if (miningNum_ % 10000 == 0 || miningNum_ == numConnections_) {
+    LOG(INFO) << "mining clients: " << miningNum_ << "/" << numConnections_
+    << ", elapsed: " << (getMonotonicTimeUs() - startTime_) / 1000 << "ms";
+  }
+  if (miningNum_ != numConnections_) {
+    return;
+  }
+
+  allMiningTime_ = getMonotonicTimeUs();
+  LOG(INFO) << "all " << numConnections_ << " clients are mining, "
+  << "time-to-all-mining: " << getTimeToAllMiningMs() << "ms";
+
+  if (isStopWhenAllMining_) {
+    stop();
+  }
+}
+
+int64_t StratumClientWrapper::getTimeToAllMiningMs() const {
+  if (allMiningTime_ == 0) {
+    return -1;
+  }
+  return (allMiningTime_ - startTime_) / 1000;
+}
+
+void StratumClientWrapper::onClientRecv(const size_t bytes) {
+  if (allMiningTime_ == 0) {
+    return;
+  }
+  const size_t slot = (size_t)((getMonotonicTimeUs() - allMiningTime_) / kRecvSlotUs_);
+  if (slot >= recvBytes_.size()) {
+    recvBytes_.resize(slot + 1, 0);
+  }
+  recvBytes_[slot] += bytes;
+}
+
+void StratumClientWrapper::onClientNotify() {
+  if (allMiningTime_ == 0) {
+    return;
+  }
+  notifyTimes_.push_back(getMonotonicTimeUs());
+}
+
+double StratumClientWrapper::getRecvPeakToAvg() const {
+  uint64_t total = 0, peak = 0;
+  for (const uint64_t bytes : recvBytes_) {
+    total += bytes;
+    peak = std::max(peak, bytes);
+  }
+  if (total == 0) {
+    return 0;
+  }
+  return (double)peak * recvBytes_.size() / total;
+}
+
+vector<int64_t> StratumClientWrapper::getNotifyBurstsMs(const int64_t gapMs) const {
+  vector<int64_t> times = notifyTimes_;
+  std::sort(times.begin(), times.end());
+
+  vector<int64_t> bursts;
+  size_t first = 0;
+  for (size_t i = 1; i <= times.size(); i++) {
+    if (i == times.size() || times[i] - times[i - 1] > gapMs * 1000) {
+      bursts.push_back((times[i - 1] - times[first]) / 1000);
+      first = i;
+    }
+  }
+  return bursts;
+}
+
 void StratumClientWrapper::eventCallback(struct bufferevent *bev,
                                          short events, void *ptr) {
   StratumClient *client = static_cast<StratumClient *>(ptr);
 
   if (events & BEV_EVENT_CONNECTED) {
     client->state_ = StratumClient::State::CONNECTED;
-    // subscribe
-    client->sendData("{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[\"__simulator__/0.1\"]}\n");
+    client->sendSubscribe();
   }
   else if (events & BEV_EVENT_ERROR) {
     /* An error occured while connecting. */
     // TODO
     LOG(ERROR) << "event error: " << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR());
+    client->onDisconnect();
+  }
+  else if (events & BEV_EVENT_EOF) {
+    LOG(ERROR) << "closed by the server";
+    client->onDisconnect();
   }
 }
 
@@ -263,6 +507,8 @@ void StratumClientWrapper::readCallback(struct bufferevent* bev, void *connectio
 }
 
 void StratumClientWrapper::run() {
+  startTime_ = getMonotonicTimeUs();
+
   //
   // create clients
   //
@@ -271,7 +517,8 @@ void StratumClientWrapper::run() {
                                                   userName_.c_str(),
                                                   minerNamePrefix_.c_str(),
                                                   i);
-    StratumClient *client = new StratumClient(base_, workerFullName);
+    StratumClient *client = new StratumClient(base_, workerFullName, this,
+                                              isBinary_);
 
     if (!client->connect(sin_)) {
       LOG(ERROR) << "client connnect failure: " << workerFullName;
@@ -282,6 +529,11 @@ void StratumClientWrapper::run() {
 
   threadSubmitShares_ = thread(&StratumClientWrapper::runThreadSubmitShares, this);
 
+  if (timeoutSeconds_ > 0) {
+    struct timeval tv = {timeoutSeconds_, 0};
+    event_base_loopexit(base_, &tv);
+  }
+
   // event loop
   event_base_dispatch(base_);
 
@@ -40,8 +40,11 @@
 #include "utilities_js.hpp"
 
 
+class StratumClientWrapper;
+
 ///////////////////////////////// StratumClient ////////////////////////////////
 class StratumClient {
+  StratumClientWrapper *wrapper_;
   struct bufferevent *bev_;
   struct evbuffer *inBuf_;
 
@@ -49,12 +52,21 @@ class StratumClient {
   int32_t  extraNonce2Size_;
   uint64_t extraNonce2_;
   string workerFullName_;
-  bool isMining_;
+  bool isMining_;  // received the first mining.notify
   string   latestJobId_;
   uint64_t latestDiff_;
 
+  // speaks BinaryStratum instead of json
+  bool isBinary_;
+  uint8_t latestShortJobId_;
+  uint32_t versionMask_;  // BIP310, binary only
+
   bool tryReadLine(string &line);
   void handleLine(const string &line);
+  bool tryReadBinMessage(string &message);
+  void handleBinMessage(const string &message);
+  void onNotify();
+  void onReject();
 
 public:
   // mining state
@@ -67,7 +79,9 @@ public:
   atomic<State> state_;
 
 public:
-  StratumClient(struct event_base *base, const string &workerFullName);
+  StratumClient(struct event_base *base, const string &workerFullName,
+                StratumClientWrapper *wrapper = nullptr,
+                const bool isBinary = false);
   ~StratumClient();
 
   bool connect(struct sockaddr_in &sin);
@@ -77,8 +91,11 @@ public:
     sendData(str.data(), str.size());
   }
 
+  void sendSubscribe();
   void readBuf(struct evbuffer *buf);
   void submitShare();
+  // closed by the server or failed
+  void onDisconnect();
 };
 
 
@@ -94,6 +111,24 @@ class StratumClientWrapper {
 
   std::set<StratumClient *> connections_;
 
+  // time-to-all-mining of the connections, e.g. of a reconnect storm
+  int64_t  startTime_;      // microseconds
+  int64_t  allMiningTime_;  // microseconds, 0 if not yet
+  uint32_t miningNum_;
+  bool     isStopWhenAllMining_;
+  int32_t  timeoutSeconds_; // 0: never
+  bool     isBinary_;       // clients speak BinaryStratum
+
+  // what the clients receive once all are mining, it shows how the server
+  // spreads its egress, e.g. with sserver.notify_pacing_ms
+  static const int64_t kRecvSlotUs_ = 10000;
+  vector<uint64_t> recvBytes_;    // per kRecvSlotUs_ since allMiningTime_
+  vector<int64_t>  notifyTimes_;  // microseconds
+
+  // e.g. across a hot restart of the server
+  uint32_t disconnectsNum_;
+  uint32_t rejectsNum_;   // submits answered with an error
+
   thread threadSubmitShares_;
   void runThreadSubmitShares();
 
@@ -109,6 +144,31 @@ public:
   void stop();
   void run();
 
+  // stop the event loop when all are mining, or after timeoutSeconds (0: never)
+  void setStopCondition(const bool isStopWhenAllMining,
+                        const int32_t timeoutSeconds);
+  // BinaryStratum instead of json, call it before run()
+  void setBinaryProtocol(const bool isBinary);
+  // called by clients in the event loop
+  void onClientMining();
+  inline uint32_t getMiningNum() const { return miningNum_; }
+  // milliseconds from run() to the last client mining, -1 if not yet
+  int64_t getTimeToAllMiningMs() const;
+
+  // called by clients in the event loop
+  void onClientRecv(const size_t bytes);
+  void onClientNotify();
+  // peak to average received bytes per 10ms, 0 if nothing received
+  double getRecvPeakToAvg() const;
+  // notifies closer than gapMs are a burst, the width of each in ms
+  vector<int64_t> getNotifyBurstsMs(const int64_t gapMs = 1000) const;
+
+  // called by clients in the event loop
+  inline void onClientDisconnect() { disconnectsNum_++; }
+  inline void onClientReject()     { rejectsNum_++; }
+  inline uint32_t getDisconnectsNum() const { return disconnectsNum_; }
+  inline uint32_t getRejectsNum()     const { return rejectsNum_; }
+
   //void submitShares();
 };
 
@@ -33,6 +33,17 @@
 #include <hash.h>
 #include <inttypes.h>
 
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <event2/http.h>
+
 #include "rsk/RskSolvedShareData.h"
 
 #include "utilities_js.hpp"
@@ -41,10 +52,67 @@
 #ifndef WORK_WITH_STRATUM_SWITCHER
 
 //////////////////////////////// SessionIDManager //////////////////////////////
+const int32_t SessionIDManager::kLevels_;
+
 SessionIDManager::SessionIDManager(const uint8_t serverId) :
 serverId_(serverId), count_(0), allocIdx_(0)
 {
-  sessionIds_.reset();
+  uint64_t nBits = (uint64_t)MAX_SESSION_INDEX_SERVER + 1;
+  for (int32_t l = 0; l < kLevels_; l++) {
+    const uint64_t nWords = (nBits + 63) / 64;
+    levels_[l].assign(nWords, 0);
+    if (nBits % 64 != 0) {
+      levels_[l].back() = ~0ull << (nBits % 64);  // padding bits
+    }
+    nBits = nWords;
+  }
+  assert(levels_[kLevels_ - 1].size() == 1);
+}
+
+int64_t SessionIDManager::findZero(const int32_t level, const uint64_t pos) const {
+  const vector<uint64_t> &words = levels_[level];
+  uint64_t w = pos / 64;
+  if (w >= words.size()) {
+    return -1;
+  }
+
+  uint64_t bits = ~words[w] & (~0ull << (pos % 64));
+  if (bits == 0) {
+    if (level + 1 == kLevels_) {
+      return -1;
+    }
+    // the next word which is not full
+    const int64_t next = findZero(level + 1, w + 1);
+    if (next < 0) {
+      return -1;
+    }
+    w = (uint64_t)next;
+    bits = ~words[w];
+  }
+  return (int64_t)(w * 64 + __builtin_ctzll(bits));
+}
+
+void SessionIDManager::setBit(uint64_t idx) {
+  for (int32_t l = 0; l < kLevels_; l++) {
+    uint64_t &word = levels_[l][idx / 64];
+    word |= (1ull << (idx % 64));
+    if (word != ~0ull) {
+      break;
+    }
+    idx /= 64;  // the word is full now, mark it in the upper level
+  }
+}
+
+void SessionIDManager::clearBit(uint64_t idx) {
+  for (int32_t l = 0; l < kLevels_; l++) {
+    uint64_t &word = levels_[l][idx / 64];
+    const bool wasFull = (word == ~0ull);
+    word &= ~(1ull << (idx % 64));
+    if (!wasFull) {
+      break;
+    }
+    idx /= 64;  // the word is not full any more
+  }
 }
 
 bool SessionIDManager::ifFull() {
@@ -65,19 +133,23 @@ bool SessionIDManager::allocSessionId(uint32_t *sessionID) {
   if (_ifFull())
     return false;
 
-  // find an empty bit
-  while (sessionIds_.test(allocIdx_) == true) {
-    allocIdx_++;
-    if (allocIdx_ > MAX_SESSION_INDEX_SERVER) {
-      allocIdx_ = 0;
-    }
+  // find an empty bit from allocIdx_, ids are used in turn
+  int64_t idx = findZero(0, allocIdx_);
+  if (idx < 0) {
+    idx = findZero(0, 0);
   }
+  assert(idx >= 0 && idx <= (int64_t)MAX_SESSION_INDEX_SERVER);
 
   // set to true
-  sessionIds_.set(allocIdx_, true);
+  setBit((uint64_t)idx);
   count_++;
 
-  *sessionID = (((uint32_t)serverId_ << 24) | allocIdx_);
+  allocIdx_ = (uint32_t)idx + 1;
+  if (allocIdx_ > MAX_SESSION_INDEX_SERVER) {
+    allocIdx_ = 0;
+  }
+
+  *sessionID = (((uint32_t)serverId_ << 24) | (uint32_t)idx);
   return true;
 }
 
@@ -85,10 +157,29 @@ void SessionIDManager::freeSessionId(uint32_t sessionId) {
   ScopeLock sl(lock_);
 
   const uint32_t idx = (sessionId & 0x00FFFFFFu);
-  sessionIds_.set(idx, false);
+  if (idx > MAX_SESSION_INDEX_SERVER ||
+      (levels_[0][idx / 64] & (1ull << (idx % 64))) == 0) {
+    LOG(WARNING) << "free an unused session id: " << sessionId;
+    return;
+  }
+  clearBit(idx);
   count_--;
 }
 
+bool SessionIDManager::reserveSessionId(const uint32_t sessionId) {
+  ScopeLock sl(lock_);
+
+  const uint32_t idx = (sessionId & 0x00FFFFFFu);
+  if ((uint8_t)(sessionId >> 24) != serverId_ ||
+      idx > MAX_SESSION_INDEX_SERVER ||
+      (levels_[0][idx / 64] & (1ull << (idx % 64))) != 0) {
+    return false;
+  }
+  setBit(idx);
+  count_++;
+  return true;
+}
+
 #endif // #ifndef WORK_WITH_STRATUM_SWITCHER
 
 
@@ -96,7 +187,7 @@ void SessionIDManager::freeSessionId(uint32_t sessionId) {
 JobRepository::JobRepository(const char *kafkaBrokers,
                              const string &fileLastNotifyTime,
                              Server *server):
-running_(true),
+running_(true), snapshotVersion_(0),
 kafkaConsumer_(kafkaBrokers, KAFKA_TOPIC_STRATUM_JOB, 0/*patition*/),
 server_(server), fileLastNotifyTime_(fileLastNotifyTime),
 kMaxJobsLifeTime_(300),
@@ -104,6 +195,8 @@ kMiningNotifyInterval_(30),  // TODO: make as config arg
 lastJobSendTime_(0)
 {
   assert(kMiningNotifyInterval_ < kMaxJobsLifeTime_);
+  ScopeLock sl(lock_);
+  publishSnapshot();
 }
 
 JobRepository::~JobRepository() {
@@ -111,24 +204,84 @@ JobRepository::~JobRepository() {
     threadConsume_.join();
 }
 
+// versions of the published snapshots (jobs, users) are unique in the
+// process, so a thread's cached (owner, version) never matches an owner
+// which is destroyed and allocated again at the same address
+static atomic<uint64_t> gSnapshotVersion(0);
+
+void JobRepository::publishSnapshot() {
+  auto snapshot = std::make_shared<JobSnapshot>(exJobs_.begin(), exJobs_.end());
+  std::atomic_store(&snapshot_, shared_ptr<const JobSnapshot>(snapshot));
+  snapshotVersion_.store(++gSnapshotVersion, std::memory_order_release);
+}
+
+const JobRepository::JobSnapshot &JobRepository::getSnapshot() {
+  //
+  // std::atomic_load() of a shared_ptr takes a lock and writes the shared
+  // reference count. jobs change every few seconds, so every thread keeps
+  // the snapshot it loaded and only checks the version for each share.
+  //
+  struct Cache {
+    const JobRepository *repository_;
+    uint64_t version_;
+    shared_ptr<const JobSnapshot> snapshot_;
+  };
+  static thread_local Cache cache = {nullptr, 0, nullptr};
+
+  const uint64_t version = snapshotVersion_.load(std::memory_order_acquire);
+  if (cache.repository_ != this || cache.version_ != version) {
+    cache.snapshot_    = std::atomic_load(&snapshot_);
+    cache.repository_  = this;
+    cache.version_     = version;
+  }
+  return *cache.snapshot_;
+}
+
 shared_ptr<StratumJobEx> JobRepository::getStratumJobEx(const uint64_t jobId) {
-  ScopeLock sl(lock_);
-  auto itr = exJobs_.find(jobId);
-  if (itr != exJobs_.end()) {
+  const JobSnapshot &jobs = getSnapshot();
+  auto itr = std::lower_bound(jobs.begin(), jobs.end(), jobId,
+                              [](const JobSnapshot::value_type &job,
+                                 const uint64_t id) {
+    return job.first < id;
+  });
+  if (itr != jobs.end() && itr->first == jobId) {
     return itr->second;
   }
   return nullptr;
 }
 
 shared_ptr<StratumJobEx> JobRepository::getLatestStratumJobEx() {
-  ScopeLock sl(lock_);
-  if (exJobs_.size()) {
-    return exJobs_.rbegin()->second;
+  const JobSnapshot &jobs = getSnapshot();
+  if (jobs.size()) {
+    return jobs.rbegin()->second;
   }
   LOG(WARNING) << "getLatestStratumJobEx fail";
   return nullptr;
 }
 
+void JobRepository::getJobs(vector<shared_ptr<StratumJobEx> > &jobs) {
+  ScopeLock sl(lock_);
+  for (const auto &it : exJobs_) {
+    jobs.push_back(it.second);
+  }
+}
+
+void JobRepository::restoreJob(StratumJob *sjob, const bool isClean,
+                               const bool isStale) {
+  shared_ptr<StratumJobEx> exJob = std::make_shared<StratumJobEx>(sjob, isClean);
+  if (isStale) {
+    exJob->markStale();
+  }
+
+  ScopeLock sl(lock_);
+  exJobs_[sjob->jobId_] = exJob;
+  // a job of the same block is not clean, and the sessions have the latest
+  // one already: no notify until the next job or the interval
+  latestPrevBlockHash_ = exJobs_.rbegin()->second->sjob_->prevHash_;
+  lastJobSendTime_     = time(nullptr);
+  publishSnapshot();
+}
+
 void JobRepository::stop() {
   if (!running_) {
     return;
@@ -222,8 +375,7 @@ void JobRepository::consumeStratumJob(rd_kafka_message_t *rkmessage) {
     delete sjob;
     return;
   }
-  // here you could use Map.find() without lock, it's sure
-  // that everyone is using this Map readonly now
+  // exJobs_ is only changed by this thread, find() needs no lock
   if (exJobs_.find(sjob->jobId_) != exJobs_.end()) {
     LOG(ERROR) << "jobId already existed";
     delete sjob;
@@ -264,6 +416,7 @@ void JobRepository::consumeStratumJob(rd_kafka_message_t *rkmessage) {
 
     // insert new job
     exJobs_[sjob->jobId_] = exJob;
+    publishSnapshot();
   }
 
   // if job has clean flag, call server to send job
@@ -273,7 +426,7 @@ void JobRepository::consumeStratumJob(rd_kafka_message_t *rkmessage) {
   }
 
   // if last job is an empty block job(clean=true), we need to send a
-  // new non-empty job as quick as possible.
+  // new non-empty job as quick as possible. read-only, no lock needed
   if (isClean == false && exJobs_.size() >= 2) {
     auto itr = exJobs_.rbegin();
     shared_ptr<StratumJobEx> exJob1 = itr->second;
@@ -326,31 +479,235 @@ void JobRepository::tryCleanExpiredJobs() {
   ScopeLock sl(lock_);
 
   const uint32_t nowTs = (uint32_t)time(nullptr);
+  bool isChanged = false;
   while (exJobs_.size()) {
     // Maps (and sets) are sorted, so the first element is the smallest,
     // and the last element is the largest.
     auto itr = exJobs_.begin();
 
-    const time_t jobTime = (time_t)(itr->first >> 32);
+    const uint64_t jobId   = itr->first;
+    const time_t   jobTime = (time_t)(jobId >> 32);
     if (nowTs < jobTime + kMaxJobsLifeTime_) {
       break;  // not expired
     }
 
     // remove expired job
     exJobs_.erase(itr);
+    isChanged = true;
 
-    LOG(INFO) << "remove expired stratum job, id: " << itr->first
+    LOG(INFO) << "remove expired stratum job, id: " << jobId
     << ", time: " << date("%F %T", jobTime);
   }
+
+  if (isChanged) {
+    publishSnapshot();
+  }
+}
+
+
+//////////////////////////////// UserDirectory /////////////////////////////////
+const uint32_t UserDirectory::kEmptySlot_;
+
+UserDirectory::UserDirectory(): size_(0), maxUserId_(0) {
+  rehash(1024);
+}
+
+uint32_t UserDirectory::hashName(const char *name, const size_t len) {
+  // FNV-1a, user names are short
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// return the slot of the name, or the empty slot where it should be
+const UserDirectory::Slot *UserDirectory::findSlot(const char *name,
+                                                   const size_t len,
+                                                   const uint32_t hash) const {
+  const size_t mask = slots_.size() - 1;
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    const Slot &slot = slots_[i];
+    if (slot.nameOffset_ == kEmptySlot_) {
+      return &slot;
+    }
+    if (slot.hash_ == hash && slot.nameLen_ == len &&
+        memcmp(names_.data() + slot.nameOffset_, name, len) == 0) {
+      return &slot;
+    }
+  }
+}
+
+void UserDirectory::rehash(const size_t nSlots) {
+  vector<Slot> oldSlots;
+  oldSlots.swap(slots_);
+
+  Slot empty;
+  empty.hash_       = 0;
+  empty.nameOffset_ = kEmptySlot_;
+  empty.nameLen_    = 0;
+  empty.userId_     = 0;
+  slots_.assign(nSlots, empty);
+
+  const size_t mask = nSlots - 1;
+  for (const auto &slot : oldSlots) {
+    if (slot.nameOffset_ == kEmptySlot_) {
+      continue;
+    }
+    size_t i = slot.hash_ & mask;
+    while (slots_[i].nameOffset_ != kEmptySlot_) {
+      i = (i + 1) & mask;
+    }
+    slots_[i] = slot;
+  }
+}
+
+void UserDirectory::addUser(const string &userName, const int32_t userId,
+                            const bool isReplace) {
+  const uint32_t hash = hashName(userName.data(), userName.size());
+  Slot *slot = const_cast<Slot *>(findSlot(userName.data(), userName.size(), hash));
+
+  if (slot->nameOffset_ != kEmptySlot_) {
+    if (isReplace) {
+      slot->userId_ = userId;
+    }
+  } else {
+    if ((size_ + 1) * 2 > slots_.size()) {
+      rehash(slots_.size() * 2);
+      slot = const_cast<Slot *>(findSlot(userName.data(), userName.size(), hash));
+    }
+    slot->hash_       = hash;
+    slot->nameOffset_ = (uint32_t)names_.size();
+    slot->nameLen_    = (uint32_t)userName.size();
+    slot->userId_     = userId;
+    names_.append(userName);
+    size_++;
+  }
+
+  if (userId > maxUserId_) {
+    maxUserId_ = userId;
+  }
+}
+
+int32_t UserDirectory::getUserId(const char *name, const size_t len) const {
+  const Slot *slot = findSlot(name, len, hashName(name, len));
+  if (slot->nameOffset_ == kEmptySlot_) {
+    return 0;  // not found
+  }
+  return slot->userId_;
+}
+
+#ifdef USER_DEFINED_COINBASE
+void UserDirectory::setCoinbaseInfo(const int32_t userId,
+                                    const string &coinbaseInfo) {
+  idCoinbaseInfos_[userId] = coinbaseInfo;
+}
+
+const string *UserDirectory::getCoinbaseInfo(const int32_t userId) const {
+  auto itr = idCoinbaseInfos_.find(userId);
+  if (itr != idCoinbaseInfos_.end()) {
+    return &itr->second;
+  }
+  return nullptr;
+}
+#endif
+
+bool UserDirectory::saveToFile(const string &file, const int64_t lastTime) const {
+  // write a temporary file and rename it, never leave a half written file
+  const string tmpFile = file + ".tmp";
+  FILE *f = fopen(tmpFile.c_str(), "w");
+  if (f == nullptr) {
+    LOG(ERROR) << "open file fail: " << tmpFile;
+    return false;
+  }
+
+  fprintf(f, "#btcpool users v1 %" PRId64 "\n", lastTime);
+  for (const auto &slot : slots_) {
+    if (slot.nameOffset_ == kEmptySlot_) {
+      continue;
+    }
+    // the fields are separated by tabs and the users by lines, such a name
+    // would break the file. the user is fetched by the API again
+    const char *name = names_.data() + slot.nameOffset_;
+    if (memchr(name, '\t', slot.nameLen_) != nullptr ||
+        memchr(name, '\n', slot.nameLen_) != nullptr) {
+      LOG(WARNING) << "user name with a tab or newline isn't saved, user id: "
+      << slot.userId_;
+      continue;
+    }
+    fprintf(f, "%d\t%.*s", slot.userId_, (int)slot.nameLen_, name);
+#ifdef USER_DEFINED_COINBASE
+    const string *coinbaseInfo = getCoinbaseInfo(slot.userId_);
+    if (coinbaseInfo != nullptr) {
+      string hex;
+      Bin2Hex((const uint8 *)coinbaseInfo->data(), coinbaseInfo->size(), hex);
+      fprintf(f, "\t%s", hex.c_str());
+    }
+#endif
+    fputc('\n', f);
+  }
+
+  const bool isWritten = (fflush(f) == 0 && ferror(f) == 0);
+  if (fclose(f) != 0 || !isWritten ||
+      rename(tmpFile.c_str(), file.c_str()) != 0) {
+    LOG(ERROR) << "write file fail: " << file;
+    unlink(tmpFile.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool UserDirectory::loadFromFile(const string &file, int64_t *lastTime) {
+  std::ifstream in(file);
+  if (!in) {
+    LOG(ERROR) << "open file fail: " << file;
+    return false;
+  }
+
+  string line;
+  if (!std::getline(in, line) ||
+      sscanf(line.c_str(), "#btcpool users v1 %" SCNd64, lastTime) != 1) {
+    LOG(ERROR) << "invalid users file: " << file;
+    return false;
+  }
+
+  while (std::getline(in, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    const size_t pos1 = line.find('\t');
+    const size_t pos2 = (pos1 == string::npos) ? string::npos : line.find('\t', pos1 + 1);
+    const int32_t userId = atoi(line.c_str());
+    const string userName = (pos1 == string::npos) ? string() :
+                            line.substr(pos1 + 1, pos2 == string::npos ? string::npos : pos2 - pos1 - 1);
+    if (userId <= 0 || userName.empty()) {
+      LOG(ERROR) << "invalid line of users file: " << line;
+      return false;
+    }
+    addUser(userName, userId, true);
+
+#ifdef USER_DEFINED_COINBASE
+    if (pos2 != string::npos) {
+      vector<char> coinbaseInfo;
+      Hex2Bin(line.c_str() + pos2 + 1, line.size() - pos2 - 1, coinbaseInfo);
+      setCoinbaseInfo(userId, string(coinbaseInfo.begin(), coinbaseInfo.end()));
+    }
+#endif
+  }
+  return true;
 }
 
 
 //////////////////////////////////// UserInfo /////////////////////////////////
-UserInfo::UserInfo(const string &apiUrl, Server *server):
-running_(true), apiUrl_(apiUrl), lastMaxUserId_(0),
+UserInfo::UserInfo(const string &apiUrl, const string &cacheFile,
+                   Server *server):
+running_(true), apiUrl_(apiUrl), cacheFile_(cacheFile),
+directory_(std::make_shared<UserDirectory>()),
+directoryVersion_(++gSnapshotVersion),
+lastMaxUserId_(0), lastTime_(0),
 server_(server)
 {
-  pthread_rwlock_init(&rwlock_, nullptr);
 }
 
 UserInfo::~UserInfo() {
@@ -361,8 +718,6 @@ UserInfo::~UserInfo() {
 
   if (threadInsertWorkerName_.joinable())
     threadInsertWorkerName_.join();
-
-  pthread_rwlock_destroy(&rwlock_);
 }
 
 void UserInfo::stop() {
@@ -372,15 +727,35 @@ void UserInfo::stop() {
   running_ = false;
 }
 
-int32_t UserInfo::getUserId(const string userName) {
-  pthread_rwlock_rdlock(&rwlock_);
-  auto itr = nameIds_.find(userName);
-  pthread_rwlock_unlock(&rwlock_);
+void UserInfo::publishDirectory(shared_ptr<const UserDirectory> directory) {
+  std::atomic_store(&directory_, directory);
+  directoryVersion_.store(++gSnapshotVersion, std::memory_order_release);
+}
 
-  if (itr != nameIds_.end()) {
-    return itr->second;
+const UserDirectory &UserInfo::getDirectory() {
+  //
+  // authorizing never waits for the update thread: it swaps in a whole new
+  // directory, and every thread reloads its reference only after the
+  // version changed.
+  //
+  struct Cache {
+    const UserInfo *userInfo_;
+    uint64_t version_;
+    shared_ptr<const UserDirectory> directory_;
+  };
+  static thread_local Cache cache = {nullptr, 0, nullptr};
+
+  const uint64_t version = directoryVersion_.load(std::memory_order_acquire);
+  if (cache.userInfo_ != this || cache.version_ != version) {
+    cache.directory_ = std::atomic_load(&directory_);
+    cache.userInfo_  = this;
+    cache.version_   = version;
   }
-  return 0;  // not found
+  return *cache.directory_;
+}
+
+int32_t UserInfo::getUserId(const string &userName) {
+  return getDirectory().getUserId(userName.data(), userName.size());
 }
 
 #ifdef USER_DEFINED_COINBASE
@@ -388,12 +763,9 @@ int32_t UserInfo::getUserId(const string userName) {
 
 // getCoinbaseInfo
 string UserInfo::getCoinbaseInfo(int32_t userId) {
-  pthread_rwlock_rdlock(&rwlock_);
-  auto itr = idCoinbaseInfos_.find(userId);
-  pthread_rwlock_unlock(&rwlock_);
-
-  if (itr != idCoinbaseInfos_.end()) {
-    return itr->second;
+  const string *coinbaseInfo = getDirectory().getCoinbaseInfo(userId);
+  if (coinbaseInfo != nullptr) {
+    return *coinbaseInfo;
   }
   return "";  // not found
 }
@@ -425,9 +797,9 @@ int32_t UserInfo::incrementalUpdateUsers() {
   if (vUser->size() == 0) {
     return 0;
   }
-  lastTime_ = data["time"].int64();
 
-  pthread_rwlock_wrlock(&rwlock_);
+  // readers keep using the current directory until the new one is published
+  auto directory = std::make_shared<UserDirectory>(*std::atomic_load(&directory_));
   for (JsonNode &itr : *vUser) {
 
     const string  userName(itr.key_start(), itr.key_end() - itr.key_start());
@@ -450,17 +822,16 @@ int32_t UserInfo::incrementalUpdateUsers() {
       coinbaseInfo.resize(USER_DEFINED_COINBASE_SIZE, '\x20');
     }
 
-    if (userId > lastMaxUserId_) {
-      lastMaxUserId_ = userId;
-    }
-    nameIds_[userName] = userId;
+    directory->addUser(userName, userId, true/* replace */);
 
     // get user's coinbase info
     LOG(INFO) << "user id: " << userId << ", coinbase info: " << coinbaseInfo;
-    idCoinbaseInfos_[userId] = coinbaseInfo;
+    directory->setCoinbaseInfo(userId, coinbaseInfo);
 
   }
-  pthread_rwlock_unlock(&rwlock_);
+  publishDirectory(directory);
+  lastMaxUserId_ = std::max(lastMaxUserId_, directory->getMaxUserId());
+  lastTime_ = data["time"].int64();
 
   return vUser->size();
 }
@@ -495,16 +866,15 @@ int32_t UserInfo::incrementalUpdateUsers() {
     return 0;
   }
 
-  pthread_rwlock_wrlock(&rwlock_);
+  // readers keep using the current directory until the new one is published
+  auto directory = std::make_shared<UserDirectory>(*std::atomic_load(&directory_));
   for (const auto &itr : *vUser) {
     const string  userName(itr.key_start(), itr.key_end() - itr.key_start());
     const int32_t userId   = itr.int32();
-    if (userId > lastMaxUserId_) {
-      lastMaxUserId_ = userId;
-    }
-    nameIds_.insert(std::make_pair(userName, userId));
+    directory->addUser(userName, userId, false/* keep the existing one */);
   }
-  pthread_rwlock_unlock(&rwlock_);
+  publishDirectory(directory);
+  lastMaxUserId_ = std::max(lastMaxUserId_, directory->getMaxUserId());
 
   return vUser->size();
 }
@@ -512,9 +882,42 @@ int32_t UserInfo::incrementalUpdateUsers() {
 /////////////////// End of user defined coinbase disabled ///////////////////
 #endif
 
+bool UserInfo::saveUsersCache() {
+  if (cacheFile_.empty()) {
+    return true;
+  }
+  shared_ptr<const UserDirectory> directory = std::atomic_load(&directory_);
+  if (!directory->saveToFile(cacheFile_, lastTime_)) {
+    return false;
+  }
+  LOG(INFO) << "save users to cache file: " << cacheFile_
+  << ", count: " << directory->size();
+  return true;
+}
+
+bool UserInfo::loadUsersCache() {
+  if (cacheFile_.empty() || !fileExists(cacheFile_.c_str())) {
+    return false;
+  }
+  auto directory = std::make_shared<UserDirectory>();
+  int64_t lastTime = 0;
+  if (!directory->loadFromFile(cacheFile_, &lastTime)) {
+    LOG(WARNING) << "ignore the users cache file: " << cacheFile_;
+    return false;
+  }
+
+  publishDirectory(directory);
+  lastMaxUserId_ = directory->getMaxUserId();
+  lastTime_      = lastTime;
+  LOG(INFO) << "load users from cache file: " << cacheFile_
+  << ", count: " << directory->size() << ", max user id: " << lastMaxUserId_;
+  return true;
+}
+
 void UserInfo::runThreadUpdate() {
   const time_t updateInterval = 10;  // seconds
   time_t lastUpdateTime = time(nullptr);
+  bool isCacheDirty = false;
 
   while (running_) {
     if (lastUpdateTime + updateInterval > time(nullptr)) {
@@ -525,30 +928,48 @@ void UserInfo::runThreadUpdate() {
     int32_t res = incrementalUpdateUsers();
     lastUpdateTime = time(nullptr);
 
-    if (res > 0)
+    if (res > 0) {
       LOG(INFO) << "update users count: " << res;
+      // there may be more, e.g. started from the cache file. the cache is
+      // saved once it's caught up
+      isCacheDirty = true;
+      lastUpdateTime = 0;
+      continue;
+    }
+
+    if (res == 0 && isCacheDirty) {
+      saveUsersCache();
+      isCacheDirty = false;
+    }
   }
 }
 
 bool UserInfo::setupThreads() {
   //
-  // get all user list, incremental update model.
-  //
-  // We use `offset` in incrementalUpdateUsers(), will keep update uitl no more
-  // new users. Most of http API have timeout limit, so can't return lots of
-  // data in one request.
+  // the users in the cache file are served at once, the new users since it
+  // was saved are caught up by the update thread.
   //
-  while (1) {
-    int32_t res = incrementalUpdateUsers();
-    if (res == 0)
-      break;
+  if (!loadUsersCache()) {
+    //
+    // get all user list, incremental update model.
+    //
+    // We use `offset` in incrementalUpdateUsers(), will keep update uitl no more
+    // new users. Most of http API have timeout limit, so can't return lots of
+    // data in one request.
+    //
+    while (1) {
+      int32_t res = incrementalUpdateUsers();
+      if (res == 0)
+        break;
+
+      if (res == -1) {
+        LOG(ERROR) << "update user list failure";
+        return false;
+      }
 
-    if (res == -1) {
-      LOG(ERROR) << "update user list failure";
-      return false;
+      LOG(INFO) << "update users count: " << res;
     }
-
-    LOG(INFO) << "update users count: " << res;
+    saveUsersCache();
   }
 
   threadUpdate_ = thread(&UserInfo::runThreadUpdate, this);
@@ -558,77 +979,98 @@ bool UserInfo::setupThreads() {
 
 void UserInfo::addWorker(const int32_t userId, const int64_t workerId,
                          const string &workerName, const string &minerAgent) {
+  // max length of worker name: 20, miner agent: 30
   ScopeLock sl(workerNameLock_);
-
-  // insert to Q
-  workerNameQ_.push_back(WorkerName());
-  workerNameQ_.rbegin()->userId_   = userId;
-  workerNameQ_.rbegin()->workerId_ = workerId;
-
-  // worker name
-  snprintf(workerNameQ_.rbegin()->workerName_,
-           sizeof(workerNameQ_.rbegin()->workerName_),
-           "%s", workerName.c_str());
-  // miner agent
-  snprintf(workerNameQ_.rbegin()->minerAgent_,
-           sizeof(workerNameQ_.rbegin()->minerAgent_),
-           "%s", minerAgent.c_str());
+  workerUpdates_.add(userId, workerId,
+                     workerName.substr(0, 20), minerAgent.substr(0, 30));
 }
 
 void UserInfo::runThreadInsertWorkerName() {
   while (running_) {
-    if (insertWorkerName() > 0) {
-      continue;
-    }
     sleep(1);
+    insertWorkerName();
   }
+  insertWorkerName();  // the rest
 }
 
 int32_t UserInfo::insertWorkerName() {
-  std::deque<WorkerName>::iterator itr = workerNameQ_.end();
+  WorkerUpdateBatch workerUpdates;
   {
     ScopeLock sl(workerNameLock_);
-    if (workerNameQ_.size() == 0)
+    if (workerUpdates_.empty())
       return 0;
-    itr = workerNameQ_.begin();
+    std::swap(workerUpdates, workerUpdates_);
   }
 
-  if (itr == workerNameQ_.end())
-    return 0;
-
-
-  // sent events to kafka: worker_update
-  {
-    string eventJson;
-    eventJson = Strings::Format("{\"created_at\":\"%s\","
-                                 "\"type\":\"worker_update\","
-                                 "\"content\":{"
-                                     "\"user_id\":%d,"
-                                     "\"worker_id\":%ld,"
-                                     "\"worker_name\":\"%s\","
-                                     "\"miner_agent\":\"%s\""
-                                "}}",
-                                date("%F %T").c_str(),
-                                itr->userId_,
-                                itr->workerId_,
-                                itr->workerName_,
-                                itr->minerAgent_);
+  // sent events to kafka: worker_update or worker_update_batch
+  vector<string> events;
+  workerUpdates.getEvents((size_t)server_->workerUpdateBatchSize_, events);
+  for (const auto &eventJson : events) {
     server_->sendCommonEvents2Kafka(eventJson);
   }
 
+  return (int32_t)workerUpdates.size();
+}
+
 
-  {
-    ScopeLock sl(workerNameLock_);
-    workerNameQ_.pop_front();
+///////////////////////////////// SharedPayload ////////////////////////////////
+SharedPayload::SharedPayload(const string &data): refCount_(1), data_(data) {
+}
+
+SharedPayload *SharedPayload::create(const string &data) {
+  return new SharedPayload(data);
+}
+
+void SharedPayload::ref() {
+  refCount_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SharedPayload::unref() {
+  if (refCount_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete this;
+  }
+}
+
+bool SharedPayload::addToEvbuffer(struct evbuffer *buf) {
+  ref();
+  if (evbuffer_add_reference(buf, data(), size(),
+                             SharedPayload::evbufferCleanup, (void *)this) != 0) {
+    unref();
+    return false;
   }
-  return 1;
+  return true;
 }
 
+void SharedPayload::evbufferCleanup(const void *data, size_t len,
+                                    void *payload) {
+  static_cast<SharedPayload *>(payload)->unref();
+}
 
+bool removeEvbufferRange(struct evbuffer *buf, const size_t pos, const size_t len) {
+  if (pos + len > evbuffer_get_length(buf)) {
+    return false;
+  }
+  struct evbuffer *rest = evbuffer_new();
+  if (rest == nullptr) {
+    return false;
+  }
+  // the chains are moved, only a chain split at pos is copied
+  if (evbuffer_add_buffer(rest, buf) != 0) {
+    evbuffer_free(rest);
+    return false;
+  }
+  evbuffer_remove_buffer(rest, buf, pos);
+  evbuffer_drain(rest, len);
+  evbuffer_add_buffer(buf, rest);
+  evbuffer_free(rest);
+  return true;
+}
 
 ////////////////////////////////// StratumJobEx ////////////////////////////////
 StratumJobEx::StratumJobEx(StratumJob *sjob, bool isClean):
-state_(0), isClean_(isClean), sjob_(sjob)
+state_(0), isClean_(isClean), sjob_(sjob),
+notifyHead_(nullptr), notifyTail_(nullptr), notifyTailClean_(nullptr),
+binNotifyHead_(nullptr), binNotifyTail_(nullptr)
 {
   assert(sjob != nullptr);
   makeMiningNotifyStr();
@@ -639,6 +1081,22 @@ StratumJobEx::~StratumJobEx() {
     delete sjob_;
     sjob_ = nullptr;
   }
+  // sessions' evbuffers may still hold them, they free themselves
+  if (notifyHead_ != nullptr) {
+    notifyHead_->unref();
+  }
+  if (notifyTail_ != nullptr) {
+    notifyTail_->unref();
+  }
+  if (notifyTailClean_ != nullptr) {
+    notifyTailClean_->unref();
+  }
+  if (binNotifyHead_ != nullptr) {
+    binNotifyHead_->unref();
+  }
+  if (binNotifyTail_ != nullptr) {
+    binNotifyTail_->unref();
+  }
 }
 
 void StratumJobEx::makeMiningNotifyStr() {
@@ -671,12 +1129,11 @@ void StratumJobEx::makeMiningNotifyStr() {
 
   miningNotify3_ = Strings::Format("\",\"%s\""
                                    ",[%s]"
-                                   ",\"%08x\",\"%08x\",\"%08x\",%s"
+                                   ",\"%08x\",\"%08x\",\"%08x\",false"
                                    "]}\n",
                                    sjob_->coinbase2_.c_str(),
                                    merkleBranchStr.c_str(),
-                                   sjob_->nVersion_, sjob_->nBits_, sjob_->nTime_,
-                                   isClean_ ? "true" : "false");
+                                   sjob_->nVersion_, sjob_->nBits_, sjob_->nTime_);
   // always set clean to true, reset of them is the same with miningNotify2_
   miningNotify3Clean_ = Strings::Format("\",\"%s\""
                                    ",[%s]"
@@ -686,6 +1143,37 @@ void StratumJobEx::makeMiningNotifyStr() {
                                    merkleBranchStr.c_str(),
                                    sjob_->nVersion_, sjob_->nBits_, sjob_->nTime_);
 
+  Hex2Bin(sjob_->coinbase1_.c_str(), coinbase1Bin_);
+  Hex2Bin(sjob_->coinbase2_.c_str(), coinbase2Bin_);
+
+  // build once, shared by all sessions
+  notifyHead_      = SharedPayload::create(miningNotify1_);
+  notifyTail_      = SharedPayload::create(miningNotify2_ + coinbase1_ +
+                                           miningNotify3_);
+  notifyTailClean_ = SharedPayload::create(miningNotify2_ + coinbase1_ +
+                                           miningNotify3Clean_);
+
+  // binary stratum, split around the bytes of the session
+  BinaryStratum::Notify binNotify;
+  binNotify.shortJobId_ = 0;
+  binNotify.isClean_    = false;
+  binNotify.prevHash_   = sjob_->prevHash_;
+  binNotify.nVersion_   = sjob_->nVersion_;
+  binNotify.nBits_      = sjob_->nBits_;
+  binNotify.nTime_      = sjob_->nTime_;
+  binNotify.coinbase1_.assign(coinbase1Bin_.begin(), coinbase1Bin_.end());
+  binNotify.coinbase2_.assign(coinbase2Bin_.begin(), coinbase2Bin_.end());
+  binNotify.merkleBranch_ = sjob_->merkleBranch_;
+  string binNotifyStr;
+  if (!BinaryStratum::encode(binNotify, binNotifyStr)) {
+    LOG(ERROR) << "job " << sjob_->jobId_ << " is too large for binary stratum";
+    return;
+  }
+  binNotifyHead_ = SharedPayload::create(
+      binNotifyStr.substr(0, BinaryStratum::kNotifySessionOffset_));
+  binNotifyTail_ = SharedPayload::create(
+      binNotifyStr.substr(BinaryStratum::kNotifySessionOffset_ +
+                          BinaryStratum::kNotifySessionSize_));
 }
 
 void StratumJobEx::markStale() {
@@ -749,19 +1237,127 @@ void StratumJobEx::generateBlockHeader(CBlockHeader *header,
   }
 }
 
+void StratumJobEx::initCoinbasePrefix(CoinbasePrefix *prefix,
+                                      const uint32_t extraNonce1,
+                                      const string *userCoinbaseInfo) const {
+  prefix->midstate_.reset();
+
+#ifdef USER_DEFINED_COINBASE
+  if (userCoinbaseInfo != nullptr && userCoinbaseInfo->size() > 0 &&
+      userCoinbaseInfo->size() <= coinbase1Bin_.size()) {
+    // replace the last `userCoinbaseInfo->size()` bytes to `userCoinbaseInfo`
+    const size_t len = coinbase1Bin_.size() - userCoinbaseInfo->size();
+    prefix->midstate_.write((const uint8_t *)coinbase1Bin_.data(), len);
+    prefix->midstate_.write((const uint8_t *)userCoinbaseInfo->data(),
+                            userCoinbaseInfo->size());
+  } else
+#endif
+  {
+    prefix->midstate_.write((const uint8_t *)coinbase1Bin_.data(),
+                            coinbase1Bin_.size());
+  }
+
+  // extraNonce1 is in hex "%08x" at coinbase, so it's big-endian
+  const uint32_t extraNonce1Be = HToBe(extraNonce1);
+  prefix->midstate_.write((const uint8_t *)&extraNonce1Be, 4);
+  prefix->isReady_ = true;
+}
+
+void StratumJobEx::initShareHashItem(ShareHashItem *item,
+                                     const SHA256Midstate *prefix,
+                                     const uint64_t extraNonce2,
+                                     const uint32_t nTime,
+                                     const uint32_t nonce,
+                                     const uint32_t versionMask,
+                                     const uint32_t versionBits) const {
+  // coinbase: continue from the midstate of coinbase1 + extraNonce1
+  const uint64_t extraNonce2Be = HToBe(extraNonce2);
+  item->coinbasePrefix_ = prefix;
+  memcpy(item->extraNonce2_, &extraNonce2Be, sizeof(item->extraNonce2_));
+  item->coinbase2_      = (const uint8_t *)coinbase2Bin_.data();
+  item->coinbase2Len_   = (uint32_t)coinbase2Bin_.size();
+  item->merkleBranch_     = sjob_->merkleBranch_.data();
+  item->merkleBranchSize_ = (uint32_t)sjob_->merkleBranch_.size();
+
+  // hashMerkleRoot is filled by SHA256Batch
+  CBlockHeader header;
+  header.hashPrevBlock = sjob_->prevHash_;
+  header.nVersion      = (int32_t)(((uint32_t)sjob_->nVersion_ & ~versionMask) |
+                                   (versionBits & versionMask));
+  header.nBits         = sjob_->nBits_;
+  header.nTime         = nTime;
+  header.nNonce        = nonce;
+  static_assert(sizeof(CBlockHeader) == sizeof(item->header_),
+                "CBlockHeader should be 80 bytes");
+  memcpy(item->header_, (const uint8_t *)&header, sizeof(item->header_));
+}
+
+void StratumJobEx::generateBlockHeader(CBlockHeader *header, uint256 *blkHash,
+                                       const CoinbasePrefix &prefix,
+                                       const uint64_t extraNonce2,
+                                       const uint32_t nTime,
+                                       const uint32_t nonce,
+                                       const uint32_t versionMask,
+                                       const uint32_t versionBits) const {
+  assert(prefix.isReady_);
+
+  ShareHashItem item;
+  initShareHashItem(&item, &prefix.midstate_, extraNonce2, nTime, nonce,
+                    versionMask, versionBits);
+  SHA256Batch::hashShares(&item, 1);
+
+  memcpy((uint8_t *)header, item.header_, sizeof(item.header_));
+  *blkHash = item.hash_;
+}
+
 ////////////////////////////////// StratumServer ///////////////////////////////
 StratumServer::StratumServer(const char *ip, const unsigned short port,
                              const char *kafkaBrokers, const string &userAPIUrl,
+                             const string &usersCacheFile,
                              const uint8_t serverId, const string &fileLastNotifyTime,
                              bool isEnableSimulator, bool isSubmitInvalidBlock,
                              bool isDevModeEnable, float minerDifficulty,
-                             const int32_t shareAvgSeconds)
+                             const int32_t shareAvgSeconds,
+                             const int32_t nThreads,
+                             const int32_t shareLogBatchSize,
+                             const int32_t shareLogBatchMs,
+                             const int32_t maxAcceptsPerSecond,
+                             const int32_t maxAuthorizesPerSecond,
+                             const int32_t firstJobBatchSize,
+                             const int32_t workerUpdateBatchSize,
+                             const DiffController::Type varDiffType,
+                             const uint32_t versionMask,
+                             const int32_t verifyThreads,
+                             const int32_t verifyQueueSize,
+                             const int32_t notifyPacingMs,
+                             const int32_t outputHighWater,
+                             const int32_t outputEvictJobs,
+                             const int32_t shareLatencySampleRate,
+                             const int32_t statsHttpPort,
+                             const string &handoffSocket,
+                             const int32_t ipBanScore,
+                             const int32_t ipBanSeconds,
+                             const int32_t ipBanHalfLife)
 :running_(true), server_(shareAvgSeconds),
 ip_(ip), port_(port), serverId_(serverId),
 fileLastNotifyTime_(fileLastNotifyTime),
 kafkaBrokers_(kafkaBrokers), userAPIUrl_(userAPIUrl),
+usersCacheFile_(usersCacheFile),
 isEnableSimulator_(isEnableSimulator), isSubmitInvalidBlock_(isSubmitInvalidBlock),
-isDevModeEnable_(isDevModeEnable), minerDifficulty_(minerDifficulty)
+isDevModeEnable_(isDevModeEnable), minerDifficulty_(minerDifficulty),
+nThreads_(nThreads), shareLogBatchSize_(shareLogBatchSize),
+shareLogBatchMs_(shareLogBatchMs),
+maxAcceptsPerSecond_(maxAcceptsPerSecond),
+maxAuthorizesPerSecond_(maxAuthorizesPerSecond),
+firstJobBatchSize_(firstJobBatchSize),
+workerUpdateBatchSize_(workerUpdateBatchSize),
+varDiffType_(varDiffType), versionMask_(versionMask),
+verifyThreads_(verifyThreads), verifyQueueSize_(verifyQueueSize),
+notifyPacingMs_(notifyPacingMs),
+outputHighWater_(outputHighWater), outputEvictJobs_(outputEvictJobs),
+shareLatencySampleRate_(shareLatencySampleRate), statsHttpPort_(statsHttpPort),
+handoffSocket_(handoffSocket), ipBanScore_(ipBanScore),
+ipBanSeconds_(ipBanSeconds), ipBanHalfLife_(ipBanHalfLife)
 {
 }
 
@@ -770,9 +1366,18 @@ StratumServer::~StratumServer() {
 
 bool StratumServer::init() {
   if (!server_.setup(ip_.c_str(), port_, kafkaBrokers_.c_str(),
-                     userAPIUrl_, serverId_, fileLastNotifyTime_,
+                     userAPIUrl_, usersCacheFile_, serverId_, fileLastNotifyTime_,
                      isEnableSimulator_, isSubmitInvalidBlock_,
-                     isDevModeEnable_, minerDifficulty_)) {
+                     isDevModeEnable_, minerDifficulty_, nThreads_,
+                     shareLogBatchSize_, shareLogBatchMs_,
+                     maxAcceptsPerSecond_, maxAuthorizesPerSecond_,
+                     firstJobBatchSize_, workerUpdateBatchSize_,
+                     varDiffType_, versionMask_,
+                     verifyThreads_, verifyQueueSize_, notifyPacingMs_,
+                     outputHighWater_, outputEvictJobs_,
+                     shareLatencySampleRate_, statsHttpPort_,
+                     handoffSocket_, ipBanScore_, ipBanSeconds_,
+                     ipBanHalfLife_)) {
     LOG(ERROR) << "fail to setup server";
     return false;
   }
@@ -792,36 +1397,2138 @@ void StratumServer::run() {
   server_.run();
 }
 
-///////////////////////////////////// Server ///////////////////////////////////
-Server::Server(const int32_t shareAvgSeconds):
-base_(nullptr), signal_event_(nullptr), listener_(nullptr),
-kafkaProducerShareLog_(nullptr),
-kafkaProducerSolvedShare_(nullptr),
-kafkaProducerNamecoinSolvedShare_(nullptr),
-kafkaProducerCommonEvents_(nullptr),
-kafkaProducerRskSolvedShare_(nullptr),
-isEnableSimulator_(false), isSubmitInvalidBlock_(false),
-
-#ifndef WORK_WITH_STRATUM_SWITCHER
-sessionIDManager_(nullptr),
-#endif
-
-isDevModeEnable_(false), minerDifficulty_(1.0),
-kShareAvgSeconds_(shareAvgSeconds),
-jobRepository_(nullptr), userInfo_(nullptr)
+/////////////////////////////// MiningNotifyTask ///////////////////////////////
+MiningNotifyTask::MiningNotifyTask(shared_ptr<StratumJobEx> exJobPtr,
+                                   const int32_t nReactors):
+exJobPtr_(exJobPtr), postTime_(getMonotonicTimeUs()),
+firstSendTime_(INT64_MAX), lastSendTime_(0),
+pendingReactors_(nReactors), sessionsCount_(0), sessionsMemory_(0)
 {
 }
 
-Server::~Server() {
-  if (signal_event_ != nullptr) {
-    event_free(signal_event_);
+bool MiningNotifyTask::finishReactor(const int64_t firstSendTime,
+                                     const int64_t lastSendTime,
+                                     const int64_t sessionsCount,
+                                     const int64_t sessionsMemory) {
+  if (sessionsCount > 0) {
+    int64_t cur = firstSendTime_.load();
+    while (firstSendTime < cur &&
+           !firstSendTime_.compare_exchange_weak(cur, firstSendTime)) {
+    }
+    cur = lastSendTime_.load();
+    while (lastSendTime > cur &&
+           !lastSendTime_.compare_exchange_weak(cur, lastSendTime)) {
+    }
+    sessionsCount_  += sessionsCount;
+    sessionsMemory_ += sessionsMemory;
   }
-  if (listener_ != nullptr) {
+  return (--pendingReactors_ == 0);
+}
+
+////////////////////////////////// PacedNotify /////////////////////////////////
+PacedNotify::PacedNotify() {
+  reset();
+}
+
+void PacedNotify::reset() {
+  task_ = nullptr;
+  sessions_.clear();
+  sentNum_        = 0;
+  maxSlotSentNum_ = 0;
+  slotsNum_       = 0;
+  startTime_      = 0;
+  firstSendTime_  = 0;
+  lastSendTime_   = 0;
+  sessionsCount_  = 0;
+  sessionsMemory_ = 0;
+}
+
+////////////////////////////////// TokenBucket /////////////////////////////////
+TokenBucket::TokenBucket(): rate_(0), burst_(0), tokens_(0), lastTime_(0) {
+}
+
+void TokenBucket::setup(const double rate, const double burst) {
+  rate_     = rate;
+  burst_    = std::max(burst, 1.0);
+  tokens_   = burst_;
+  lastTime_ = 0;
+}
+
+void TokenBucket::refill(const int64_t now) {
+  if (lastTime_ != 0 && now > lastTime_) {
+    tokens_ = std::min(burst_, tokens_ + (now - lastTime_) * rate_ / 1000000.0);
+  }
+  lastTime_ = now;
+}
+
+bool TokenBucket::tryConsume(const int64_t now) {
+  if (isUnlimited()) {
+    return true;
+  }
+  refill(now);
+  if (tokens_ < 1.0) {
+    return false;
+  }
+  tokens_ -= 1.0;
+  return true;
+}
+
+int64_t TokenBucket::getWaitUs(const int64_t now) {
+  if (isUnlimited()) {
+    return 0;
+  }
+  refill(now);
+  if (tokens_ >= 1.0) {
+    return 0;
+  }
+  return (int64_t)((1.0 - tokens_) * 1000000.0 / rate_) + 1;
+}
+
+////////////////////////////////// IpReputation ////////////////////////////////
+const double IpReputation::kWeights_[IpReputation::EVENT_NUM] = {
+  1.0,   // EVENT_CONNECT
+  10.0,  // EVENT_AUTHORIZE_FAIL, a valid user name is known by a real miner
+  1.0    // EVENT_INVALID_SHARE
+};
+const int32_t IpReputation::kSubnetFactor_;
+const int32_t IpReputation::kShards_;
+const size_t IpReputation::kMaxShardEntries_;
+
+// ips are the low 32 bits, subnets have bit 32 set
+static const uint64_t kIpReputationSubnetFlag = (1ull << 32);
+
+static string ipReputationKeyToString(const uint64_t key) {
+  struct in_addr addr;
+  addr.s_addr = htonl((uint32_t)key);
+  char ipStr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &addr, ipStr, sizeof(ipStr));
+  return (key & kIpReputationSubnetFlag) ? string(ipStr) + "/24" : string(ipStr);
+}
+
+IpReputation::IpReputation(): banScore_(0), banUs_(0), halfLifeUs_(1),
+bansNum_(0), bannedEventsNum_(0)
+{
+  for (Shard &shard : shards_) {
+    shard.purgeTime_ = 0;
+  }
+}
+
+void IpReputation::setup(const double banScore, const int32_t banSeconds,
+                         const int32_t halfLifeSeconds) {
+  banScore_   = std::max(banScore, 0.0);
+  banUs_      = (int64_t)std::max(banSeconds, 1) * 1000000;
+  halfLifeUs_ = (int64_t)std::max(halfLifeSeconds, 1) * 1000000;
+}
+
+void IpReputation::decay(Entry &entry, const int64_t now) const {
+  if (now <= entry.lastTime_) {
+    return;
+  }
+  const double factor = exp2(-(double)(now - entry.lastTime_) / halfLifeUs_);
+  for (double &counter : entry.counters_) {
+    counter *= factor;
+  }
+  entry.lastTime_ = now;
+}
+
+double IpReputation::getScore(const Entry &entry) const {
+  double score = 0;
+  for (int32_t i = 0; i < EVENT_NUM; i++) {
+    score += entry.counters_[i] * kWeights_[i];
+  }
+  return score;
+}
+
+void IpReputation::purge(Shard &shard, const int64_t now) {
+  auto itr = shard.entries_.begin();
+  while (itr != shard.entries_.end()) {
+    Entry &entry = itr->second;
+    decay(entry, now);
+    if (entry.banTime_ <= now && getScore(entry) < 1.0) {
+      itr = shard.entries_.erase(itr);
+    } else {
+      ++itr;
+    }
+  }
+  // a flood of new peers: not every one of them scans the shard
+  if (shard.entries_.size() >= kMaxShardEntries_) {
+    shard.purgeTime_ = now + halfLifeUs_ / 4;
+  }
+}
+
+bool IpReputation::addEvent(const uint64_t key, const Event event,
+                            const int64_t now) {
+  Shard &shard = getShard(key);
+  ScopeLock sl(shard.lock_);
+
+  auto itr = shard.entries_.find(key);
+  if (itr == shard.entries_.end()) {
+    if (shard.entries_.size() >= kMaxShardEntries_) {
+      if (now < shard.purgeTime_) {
+        return false;
+      }
+      purge(shard, now);
+      if (shard.entries_.size() >= kMaxShardEntries_) {
+        return false;
+      }
+    }
+    Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.lastTime_ = now;
+    itr = shard.entries_.insert(std::make_pair(key, entry)).first;
+  }
+
+  // a banned peer keeps its score up, it's banned again once expired
+  Entry &entry = itr->second;
+  decay(entry, now);
+  entry.counters_[event] += 1;
+  if (entry.banTime_ > now) {
+    return true;
+  }
+
+  const double score = getScore(entry);
+  const double banScore = (key & kIpReputationSubnetFlag) ?
+                          banScore_ * kSubnetFactor_ : banScore_;
+  if (score < banScore) {
+    return false;
+  }
+  entry.banTime_ = now + banUs_;
+  bansNum_++;
+  LOG(WARNING) << "ban " << ipReputationKeyToString(key) << " for "
+  << banUs_ / 1000000 << "s, score: " << Strings::Format("%.1f", score)
+  << ", connects: " << Strings::Format("%.1f", entry.counters_[EVENT_CONNECT])
+  << ", failed authorizes: " << Strings::Format("%.1f", entry.counters_[EVENT_AUTHORIZE_FAIL])
+  << ", invalid shares: " << Strings::Format("%.1f", entry.counters_[EVENT_INVALID_SHARE]);
+  return true;
+}
+
+bool IpReputation::isBanned(const uint64_t key, const int64_t now) {
+  Shard &shard = getShard(key);
+  ScopeLock sl(shard.lock_);
+  auto itr = shard.entries_.find(key);
+  return itr != shard.entries_.end() && itr->second.banTime_ > now;
+}
+
+bool IpReputation::addEvent(const uint32_t ip, const Event event,
+                            const int64_t now) {
+  if (!isEnabled()) {
+    return false;
+  }
+  const uint32_t hostIp = ntohl(ip);
+  // a banned ip is stopped by its own entry. its events are not counted to
+  // the subnet, or a single flooding peer would get its neighbours banned
+  if (addEvent((uint64_t)hostIp, event, now) ||
+      addEvent(kIpReputationSubnetFlag | (hostIp & 0xFFFFFF00u), event, now)) {
+    bannedEventsNum_++;
+    return true;
+  }
+  return false;
+}
+
+bool IpReputation::isBanned(const uint32_t ip, const int64_t now) {
+  if (!isEnabled()) {
+    return false;
+  }
+  const uint32_t hostIp = ntohl(ip);
+  return isBanned((uint64_t)hostIp, now) ||
+         isBanned(kIpReputationSubnetFlag | (hostIp & 0xFFFFFF00u), now);
+}
+
+size_t IpReputation::getEntriesNum() {
+  size_t n = 0;
+  for (Shard &shard : shards_) {
+    ScopeLock sl(shard.lock_);
+    n += shard.entries_.size();
+  }
+  return n;
+}
+
+/////////////////////////////////// ShareVerifier //////////////////////////////
+// the block hashes of the shares, the ones rejected before hashing are skipped
+static void hashPendingShares(vector<PendingShare> &shares,
+                              vector<ShareHashItem> &items) {
+  items.resize(shares.size());
+  size_t n = 0;
+  bool hasTraced = false;
+  const int64_t hashTime = getMonotonicTimeUs();
+  for (PendingShare &ps : shares) {
+    if (ps.result_ != StratumError::NO_ERROR) {
+      continue;
+    }
+    if (ps.trace_.isTraced()) {
+      ps.trace_.hashTime_ = hashTime;
+      hasTraced = true;
+    }
+    ps.exJobPtr_->initShareHashItem(&items[n++], &ps.coinbasePrefix_,
+                                    ps.extraNonce2_, ps.nTime_, ps.nonce_,
+                                    ps.versionMask_, ps.versionBits_);
+  }
+  SHA256Batch::hashShares(items.data(), n);
+
+  if (hasTraced) {
+    const int64_t hashedTime = getMonotonicTimeUs();
+    for (PendingShare &ps : shares) {
+      if (ps.trace_.isTraced()) {
+        ps.trace_.hashedTime_ = hashedTime;
+      }
+    }
+  }
+}
+
+// in the order of submitting
+static void finishPendingShares(vector<PendingShare> &shares,
+                                const vector<ShareHashItem> &items) {
+  size_t n = 0;
+  for (PendingShare &ps : shares) {
+    const ShareHashItem *item = nullptr;
+    if (ps.result_ == StratumError::NO_ERROR) {
+      item = &items[n++];
+    }
+    ps.session_->finishPendingShare(ps, item);
+  }
+}
+
+VerifyBatch::VerifyBatch(Reactor *reactor):
+reactor_(reactor), postTime_(0), isDone_(false)
+{
+  shares_.reserve(SHA256Batch::kMaxBatchSize_);
+  items_.reserve(SHA256Batch::kMaxBatchSize_);
+}
+
+void VerifyBatch::hash() {
+  hashPendingShares(shares_, items_);
+}
+
+void VerifyBatch::finish() {
+  finishPendingShares(shares_, items_);
+}
+
+void VerifyBatch::clear() {
+  shares_.clear();
+  isDone_ = false;
+}
+
+ShareVerifier::ShareVerifier(const int32_t nThreads,
+                             const size_t maxQueuedShares):
+running_(true), kMaxQueuedShares_(maxQueuedShares), queuedShares_(0),
+maxQueuedShares_(0), overflowsNum_(0)
+{
+  for (int32_t i = 0; i < nThreads; i++) {
+    threads_.push_back(thread(&ShareVerifier::runThread, this));
+  }
+}
+
+ShareVerifier::~ShareVerifier() {
+  stop();
+}
+
+void ShareVerifier::stop() {
+  {
+    ScopeLock sl(lock_);
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+  }
+  cond_.notify_all();
+
+  for (thread &t : threads_) {
+    if (t.joinable()) {
+      t.join();
+    }
+  }
+  LOG(INFO) << "share verifier stopped";
+}
+
+bool ShareVerifier::post(VerifyBatch *batch) {
+  const size_t n = batch->shares_.size();
+  {
+    ScopeLock sl(lock_);
+    if (!running_ || queuedShares_ + n > kMaxQueuedShares_) {
+      return false;
+    }
+    queue_.push_back(batch);
+    queuedShares_ += n;
+  }
+  cond_.notify_one();
+
+  // may miss a concurrent max, it's only a metric
+  const size_t queued = queuedShares_;
+  if (queued > maxQueuedShares_) {
+    maxQueuedShares_ = queued;
+  }
+  return true;
+}
+
+void ShareVerifier::recordOverflow(const VerifyBatch &batch) {
+  overflowsNum_++;
+  latency_.record((uint64_t)(getMonotonicTimeUs() - batch.postTime_));
+}
+
+void ShareVerifier::resetStats() {
+  maxQueuedShares_ = (size_t)queuedShares_;
+  latency_.reset();
+}
+
+void ShareVerifier::runThread() {
+  while (true) {
+    VerifyBatch *batch = nullptr;
+    {
+      UniqueLock ul(lock_);
+      while (running_ && queue_.empty()) {
+        cond_.wait(ul);
+      }
+      // stopped, the queue is drained first
+      if (queue_.empty()) {
+        break;
+      }
+      batch = queue_.front();
+      queue_.pop_front();
+      queuedShares_ -= batch->shares_.size();
+    }
+
+    batch->hash();
+    latency_.record((uint64_t)(getMonotonicTimeUs() - batch->postTime_));
+    // the batch belongs to the reactor again
+    batch->reactor_->postVerifiedBatch(batch);
+  }
+}
+
+///////////////////////////////// ShareLatency /////////////////////////////////
+ShareLatency::ShareLatency(): sampleRate_(0), isLogTrace_(false) {
+}
+
+const char *ShareLatency::getStageName(const int32_t stage) {
+  static const char *names[STAGES_NUM] = {
+    "read", "parse", "job_lookup", "hash_queue", "hash", "verified",
+    "check", "response", "total",
+    "sharelog_produce", "sharelog_queue", "solved_produce", "solved_queue"
+  };
+  if (stage < 0 || stage >= STAGES_NUM) {
+    return "unknown";
+  }
+  return names[stage];
+}
+
+void ShareLatency::recordTrace(const ShareTrace &trace, const int64_t checkTime,
+                               const int64_t checkedTime,
+                               const int64_t respondedTime,
+                               const string &workerName) {
+  const int64_t us[] = {
+    trace.lineTime_     - trace.readTime_,
+    trace.parsedTime_   - trace.lineTime_,
+    trace.preparedTime_ - trace.parsedTime_,
+    trace.hashTime_     - trace.preparedTime_,
+    trace.hashedTime_   - trace.hashTime_,
+    checkTime           - trace.hashedTime_,
+    checkedTime         - checkTime,
+    respondedTime       - checkedTime,
+    respondedTime       - trace.readTime_
+  };
+  for (int32_t i = 0; i <= STAGE_TOTAL; i++) {
+    record((Stage)i, us[i]);
+  }
+
+  if (isLogTrace()) {
+    string stages;
+    for (int32_t i = 0; i <= STAGE_TOTAL; i++) {
+      stages += Strings::Format("%s%s: %" PRId64, i == 0 ? "" : ", ",
+                                getStageName(i), us[i]);
+    }
+    LOG(INFO) << "share trace, worker: " << workerName << ", " << stages << " (us)";
+  }
+}
+
+void ShareLatency::reset() {
+  for (LatencyHistogram &stage : stages_) {
+    stage.reset();
+  }
+}
+
+string ShareLatency::toJson() const {
+  string stages;
+  for (int32_t i = 0; i < STAGES_NUM; i++) {
+    const LatencyHistogram &h = stages_[i];
+    stages += Strings::Format("%s\"%s\":{\"count\":%" PRIu64",\"mean\":%" PRIu64
+                              ",\"p50\":%" PRIu64",\"p90\":%" PRIu64
+                              ",\"p99\":%" PRIu64",\"p999\":%" PRIu64
+                              ",\"max\":%" PRIu64"}",
+                              i == 0 ? "" : ",", getStageName(i),
+                              h.getCount(), h.getMean(), h.getPercentile(0.5),
+                              h.getPercentile(0.9), h.getPercentile(0.99),
+                              h.getPercentile(0.999), h.getMax());
+  }
+  return Strings::Format("{\"sample_rate\":%u,\"log_trace\":%s,\"stages\":{%s}}",
+                         getSampleRate(), isLogTrace() ? "true" : "false",
+                         stages.c_str());
+}
+
+void ShareLatency::sharelogDelivered(const int64_t latencyUs, void *arg) {
+  ShareLatency *latency = static_cast<ShareLatency *>(arg);
+  // like the produce, solved shares are always recorded
+  if (latency->getSampleRate() > 0) {
+    latency->record(STAGE_SHARELOG_QUEUE, latencyUs);
+  }
+}
+
+void ShareLatency::solvedShareDelivered(const int64_t latencyUs, void *arg) {
+  static_cast<ShareLatency *>(arg)->record(STAGE_SOLVED_QUEUE, latencyUs);
+}
+
+////////////////////////////////// StatsHttpd //////////////////////////////////
+StatsHttpd::StatsHttpd(Server *server, const string &ip,
+                       const unsigned short port):
+server_(server), ip_(ip), port_(port), base_(nullptr), httpd_(nullptr)
+{
+}
+
+StatsHttpd::~StatsHttpd() {
+  stop();
+  if (httpd_ != nullptr) {
+    evhttp_free(httpd_);
+  }
+  if (base_ != nullptr) {
+    event_base_free(base_);
+  }
+}
+
+bool StatsHttpd::setup() {
+  base_  = event_base_new();
+  httpd_ = (base_ != nullptr) ? evhttp_new(base_) : nullptr;
+  if (httpd_ == nullptr) {
+    LOG(ERROR) << "stats httpd: cannot create evhttp";
+    return false;
+  }
+
+  evhttp_set_allowed_methods(httpd_, EVHTTP_REQ_GET | EVHTTP_REQ_HEAD);
+  evhttp_set_timeout(httpd_, 5 /* timeout in seconds */);
+  evhttp_set_cb(httpd_, "/share_latency",  StatsHttpd::httpdShareLatency, this);
+  evhttp_set_cb(httpd_, "/share_latency/", StatsHttpd::httpdShareLatency, this);
+
+  if (evhttp_bind_socket_with_handle(httpd_, ip_.c_str(), port_) == nullptr) {
+    LOG(ERROR) << "stats httpd: couldn't bind to " << ip_ << ":" << port_;
+    return false;
+  }
+  LOG(INFO) << "stats httpd listen on " << ip_ << ":" << port_;
+  return true;
+}
+
+void StatsHttpd::runThread() {
+  thread_ = thread(&StatsHttpd::run, this);
+}
+
+void StatsHttpd::run() {
+  event_base_dispatch(base_);
+}
+
+void StatsHttpd::stop() {
+  if (!thread_.joinable()) {
+    return;
+  }
+  event_base_loopexit(base_, NULL);
+  thread_.join();
+}
+
+void StatsHttpd::httpdShareLatency(struct evhttp_request *req, void *arg) {
+  evhttp_add_header(evhttp_request_get_output_headers(req),
+                    "Content-Type", "text/json");
+  StatsHttpd *httpd = static_cast<StatsHttpd *>(arg);
+  ShareLatency &latency = httpd->server_->shareLatency_;
+
+  // the switches, changed before the reply
+  bool isReset = false;
+  struct evkeyvalq params;
+  const char *query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+  if (query != nullptr && evhttp_parse_query_str(query, &params) == 0) {
+    const char *sampleRate = evhttp_find_header(&params, "sample_rate");
+    const char *logTrace   = evhttp_find_header(&params, "log_trace");
+    const char *reset      = evhttp_find_header(&params, "reset");
+    if (sampleRate != nullptr) {
+      latency.setSampleRate((uint32_t)strtoul(sampleRate, nullptr, 10));
+      LOG(INFO) << "share latency sample rate: " << latency.getSampleRate();
+    }
+    if (logTrace != nullptr) {
+      latency.setLogTrace(atoi(logTrace) != 0);
+    }
+    isReset = (reset != nullptr && atoi(reset) != 0);
+    evhttp_clear_headers(&params);
+  }
+
+  struct evbuffer *evb = evbuffer_new();
+  const string data = latency.toJson();
+  evbuffer_add_printf(evb, "{\"err_no\":0,\"err_msg\":\"\",\"data\":%s}",
+                      data.c_str());
+  evhttp_send_reply(req, HTTP_OK, "OK", evb);
+  evbuffer_free(evb);
+
+  if (isReset) {
+    latency.reset();
+  }
+}
+
+//////////////////////////////// HandoffSession ////////////////////////////////
+HandoffTask::HandoffTask(const int32_t nReactors):
+pendingReactors_(nReactors), isCancelled_(false)
+{
+}
+
+bool HandoffTask::finishReactor(vector<HandoffSession> &sessions) {
+  ScopeLock sl(lock_);
+  if (isCancelled_) {
+    return false;
+  }
+  for (HandoffSession &session : sessions) {
+    sessions_.push_back(std::move(session));
+  }
+  sessions.clear();
+  pendingReactors_--;
+  cond_.notify_all();
+  return true;
+}
+
+bool HandoffTask::wait(const int32_t timeoutMs) {
+  UniqueLock ul(lock_);
+  return cond_.wait_for(ul, std::chrono::milliseconds(timeoutMs),
+                        [this] { return pendingReactors_ <= 0; });
+}
+
+bool HandoffTask::isCancelled() {
+  ScopeLock sl(lock_);
+  return isCancelled_;
+}
+
+void HandoffTask::cancel(vector<HandoffSession> &sessions) {
+  ScopeLock sl(lock_);
+  isCancelled_ = true;
+  sessions.swap(sessions_);
+}
+
+////////////////////////////////// HotRestart //////////////////////////////////
+const uint32_t HotRestart::kVersion_;
+const uint32_t HotRestart::kMaxRecordSize_;
+
+static bool setSocketTimeout(const int sock, const int32_t seconds) {
+  struct timeval tv = {seconds, 0};
+  return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
+         setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+static bool recvFully(const int sock, char *buf, size_t len) {
+  while (len > 0) {
+    const ssize_t n = recv(sock, buf, len, MSG_WAITALL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG(ERROR) << "hot restart, recv failure: "
+      << (n < 0 ? strerror(errno) : "closed by peer");
+      return false;
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool makeUnixAddr(const string &path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  if (path.empty() || path.size() >= sizeof(addr->sun_path)) {
+    LOG(ERROR) << "hot restart, invalid socket path: " << path;
+    return false;
+  }
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+  return true;
+}
+
+HotRestart::HotRestart(Server *server, const string &path,
+                       const uint8_t serverId):
+server_(server), path_(path), serverId_(serverId), running_(false),
+listenSock_(-1), takeOverSock_(-1)
+{
+}
+
+HotRestart::~HotRestart() {
+  stop();
+  // closed without ACK, the old sserver resumes its sessions
+  if (takeOverSock_ >= 0) {
+    close(takeOverSock_);
+  }
+  // the path is left, it may be the next sserver's already. a stale one
+  // is refused and the next sserver starts cold
+  if (listenSock_ >= 0) {
+    close(listenSock_);
+  }
+}
+
+bool HotRestart::sendRecord(const int sock, const uint32_t type,
+                            const evutil_socket_t fd, const string &payload) {
+  uint32_t header[2] = {type, (uint32_t)payload.size()};
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len  = sizeof(header);
+  iov[1].iov_base = (void *)payload.data();
+  iov[1].iov_len  = payload.size();
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov    = iov;
+  msg.msg_iovlen = 2;
+  if (fd >= 0) {
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  // the fd goes with the first bytes of the record
+  size_t left = sizeof(header) + payload.size();
+  while (left > 0) {
+    ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG(ERROR) << "hot restart, send failure: " << strerror(errno);
+      return false;
+    }
+    left -= (size_t)n;
+    msg.msg_control    = nullptr;
+    msg.msg_controllen = 0;
+
+    while (n > 0 && msg.msg_iovlen > 0) {
+      if ((size_t)n < msg.msg_iov->iov_len) {
+        msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+        msg.msg_iov->iov_len -= (size_t)n;
+        n = 0;
+      } else {
+        n -= (ssize_t)msg.msg_iov->iov_len;
+        msg.msg_iov++;
+        msg.msg_iovlen--;
+      }
+    }
+  }
+  return true;
+}
+
+bool HotRestart::recvRecord(const int sock, uint32_t *type,
+                            evutil_socket_t *fd, string *payload) {
+  *fd = -1;
+  uint32_t header[2];
+  struct iovec iov;
+  iov.iov_base = header;
+  iov.iov_len  = sizeof(header);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n;
+  do {
+    n = recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    LOG(ERROR) << "hot restart, recv failure: "
+    << (n < 0 ? strerror(errno) : "closed by peer");
+    return false;
+  }
+
+  // a record carries one fd at most, sent with its header
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  if ((msg.msg_flags & MSG_CTRUNC) != 0) {
+    LOG(ERROR) << "hot restart, fd is truncated, too many open files?";
+  }
+  else if ((size_t)n == sizeof(header) ||
+           recvFully(sock, (char *)header + n, sizeof(header) - (size_t)n)) {
+    *type = header[0];
+    if (header[1] > kMaxRecordSize_) {
+      LOG(ERROR) << "hot restart, too large record: " << header[1];
+    } else {
+      payload->resize(header[1]);
+      if (header[1] == 0 || recvFully(sock, &(*payload)[0], header[1])) {
+        return true;
+      }
+    }
+  }
+
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+  return false;
+}
+
+bool HotRestart::takeOver(JobRepository *jobRepository,
+                          vector<evutil_socket_t> &listenFds,
+                          vector<HandoffSession> &sessions) {
+  struct sockaddr_un addr;
+  if (!makeUnixAddr(path_, &addr)) {
+    return false;
+  }
+  const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    LOG(ERROR) << "hot restart, cannot create socket: " << strerror(errno);
+    return false;
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    const int err = errno;
+    close(sock);
+    if (err == ENOENT || err == ECONNREFUSED) {
+      LOG(INFO) << "hot restart, no running sserver on " << path_;
+      return true;
+    }
+    LOG(ERROR) << "hot restart, cannot connect to " << path_ << ": "
+    << strerror(err);
+    return false;
+  }
+  // the old sserver finishes the shares of its sessions first
+  setSocketTimeout(sock, kFreezeTimeoutSeconds_ + kIoTimeoutSeconds_);
+
+  const int64_t beginTime = getMonotonicTimeUs();
+  LOG(INFO) << "hot restart, taking over the sserver on " << path_;
+
+  string hello;
+  HandoffWriter writer(hello);
+  writer.put(kVersion_);
+  writer.put(serverId_);
+
+  size_t jobsNum = 0;
+  bool isDone = false;
+  bool isOk = sendRecord(sock, RECORD_HELLO, -1, hello);
+  while (isOk && !isDone) {
+    uint32_t type = 0;
+    evutil_socket_t fd = -1;
+    string payload;
+    if (!recvRecord(sock, &type, &fd, &payload)) {
+      isOk = false;
+      break;
+    }
+
+    if (type == RECORD_LISTEN && fd >= 0) {
+      listenFds.push_back(fd);
+      continue;
+    }
+    if (type == RECORD_SESSION && fd >= 0) {
+      HandoffSession session;
+      session.fd_ = fd;
+      session.state_.swap(payload);
+      sessions.push_back(std::move(session));
+      continue;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    if (type == RECORD_JOB && payload.size() > 2) {
+      StratumJob *sjob = new StratumJob();
+      if (!sjob->unserializeFromJson(payload.data() + 2, payload.size() - 2)) {
+        LOG(ERROR) << "hot restart, unserialize stratum job fail";
+        delete sjob;
+        isOk = false;
+        break;
+      }
+      jobRepository->restoreJob(sjob, payload[0] != 0, payload[1] != 0);
+      jobsNum++;
+    } else if (type == RECORD_END) {
+      isDone = true;
+    } else if (type == RECORD_REJECT) {
+      LOG(ERROR) << "hot restart, rejected by the running sserver: " << payload;
+      isOk = false;
+    } else {
+      LOG(ERROR) << "hot restart, unexpected record: " << type;
+      isOk = false;
+    }
+  }
+
+  if (!isOk) {
+    // the old sserver resumes the sessions
+    close(sock);
+    for (evutil_socket_t fd : listenFds) {
+      close(fd);
+    }
+    for (const HandoffSession &session : sessions) {
+      close(session.fd_);
+    }
+    listenFds.clear();
+    sessions.clear();
+    return false;
+  }
+  // the old sserver exits on ACK, see finishTakeOver()
+  takeOverSock_ = sock;
+  LOG(INFO) << "hot restart, took over listeners: " << listenFds.size()
+  << ", jobs: " << jobsNum << ", sessions: " << sessions.size()
+  << ", in " << (getMonotonicTimeUs() - beginTime) / 1000 << " ms";
+  return true;
+}
+
+bool HotRestart::finishTakeOver() {
+  if (takeOverSock_ < 0) {
+    return true;  // nothing was taken over
+  }
+  const bool isOk = sendRecord(takeOverSock_, RECORD_ACK, -1, "");
+  close(takeOverSock_);
+  takeOverSock_ = -1;
+  if (!isOk) {
+    LOG(ERROR) << "hot restart, the running sserver is gone before ACK";
+  }
+  return isOk;
+}
+
+bool HotRestart::setup() {
+  struct sockaddr_un addr;
+  if (!makeUnixAddr(path_, &addr)) {
+    return false;
+  }
+  listenSock_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenSock_ < 0) {
+    LOG(ERROR) << "hot restart, cannot create socket: " << strerror(errno);
+    return false;
+  }
+
+  // the path of the previous sserver, it's taken over or gone
+  unlink(path_.c_str());
+  if (::bind(listenSock_, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listenSock_, 1) != 0) {
+    LOG(ERROR) << "hot restart, cannot listen on " << path_ << ": "
+    << strerror(errno);
+    return false;
+  }
+  LOG(INFO) << "hot restart, listen on " << path_;
+  return true;
+}
+
+void HotRestart::runThread() {
+  running_ = true;
+  thread_ = thread(&HotRestart::run, this);
+}
+
+void HotRestart::stop() {
+  running_ = false;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void HotRestart::run() {
+  while (running_) {
+    struct pollfd pfd;
+    pfd.fd      = listenSock_;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 500) <= 0) {
+      continue;
+    }
+    const int sock = accept4(listenSock_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock < 0) {
+      continue;
+    }
+
+    const bool isHandedOver = handOver(sock);
+    close(sock);
+    if (isHandedOver) {
+      LOG(INFO) << "hot restart, the sessions are handed over, stop";
+      server_->stop();
+      break;
+    }
+    LOG(ERROR) << "hot restart, handover failure, the sessions are resumed";
+  }
+}
+
+bool HotRestart::handOver(const int sock) {
+  setSocketTimeout(sock, kIoTimeoutSeconds_);
+
+  uint32_t type = 0;
+  evutil_socket_t fd = -1;
+  string hello;
+  if (!recvRecord(sock, &type, &fd, &hello)) {
+    return false;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  uint32_t version = 0;
+  uint8_t serverId = 0;
+  HandoffReader reader((const uint8_t *)hello.data(), hello.size());
+  if (type != RECORD_HELLO || !reader.get(version) || !reader.get(serverId)) {
+    LOG(ERROR) << "hot restart, invalid hello";
+    return false;
+  }
+  if (version != kVersion_ || serverId != serverId_) {
+    const string reason = Strings::Format("version: %u, server id: %u, "
+                                          "expected: %u, %u",
+                                          version, (uint32_t)serverId,
+                                          kVersion_, (uint32_t)serverId_);
+    LOG(ERROR) << "hot restart, reject the new sserver, " << reason;
+    sendRecord(sock, RECORD_REJECT, -1, reason);
+    return false;
+  }
+  LOG(INFO) << "hot restart, a new sserver is taking over";
+
+  //
+  // the reactors stop accepting and reading, and give their sessions once
+  // the shares are finished. the shares of the input buffers go with the
+  // sessions.
+  //
+  const int64_t beginTime = getMonotonicTimeUs();
+  shared_ptr<HandoffTask> task = server_->postHandoff();
+  int32_t waitedSeconds = 0;
+  while (!task->wait(1000)) {
+    if (!running_ || ++waitedSeconds >= kFreezeTimeoutSeconds_) {
+      LOG(ERROR) << "hot restart, the reactors are not frozen in time";
+      server_->resumeHandoff(task);
+      sendRecord(sock, RECORD_REJECT, -1, "timeout");
+      return false;
+    }
+  }
+  const int64_t frozenTime = getMonotonicTimeUs();
+
+  // all reactors are finished, the sessions are not changed any more
+  const size_t sessionsNum = task->sessions_.size();
+  if (!sendHandoff(sock, task->sessions_)) {
+    server_->resumeHandoff(task);
+    return false;
+  }
+  for (const HandoffSession &session : task->sessions_) {
+    close(session.fd_);
+  }
+  task->sessions_.clear();
+
+  LOG(INFO) << "hot restart, handed over sessions: " << sessionsNum
+  << ", frozen in " << (frozenTime - beginTime) / 1000 << " ms"
+  << ", sent in " << (getMonotonicTimeUs() - frozenTime) / 1000 << " ms";
+  return true;
+}
+
+bool HotRestart::sendHandoff(const int sock, vector<HandoffSession> &sessions) {
+  vector<evutil_socket_t> listenFds;
+  server_->getListenerFds(listenFds);
+  for (evutil_socket_t fd : listenFds) {
+    if (!sendRecord(sock, RECORD_LISTEN, fd, "")) {
+      return false;
+    }
+  }
+
+  vector<shared_ptr<StratumJobEx> > jobs;
+  server_->jobRepository_->getJobs(jobs);
+  for (shared_ptr<StratumJobEx> &exJob : jobs) {
+    string payload;
+    payload.push_back(exJob->isClean_   ? 1 : 0);
+    payload.push_back(exJob->isStale()  ? 1 : 0);
+    payload.append(exJob->sjob_->serializeToJson());
+    if (!sendRecord(sock, RECORD_JOB, -1, payload)) {
+      return false;
+    }
+  }
+
+  for (const HandoffSession &session : sessions) {
+    if (!sendRecord(sock, RECORD_SESSION, session.fd_, session.state_)) {
+      return false;
+    }
+  }
+  if (!sendRecord(sock, RECORD_END, -1, "")) {
+    return false;
+  }
+
+  // the new sserver sets up its reactors and restores the sessions first
+  setSocketTimeout(sock, kSetupTimeoutSeconds_);
+  uint32_t type = 0;
+  evutil_socket_t fd = -1;
+  string payload;
+  if (!recvRecord(sock, &type, &fd, &payload)) {
+    return false;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (type != RECORD_ACK) {
+    LOG(ERROR) << "hot restart, unexpected record: " << type;
+    return false;
+  }
+  return true;
+}
+
+///////////////////////////////////// Reactor //////////////////////////////////
+Reactor::Reactor(Server *server, const int32_t index):
+server_(server), index_(index), base_(nullptr), listener_(nullptr),
+notifyEvent_(nullptr), pacingEvent_(nullptr), readTime_(0),
+sampledMessagesNum_(0), flushSharesEvent_(nullptr), isFlushingShares_(false),
+verifiedEvent_(nullptr), shareLogEvent_(nullptr),
+admissionEvent_(nullptr), isListenerPaused_(false),
+firstJobsEvent_(nullptr), handoffEvent_(nullptr), isFrozen_(false),
+pendingAuthorizesNum_(0), pendingFirstJobsNum_(0),
+maxPendingAuthorizesNum_(0), deferredAuthorizesNum_(0), listenerPausesNum_(0)
+{
+  pendingShares_.reserve(SHA256Batch::kMaxBatchSize_);
+}
+
+Reactor::~Reactor() {
+  if (notifyEvent_ != nullptr) {
+    event_free(notifyEvent_);
+  }
+  if (pacingEvent_ != nullptr) {
+    event_free(pacingEvent_);
+  }
+  if (flushSharesEvent_ != nullptr) {
+    event_free(flushSharesEvent_);
+  }
+  if (verifiedEvent_ != nullptr) {
+    event_free(verifiedEvent_);
+  }
+  for (VerifyBatch *batch : verifyingBatches_) {
+    delete batch;
+  }
+  for (VerifyBatch *batch : freeBatches_) {
+    delete batch;
+  }
+  if (shareLogEvent_ != nullptr) {
+    event_free(shareLogEvent_);
+  }
+  if (admissionEvent_ != nullptr) {
+    event_free(admissionEvent_);
+  }
+  if (firstJobsEvent_ != nullptr) {
+    event_free(firstJobsEvent_);
+  }
+  if (handoffEvent_ != nullptr) {
+    event_free(handoffEvent_);
+  }
+  // the handover failed while stopping
+  for (const HandoffSession &session : restoreSessions_) {
+    evutil_closesocket(session.fd_);
+  }
+  if (listener_ != nullptr) {
     evconnlistener_free(listener_);
   }
-  if (base_ != nullptr) {
-    event_base_free(base_);
+
+  if (base_ != nullptr) {
+    event_base_free(base_);
+  }
+}
+
+evutil_socket_t Reactor::bindSocket(const struct sockaddr_in &sin) {
+  evutil_socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create socket";
+    return -1;
+  }
+
+  //
+  // every reactor binds its own socket to the same address, the kernel
+  // balances incoming connections between them (linux >= 3.9)
+  //
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+    LOG(ERROR) << "reactor " << index_ << ": setsockopt failure: "
+    << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR());
+    evutil_closesocket(fd);
+    return -1;
+  }
+
+  if (evutil_make_socket_nonblocking(fd) != 0 ||
+      ::bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+    LOG(ERROR) << "reactor " << index_ << ": bind failure: "
+    << evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR());
+    evutil_closesocket(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool Reactor::setup(const struct sockaddr_in &sin, const int32_t nReactors,
+                    const evutil_socket_t listenFd) {
+  const bool isReusePort = (nReactors > 1);
+
+  base_ = event_base_new();
+  if(!base_) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create base";
+    return false;
+  }
+
+  // no fd, activated by postMiningNotify()
+  notifyEvent_ = event_new(base_, -1, 0, Reactor::notifyCallback, (void *)this);
+  if (!notifyEvent_) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create notify event";
+    return false;
+  }
+
+  // timer, added by sendPacedNotify()
+  pacingEvent_ = event_new(base_, -1, 0, Reactor::pacingCallback, (void *)this);
+  if (!pacingEvent_) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create pacing event";
+    return false;
+  }
+
+  // no fd, activated by addPendingShare()
+  flushSharesEvent_ = event_new(base_, -1, 0, Reactor::flushSharesCallback,
+                                (void *)this);
+  if (!flushSharesEvent_) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create flush shares event";
+    return false;
+  }
+
+  // no fd, activated by postVerifiedBatch()
+  verifiedEvent_ = event_new(base_, -1, 0, Reactor::verifiedCallback,
+                             (void *)this);
+  if (!verifiedEvent_) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create verified event";
+    return false;
+  }
+
+  // no fd, activated or added with a timeout by addShareLog()
+  shareLogEvent_ = event_new(base_, -1, 0, Reactor::shareLogCallback,
+                             (void *)this);
+  if (!shareLogEvent_) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create sharelog event";
+    return false;
+  }
+
+  // timer, added by scheduleAdmission()
+  admissionEvent_ = event_new(base_, -1, 0, Reactor::admissionCallback,
+                              (void *)this);
+  // timer of 0, added by addFirstJob()
+  firstJobsEvent_ = event_new(base_, -1, 0, Reactor::firstJobsCallback,
+                              (void *)this);
+  if (!admissionEvent_ || !firstJobsEvent_) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create admission events";
+    return false;
+  }
+
+  // no fd, activated by postHandoff() and postRestore()
+  handoffEvent_ = event_new(base_, -1, 0, Reactor::handoffCallback, (void *)this);
+  if (!handoffEvent_) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create handoff event";
+    return false;
+  }
+  //
+  // the limits are shared by the reactors. burst: 100ms of the rate, a whole
+  // second of it would block the loop for too long at the storm's beginning
+  //
+  const double acceptRate    = (double)server_->maxAcceptsPerSecond_    / nReactors;
+  const double authorizeRate = (double)server_->maxAuthorizesPerSecond_ / nReactors;
+  acceptBucket_.setup   (acceptRate,    acceptRate    / 10);
+  authorizeBucket_.setup(authorizeRate, authorizeRate / 10);
+
+  if (listenFd >= 0) {
+    // handed over by the previous sserver, it's bound and listening
+    listener_ = evconnlistener_new(base_,
+                                   Reactor::listenerCallback,
+                                   (void*)this,
+                                   LEV_OPT_CLOSE_ON_FREE,
+                                   -1, listenFd);
+    if (!listener_) {
+      evutil_closesocket(listenFd);
+    }
+  } else if (!isReusePort) {
+    listener_ = evconnlistener_new_bind(base_,
+                                        Reactor::listenerCallback,
+                                        (void*)this,
+                                        LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE,
+                                        -1, (struct sockaddr*)&sin, sizeof(sin));
+  } else {
+    evutil_socket_t fd = bindSocket(sin);
+    if (fd < 0) {
+      return false;
+    }
+    listener_ = evconnlistener_new(base_,
+                                   Reactor::listenerCallback,
+                                   (void*)this,
+                                   LEV_OPT_CLOSE_ON_FREE,
+                                   -1, fd);
+    if (!listener_) {
+      evutil_closesocket(fd);
+    }
+  }
+
+  if(!listener_) {
+    LOG(ERROR) << "reactor " << index_ << ": cannot create listener";
+    return false;
+  }
+  return true;
+}
+
+void Reactor::runThread() {
+  thread_ = thread(&Reactor::run, this);
+}
+
+void Reactor::run() {
+  LOG(INFO) << "reactor " << index_ << " start event loop";
+  event_base_dispatch(base_);
+
+  // the shares being verified are finished before stopping, their sessions
+  // may read more shares meanwhile
+  flushShares();
+  while (!verifyingBatches_.empty()) {
+    finishVerifiedShares();
+    flushShares();
+    if (!verifyingBatches_.empty() && !verifyingBatches_.front()->isDone_) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  flushShareLog();
+  finishPacedNotify();
+  LOG(INFO) << "reactor " << index_ << " stop event loop";
+}
+
+void Reactor::stop() {
+  if (base_ != nullptr) {
+    event_base_loopexit(base_, NULL);
+  }
+}
+
+void Reactor::join() {
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+evutil_socket_t Reactor::getListenerFd() const {
+  return (listener_ != nullptr) ? evconnlistener_get_fd(listener_) : -1;
+}
+
+size_t Reactor::getConnectionsCount() {
+  ScopeLock sl(connsLock_);
+  return connections_.size();
+}
+
+void Reactor::postMiningNotify(shared_ptr<MiningNotifyTask> task) {
+  {
+    ScopeLock sl(notifyTasksLock_);
+    notifyTasks_.push_back(task);
+  }
+  event_active(notifyEvent_, 0, 0);
+}
+
+void Reactor::notifyCallback(evutil_socket_t, short, void *data) {
+  Reactor *reactor = static_cast<Reactor *>(data);
+  reactor->runMiningNotifyTasks();
+}
+
+void Reactor::beginShareTrace(const bool isSubmit, const int64_t lineTime) {
+  if (shareTrace_.isTraced()) {
+    shareTrace_.reset();
+  }
+  if (!isSubmit || readTime_ == 0) {
+    return;
+  }
+  const uint32_t sampleRate = server_->shareLatency_.getSampleRate();
+  if (sampleRate == 0 || ++sampledMessagesNum_ % sampleRate != 0) {
+    return;
+  }
+  shareTrace_.readTime_ = readTime_;
+  shareTrace_.lineTime_ = lineTime;
+}
+
+void Reactor::addPendingShare(const PendingShare &pendingShare) {
+  //
+  // the event runs after the other active events of this loop iteration,
+  // so shares read from all the readable sessions are hashed together.
+  //
+  if (pendingShares_.empty()) {
+    event_active(flushSharesEvent_, 0, 0);
+  }
+  pendingShares_.push_back(pendingShare);
+
+  if (pendingShares_.size() >= SHA256Batch::kMaxBatchSize_) {
+    flushShares();
+  }
+}
+
+void Reactor::flushShares() {
+  // finishing a share may send data, which flushes again
+  if (pendingShares_.empty() || isFlushingShares_) {
+    return;
+  }
+  isFlushingShares_ = true;
+
+  ShareVerifier *verifier = server_->shareVerifier_;
+  if (verifier == nullptr) {
+    hashPendingShares(pendingShares_, shareHashItems_);
+    finishPendingShares(pendingShares_, shareHashItems_);
+    pendingShares_.clear();
+    isFlushingShares_ = false;
+    return;
+  }
+
+  //
+  // hashed by the verifier, finished by finishVerifiedShares(). the vectors
+  // are swapped, the batch's old ones are reserved already
+  //
+  VerifyBatch *batch;
+  if (!freeBatches_.empty()) {
+    batch = freeBatches_.back();
+    freeBatches_.pop_back();
+  } else {
+    batch = new VerifyBatch(this);
+  }
+  batch->shares_.swap(pendingShares_);
+  pendingShares_.reserve(SHA256Batch::kMaxBatchSize_);
+  batch->postTime_ = getMonotonicTimeUs();
+  verifyingBatches_.push_back(batch);
+
+  if (!verifier->post(batch)) {
+    // the queue is full, the loop is slowed down instead of queuing more
+    batch->hash();
+    verifier->recordOverflow(*batch);
+    postVerifiedBatch(batch);
+  }
+  isFlushingShares_ = false;
+}
+
+void Reactor::flushSharesCallback(evutil_socket_t, short, void *data) {
+  Reactor *reactor = static_cast<Reactor *>(data);
+  reactor->flushShares();
+}
+
+void Reactor::postVerifiedBatch(VerifyBatch *batch) {
+  batch->isDone_.store(true, std::memory_order_release);
+  event_active(verifiedEvent_, 0, 0);
+}
+
+void Reactor::finishVerifiedShares() {
+  //
+  // the batches may be hashed out of order by the threads, but a session's
+  // shares must be answered in order, so only from the front
+  //
+  while (!verifyingBatches_.empty() &&
+         verifyingBatches_.front()->isDone_.load(std::memory_order_acquire)) {
+    VerifyBatch *batch = verifyingBatches_.front();
+    verifyingBatches_.pop_front();
+
+    // sessions may read and flush more shares meanwhile
+    batch->finish();
+    batch->clear();
+    freeBatches_.push_back(batch);
+  }
+}
+
+void Reactor::verifiedCallback(evutil_socket_t, short, void *data) {
+  Reactor *reactor = static_cast<Reactor *>(data);
+  reactor->finishVerifiedShares();
+}
+
+void Reactor::addShareLog(const Share &share) {
+  if (server_->shareLogBatchSize_ <= 1) {
+    server_->sendShare2Kafka((const uint8_t *)&share, sizeof(Share));
+    return;
+  }
+
+  if (shareLogBatch_.empty()) {
+    if (server_->shareLogBatchMs_ == 0) {
+      event_active(shareLogEvent_, 0, 0);
+    } else {
+      struct timeval tv;
+      tv.tv_sec  = server_->shareLogBatchMs_ / 1000;
+      tv.tv_usec = (server_->shareLogBatchMs_ % 1000) * 1000;
+      event_add(shareLogEvent_, &tv);
+    }
+  }
+  shareLogBatch_.add(share);
+
+  if (shareLogBatch_.count() >= server_->shareLogBatchSize_) {
+    flushShareLog();
+  }
+}
+
+void Reactor::flushShareLog() {
+  if (shareLogBatch_.empty()) {
+    return;
+  }
+  // a pending timeout would cut the next batch short
+  if (shareLogEvent_ != nullptr && server_->shareLogBatchMs_ > 0) {
+    event_del(shareLogEvent_);
+  }
+
+  const string &message = shareLogBatch_.getMessage();
+  server_->sendShare2Kafka((const uint8_t *)message.data(), message.size());
+  shareLogBatch_.clear();
+}
+
+void Reactor::shareLogCallback(evutil_socket_t, short, void *data) {
+  Reactor *reactor = static_cast<Reactor *>(data);
+  reactor->flushShareLog();
+}
+
+StratumSession *Reactor::findSession(evutil_socket_t fd, StratumSession *session) {
+  //
+  // dead sessions are deleted by sendMiningNotifyToAll(), a queued pointer
+  // is only used if it's still the live session of the fd
+  //
+  ScopeLock sl(connsLock_);
+  auto itr = connections_.find(fd);
+  if (itr == connections_.end() || itr->second != session || session->isDead()) {
+    return nullptr;
+  }
+  return session;
+}
+
+bool Reactor::tryAdmitAuthorize() {
+  // the deferred ones go first
+  if (!pendingAuthorizes_.empty()) {
+    return false;
+  }
+  return authorizeBucket_.tryConsume(getMonotonicTimeUs());
+}
+
+void Reactor::deferAuthorize(StratumSession *session) {
+  pendingAuthorizes_.push_back(std::make_pair(session->fd_, session));
+  pendingAuthorizesNum_ = (uint32_t)pendingAuthorizes_.size();
+  deferredAuthorizesNum_++;
+  if (pendingAuthorizesNum_ > maxPendingAuthorizesNum_) {
+    maxPendingAuthorizesNum_ = pendingAuthorizesNum_.load();
+  }
+
+  if (pendingAuthorizes_.size() == 1) {
+    LOG(WARNING) << "reactor " << index_ << ": authorizes are limited, "
+    << server_->maxAuthorizesPerSecond_ << "/s of the server";
+    scheduleAdmission();
+  }
+}
+
+void Reactor::addFirstJob(StratumSession *session) {
+  if (pendingFirstJobs_.empty()) {
+    scheduleFirstJobs();
+  }
+  pendingFirstJobs_.push_back(std::make_pair(session->fd_, session));
+  pendingFirstJobsNum_ = (uint32_t)pendingFirstJobs_.size();
+}
+
+void Reactor::sendFirstJobs() {
+  //
+  // the latest job is looked up once for the batch. the rest waits for the
+  // next loop iteration, so the sessions' reads are not starved.
+  //
+  shared_ptr<StratumJobEx> exJobPtr = server_->jobRepository_->getLatestStratumJobEx();
+  size_t n = pendingFirstJobs_.size();
+  if (server_->firstJobBatchSize_ > 0) {
+    n = std::min(n, (size_t)server_->firstJobBatchSize_);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    auto item = pendingFirstJobs_.front();
+    pendingFirstJobs_.pop_front();
+
+    StratumSession *session = findSession(item.first, item.second);
+    if (session != nullptr) {
+      session->sendFirstJob(exJobPtr);
+    }
+  }
+
+  pendingFirstJobsNum_ = (uint32_t)pendingFirstJobs_.size();
+  if (!pendingFirstJobs_.empty()) {
+    scheduleFirstJobs();
+  }
+}
+
+void Reactor::scheduleFirstJobs() {
+  //
+  // a timer of 0, not event_active(): an event activated in its callback runs
+  // again in the same loop iteration, before the sockets are polled. the
+  // timer fires in the next one, after the reads
+  //
+  struct timeval tv = {0, 0};
+  event_add(firstJobsEvent_, &tv);
+}
+
+void Reactor::firstJobsCallback(evutil_socket_t, short, void *data) {
+  Reactor *reactor = static_cast<Reactor *>(data);
+  reactor->sendFirstJobs();
+}
+
+void Reactor::runAdmission() {
+  const int64_t now = getMonotonicTimeUs();
+
+  if (isListenerPaused_ && acceptBucket_.getWaitUs(now) == 0) {
+    evconnlistener_enable(listener_);
+    isListenerPaused_ = false;
+  }
+
+  const bool hasPendingAuthorizes = !pendingAuthorizes_.empty();
+  while (!pendingAuthorizes_.empty() && authorizeBucket_.tryConsume(now)) {
+    auto item = pendingAuthorizes_.front();
+    pendingAuthorizes_.pop_front();
+
+    StratumSession *session = findSession(item.first, item.second);
+    if (session != nullptr) {
+      session->resumeAuthorize();
+    }
+  }
+
+  pendingAuthorizesNum_ = (uint32_t)pendingAuthorizes_.size();
+  if (hasPendingAuthorizes && pendingAuthorizes_.empty()) {
+    LOG(INFO) << "reactor " << index_ << ": admission queue is drained, "
+    << "deferred authorizes: " << deferredAuthorizesNum_
+    << ", max queue depth: " << maxPendingAuthorizesNum_
+    << ", listener pauses: " << listenerPausesNum_;
+  }
+  scheduleAdmission();
+}
+
+void Reactor::scheduleAdmission() {
+  const int64_t now = getMonotonicTimeUs();
+  int64_t waitUs = -1;
+  if (isListenerPaused_) {
+    waitUs = acceptBucket_.getWaitUs(now);
+  }
+  if (!pendingAuthorizes_.empty()) {
+    const int64_t us = authorizeBucket_.getWaitUs(now);
+    waitUs = (waitUs < 0) ? us : std::min(waitUs, us);
+  }
+  if (waitUs < 0) {
+    return;  // nothing is waiting
+  }
+
+  struct timeval tv;
+  tv.tv_sec  = waitUs / 1000000;
+  tv.tv_usec = waitUs % 1000000;
+  event_add(admissionEvent_, &tv);
+}
+
+void Reactor::admissionCallback(evutil_socket_t, short, void *data) {
+  Reactor *reactor = static_cast<Reactor *>(data);
+  reactor->runAdmission();
+}
+
+void Reactor::runMiningNotifyTasks() {
+  //
+  // more than one task may be posted before the event fires, send them
+  // all in order: a clean job must not be skipped even if a newer job
+  // comes right after it.
+  //
+  std::deque<shared_ptr<MiningNotifyTask> > tasks;
+  {
+    ScopeLock sl(notifyTasksLock_);
+    tasks.swap(notifyTasks_);
+  }
+
+  // dead sessions will be deleted, they must not have pending shares. the
+  // ones still being verified are kept
+  flushShares();
+
+  for (auto &task : tasks) {
+    if (server_->notifyPacingMs_ > 0) {
+      startPacedNotify(task);
+      continue;
+    }
+
+    int64_t firstSendTime = 0, lastSendTime = 0;
+    int64_t sessionsCount = 0, sessionsMemory = 0;
+    sendMiningNotifyToAll(task->exJobPtr_, &firstSendTime, &lastSendTime,
+                          &sessionsCount, &sessionsMemory);
+
+    if (task->finishReactor(firstSendTime, lastSendTime,
+                            sessionsCount, sessionsMemory)) {
+      server_->finishMiningNotify(*task);
+    }
+  }
+}
+
+void Reactor::startPacedNotify(shared_ptr<MiningNotifyTask> task) {
+  // the sessions not reached yet get the new job instead
+  finishPacedNotify();
+
+  PacedNotify &paced = pacedNotify_;
+  paced.task_      = task;
+  paced.startTime_ = server_->pacingClock_();
+
+  // dead sessions are deleted here only, the collected ones stay valid
+  // until the next round
+  int64_t firstSendTime = 0, lastSendTime = 0;
+  int64_t sessionsCount = 0, sessionsMemory = 0;
+  sendMiningNotifyToAll(task->exJobPtr_, &firstSendTime, &lastSendTime,
+                        &sessionsCount, &sessionsMemory, &paced.sessions_);
+  std::stable_sort(paced.sessions_.begin(), paced.sessions_.end(),
+                   [](const std::pair<uint64_t, StratumSession *> &a,
+                      const std::pair<uint64_t, StratumSession *> &b) {
+                     return a.first > b.first;
+                   });
+
+  // a clean job invalidates the miners' work, it can't wait
+  paced.slotsNum_ = 1;
+  if (!task->exJobPtr_->isClean_) {
+    paced.slotsNum_ = std::max(server_->notifyPacingMs_ / kPacingSlotMs_, 1);
+  }
+  sendPacedNotify();
+}
+
+void Reactor::sendPacedNotify() {
+  PacedNotify &paced = pacedNotify_;
+  if (paced.task_ == nullptr) {
+    return;
+  }
+
+  //
+  // slot k (1-based) ends with ceil(n * k / slots) sessions sent. a late
+  // timer catches up, the slots are never shifted.
+  //
+  const int64_t slotUs  = (int64_t)kPacingSlotMs_ * 1000;
+  const int64_t now     = server_->pacingClock_();
+  const int64_t slot    = std::min((int64_t)paced.slotsNum_,
+                                   (now - paced.startTime_) / slotUs + 1);
+  const size_t  n       = paced.sessions_.size();
+  const size_t  target  = (size_t)((n * slot + paced.slotsNum_ - 1) / paced.slotsNum_);
+
+  size_t slotSentNum = 0;
+  for (; paced.sentNum_ < target; paced.sentNum_++) {
+    StratumSession *session = paced.sessions_[paced.sentNum_].second;
+    if (session->isDead()) {
+      continue;
+    }
+    if (paced.sessionsCount_ == 0) {
+      paced.firstSendTime_ = getMonotonicTimeUs();
+    }
+    session->sendMiningNotify(paced.task_->exJobPtr_);
+    paced.sessionsCount_++;
+    paced.sessionsMemory_ += session->getMemoryUsage();
+    slotSentNum++;
+  }
+  if (slotSentNum > 0) {
+    paced.lastSendTime_   = getMonotonicTimeUs();
+    paced.maxSlotSentNum_ = std::max(paced.maxSlotSentNum_, slotSentNum);
+  }
+
+  if (paced.sentNum_ >= n) {
+    finishPacedNotify();
+    return;
+  }
+
+  const int64_t waitUs = std::max(paced.startTime_ + slot * slotUs - now,
+                                  (int64_t)0);
+  struct timeval tv;
+  tv.tv_sec  = waitUs / 1000000;
+  tv.tv_usec = waitUs % 1000000;
+  event_add(pacingEvent_, &tv);
+}
+
+void Reactor::finishPacedNotify() {
+  PacedNotify &paced = pacedNotify_;
+  if (paced.task_ == nullptr) {
+    return;
+  }
+  if (pacingEvent_ != nullptr) {
+    event_del(pacingEvent_);
+  }
+
+  if (paced.slotsNum_ > 1 && paced.sessionsCount_ > 0) {
+    // peak to average sessions per slot over the window
+    const double peakToAvg = (double)paced.maxSlotSentNum_ * paced.slotsNum_
+                             / paced.sessionsCount_;
+    LOG(INFO) << "reactor " << index_ << ": paced job "
+    << paced.task_->exJobPtr_->sjob_->jobId_ << " to "
+    << paced.sessionsCount_ << "/" << paced.sessions_.size()
+    << " sessions, slots: " << paced.slotsNum_ << " x " << kPacingSlotMs_
+    << "ms, max per slot: " << paced.maxSlotSentNum_
+    << ", peak/avg: " << Strings::Format("%.2f", peakToAvg)
+    << ", first to last: " << paced.lastSendTime_ - paced.firstSendTime_ << " us";
+  }
+
+  shared_ptr<MiningNotifyTask> task = paced.task_;
+  if (task->finishReactor(paced.firstSendTime_, paced.lastSendTime_,
+                          paced.sessionsCount_, paced.sessionsMemory_)) {
+    server_->finishMiningNotify(*task);
+  }
+  paced.reset();
+}
+
+void Reactor::pacingCallback(evutil_socket_t, short, void *data) {
+  Reactor *reactor = static_cast<Reactor *>(data);
+  reactor->sendPacedNotify();
+}
+
+void Reactor::sendMiningNotifyToAll(shared_ptr<StratumJobEx> exJobPtr,
+                                    int64_t *firstSendTime,
+                                    int64_t *lastSendTime,
+                                    int64_t *sessionsCount,
+                                    int64_t *sessionsMemory,
+                                    vector<std::pair<uint64_t, StratumSession *> >
+                                      *pacedSessions) {
+  //
+  // http://www.sgi.com/tech/stl/Map.html
+  //
+  // Map has the important property that inserting a new element into a map
+  // does not invalidate iterators that point to existing elements. Erasing
+  // an element from a map also does not invalidate any iterators, except,
+  // of course, for iterators that actually point to the element that is
+  // being erased.
+  //
+
+  ScopeLock sl(connsLock_);
+  *firstSendTime = getMonotonicTimeUs();
+
+  std::map<evutil_socket_t, StratumSession *>::iterator itr = connections_.begin();
+  while (itr != connections_.end()) {
+    StratumSession *conn = itr->second;  // alias
+
+    if (conn->isDead()) {
+      // shares being verified hold the session, it's deleted by the next job
+      if (conn->hasPendingShares()) {
+        ++itr;
+        continue;
+      }
+#ifndef WORK_WITH_STRATUM_SWITCHER
+      server_->sessionIDManager_->freeSessionId(conn->getSessionId());
+#endif
+
+      delete conn;
+      itr = connections_.erase(itr);
+    } else if (pacedSessions != nullptr) {
+      pacedSessions->push_back(std::make_pair(conn->getNotifyPriority(), conn));
+      ++itr;
+    } else {
+
+      conn->sendMiningNotify(exJobPtr);
+      (*sessionsCount)++;
+      *sessionsMemory += conn->getMemoryUsage();
+      ++itr;
+    }
+  }
+
+  *lastSendTime = getMonotonicTimeUs();
+}
+
+void Reactor::addConnection(evutil_socket_t fd, StratumSession *connection) {
+  ScopeLock sl(connsLock_);
+  connections_.insert(std::pair<evutil_socket_t, StratumSession *>(fd, connection));
+}
+
+void Reactor::removeConnection(evutil_socket_t fd) {
+  //
+  // if we are here, means the related evbuffer has already been locked.
+  // don't lock connsLock_ in this function, it will cause deadlock.
+  //
+  auto itr = connections_.find(fd);
+  if (itr == connections_.end()) {
+    return;
+  }
+
+  // mark to delete
+  itr->second->markAsDead();
+}
+
+void Reactor::listenerCallback(struct evconnlistener* listener,
+                               evutil_socket_t fd,
+                               struct sockaddr *saddr,
+                               int socklen, void* data)
+{
+  Reactor *reactor = static_cast<Reactor *>(data);
+  Server  *server  = reactor->server_;
+  struct bufferevent *bev;
+  uint32_t sessionID = 0u;
+
+#ifndef WORK_WITH_STRATUM_SWITCHER
+  // a banned peer costs no session id, no bufferevent and no session. behind
+  // the switcher, the peer is the switcher and the miner's ip comes later
+  if (server->ipReputation_.isEnabled() &&
+      server->ipReputation_.addEvent(((struct sockaddr_in *)saddr)->sin_addr.s_addr,
+                                     IpReputation::EVENT_CONNECT,
+                                     getMonotonicTimeUs())) {
+    close(fd);
+    return;
+  }
+
+  // can't alloc session Id
+  if (server->sessionIDManager_->allocSessionId(&sessionID) == false) {
+    close(fd);
+    return;
+  }
+#endif
+
+  bev = bufferevent_socket_new(reactor->base_, fd,
+                               BEV_OPT_CLOSE_ON_FREE|BEV_OPT_THREADSAFE);
+  if(bev == nullptr) {
+    LOG(ERROR) << "error constructing bufferevent!";
+    server->stop();
+    return;
+  }
+
+  // create stratum session
+  StratumSession* conn = new StratumSession(fd, bev, server, reactor, saddr,
+                                            server->kShareAvgSeconds_,
+                                            sessionID);
+  // set callback functions
+  bufferevent_setcb(bev,
+                    Server::readCallback, nullptr,
+                    Server::eventCallback, (void*)conn);
+  // By default, a newly created bufferevent has writing enabled.
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+  reactor->addConnection(fd, conn);
+
+  //
+  // reconnect storm: stop accepting until the next token, the connections
+  // wait in the listen backlog of the kernel meanwhile
+  //
+  if (!reactor->acceptBucket_.tryConsume(getMonotonicTimeUs()) &&
+      !reactor->isListenerPaused_) {
+    evconnlistener_disable(listener);
+    reactor->isListenerPaused_ = true;
+    reactor->listenerPausesNum_++;
+    reactor->scheduleAdmission();
+  }
+}
+
+void Reactor::postHandoff(shared_ptr<HandoffTask> task) {
+  {
+    ScopeLock sl(handoffLock_);
+    handoffTask_ = task;
+  }
+  event_active(handoffEvent_, 0, 0);
+}
+
+void Reactor::postRestore(vector<HandoffSession> &sessions) {
+  {
+    ScopeLock sl(handoffLock_);
+    for (HandoffSession &session : sessions) {
+      restoreSessions_.push_back(std::move(session));
+    }
+  }
+  sessions.clear();
+  event_active(handoffEvent_, 0, 0);
+}
+
+void Reactor::runHandoff() {
+  shared_ptr<HandoffTask> task;
+  vector<HandoffSession> sessions;
+  {
+    ScopeLock sl(handoffLock_);
+    if (handoffTask_ != nullptr && handoffTask_->isCancelled()) {
+      handoffTask_ = nullptr;
+    }
+    task = handoffTask_;
+    sessions.swap(restoreSessions_);
+  }
+  if (task == nullptr) {
+    // the handover failed, the ids of the sessions are kept
+    restoreSessions(sessions, true);
+    return;
+  }
+
+  if (!isFrozen_) {
+    isFrozen_ = true;
+    evconnlistener_disable(listener_);
+    isListenerPaused_ = false;
+    event_del(admissionEvent_);
+
+    ScopeLock sl(connsLock_);
+    for (auto &it : connections_) {
+      bufferevent_disable(it.second->bev_, EV_READ);
+    }
+  }
+
+  vector<HandoffSession> taken;
+  if (!takeSessions(taken)) {
+    struct timeval tv = {0, 1000};
+    event_add(handoffEvent_, &tv);
+    return;
+  }
+  LOG(INFO) << "reactor " << index_ << ": " << taken.size()
+  << " sessions are frozen for the handover";
+
+  {
+    ScopeLock sl(handoffLock_);
+    handoffTask_ = nullptr;
+  }
+  if (!task->finishReactor(taken)) {
+    restoreSessions(taken, true);
+  }
+}
+
+bool Reactor::takeSessions(vector<HandoffSession> &sessions) {
+  //
+  // the queues of the reactor hold sessions, they are finished first. the
+  // verified shares may resume the parsing of the input buffers, so it's
+  // retried until no share is left.
+  //
+  if (pacedNotify_.task_ != nullptr) {
+    pacedNotify_.slotsNum_ = 1;  // the rest of the round now
+    sendPacedNotify();
+  }
+  flushShares();
+  finishVerifiedShares();
+  if (!pendingShares_.empty() || !verifyingBatches_.empty()) {
+    return false;
+  }
+  flushShareLog();
+
+  // a deferred authorize or first job is saved with the session
+  pendingAuthorizes_.clear();
+  pendingFirstJobs_.clear();
+  pendingAuthorizesNum_ = 0;
+  pendingFirstJobsNum_  = 0;
+
+  ScopeLock sl(connsLock_);
+  for (auto &it : connections_) {
+    StratumSession *conn = it.second;
+    bool isTaken = false;
+    if (!conn->isDead()) {
+      // the session closes its fd, the socket is kept open by the dup
+      HandoffSession session;
+      session.fd_ = fcntl(conn->fd_, F_DUPFD_CLOEXEC, 0);
+      if (session.fd_ >= 0) {
+        conn->saveState(session.state_);
+        sessions.push_back(std::move(session));
+        isTaken = true;
+      } else {
+        LOG(ERROR) << "reactor " << index_ << ": dup failure: " << strerror(errno);
+      }
+    }
+#ifndef WORK_WITH_STRATUM_SWITCHER
+    // the id of a taken session is kept in case the handover fails
+    if (!isTaken) {
+      server_->sessionIDManager_->freeSessionId(conn->getSessionId());
+    }
+#endif
+    (void)isTaken;
+    delete conn;
+  }
+  connections_.clear();
+  return true;
+}
+
+void Reactor::restoreSessions(const vector<HandoffSession> &sessions,
+                              const bool isSessionIdReserved) {
+  size_t restoredNum = 0;
+  for (const HandoffSession &session : sessions) {
+    if (restoreSession(session, isSessionIdReserved)) {
+      restoredNum++;
+    }
+  }
+  if (!sessions.empty()) {
+    LOG(INFO) << "reactor " << index_ << ": resumed sessions: "
+    << restoredNum << "/" << sessions.size();
+  }
+
+  if (isFrozen_) {
+    isFrozen_ = false;
+    evconnlistener_enable(listener_);
+
+    ScopeLock sl(connsLock_);
+    for (auto &it : connections_) {
+      if (!it.second->isDead()) {
+        bufferevent_enable(it.second->bev_, EV_READ);
+      }
+    }
+  }
+  scheduleAdmission();
+}
+
+bool Reactor::restoreSession(const HandoffSession &handoffSession,
+                             const bool isSessionIdReserved) {
+  const evutil_socket_t fd = handoffSession.fd_;
+
+  // the miner may be gone meanwhile
+  struct sockaddr_in saddr;
+  socklen_t saddrLen = sizeof(saddr);
+  memset(&saddr, 0, sizeof(saddr));
+  if (getpeername(fd, (struct sockaddr *)&saddr, &saddrLen) != 0) {
+    evutil_closesocket(fd);
+    return false;
+  }
+
+  struct bufferevent *bev = bufferevent_socket_new(base_, fd,
+                                                   BEV_OPT_CLOSE_ON_FREE|BEV_OPT_THREADSAFE);
+  if (bev == nullptr) {
+    LOG(ERROR) << "error constructing bufferevent!";
+    evutil_closesocket(fd);
+    return false;
+  }
+
+  StratumSession *conn = new StratumSession(fd, bev, server_, this,
+                                            (struct sockaddr *)&saddr,
+                                            server_->kShareAvgSeconds_, 0);
+  if (!conn->restoreState(handoffSession.state_)) {
+    LOG(ERROR) << "reactor " << index_ << ": invalid state of a handed over session";
+    delete conn;
+    return false;
   }
+#ifndef WORK_WITH_STRATUM_SWITCHER
+  if (!isSessionIdReserved &&
+      !server_->sessionIDManager_->reserveSessionId(conn->getSessionId())) {
+    LOG(ERROR) << "reactor " << index_ << ": session id of a handed over "
+    << "session is used: " << conn->getSessionId();
+    delete conn;
+    return false;
+  }
+#endif
+
+  bufferevent_setcb(bev,
+                    Server::readCallback, nullptr,
+                    Server::eventCallback, (void*)conn);
+  bufferevent_enable(bev, EV_READ|EV_WRITE);
+  addConnection(fd, conn);
+
+  conn->resumeHandoff();
+  return true;
+}
+
+void Reactor::handoffCallback(evutil_socket_t, short, void *data) {
+  Reactor *reactor = static_cast<Reactor *>(data);
+  reactor->runHandoff();
+}
+
+///////////////////////////////////// Server ///////////////////////////////////
+Server::Server(const int32_t shareAvgSeconds):
+signal_event_(nullptr),
+kafkaProducerShareLog_(nullptr),
+kafkaProducerSolvedShare_(nullptr),
+kafkaProducerNamecoinSolvedShare_(nullptr),
+kafkaProducerCommonEvents_(nullptr),
+kafkaProducerRskSolvedShare_(nullptr),
+isSubmitInvalidBlock_(false),
+
+#ifndef WORK_WITH_STRATUM_SWITCHER
+sessionIDManager_(nullptr),
+#endif
+
+isEnableSimulator_(false), isDevModeEnable_(false), minerDifficulty_(1.0),
+kShareAvgSeconds_(shareAvgSeconds),
+shareLogBatchSize_(1), shareLogBatchMs_(0),
+maxAcceptsPerSecond_(0), maxAuthorizesPerSecond_(0), firstJobBatchSize_(0),
+workerUpdateBatchSize_(1), varDiffType_(DiffController::TYPE_WINDOW),
+versionMask_(0), shareVerifier_(nullptr),
+notifyPacingMs_(0), pacingClock_(getMonotonicTimeUs),
+outputHighWater_(0), outputEvictJobs_(3),
+outputDroppedBytes_(0), outputEvictedSessions_(0), statsHttpd_(nullptr),
+hotRestart_(nullptr), jobRepository_(nullptr),
+userInfo_(nullptr)
+{
+}
+
+Server::~Server() {
+  if (signal_event_ != nullptr) {
+    event_free(signal_event_);
+  }
+  if (statsHttpd_ != nullptr) {
+    delete statsHttpd_;
+  }
+  if (hotRestart_ != nullptr) {
+    delete hotRestart_;
+  }
+  for (Reactor *reactor : reactors_) {
+    delete reactor;
+  }
+  reactors_.clear();
+  // after the reactors, they finish the verifying shares before stopping
+  if (shareVerifier_ != nullptr) {
+    delete shareVerifier_;
+  }
+
   if (kafkaProducerShareLog_ != nullptr) {
     delete kafkaProducerShareLog_;
   }
@@ -853,10 +3560,30 @@ Server::~Server() {
 
 bool Server::setup(const char *ip, const unsigned short port,
                    const char *kafkaBrokers,
-                   const string &userAPIUrl,
+                   const string &userAPIUrl, const string &usersCacheFile,
                    const uint8_t serverId, const string &fileLastNotifyTime,
                    bool isEnableSimulator, bool isSubmitInvalidBlock,
-                   bool isDevModeEnable, float minerDifficulty) {
+                   bool isDevModeEnable, float minerDifficulty,
+                   const int32_t nThreads,
+                   const int32_t shareLogBatchSize,
+                   const int32_t shareLogBatchMs,
+                   const int32_t maxAcceptsPerSecond,
+                   const int32_t maxAuthorizesPerSecond,
+                   const int32_t firstJobBatchSize,
+                   const int32_t workerUpdateBatchSize,
+                   const DiffController::Type varDiffType,
+                   const uint32_t versionMask,
+                   const int32_t verifyThreads,
+                   const int32_t verifyQueueSize,
+                   const int32_t notifyPacingMs,
+                   const int32_t outputHighWater,
+                   const int32_t outputEvictJobs,
+                   const int32_t shareLatencySampleRate,
+                   const int32_t statsHttpPort,
+                   const string &handoffSocket,
+                   const int32_t ipBanScore,
+                   const int32_t ipBanSeconds,
+                   const int32_t ipBanHalfLife) {
   if (isEnableSimulator) {
     isEnableSimulator_ = true;
     LOG(WARNING) << "Simulator is enabled, all share will be accepted";
@@ -873,6 +3600,69 @@ bool Server::setup(const char *ip, const unsigned short port,
     LOG(INFO) << "development mode is enabled with difficulty: " << minerDifficulty;
   }
 
+  shareLogBatchSize_ = std::min(std::max(shareLogBatchSize, 1),
+                                (int32_t)ShareLogBatch::kMaxCount_);
+  shareLogBatchMs_   = std::max(shareLogBatchMs, 0);
+  if (shareLogBatchSize_ > 1) {
+    LOG(INFO) << "sharelog batch size: " << shareLogBatchSize_
+    << ", max delay: " << shareLogBatchMs_ << "ms";
+  }
+
+  maxAcceptsPerSecond_    = std::max(maxAcceptsPerSecond,    0);
+  maxAuthorizesPerSecond_ = std::max(maxAuthorizesPerSecond, 0);
+  firstJobBatchSize_      = std::max(firstJobBatchSize,      0);
+  if (maxAcceptsPerSecond_ > 0 || maxAuthorizesPerSecond_ > 0) {
+    LOG(INFO) << "admission control, max accepts: " << maxAcceptsPerSecond_
+    << "/s, max authorizes: " << maxAuthorizesPerSecond_
+    << "/s, first job batch size: " << firstJobBatchSize_;
+  }
+
+  workerUpdateBatchSize_ = std::min(std::max(workerUpdateBatchSize, 1),
+                                    (int32_t)WorkerUpdateBatch::kMaxEventSize_);
+  if (workerUpdateBatchSize_ > 1) {
+    LOG(INFO) << "worker update batch size: " << workerUpdateBatchSize_;
+  }
+
+  varDiffType_ = varDiffType;
+  if (varDiffType_ == DiffController::TYPE_EWMA) {
+    LOG(INFO) << "vardiff: ewma";
+  }
+
+  versionMask_ = versionMask;
+  LOG(INFO) << "version rolling mask: " << Strings::Format("%08x", versionMask_);
+
+  if (verifyThreads > 0) {
+    const size_t maxQueuedShares = (size_t)std::max(verifyQueueSize,
+                                                    (int32_t)SHA256Batch::kMaxBatchSize_);
+    shareVerifier_ = new ShareVerifier(verifyThreads, maxQueuedShares);
+    LOG(INFO) << "share verifier threads: " << verifyThreads
+    << ", max queued shares: " << maxQueuedShares;
+  }
+
+  notifyPacingMs_ = std::max(notifyPacingMs, 0);
+  if (notifyPacingMs_ > 0) {
+    LOG(INFO) << "non-clean jobs are paced over " << notifyPacingMs_ << "ms";
+  }
+
+  outputHighWater_ = std::max(outputHighWater, 0);
+  outputEvictJobs_ = std::min(std::max(outputEvictJobs, 1), 100);
+  if (outputHighWater_ > 0) {
+    LOG(INFO) << "session output high-water mark: " << outputHighWater_
+    << " bytes, evicted after " << outputEvictJobs_ << " jobs over it";
+  }
+
+  shareLatency_.setSampleRate((uint32_t)std::max(shareLatencySampleRate, 0));
+  if (shareLatency_.getSampleRate() > 0) {
+    LOG(INFO) << "share latency, 1 of " << shareLatency_.getSampleRate()
+    << " shares is traced";
+  }
+
+  ipReputation_.setup((double)ipBanScore, ipBanSeconds, ipBanHalfLife);
+  if (ipReputation_.isEnabled()) {
+    LOG(INFO) << "ip ban score: " << ipBanScore << ", ban: " << ipBanSeconds
+    << "s, half-life: " << ipBanHalfLife << "s";
+  }
+
   kafkaProducerSolvedShare_ = new KafkaProducer(kafkaBrokers,
                                                 KAFKA_TOPIC_SOLVED_SHARE,
                                                 RD_KAFKA_PARTITION_UA);
@@ -888,15 +3678,21 @@ bool Server::setup(const char *ip, const unsigned short port,
   kafkaProducerCommonEvents_ = new KafkaProducer(kafkaBrokers,
                                                  KAFKA_TOPIC_COMMON_EVENTS,
                                                  RD_KAFKA_PARTITION_UA);
+  // the queue time of the messages, it can be traced at runtime. the
+  // reports are served by the producers' threads, and only the solved
+  // shares and the sampled sharelogs are timed
+  if (statsHttpPort > 0 || shareLatency_.getSampleRate() > 0) {
+    kafkaProducerShareLog_->setDeliveryCallback(ShareLatency::sharelogDelivered,
+                                                &shareLatency_);
+    kafkaProducerSolvedShare_->setDeliveryCallback(ShareLatency::solvedShareDelivered,
+                                                   &shareLatency_);
+  }
 
-  // job repository
+  // job repository, it consumes after the jobs of hot restart
   jobRepository_ = new JobRepository(kafkaBrokers, fileLastNotifyTime, this);
-  if (!jobRepository_->setupThreadConsume()) {
-    return false;
-  }
 
   // user info
-  userInfo_ = new UserInfo(userAPIUrl, this);
+  userInfo_ = new UserInfo(userAPIUrl, usersCacheFile, this);
   if (!userInfo_->setupThreads()) {
     return false;
   }
@@ -988,12 +3784,6 @@ bool Server::setup(const char *ip, const unsigned short port,
     }
   }
 
-  base_ = event_base_new();
-  if(!base_) {
-    LOG(ERROR) << "server: cannot create base";
-    return false;
-  }
-
   memset(&sin_, 0, sizeof(sin_));
   sin_.sin_family = AF_INET;
   sin_.sin_port   = htons(port);
@@ -1003,131 +3793,224 @@ bool Server::setup(const char *ip, const unsigned short port,
     return false;
   }
 
-  listener_ = evconnlistener_new_bind(base_,
-                                      Server::listenerCallback,
-                                      (void*)this,
-                                      LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE,
-                                      -1, (struct sockaddr*)&sin_, sizeof(sin_));
-  if(!listener_) {
-    LOG(ERROR) << "cannot create listener: " << ip << ":" << port;
+  //
+  // hot restart: the running sserver hands over its listening sockets, its
+  // jobs and its sessions, see HotRestart. the users and the producers are
+  // ready before. it keeps the sessions until finishTakeOver() at the end,
+  // and resumes them if a step fails before.
+  //
+  vector<evutil_socket_t> listenFds;
+  vector<HandoffSession> handoffSessions;
+  if (!handoffSocket.empty()) {
+    hotRestart_ = new HotRestart(this, handoffSocket, serverId);
+    if (!hotRestart_->takeOver(jobRepository_, listenFds, handoffSessions)) {
+      return false;
+    }
+  }
+
+  if (!jobRepository_->setupThreadConsume()) {
+    return false;
+  }
+
+  //
+  // each reactor owns an event loop, a listener and its sessions. with more
+  // than one reactor, every listener binds the same address by SO_REUSEPORT.
+  //
+  const int32_t nReactors = std::max(nThreads, 1);
+  for (int32_t i = 0; i < nReactors; i++) {
+    Reactor *reactor = new Reactor(this, i);
+    reactors_.push_back(reactor);
+
+    // more reactors than the previous sserver share its sockets
+    evutil_socket_t listenFd = -1;
+    if (i < (int32_t)listenFds.size()) {
+      listenFd = listenFds[i];
+    } else if (listenFds.size() > 0) {
+      listenFd = fcntl(listenFds[i % listenFds.size()], F_DUPFD_CLOEXEC, 0);
+    }
+    if (!reactor->setup(sin_, nReactors, listenFd)) {
+      LOG(ERROR) << "cannot create listener: " << ip << ":" << port;
+      return false;
+    }
+  }
+  if (listenFds.size() > (size_t)nReactors) {
+    LOG(WARNING) << "hot restart, the connections in the backlogs of "
+    << listenFds.size() - nReactors << " listeners are dropped";
+    for (size_t i = nReactors; i < listenFds.size(); i++) {
+      evutil_closesocket(listenFds[i]);
+    }
+  }
+
+  // a session may go to another reactor, its state is all it needs
+  if (handoffSessions.size() > 0) {
+    size_t restoredNum = 0;
+    for (size_t i = 0; i < handoffSessions.size(); i++) {
+      if (reactors_[i % reactors_.size()]->restoreSession(handoffSessions[i],
+                                                          false)) {
+        restoredNum++;
+      }
+    }
+    LOG(INFO) << "hot restart, restored sessions: " << restoredNum << "/"
+    << handoffSessions.size();
+  }
+  LOG(INFO) << "server listen on " << ip << ":" << port
+  << ", reactors: " << nReactors
+  << ", share hashing: " << SHA256Batch::getImplName();
+
+  // local only, it may change the switches
+  if (statsHttpPort > 0) {
+    statsHttpd_ = new StatsHttpd(this, "127.0.0.1", (unsigned short)statsHttpPort);
+    if (!statsHttpd_->setup()) {
+      return false;
+    }
+  }
+
+  //
+  // the path is taken from the old sserver, so it's the last step before
+  // ACK. the reactors don't run yet, nothing is read from or written to the
+  // sockets of the sessions before the old sserver lets them go.
+  //
+  if (hotRestart_ != nullptr &&
+      (!hotRestart_->setup() || !hotRestart_->finishTakeOver())) {
     return false;
   }
   return true;
 }
 
 void Server::run() {
-  if(base_ != NULL) {
-    //    event_base_loop(base_, EVLOOP_NONBLOCK);
-    event_base_dispatch(base_);
+  if (reactors_.size() == 0) {
+    return;
+  }
+
+  if (statsHttpd_ != nullptr) {
+    statsHttpd_->runThread();
+  }
+  if (hotRestart_ != nullptr) {
+    hotRestart_->runThread();
+  }
+  for (size_t i = 1; i < reactors_.size(); i++) {
+    reactors_[i]->runThread();
+  }
+  reactors_[0]->run();
+
+  for (size_t i = 1; i < reactors_.size(); i++) {
+    reactors_[i]->join();
+  }
+  if (hotRestart_ != nullptr) {
+    hotRestart_->stop();
+  }
+  if (statsHttpd_ != nullptr) {
+    statsHttpd_->stop();
+  }
+
+  if (shareVerifier_ != nullptr) {
+    shareVerifier_->stop();
   }
 }
 
 void Server::stop() {
   LOG(INFO) << "stop tcp server event loop";
-  event_base_loopexit(base_, NULL);
+  for (Reactor *reactor : reactors_) {
+    reactor->stop();
+  }
 
   jobRepository_->stop();
   userInfo_->stop();
 }
 
-void Server::sendMiningNotifyToAll(shared_ptr<StratumJobEx> exJobPtr) {
-  //
-  // http://www.sgi.com/tech/stl/Map.html
-  //
-  // Map has the important property that inserting a new element into a map
-  // does not invalidate iterators that point to existing elements. Erasing
-  // an element from a map also does not invalidate any iterators, except,
-  // of course, for iterators that actually point to the element that is
-  // being erased.
-  //
-
-  ScopeLock sl(connsLock_);
-  std::map<evutil_socket_t, StratumSession *>::iterator itr = connections_.begin();
-  while (itr != connections_.end()) {
-    StratumSession *conn = itr->second;  // alias
-
-    if (conn->isDead()) {
-#ifndef WORK_WITH_STRATUM_SWITCHER
-      sessionIDManager_->freeSessionId(conn->getSessionId());
-#endif
+shared_ptr<HandoffTask> Server::postHandoff() {
+  shared_ptr<HandoffTask> task = std::make_shared<HandoffTask>((int32_t)reactors_.size());
+  for (Reactor *reactor : reactors_) {
+    reactor->postHandoff(task);
+  }
+  return task;
+}
 
-      delete conn;
-      itr = connections_.erase(itr);
-    } else {
+void Server::resumeHandoff(shared_ptr<HandoffTask> task) {
+  // the reactors not finished yet keep their sessions
+  vector<HandoffSession> sessions;
+  task->cancel(sessions);
 
-      conn->sendMiningNotify(exJobPtr);
-      ++itr;
-    }
+  vector<vector<HandoffSession> > reactorSessions(reactors_.size());
+  for (size_t i = 0; i < sessions.size(); i++) {
+    reactorSessions[i % reactors_.size()].push_back(std::move(sessions[i]));
+  }
+  for (size_t i = 0; i < reactors_.size(); i++) {
+    reactors_[i]->postRestore(reactorSessions[i]);
   }
 }
 
-void Server::addConnection(evutil_socket_t fd, StratumSession *connection) {
-  ScopeLock sl(connsLock_);
-  connections_.insert(std::pair<evutil_socket_t, StratumSession *>(fd, connection));
+void Server::getListenerFds(vector<evutil_socket_t> &fds) const {
+  for (Reactor *reactor : reactors_) {
+    fds.push_back(reactor->getListenerFd());
+  }
 }
 
-void Server::removeConnection(evutil_socket_t fd) {
+void Server::sendMiningNotifyToAll(shared_ptr<StratumJobEx> exJobPtr) {
   //
-  // if we are here, means the related evbuffer has already been locked.
-  // don't lock connsLock_ in this function, it will cause deadlock.
+  // every reactor sends the job to its own sessions in its own thread,
+  // so the broadcast runs in parallel and never races with the sessions'
+  // read callbacks.
   //
-  auto itr = connections_.find(fd);
-  if (itr == connections_.end()) {
-    return;
+  auto task = std::make_shared<MiningNotifyTask>(exJobPtr,
+                                                 (int32_t)reactors_.size());
+  for (Reactor *reactor : reactors_) {
+    reactor->postMiningNotify(task);
   }
-
-  // mark to delete
-  itr->second->markAsDead();
 }
 
-void Server::listenerCallback(struct evconnlistener* listener,
-                              evutil_socket_t fd,
-                              struct sockaddr *saddr,
-                              int socklen, void* data)
-{
-  Server *server = static_cast<Server *>(data);
-  struct event_base  *base = (struct event_base*)server->base_;
-  struct bufferevent *bev;
-  uint32_t sessionID = 0u;
-
-#ifndef WORK_WITH_STRATUM_SWITCHER
-  // can't alloc session Id
-  if (server->sessionIDManager_->allocSessionId(&sessionID) == false) {
-    close(fd);
+void Server::finishMiningNotify(const MiningNotifyTask &task) {
+  const int64_t sessionsCount = task.sessionsCount_;
+  if (sessionsCount == 0) {
     return;
   }
-#endif
-
-  bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE|BEV_OPT_THREADSAFE);
-  if(bev == nullptr) {
-    LOG(ERROR) << "error constructing bufferevent!";
-    server->stop();
-    return;
+  const int64_t spread  = task.lastSendTime_ - task.firstSendTime_;
+  const int64_t elapsed = task.lastSendTime_ - task.postTime_;
+  miningNotifyLatency_.record((uint64_t)spread);
+
+  LOG(INFO) << "mining notify job " << task.exJobPtr_->sjob_->jobId_
+  << " to " << sessionsCount << " sessions, first to last: " << spread
+  << " us, post to last: " << elapsed << " us, histogram(us): "
+  << miningNotifyLatency_.toString();
+
+  if (shareVerifier_ != nullptr) {
+    LOG(INFO) << "share verifier, queued shares: "
+    << shareVerifier_->getQueuedShares() << ", max: "
+    << shareVerifier_->getMaxQueuedShares() << ", overflows: "
+    << shareVerifier_->getOverflowsNum() << ", histogram(us): "
+    << shareVerifier_->getLatency().toString();
+    shareVerifier_->resetStats();
   }
 
-  // create stratum session
-  StratumSession* conn = new StratumSession(fd, bev, server, saddr,
-                                            server->kShareAvgSeconds_,
-                                            sessionID);
-  // set callback functions
-  bufferevent_setcb(bev,
-                    Server::readCallback, nullptr,
-                    Server::eventCallback, (void*)conn);
-  // By default, a newly created bufferevent has writing enabled.
-  bufferevent_enable(bev, EV_READ|EV_WRITE);
+  if (outputHighWater_ > 0) {
+    LOG(INFO) << "sessions output, dropped notifies: "
+    << outputDroppedBytes_ << " bytes, evicted sessions: "
+    << outputEvictedSessions_;
+  }
 
-  server->addConnection(fd, conn);
+  const int64_t sessionsMemory = task.sessionsMemory_;
+  LOG(INFO) << "sessions memory: " << sessionsMemory / 1024 << " KiB, "
+  << sessionsMemory / sessionsCount << " bytes per session, interned names: "
+  << InternedString::getEntriesNum() << ", "
+  << InternedString::getEntriesMemoryUsage() / 1024 << " KiB";
 }
 
 void Server::readCallback(struct bufferevent* bev, void *connection) {
   StratumSession *conn = static_cast<StratumSession *>(connection);
-  conn->readBuf(bufferevent_get_input(bev));
+  // a submit read in this callback may be traced, see ShareLatency
+  const bool isTracing = (conn->server_->shareLatency_.getSampleRate() > 0);
+  if (isTracing) {
+    conn->reactor_->setReadTime(getMonotonicTimeUs());
+  }
+  conn->readBuf();
+  if (isTracing) {
+    conn->reactor_->setReadTime(0);
+  }
 }
 
 void Server::eventCallback(struct bufferevent* bev, short events,
                               void *connection) {
   StratumSession *conn = static_cast<StratumSession *>(connection);
-  Server       *server = static_cast<Server *>(conn->server_);
 
   // should not be 'BEV_EVENT_CONNECTED'
   assert((events & BEV_EVENT_CONNECTED) != BEV_EVENT_CONNECTED);
@@ -1145,21 +4028,20 @@ void Server::eventCallback(struct bufferevent* bev, short events,
   else {
     LOG(ERROR) << "unhandled socket events: " << events;
   }
-  server->removeConnection(conn->fd_);
+  conn->reactor_->removeConnection(conn->fd_);
 }
 
-int Server::checkShare(const Share &share,
-                       const uint32 extraNonce1, const string &extraNonce2Hex,
-                       const uint32_t nTime, const uint32_t nonce,
-                       const uint256 &jobTarget, const string &workFullName,
-                       string *userCoinbaseInfo) {
-  shared_ptr<StratumJobEx> exJobPtr = jobRepository_->getStratumJobEx(share.jobId_);
-  if (exJobPtr == nullptr) {
+int Server::prepareShare(const Share &share, const uint32 extraNonce1,
+                         const uint32_t nTime, CoinbasePrefix *coinbasePrefix,
+                         shared_ptr<StratumJobEx> *exJobPtr,
+                         string *userCoinbaseInfo) {
+  *exJobPtr = jobRepository_->getStratumJobEx(share.jobId_);
+  if (*exJobPtr == nullptr) {
     return StratumError::JOB_NOT_FOUND;
   }
-  StratumJob *sjob = exJobPtr->sjob_;
+  StratumJob *sjob = (*exJobPtr)->sjob_;
 
-  if (exJobPtr->isStale()) {
+  if ((*exJobPtr)->isStale()) {
     return StratumError::JOB_NOT_FOUND;
   }
   if (nTime <= sjob->minTime_) {
@@ -1169,18 +4051,48 @@ int Server::checkShare(const Share &share,
     return StratumError::TIME_TOO_NEW;
   }
 
-  CBlockHeader header;
-  std::vector<char> coinbaseBin;
-  exJobPtr->generateBlockHeader(&header, &coinbaseBin,
-                                extraNonce1, extraNonce2Hex,
-                                sjob->merkleBranch_, sjob->prevHash_,
-                                sjob->nBits_, sjob->nVersion_, nTime, nonce,
-                                userCoinbaseInfo);
-  uint256 blkHash = header.GetHash();
+  if (!coinbasePrefix->isReady_) {
+    (*exJobPtr)->initCoinbasePrefix(coinbasePrefix, extraNonce1, userCoinbaseInfo);
+  }
+  return StratumError::NO_ERROR;
+}
+
+int Server::finishShare(const Share &share,
+                        const uint32 extraNonce1, const uint64_t extraNonce2,
+                        shared_ptr<StratumJobEx> exJobPtr,
+                        const CBlockHeader &header, uint256 blkHash,
+                        const uint256 &jobTarget, const StratumWorker &worker,
+                        string *userCoinbaseInfo) {
+  StratumJob *sjob = exJobPtr->sjob_;
+  const uint32_t nTime = header.nTime;
+  const uint32_t nonce = header.nNonce;
 
   arith_uint256 bnBlockHash     = UintToArith256(blkHash);
   arith_uint256 bnNetworkTarget = UintToArith256(sjob->networkTarget_);
 
+  //
+  // the whole coinbase tx is only needed when we found a block
+  //
+  std::vector<char> coinbaseBin;
+  if (isSubmitInvalidBlock_ == true || bnBlockHash <= bnNetworkTarget ||
+      (!sjob->blockHashForMergedMining_.empty() &&
+       bnBlockHash <= UintToArith256(sjob->rskNetworkTarget_)) ||
+      (sjob->nmcAuxBits_ != 0 &&
+       bnBlockHash <= UintToArith256(sjob->nmcNetworkTarget_))) {
+    const string extraNonce2Hex = Strings::Format("%016llx", extraNonce2);
+    CBlockHeader fullHeader;
+    exJobPtr->generateBlockHeader(&fullHeader, &coinbaseBin,
+                                  extraNonce1, extraNonce2Hex,
+                                  sjob->merkleBranch_, sjob->prevHash_,
+                                  sjob->nBits_, header.nVersion, nTime, nonce,
+                                  userCoinbaseInfo);
+    if (fullHeader.hashMerkleRoot != header.hashMerkleRoot) {
+      LOG(ERROR) << "coinbase prefix mismatch, merkle root: "
+      << header.hashMerkleRoot.ToString() << ", expected: "
+      << fullHeader.hashMerkleRoot.ToString();
+    }
+  }
+
   //
   // found new block
   //
@@ -1195,7 +4107,7 @@ int Server::checkShare(const Share &share,
     foundBlock.height_   = sjob->height_;
     memcpy(foundBlock.header80_, (const uint8_t *)&header, sizeof(CBlockHeader));
     snprintf(foundBlock.workerFullName_, sizeof(foundBlock.workerFullName_),
-             "%s", workFullName.c_str());
+             "%s", worker.getFullName().c_str());
     // send
     sendSolvedShare2Kafka(&foundBlock, coinbaseBin);
 
@@ -1204,7 +4116,8 @@ int Server::checkShare(const Share &share,
 
     LOG(INFO) << ">>>> found a new block: " << blkHash.ToString()
     << ", jobId: " << share.jobId_ << ", userId: " << share.userId_
-    << ", by: " << workFullName << " <<<<";
+    << ", nVersion: " << Strings::Format("%08x", (uint32_t)header.nVersion)
+    << ", by: " << worker.getFullName() << " <<<<";
   }
 
   // print out high diff share, 2^10 = 1024
@@ -1212,7 +4125,7 @@ int Server::checkShare(const Share &share,
     LOG(INFO) << "high diff share, blkhash: " << blkHash.ToString()
     << ", diff: " << TargetToDiff(blkHash)
     << ", networkDiff: " << TargetToDiff(sjob->networkTarget_)
-    << ", by: " << workFullName;
+    << ", by: " << worker.getFullName();
   }
 
   //
@@ -1233,7 +4146,7 @@ int Server::checkShare(const Share &share,
     snprintf(shareData.rpcAddress_, sizeof(shareData.rpcAddress_), "%s", sjob->rskdRpcAddress_.c_str());
     snprintf(shareData.rpcUserPwd_, sizeof(shareData.rpcUserPwd_), "%s", sjob->rskdRpcUserPwd_.c_str());
     memcpy(shareData.header80_, (const uint8_t *)&header, sizeof(CBlockHeader));
-    snprintf(shareData.workerFullName_, sizeof(shareData.workerFullName_), "%s", workFullName.c_str());
+    snprintf(shareData.workerFullName_, sizeof(shareData.workerFullName_), "%s", worker.getFullName().c_str());
     
     //
     // send to kafka topic
@@ -1256,7 +4169,7 @@ int Server::checkShare(const Share &share,
     //
     LOG(INFO) << ">>>> found a new RSK block: " << blkHash.ToString()
     << ", jobId: " << share.jobId_ << ", userId: " << share.userId_
-    << ", by: " << workFullName << " <<<<";
+    << ", by: " << worker.getFullName() << " <<<<";
   }
 
   //
@@ -1295,7 +4208,7 @@ int Server::checkShare(const Share &share,
     LOG(INFO) << ">>>> found namecoin block: " << sjob->nmcHeight_ << ", "
     << sjob->nmcAuxBlockHash_.ToString()
     << ", jobId: " << share.jobId_ << ", userId: " << share.userId_
-    << ", by: " << workFullName << " <<<<";
+    << ", by: " << worker.getFullName() << " <<<<";
   }
 
   // check share diff
@@ -1311,7 +4224,14 @@ int Server::checkShare(const Share &share,
 }
 
 void Server::sendShare2Kafka(const uint8_t *data, size_t len) {
-  kafkaProducerShareLog_->produce(data, len);
+  if (shareLatency_.getSampleRate() == 0) {
+    kafkaProducerShareLog_->produce(data, len);
+    return;
+  }
+  const int64_t produceTime = getMonotonicTimeUs();
+  kafkaProducerShareLog_->produce(data, len, true /* isTimed */);
+  shareLatency_.record(ShareLatency::STAGE_SHARELOG_PRODUCE,
+                       getMonotonicTimeUs() - produceTime);
 }
 
 void Server::sendSolvedShare2Kafka(const FoundBlock *foundBlock,
@@ -1330,7 +4250,10 @@ void Server::sendSolvedShare2Kafka(const FoundBlock *foundBlock,
   // coinbase TX
   memcpy(p, coinbaseBin.data(), coinbaseBin.size());
 
-  kafkaProducerSolvedShare_->produce(buf.data(), buf.size());
+  const int64_t produceTime = getMonotonicTimeUs();
+  kafkaProducerSolvedShare_->produce(buf.data(), buf.size(), true /* isTimed */);
+  shareLatency_.record(ShareLatency::STAGE_SOLVED_PRODUCE,
+                       getMonotonicTimeUs() - produceTime);
 }
 
 void Server::sendCommonEvents2Kafka(const string &message) {
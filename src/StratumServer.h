@@ -51,6 +51,7 @@
 
 class Server;
 class StratumJobEx;
+class Reactor;
 
 
 #ifndef WORK_WITH_STRATUM_SWITCHER
@@ -69,14 +70,23 @@ class SessionIDManager {
   //  server ID          session id
   //   [1, 255]        range: [0, MAX_SESSION_INDEX_SERVER]
   //
+  // levels_[0] is the bitmap of used session ids. a bit of levels_[k + 1]
+  // is set when the word of levels_[k] is full, so finding a free id visits
+  // at most two words per level. padding bits are always set.
+  static const int32_t kLevels_ = 4;
+
   uint8_t serverId_;
-  std::bitset<MAX_SESSION_INDEX_SERVER + 1> sessionIds_;
+  vector<uint64_t> levels_[kLevels_];
 
   int32_t count_;  // how many ids are used now
   uint32_t allocIdx_;
   mutex lock_;
 
   bool _ifFull();
+  // the first 0 bit at or after pos of the level, -1 if there is none
+  int64_t findZero(const int32_t level, const uint64_t pos) const;
+  void setBit  (uint64_t idx);
+  void clearBit(uint64_t idx);
 
 public:
   SessionIDManager(const uint8_t serverId);
@@ -84,17 +94,31 @@ public:
   bool ifFull();
   bool allocSessionId(uint32_t *sessionID);
   void freeSessionId(uint32_t sessionId);
+  // the id of a session handed over by hot restart, false if it's of another
+  // server or used already
+  bool reserveSessionId(const uint32_t sessionId);
 };
 
 #endif // #ifndef WORK_WITH_STRATUM_SWITCHER
 
 
 ////////////////////////////////// JobRepository ///////////////////////////////
+//
+// exJobs_ is only changed by the consume thread. every change publishes an
+// immutable snapshot of it, which the reactors read without any lock.
+//
 class JobRepository {
+  // sorted by jobId
+  typedef vector<std::pair<uint64_t, shared_ptr<StratumJobEx> > > JobSnapshot;
+
   atomic<bool> running_;
-  mutex lock_;
+  mutex lock_;  // for exJobs_
   std::map<uint64_t/* jobId */, shared_ptr<StratumJobEx> > exJobs_;
 
+  // only accessed by std::atomic_load() / std::atomic_store()
+  shared_ptr<const JobSnapshot> snapshot_;
+  atomic<uint64_t> snapshotVersion_;
+
   KafkaConsumer kafkaConsumer_;  // consume topic: 'StratumJob'
   Server *server_;               // call server to send new job
 
@@ -114,6 +138,11 @@ class JobRepository {
   void tryCleanExpiredJobs();
   void checkAndSendMiningNotify();
 
+  // lock_ must be held
+  void publishSnapshot();
+  // the snapshot cached by the calling thread, valid until its next call
+  const JobSnapshot &getSnapshot();
+
 public:
   JobRepository(const char *kafkaBrokers, const string &fileLastNotifyTime,
                 Server *server);
@@ -125,6 +154,68 @@ public:
 
   shared_ptr<StratumJobEx> getStratumJobEx(const uint64_t jobId);
   shared_ptr<StratumJobEx> getLatestStratumJobEx();
+
+  // hot restart, see HotRestart. thread safe
+  void getJobs(vector<shared_ptr<StratumJobEx> > &jobs);
+  // a job handed over, before setupThreadConsume(). the sessions are mining
+  // the latest one already
+  void restoreJob(StratumJob *sjob, const bool isClean, const bool isStale);
+};
+
+
+//////////////////////////////// UserDirectory /////////////////////////////////
+//
+// userName -> userId table. it's immutable after published by UserInfo,
+// every update builds a new copy. names live in one buffer and are looked
+// up by pointer and length, open addressing with linear probing.
+//
+class UserDirectory {
+  struct Slot {
+    uint32_t hash_;
+    uint32_t nameOffset_;  // in names_, kEmptySlot_ if unused
+    uint32_t nameLen_;
+    int32_t  userId_;
+  };
+  static const uint32_t kEmptySlot_ = 0xFFFFFFFFu;
+
+  vector<Slot> slots_;  // power of 2, load factor <= 0.5
+  string names_;
+  size_t size_;
+  int32_t maxUserId_;
+
+#ifdef USER_DEFINED_COINBASE
+  // userId -> userCoinbaseInfo
+  std::unordered_map<int32_t, string> idCoinbaseInfos_;
+#endif
+
+  static uint32_t hashName(const char *name, const size_t len);
+  const Slot *findSlot(const char *name, const size_t len,
+                       const uint32_t hash) const;
+  void rehash(const size_t nSlots);
+
+public:
+  UserDirectory();
+
+  // the existing user is kept if isReplace is false
+  void addUser(const string &userName, const int32_t userId,
+               const bool isReplace);
+  // 0 if not found
+  int32_t getUserId(const char *name, const size_t len) const;
+  size_t  size() const { return size_; }
+  int32_t getMaxUserId() const { return maxUserId_; }
+
+#ifdef USER_DEFINED_COINBASE
+  void setCoinbaseInfo(const int32_t userId, const string &coinbaseInfo);
+  // nullptr if not found
+  const string *getCoinbaseInfo(const int32_t userId) const;
+#endif
+
+  //
+  // text file, the first line is "#btcpool users v1 <lastTime>", then
+  // "<userId> <userName>[ <coinbaseInfo hex>]" per line
+  //
+  bool saveToFile(const string &file, const int64_t lastTime) const;
+  bool loadFromFile(const string &file, int64_t *lastTime);
 };
 
 
@@ -132,36 +223,27 @@ public:
 // 1. update userName->userId by interval
 // 2. insert worker name to db
 class UserInfo {
-  struct WorkerName {
-    int32_t userId_;
-    int64_t workerId_;
-    char    workerName_[21];
-    char    minerAgent_[31];
-
-    WorkerName(): userId_(0), workerId_(0) {
-      memset(workerName_, 0, sizeof(workerName_));
-      memset(minerAgent_, 0, sizeof(minerAgent_));
-    }
-  };
-
   //--------------------
-  pthread_rwlock_t rwlock_;
   atomic<bool> running_;
   string apiUrl_;
+  // the users are saved to it after every update and loaded at start,
+  // so a restart doesn't wait for the user list API. empty: disabled
+  string cacheFile_;
+
+  // the current directory, only accessed by std::atomic_load() /
+  // std::atomic_store(). only the update thread publishes a new one
+  shared_ptr<const UserDirectory> directory_;
+  atomic<uint64_t> directoryVersion_;
 
-  // username -> userId
-  std::unordered_map<string, int32_t> nameIds_;
   int32_t lastMaxUserId_;
-  
-#ifdef USER_DEFINED_COINBASE
-  // userId -> userCoinbaseInfo
-  std::unordered_map<int32_t, string> idCoinbaseInfos_;
-  int64_t lastTime_;
-#endif
+  int64_t lastTime_;  // for USER_DEFINED_COINBASE
 
-  // workerName
+  //
+  // worker names, deduplicated and sent to kafka every second, so a
+  // reconnect storm makes a few events. see WorkerUpdateBatch
+  //
   mutex workerNameLock_;
-  std::deque<WorkerName> workerNameQ_;
+  WorkerUpdateBatch workerUpdates_;
   Server *server_;
 
   thread threadInsertWorkerName_;
@@ -172,14 +254,21 @@ class UserInfo {
   void runThreadUpdate();
   int32_t incrementalUpdateUsers();
 
+  bool saveUsersCache();
+  bool loadUsersCache();
+
+  void publishDirectory(shared_ptr<const UserDirectory> directory);
+  // the directory cached by the calling thread, valid until its next call
+  const UserDirectory &getDirectory();
+
 public:
-  UserInfo(const string &apiUrl, Server *server);
+  UserInfo(const string &apiUrl, const string &cacheFile, Server *server);
   ~UserInfo();
 
   void stop();
   bool setupThreads();
 
-  int32_t getUserId(const string userName);
+  int32_t getUserId(const string &userName);
 
 #ifdef USER_DEFINED_COINBASE
   string  getCoinbaseInfo(int32_t userId);
@@ -190,6 +279,45 @@ public:
 };
 
 
+///////////////////////////////// SharedPayload ////////////////////////////////
+//
+// immutable bytes with an intrusive reference count. sessions put it into
+// their output evbuffer by reference, so the same bytes are shared by all
+// sessions and freed when the last evbuffer drains it.
+//
+class SharedPayload {
+  atomic<int32_t> refCount_;
+  const string data_;
+
+  explicit SharedPayload(const string &data);
+  ~SharedPayload() {}
+
+public:
+  // the returned payload holds one reference
+  static SharedPayload *create(const string &data);
+
+  void ref();
+  void unref();
+
+  inline const char *data() const { return data_.data(); }
+  inline size_t      size() const { return data_.size(); }
+
+  // add to the evbuffer by reference, caller should lock the evbuffer
+  // if it needs to be contiguous with other data
+  bool addToEvbuffer(struct evbuffer *buf);
+  // evbuffer_ref_cleanup_cb
+  static void evbufferCleanup(const void *data, size_t len, void *payload);
+};
+
+//
+// removes [pos, pos + len) from the middle of buf, the rest is moved back
+// without copying, so the payloads added by reference stay shared. caller
+// should lock the evbuffer. false if the range is out of buf, or buf is
+// frozen: the output of a bufferevent must be unfrozen at the start first.
+//
+bool removeEvbufferRange(struct evbuffer *buf, const size_t pos, const size_t len);
+
+
 ////////////////////////////////// StratumJobEx ////////////////////////////////
 //
 // StratumJobEx is use to wrap StratumJob
@@ -214,6 +342,24 @@ public:
   string miningNotify3_;
   string miningNotify3Clean_;
 
+  //
+  // shared notify payloads: notifyHead_ + <jobId> + notifyTail_
+  // notifyTail_ = miningNotify2_ + coinbase1_ + miningNotify3_, the clean one
+  // uses miningNotify3Clean_. clean_jobs of miningNotify3_ is always false,
+  // not isClean_: a session decides it, see StratumSession::sendMiningNotify()
+  //
+  SharedPayload *notifyHead_;
+  SharedPayload *notifyTail_;
+  SharedPayload *notifyTailClean_;
+  // the same of BinaryStratum: binNotifyHead_ + <jobId, clean> + binNotifyTail_.
+  // nullptr if the job can't be sent in binary
+  SharedPayload *binNotifyHead_;
+  SharedPayload *binNotifyTail_;
+
+  // binary coinbase1 & coinbase2, for share checking
+  std::vector<char> coinbase1Bin_;
+  std::vector<char> coinbase2Bin_;
+
 public:
   StratumJobEx(StratumJob *sjob, bool isClean);
   ~StratumJobEx();
@@ -230,6 +376,650 @@ public:
                            const uint32_t nBits, const int32_t nVersion,
                            const uint32_t nTime, const uint32_t nonce,
                            string *userCoinbaseInfo = nullptr);
+
+  // coinbase1 + extraNonce1 don't change between a session's shares
+  void initCoinbasePrefix(CoinbasePrefix *prefix, const uint32_t extraNonce1,
+                          const string *userCoinbaseInfo = nullptr) const;
+  // a share's hashing work for SHA256Batch, the prefix must outlive the item.
+  // the bits of versionMask in nVersion are replaced by versionBits (BIP310)
+  void initShareHashItem(ShareHashItem *item, const SHA256Midstate *prefix,
+                         const uint64_t extraNonce2,
+                         const uint32_t nTime, const uint32_t nonce,
+                         const uint32_t versionMask = 0,
+                         const uint32_t versionBits = 0) const;
+  // hash only the tail of coinbase: extraNonce2 + coinbase2, no allocation
+  void generateBlockHeader(CBlockHeader *header, uint256 *blkHash,
+                           const CoinbasePrefix &prefix,
+                           const uint64_t extraNonce2,
+                           const uint32_t nTime, const uint32_t nonce,
+                           const uint32_t versionMask = 0,
+                           const uint32_t versionBits = 0) const;
+};
+
+
+/////////////////////////////// MiningNotifyTask ///////////////////////////////
+//
+// one mining.notify broadcast, shared by all reactors. every reactor sends
+// the job to its own sessions in its own thread, the last one to finish
+// reports the first-session to last-session latency of the whole broadcast.
+//
+struct MiningNotifyTask {
+  shared_ptr<StratumJobEx> exJobPtr_;
+  int64_t postTime_;                 // microseconds
+  atomic<int64_t> firstSendTime_;    // microseconds
+  atomic<int64_t> lastSendTime_;     // microseconds
+  atomic<int32_t> pendingReactors_;
+  atomic<int64_t> sessionsCount_;
+  atomic<int64_t> sessionsMemory_;   // bytes, see StratumSession::getMemoryUsage()
+
+  MiningNotifyTask(shared_ptr<StratumJobEx> exJobPtr, const int32_t nReactors);
+  // return true if it's the last reactor
+  bool finishReactor(const int64_t firstSendTime, const int64_t lastSendTime,
+                     const int64_t sessionsCount, const int64_t sessionsMemory);
+};
+
+
+////////////////////////////////// PacedNotify /////////////////////////////////
+//
+// a job sent by a reactor to its sessions over the pacing window, the ones
+// of higher priority first. see Reactor::startPacedNotify()
+//
+struct PacedNotify {
+  shared_ptr<MiningNotifyTask> task_;
+  // sorted by StratumSession::getNotifyPriority(), the higher first
+  vector<std::pair<uint64_t, StratumSession *> > sessions_;
+  size_t  sentNum_;
+  size_t  maxSlotSentNum_;  // most sessions sent in one slot
+  int32_t slotsNum_;
+  int64_t startTime_;       // microseconds
+  int64_t firstSendTime_;   // microseconds
+  int64_t lastSendTime_;    // microseconds
+  int64_t sessionsCount_;
+  int64_t sessionsMemory_;
+
+  PacedNotify();
+  void reset();
+};
+
+
+////////////////////////////////// TokenBucket /////////////////////////////////
+//
+// rate limiter, not thread safe. rate <= 0 means unlimited.
+//
+class TokenBucket {
+  double  rate_;      // tokens per second
+  double  burst_;     // max tokens
+  double  tokens_;
+  int64_t lastTime_;  // microseconds
+
+  void refill(const int64_t now);
+
+public:
+  TokenBucket();
+
+  void setup(const double rate, const double burst);
+  inline bool isUnlimited() const { return rate_ <= 0; }
+
+  // take one token
+  bool tryConsume(const int64_t now);
+  // microseconds until the next token, 0 if there is one now
+  int64_t getWaitUs(const int64_t now);
+};
+
+
+////////////////////////////////// IpReputation ////////////////////////////////
+//
+// abuse of the peers across their sessions, e.g. reconnecting to get around
+// the invalid shares limit of a session. an ip and its /24 subnet have
+// decaying counters of the connects, the failed authorizes and the invalid
+// shares, halved every half-life. over the ban score, the peer is banned
+// for a while: its connections are closed at accept and its sessions with
+// new events are closed. the subnet counts the events of the ips not banned,
+// so it's banned by several offenders, not by a single flooding one.
+//
+// thread safe, the table is sharded by the key. ips are ipv4 in network byte
+// order, times are monotonic in microseconds.
+//
+class IpReputation {
+public:
+  enum Event {
+    EVENT_CONNECT        = 0,
+    EVENT_AUTHORIZE_FAIL = 1,
+    EVENT_INVALID_SHARE  = 2,
+    EVENT_NUM            = 3
+  };
+  // weights of the events in the score
+  static const double kWeights_[EVENT_NUM];
+  // a /24 subnet is banned at so many times the score of an ip
+  static const int32_t kSubnetFactor_ = 4;
+
+  static const int32_t kShards_ = 64;
+  // the table doesn't grow over it, new peers aren't tracked then
+  static const size_t kMaxShardEntries_ = 4096;
+
+private:
+  struct Entry {
+    double  counters_[EVENT_NUM];  // decayed to lastTime_
+    int64_t lastTime_;
+    int64_t banTime_;              // banned until, 0: never banned
+  };
+  struct Shard {
+    mutex lock_;
+    std::unordered_map<uint64_t, Entry> entries_;
+    int64_t purgeTime_;            // no purge before, the shard is full
+  };
+
+  double  banScore_;    // 0: off
+  int64_t banUs_;
+  int64_t halfLifeUs_;
+  Shard   shards_[kShards_];
+
+  atomic<uint64_t> bansNum_;
+  atomic<uint64_t> bannedEventsNum_;
+
+  inline Shard &getShard(const uint64_t key) {
+    return shards_[(key * 0x9E3779B97F4A7C15ull) >> 58];
+  }
+  void decay(Entry &entry, const int64_t now) const;
+  double getScore(const Entry &entry) const;
+  // drop the entries decayed to nothing
+  void purge(Shard &shard, const int64_t now);
+  bool addEvent(const uint64_t key, const Event event, const int64_t now);
+  bool isBanned(const uint64_t key, const int64_t now);
+
+public:
+  IpReputation();
+
+  // banScore <= 0 turns it off
+  void setup(const double banScore, const int32_t banSeconds,
+             const int32_t halfLifeSeconds);
+  inline bool isEnabled() const { return banScore_ > 0; }
+
+  // the event is counted to the ip, and to its subnet if the ip is not
+  // banned. true if either is banned
+  bool addEvent(const uint32_t ip, const Event event, const int64_t now);
+  bool isBanned(const uint32_t ip, const int64_t now);
+
+  size_t getEntriesNum();
+  inline uint64_t getBansNum() const { return bansNum_; }
+  // events of the banned peers, e.g. the connections closed at accept
+  inline uint64_t getBannedEventsNum() const { return bannedEventsNum_; }
+};
+
+
+///////////////////////////////// ShareVerifier ////////////////////////////////
+//
+// the pending shares of a reactor, hashed by a ShareVerifier thread. the
+// batch goes back to its reactor, which finishes the shares in the order
+// they were submitted.
+//
+struct VerifyBatch {
+  Reactor *reactor_;
+  vector<PendingShare>  shares_;
+  vector<ShareHashItem> items_;
+  int64_t postTime_;     // microseconds
+  atomic<bool> isDone_;
+
+  explicit VerifyBatch(Reactor *reactor);
+  // the block hashes of the shares to verify, rejected ones have no item
+  void hash();
+  // in the order of submitting, in the reactor's thread
+  void finish();
+  void clear();
+};
+
+//
+// hashes the shares out of the event loops, a burst of submits doesn't
+// block the reads, notifies and timeouts of other sessions. the queue is
+// bounded by shares, a reactor hashes the batch itself if it's full.
+//
+class ShareVerifier {
+  atomic<bool> running_;
+  const size_t kMaxQueuedShares_;
+
+  mutex lock_;
+  Condition cond_;
+  std::deque<VerifyBatch *> queue_;
+  vector<thread> threads_;
+
+  // metrics, the max and the latency are reset by resetStats()
+  atomic<size_t>   queuedShares_;
+  atomic<size_t>   maxQueuedShares_;
+  atomic<uint64_t> overflowsNum_;
+  // post to hashed, unit: microseconds
+  LatencyHistogram latency_;
+
+  void runThread();
+
+public:
+  ShareVerifier(const int32_t nThreads, const size_t maxQueuedShares);
+  ~ShareVerifier();
+
+  // the queued batches are hashed before the threads exit
+  void stop();
+
+  // thread safe, false if the queue is full
+  bool post(VerifyBatch *batch);
+  // a batch hashed by its reactor because the queue was full
+  void recordOverflow(const VerifyBatch &batch);
+
+  inline size_t   getQueuedShares()    const { return queuedShares_; }
+  inline size_t   getMaxQueuedShares() const { return maxQueuedShares_; }
+  inline uint64_t getOverflowsNum()    const { return overflowsNum_; }
+  inline const LatencyHistogram &getLatency() const { return latency_; }
+  void resetStats();
+};
+
+
+///////////////////////////////// ShareLatency /////////////////////////////////
+//
+// latency of the stages of the shares, microseconds. the stages of a share
+// are recorded if it's traced, 1 of the sample rate. the kafka stages are
+// recorded for every solved share, and for every sharelog message while the
+// sample rate isn't 0. the switches may be changed at runtime, see
+// StatsHttpd.
+//
+class ShareLatency {
+public:
+  enum Stage {
+    STAGE_READ = 0,         // the socket is readable -> the message is read
+    STAGE_PARSE,            // the message -> the submit is parsed
+    STAGE_JOB_LOOKUP,       // local job & JobRepository, the coinbase prefix
+    STAGE_HASH_QUEUE,       // queued -> its batch starts hashing
+    STAGE_HASH,             // its batch is hashed
+    STAGE_VERIFIED,         // hashed -> back in the event loop
+    STAGE_CHECK,            // Server::finishShare(), target & solved block
+    STAGE_RESPONSE,         // the response is written, the sharelog is added
+    STAGE_TOTAL,            // the socket is readable -> the response
+    STAGE_SHARELOG_PRODUCE, // kafka produce() of a sharelog message
+    STAGE_SHARELOG_QUEUE,   // kafka produce() -> the delivery report
+    STAGE_SOLVED_PRODUCE,
+    STAGE_SOLVED_QUEUE,
+    STAGES_NUM
+  };
+  static const char *getStageName(const int32_t stage);
+
+private:
+  LatencyHistogram stages_[STAGES_NUM];
+  atomic<uint32_t> sampleRate_;  // 1 of it is traced, 0: off
+  atomic<bool>     isLogTrace_;  // log the stages of every traced share
+
+public:
+  ShareLatency();
+
+  inline void setSampleRate(const uint32_t sampleRate) { sampleRate_ = sampleRate; }
+  inline uint32_t getSampleRate() const {
+    return sampleRate_.load(std::memory_order_relaxed);
+  }
+  inline void setLogTrace(const bool isLogTrace) { isLogTrace_ = isLogTrace; }
+  inline bool isLogTrace() const { return isLogTrace_; }
+
+  inline void record(const Stage stage, const int64_t us) {
+    stages_[stage].record(us > 0 ? (uint64_t)us : 0);
+  }
+  // the stages of a traced share, it's responded at respondedTime
+  void recordTrace(const ShareTrace &trace, const int64_t checkTime,
+                   const int64_t checkedTime, const int64_t respondedTime,
+                   const string &workerName);
+  inline const LatencyHistogram &getStage(const Stage stage) const {
+    return stages_[stage];
+  }
+  void reset();
+
+  // {"sample_rate":100,"log_trace":false,"stages":{"read":{"count":1,...}}}
+  string toJson() const;
+
+  // KafkaProducer::DeliveryCallback, arg is the ShareLatency
+  static void sharelogDelivered(const int64_t latencyUs, void *arg);
+  static void solvedShareDelivered(const int64_t latencyUs, void *arg);
+};
+
+
+////////////////////////////////// StatsHttpd //////////////////////////////////
+//
+// local http endpoint of sserver's stats, in its own thread:
+//
+//   /share_latency   the histograms of ShareLatency. optional args:
+//                    sample_rate=N  trace 1 of N shares, 0: off
+//                    log_trace=0|1  log the stages of every traced share
+//                    reset=1        reset the histograms after the reply
+//
+class StatsHttpd {
+  Server *server_;
+  string ip_;
+  unsigned short port_;
+
+  struct event_base *base_;
+  struct evhttp *httpd_;
+  thread thread_;
+
+  void run();
+
+public:
+  StatsHttpd(Server *server, const string &ip, const unsigned short port);
+  ~StatsHttpd();
+
+  bool setup();
+  void runThread();
+  void stop();
+
+  static void httpdShareLatency(struct evhttp_request *req, void *arg);
+};
+
+
+//////////////////////////////// HandoffSession ////////////////////////////////
+//
+// a session handed over by hot restart: a dup of its socket and its state,
+// see StratumSession::saveState()
+//
+struct HandoffSession {
+  evutil_socket_t fd_;
+  string state_;
+};
+
+//
+// the old process takes the sessions of all reactors, see Reactor::postHandoff().
+// a reactor finishing after the task is cancelled keeps its sessions.
+//
+struct HandoffTask {
+  mutex lock_;
+  Condition cond_;
+  int32_t pendingReactors_;
+  bool isCancelled_;
+  vector<HandoffSession> sessions_;
+
+  explicit HandoffTask(const int32_t nReactors);
+
+  // false if it's cancelled, the sessions are left to the reactor
+  bool finishReactor(vector<HandoffSession> &sessions);
+  // false if the reactors are not finished in timeoutMs
+  bool wait(const int32_t timeoutMs);
+  bool isCancelled();
+  // the sessions taken so far are returned
+  void cancel(vector<HandoffSession> &sessions);
+};
+
+
+////////////////////////////////// HotRestart //////////////////////////////////
+//
+// zero-downtime restart. a new sserver connects to the unix socket of the
+// running one at start, which hands over its listening sockets, its jobs and
+// every session: the socket by SCM_RIGHTS and the state. the miners stay
+// connected, and the old sserver exits once the new one has them.
+//
+//   new -> old: HELLO    | version(4) | server id(1) |
+//   old -> new: LISTEN   fd of a listening socket, one per reactor
+//               JOB      | isClean(1) | isStale(1) | json of StratumJob |
+//               SESSION  fd of the socket, StratumSession::saveState()
+//               END      or REJECT | reason |
+//   new -> old: ACK
+//
+// a record is | type(4) | len(4) | payload |, the fd is sent with it. the
+// new sserver sends ACK once it's set up: the listeners and the sessions are
+// attached, and it listens on the path for the next one. the old sserver
+// resumes its sessions if the handover fails before ACK.
+//
+class HotRestart {
+public:
+  enum RecordType {
+    RECORD_HELLO   = 1,
+    RECORD_LISTEN  = 2,
+    RECORD_JOB     = 3,
+    RECORD_SESSION = 4,
+    RECORD_END     = 5,
+    RECORD_REJECT  = 6,
+    RECORD_ACK     = 7
+  };
+  // the format of the records and the states, both sides must be the same
+  static const uint32_t kVersion_ = 1;
+  // a session keeps up to 64K shares of each of its jobs
+  static const uint32_t kMaxRecordSize_ = 64 * 1024 * 1024;
+
+private:
+  Server *server_;
+  string path_;
+  uint8_t serverId_;
+
+  atomic<bool> running_;
+  int listenSock_;
+  // the new side, the connection to the old sserver until finishTakeOver()
+  int takeOverSock_;
+  thread thread_;
+
+  static const int32_t kIoTimeoutSeconds_     = 30;
+  static const int32_t kFreezeTimeoutSeconds_ = 30;
+  // the old sserver waits so long for ACK, the new one is setting up
+  static const int32_t kSetupTimeoutSeconds_  = 60;
+
+  void run();
+  // the old side of a connection, true if the new one took the sessions
+  bool handOver(const int sock);
+  bool sendHandoff(const int sock, vector<HandoffSession> &sessions);
+
+public:
+  HotRestart(Server *server, const string &path, const uint8_t serverId);
+  ~HotRestart();
+
+  //
+  // the new side, at start. the jobs are restored to jobRepository, the
+  // sockets belong to the caller then. true with nothing taken if there's
+  // no running sserver on the path.
+  //
+  bool takeOver(JobRepository *jobRepository,
+                vector<evutil_socket_t> &listenFds,
+                vector<HandoffSession> &sessions);
+  // ACK to the old sserver, after the sessions are restored and setup().
+  // if the new sserver fails before, the old one resumes the sessions
+  bool finishTakeOver();
+  // listen on the path for the next sserver
+  bool setup();
+  void runThread();
+  void stop();
+
+  // a record, fd is -1 if none. false if the socket fails
+  static bool sendRecord(const int sock, const uint32_t type,
+                         const evutil_socket_t fd, const string &payload);
+  static bool recvRecord(const int sock, uint32_t *type, evutil_socket_t *fd,
+                         string *payload);
+};
+
+
+///////////////////////////////////// Reactor //////////////////////////////////
+//
+// One libevent event loop with its own listener and its own slice of sessions.
+// A session is created by the reactor which accepted it and never migrates,
+// so all of its bufferevent callbacks run in that reactor's thread.
+//
+class Reactor {
+  Server *server_;
+  const int32_t index_;
+
+  struct event_base* base_;
+  struct evconnlistener* listener_;
+  std::map<evutil_socket_t, StratumSession *> connections_;
+  mutex connsLock_;
+
+  // mining notify tasks posted by other threads, run in the reactor's thread
+  struct event *notifyEvent_;
+  std::deque<shared_ptr<MiningNotifyTask> > notifyTasks_;
+  mutex notifyTasksLock_;
+
+  //
+  // with Server::notifyPacingMs_ > 0, a non-clean job is sent in slots of
+  // kPacingSlotMs_ over the window. a clean job is sent to all at once, both
+  // in the order of the sessions' priority. a new job ends the last round,
+  // the sessions not reached yet get the new one.
+  //
+  static const int32_t kPacingSlotMs_ = 10;
+  struct event *pacingEvent_;
+  PacedNotify pacedNotify_;
+
+  // the share of the message being handled, see beginShareTrace()
+  int64_t    readTime_;  // of the current read callback, 0: not traced
+  uint32_t   sampledMessagesNum_;
+  ShareTrace shareTrace_;
+
+  //
+  // submitted shares are accumulated and hashed together by SHA256Batch.
+  // the batch is flushed after the loop handled the current readable
+  // sessions, when it's full, or before a session with pending shares
+  // sends anything else.
+  //
+  struct event *flushSharesEvent_;
+  vector<PendingShare>  pendingShares_;
+  vector<ShareHashItem> shareHashItems_;
+  bool isFlushingShares_;
+
+  //
+  // with Server::shareVerifier_, a flushed batch is hashed by its threads.
+  // verifyingBatches_ are in the order of flushing, finished from the front
+  // when done. finished batches are reused.
+  //
+  struct event *verifiedEvent_;
+  std::deque<VerifyBatch *> verifyingBatches_;
+  vector<VerifyBatch *> freeBatches_;
+
+  //
+  // shares sent to kafka are batched if Server::shareLogBatchSize_ > 1.
+  // the batch is sent when it's full, or shareLogBatchMs_ after its first
+  // share (0: after the current loop iteration).
+  //
+  struct event *shareLogEvent_;
+  ShareLogBatch shareLogBatch_;
+
+  //
+  // admission control of reconnect storms. the listener is paused when
+  // acceptBucket_ is empty, and authorizes wait in pendingAuthorizes_ for
+  // authorizeBucket_. admissionEvent_ is the timer to resume both.
+  // the first jobs of authorized sessions may be sent in batches.
+  //
+  TokenBucket acceptBucket_;
+  TokenBucket authorizeBucket_;
+  struct event *admissionEvent_;
+  bool isListenerPaused_;
+  std::deque<std::pair<evutil_socket_t, StratumSession *> > pendingAuthorizes_;
+
+  struct event *firstJobsEvent_;
+  std::deque<std::pair<evutil_socket_t, StratumSession *> > pendingFirstJobs_;
+
+  //
+  // hot restart, see HotRestart. postHandoff() freezes the reactor: no
+  // accepts and no reads, the sessions are saved and deleted once their
+  // shares are finished. the sessions come back by postRestore() if the
+  // handover fails. both run in handoffEvent_
+  //
+  struct event *handoffEvent_;
+  mutex handoffLock_;
+  shared_ptr<HandoffTask> handoffTask_;
+  vector<HandoffSession> restoreSessions_;
+  bool isFrozen_;
+
+  // metrics, may be read by other threads
+  atomic<uint32_t> pendingAuthorizesNum_;
+  atomic<uint32_t> pendingFirstJobsNum_;
+  atomic<uint32_t> maxPendingAuthorizesNum_;
+  atomic<uint64_t> deferredAuthorizesNum_;
+  atomic<uint64_t> listenerPausesNum_;
+
+  thread thread_;
+
+  evutil_socket_t bindSocket(const struct sockaddr_in &sin);
+  void runMiningNotifyTasks();
+  void finishVerifiedShares();
+  void startPacedNotify(shared_ptr<MiningNotifyTask> task);
+  void sendPacedNotify();
+  void finishPacedNotify();
+  StratumSession *findSession(evutil_socket_t fd, StratumSession *session);
+  void runAdmission();
+  void scheduleAdmission();
+  void sendFirstJobs();
+  void scheduleFirstJobs();
+  void runHandoff();
+  // false if the shares of the sessions are not finished yet
+  bool takeSessions(vector<HandoffSession> &sessions);
+  void restoreSessions(const vector<HandoffSession> &sessions,
+                       const bool isSessionIdReserved);
+  // sessions are only collected, not sent, if pacedSessions isn't nullptr
+  void sendMiningNotifyToAll(shared_ptr<StratumJobEx> exJobPtr,
+                             int64_t *firstSendTime, int64_t *lastSendTime,
+                             int64_t *sessionsCount, int64_t *sessionsMemory,
+                             vector<std::pair<uint64_t, StratumSession *> >
+                               *pacedSessions = nullptr);
+
+public:
+  Reactor(Server *server, const int32_t index);
+  ~Reactor();
+
+  // listeners bind by SO_REUSEPORT if nReactors > 1. listenFd is a
+  // listening socket handed over by HotRestart, -1: bind sin
+  bool setup(const struct sockaddr_in &sin, const int32_t nReactors,
+             const evutil_socket_t listenFd = -1);
+  void runThread();
+  void run();
+  void stop();
+  void join();
+
+  inline int32_t getIndex() const { return index_; }
+  inline struct event_base *getBase() const { return base_; }
+  evutil_socket_t getListenerFd() const;
+  size_t getConnectionsCount();
+
+  // thread safe, the task will run in the reactor's thread
+  void postMiningNotify(shared_ptr<MiningNotifyTask> task);
+
+  void addConnection   (evutil_socket_t fd, StratumSession *connection);
+  void removeConnection(evutil_socket_t fd);
+
+  // only in the reactor's thread. the submit in the message read out at
+  // lineTime is traced if it's sampled, see ShareLatency
+  // 0: the read callback is done, the trace is dropped if it's left
+  void setReadTime(const int64_t readTime) {
+    readTime_ = readTime;
+    if (readTime == 0) {
+      shareTrace_.reset();
+    }
+  }
+  inline bool isTracing() const { return readTime_ != 0; }
+  void beginShareTrace(const bool isSubmit, const int64_t lineTime);
+  inline ShareTrace &getShareTrace() { return shareTrace_; }
+
+  void addPendingShare(const PendingShare &pendingShare);
+  void flushShares();
+  // thread safe, called by ShareVerifier
+  void postVerifiedBatch(VerifyBatch *batch);
+  void addShareLog(const Share &share);
+  void flushShareLog();
+
+  // admission control, only in the reactor's thread. an authorize is
+  // deferred if tryAdmitAuthorize() returns false
+  bool tryAdmitAuthorize();
+  void deferAuthorize(StratumSession *session);
+  void addFirstJob(StratumSession *session);
+
+  inline uint32_t getPendingAuthorizesNum() const { return pendingAuthorizesNum_; }
+  inline uint32_t getPendingFirstJobsNum()  const { return pendingFirstJobsNum_; }
+
+  // hot restart, thread safe
+  void postHandoff(shared_ptr<HandoffTask> task);
+  void postRestore(vector<HandoffSession> &sessions);
+  // in the reactor's thread or before it runs, the socket is closed if the
+  // session can't be restored. the session id is kept by the old sserver
+  // if the handover fails
+  bool restoreSession(const HandoffSession &handoffSession,
+                      const bool isSessionIdReserved);
+
+  static void listenerCallback(struct evconnlistener* listener,
+                               evutil_socket_t socket,
+                               struct sockaddr* saddr,
+                               int socklen, void* reactor);
+  static void notifyCallback(evutil_socket_t, short, void *reactor);
+  static void flushSharesCallback(evutil_socket_t, short, void *reactor);
+  static void verifiedCallback(evutil_socket_t, short, void *reactor);
+  static void pacingCallback(evutil_socket_t, short, void *reactor);
+  static void shareLogCallback(evutil_socket_t, short, void *reactor);
+  static void admissionCallback(evutil_socket_t, short, void *reactor);
+  static void firstJobsCallback(evutil_socket_t, short, void *reactor);
+  static void handoffCallback(evutil_socket_t, short, void *reactor);
 };
 
 
@@ -237,11 +1027,9 @@ public:
 class Server {
   // NetIO
   struct sockaddr_in sin_;
-  struct event_base* base_;
   struct event* signal_event_;
-  struct evconnlistener* listener_;
-  std::map<evutil_socket_t, StratumSession *> connections_;
-  mutex connsLock_;
+  // reactors_[0] runs in the caller's thread of run(), others in their own
+  vector<Reactor *> reactors_;
 
   // kafka producers
   KafkaProducer *kafkaProducerShareLog_;
@@ -250,11 +1038,6 @@ class Server {
   KafkaProducer *kafkaProducerCommonEvents_;
   KafkaProducer *kafkaProducerRskSolvedShare_;
 
-  //
-  // WARNING: if enable simulator, all share will be accepted. only for test.
-  //
-  bool isEnableSimulator_;
-
   //
   // WARNING: if enable it, will make block and submit it even it's not a
   //          solved share. use to test submit block.
@@ -266,6 +1049,11 @@ public:
   SessionIDManager *sessionIDManager_;
 #endif
 
+  //
+  // WARNING: if enable simulator, all share will be accepted. only for test.
+  //
+  bool isEnableSimulator_;
+
   //
   // WARNING: if enable, difficulty sent to miners is always minerDifficulty_. 
   //          for development
@@ -276,40 +1064,108 @@ public:
   //
   float minerDifficulty_;
   const int32_t kShareAvgSeconds_;
+  // shares per ShareLog message, 1 is the old format. see ShareLogBatch
+  int32_t shareLogBatchSize_;
+  // max milliseconds a share waits in the batch
+  int32_t shareLogBatchMs_;
+  // admission control of the whole server, 0: unlimited
+  int32_t maxAcceptsPerSecond_;
+  int32_t maxAuthorizesPerSecond_;
+  // max first jobs sent by a reactor in one loop iteration, 0: the first
+  // job is sent by authorize
+  int32_t firstJobBatchSize_;
+  // workers per common event, 1 is the old 'worker_update' event
+  int32_t workerUpdateBatchSize_;
+  // vardiff of the sessions
+  DiffController::Type varDiffType_;
+  // nVersion bits the miners may roll (BIP310), 0: version rolling is off
+  uint32_t versionMask_;
+  // nullptr: the shares are hashed in the event loops
+  ShareVerifier *shareVerifier_;
+  // non-clean jobs are sent over it, 0: at once
+  int32_t notifyPacingMs_;
+  // clock of the pacing slots, microseconds. the tests step it by hand
+  int64_t (*pacingClock_)();
+  // output bytes of a session before its superseded notifies are dropped,
+  // 0: unlimited. see StratumSession::reclaimOutput()
+  int32_t outputHighWater_;
+  // a session over the mark at so many jobs in a row is evicted
+  int32_t outputEvictJobs_;
+  atomic<uint64_t> outputDroppedBytes_;
+  atomic<uint64_t> outputEvictedSessions_;
+  ShareLatency shareLatency_;
+  IpReputation ipReputation_;
+  // nullptr: no stats endpoint
+  StatsHttpd *statsHttpd_;
+  // nullptr: hot restart is off
+  HotRestart *hotRestart_;
   JobRepository *jobRepository_;
   UserInfo *userInfo_;
 
+  // mining notify: first session to last session, unit: microseconds
+  LatencyHistogram miningNotifyLatency_;
+
 public:
   Server(const int32_t shareAvgSeconds);
   ~Server();
 
   bool setup(const char *ip, const unsigned short port, const char *kafkaBrokers,
-             const string &userAPIUrl,
+             const string &userAPIUrl, const string &usersCacheFile,
              const uint8_t serverId, const string &fileLastNotifyTime,
              bool isEnableSimulator,
              bool isSubmitInvalidBlock,
              bool isDevModeEnable,
-             float minerDifficulty);
+             float minerDifficulty,
+             const int32_t nThreads,
+             const int32_t shareLogBatchSize,
+             const int32_t shareLogBatchMs,
+             const int32_t maxAcceptsPerSecond,
+             const int32_t maxAuthorizesPerSecond,
+             const int32_t firstJobBatchSize,
+             const int32_t workerUpdateBatchSize,
+             const DiffController::Type varDiffType,
+             const uint32_t versionMask,
+             const int32_t verifyThreads,
+             const int32_t verifyQueueSize,
+             const int32_t notifyPacingMs,
+             const int32_t outputHighWater,
+             const int32_t outputEvictJobs,
+             const int32_t shareLatencySampleRate,
+             const int32_t statsHttpPort,
+             const string &handoffSocket,
+             const int32_t ipBanScore,
+             const int32_t ipBanSeconds,
+             const int32_t ipBanHalfLife);
   void run();
   void stop();
 
-  void sendMiningNotifyToAll(shared_ptr<StratumJobEx> exJobPtr);
+  // hot restart, the old side. the sessions of all reactors are taken by
+  // the task, see HotRestart
+  shared_ptr<HandoffTask> postHandoff();
+  // the handover failed, the sessions go back to the reactors
+  void resumeHandoff(shared_ptr<HandoffTask> task);
+  void getListenerFds(vector<evutil_socket_t> &fds) const;
 
-  void addConnection   (evutil_socket_t fd, StratumSession *connection);
-  void removeConnection(evutil_socket_t fd);
+  void sendMiningNotifyToAll(shared_ptr<StratumJobEx> exJobPtr);
+  void finishMiningNotify(const MiningNotifyTask &task);
 
-  static void listenerCallback(struct evconnlistener* listener,
-                               evutil_socket_t socket,
-                               struct sockaddr* saddr,
-                               int socklen, void* server);
   static void readCallback (struct bufferevent *, void *connection);
   static void eventCallback(struct bufferevent *, short, void *connection);
 
-  int checkShare(const Share &share,
-                 const uint32 extraNonce1, const string &extraNonce2Hex,
-                 const uint32_t nTime, const uint32_t nonce,
-                 const uint256 &jobTarget, const string &workFullName,
-                 string *userCoinbaseInfo = nullptr);
+  //
+  // share checking is split in two steps, the block hashes of the prepared
+  // shares are calculated by SHA256Batch between them. see Reactor::flushShares()
+  //
+  int prepareShare(const Share &share, const uint32 extraNonce1,
+                   const uint32_t nTime, CoinbasePrefix *coinbasePrefix,
+                   shared_ptr<StratumJobEx> *exJobPtr,
+                   string *userCoinbaseInfo = nullptr);
+  int finishShare(const Share &share,
+                  const uint32 extraNonce1, const uint64_t extraNonce2,
+                  shared_ptr<StratumJobEx> exJobPtr,
+                  const CBlockHeader &header, uint256 blkHash,
+                  const uint256 &jobTarget, const StratumWorker &worker,
+                  string *userCoinbaseInfo = nullptr);
 
   void sendShare2Kafka      (const uint8_t *data, size_t len);
   void sendSolvedShare2Kafka(const FoundBlock *foundBlock,
@@ -331,6 +1187,7 @@ class StratumServer {
 
   string kafkaBrokers_;
   string userAPIUrl_;
+  string usersCacheFile_;
 
   // if enable simulator, all share will be accepted
   bool isEnableSimulator_;
@@ -344,16 +1201,80 @@ class StratumServer {
   // difficulty to send to miners. for development
   float minerDifficulty_;
 
+  // number of event loop threads (reactors)
+  int32_t nThreads_;
+
+  // batching of kafka topic 'ShareLog'
+  int32_t shareLogBatchSize_;
+  int32_t shareLogBatchMs_;
+
+  // admission control of reconnect storms
+  int32_t maxAcceptsPerSecond_;
+  int32_t maxAuthorizesPerSecond_;
+  int32_t firstJobBatchSize_;
+
+  // batching of the common event 'worker_update'
+  int32_t workerUpdateBatchSize_;
+
+  // vardiff of the sessions
+  DiffController::Type varDiffType_;
+
+  // version rolling mask (BIP310)
+  uint32_t versionMask_;
+
+  // share verifier threads, 0: in the event loops
+  int32_t verifyThreads_;
+  int32_t verifyQueueSize_;
+
+  // pacing window of non-clean jobs, 0: at once
+  int32_t notifyPacingMs_;
+
+  // output backpressure of the sessions, 0: unlimited
+  int32_t outputHighWater_;
+  int32_t outputEvictJobs_;
+
+  // 1 of so many shares is traced, 0: off. the stats endpoint, 0: off
+  int32_t shareLatencySampleRate_;
+  int32_t statsHttpPort_;
+
+  // unix socket of hot restart, empty: off
+  string handoffSocket_;
+
+  // see IpReputation, ban score 0: off
+  int32_t ipBanScore_;
+  int32_t ipBanSeconds_;
+  int32_t ipBanHalfLife_;
+
 public:
   StratumServer(const char *ip, const unsigned short port,
                 const char *kafkaBrokers,
-                const string &userAPIUrl,
+                const string &userAPIUrl, const string &usersCacheFile,
                 const uint8_t serverId, const string &fileLastNotifyTime,
                 bool isEnableSimulator,
                 bool isSubmitInvalidBlock,
                 bool isDevModeEnable,
                 float minerDifficulty,
-                const int32_t shareAvgSeconds);
+                const int32_t shareAvgSeconds,
+                const int32_t nThreads,
+                const int32_t shareLogBatchSize,
+                const int32_t shareLogBatchMs,
+                const int32_t maxAcceptsPerSecond,
+                const int32_t maxAuthorizesPerSecond,
+                const int32_t firstJobBatchSize,
+                const int32_t workerUpdateBatchSize,
+                const DiffController::Type varDiffType,
+                const uint32_t versionMask,
+                const int32_t verifyThreads,
+                const int32_t verifyQueueSize,
+                const int32_t notifyPacingMs,
+                const int32_t outputHighWater,
+                const int32_t outputEvictJobs,
+                const int32_t shareLatencySampleRate,
+                const int32_t statsHttpPort,
+                const string &handoffSocket,
+                const int32_t ipBanScore,
+                const int32_t ipBanSeconds,
+                const int32_t ipBanHalfLife);
   ~StratumServer();
 
   bool init();
@@ -25,6 +25,7 @@
 #include "Utils.h"
 #include "utilities_js.hpp"
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <boost/algorithm/string.hpp>
 
@@ -32,6 +33,36 @@
 
 
 //////////////////////////////// DiffController ////////////////////////////////
+DiffController::DiffController(const int32_t shareAvgSeconds):
+minDiff_(kMinDiff_), curDiff_(kDefaultDiff_)
+{
+  if (shareAvgSeconds >= 1 && shareAvgSeconds <= 60) {
+    shareAvgSeconds_ = shareAvgSeconds;
+  } else {
+    shareAvgSeconds_ = 8;
+  }
+}
+
+bool DiffController::parseType(const string &name, Type &type) {
+  if (name == "window") {
+    type = TYPE_WINDOW;
+    return true;
+  }
+  if (name == "ewma") {
+    type = TYPE_EWMA;
+    return true;
+  }
+  return false;
+}
+
+DiffController *DiffController::create(const Type type,
+                                       const int32_t shareAvgSeconds) {
+  if (type == TYPE_EWMA) {
+    return new EwmaDiffController(shareAvgSeconds);
+  }
+  return new WindowDiffController(shareAvgSeconds);
+}
+
 void DiffController::setMinDiff(uint64 minDiff) {
   if (minDiff < kMinDiff_) {
     minDiff = kMinDiff_;
@@ -52,7 +83,40 @@ void DiffController::setCurDiff(uint64 curDiff) {
   curDiff_ = curDiff;
 }
 
-void DiffController::resetCurDiff(uint64 curDiff) {
+void DiffController::saveState(HandoffWriter &writer) const {
+  // the state of the subclass is sized, another type can skip it
+  string varDiff;
+  HandoffWriter varDiffWriter(varDiff);
+  saveVarDiff(varDiffWriter);
+
+  writer.put((uint8_t)getType());
+  writer.put(minDiff_);
+  writer.put(curDiff_);
+  writer.putString(varDiff);
+}
+
+bool DiffController::restoreState(HandoffReader &reader) {
+  uint8_t type = 0;
+  uint64 minDiff = 0, curDiff = 0;
+  string varDiff;
+  if (!reader.get(type) || !reader.get(minDiff) || !reader.get(curDiff) ||
+      !reader.getString(varDiff, 65536)) {
+    return false;
+  }
+  setMinDiff(minDiff);
+
+  if (type != (uint8_t)getType()) {
+    resetCurDiff(curDiff);
+    return true;
+  }
+  setCurDiff(curDiff);
+  HandoffReader varDiffReader((const uint8_t *)varDiff.data(), varDiff.size());
+  return restoreVarDiff(varDiffReader) && varDiffReader.isEnd();
+}
+
+
+///////////////////////////// WindowDiffController /////////////////////////////
+void WindowDiffController::resetCurDiff(uint64 curDiff) {
   if (curDiff < kMinDiff_) {
     curDiff = kMinDiff_;
   }
@@ -64,10 +128,24 @@ void DiffController::resetCurDiff(uint64 curDiff) {
   shares_.mapMultiply(0);
 }
 
-void DiffController::addAcceptedShare(const uint64 share) {
-  const int64 k = time(nullptr) / kRecordSeconds_;
+void WindowDiffController::saveVarDiff(HandoffWriter &writer) const {
+  writer.put(startTime_);
+  writer.put(curHashRateLevel_);
+  sharesNum_.save(writer);
+  shares_.save(writer);
+}
+
+bool WindowDiffController::restoreVarDiff(HandoffReader &reader) {
+  return reader.get(startTime_) && reader.get(curHashRateLevel_) &&
+         sharesNum_.restore(reader) && shares_.restore(reader);
+}
+
+bool WindowDiffController::addAcceptedShare(const uint64 share,
+                                            const int64_t nowUs) {
+  const int64 k = (nowUs / 1000000) / kRecordSeconds_;
   sharesNum_.insert(k, 1.0);
   shares_.insert(k, share);
+  return false;  // waits for the next job
 }
 
 
@@ -104,7 +182,7 @@ static int __hashRateUp(int level) {
 }
 
 // TODO: test case
-int DiffController::adjustHashRateLevel(const double hashRateT) {
+int WindowDiffController::adjustHashRateLevel(const double hashRateT) {
   // hashrate is always danceing,
   // so need to use rate high and low to check it's level
   const double rateHigh = 1.50;
@@ -131,7 +209,7 @@ int DiffController::adjustHashRateLevel(const double hashRateT) {
   return curHashRateLevel_;
 }
 
-double DiffController::minerCoefficient(const time_t now, const int64_t idx) {
+double WindowDiffController::minerCoefficient(const time_t now, const int64_t idx) {
   if (now <= startTime_) {
     return 1.0;
   }
@@ -146,20 +224,19 @@ double DiffController::minerCoefficient(const time_t now, const int64_t idx) {
   return c[curHashRateLevel_];
 }
 
-uint64 DiffController::calcCurDiff() {
-  uint64 diff = _calcCurDiff();
+uint64 WindowDiffController::calcCurDiff(const int64_t nowUs) {
+  uint64 diff = _calcCurDiff((time_t)(nowUs / 1000000));
   if (diff < minDiff_) {
     diff = minDiff_;
   }
   return diff;
 }
 
-uint64 DiffController::_calcCurDiff() {
-  const time_t now = time(nullptr);
+uint64 WindowDiffController::_calcCurDiff(const time_t now) {
   const int64 k = now / kRecordSeconds_;
   const double sharesCount = (double)sharesNum_.sum(k);
   if (startTime_ == 0) {  // first time, we set the start time
-    startTime_ = time(nullptr);
+    startTime_ = now;
   }
 
   const double kRateHigh = 1.40;
@@ -208,42 +285,297 @@ uint64 DiffController::_calcCurDiff() {
   return curDiff_;
 }
 
+////////////////////////////// EwmaDiffController //////////////////////////////
+const double EwmaDiffController::kJobRetargetRate_   = 1.25;
+const double EwmaDiffController::kShareRetargetRate_ = 2.0;
+
+EwmaDiffController::EwmaDiffController(const int32_t shareAvgSeconds):
+DiffController(shareAvgSeconds),
+startUs_(0), workUs_(0), lastShareUs_(0), lastRetargetUs_(0), work_(0.0),
+sharesNum_(0.0), sharesSinceRetarget_(0), retargetDiff_(0)
+{
+}
+
+void EwmaDiffController::start(const int64_t nowUs) {
+  startUs_        = nowUs;
+  workUs_         = nowUs;
+  lastRetargetUs_ = nowUs;
+}
+
+double EwmaDiffController::getHashRate(const int64_t nowUs) const {
+  double sharesNum;
+  return getHashRate(nowUs, 0.0, sharesNum);
+}
+
+double EwmaDiffController::getHashRate(const int64_t nowUs,
+                                       const double excludedWork,
+                                       double &sharesNum) const {
+  sharesNum = 0.0;
+  if (startUs_ == 0 || nowUs <= startUs_) {
+    return 0.0;
+  }
+  const double tau     = (double)kTauShares_ * shareAvgSeconds_;
+  const double elapsed = (nowUs - startUs_) / 1000000.0;
+  const double decay   = exp(-(nowUs - workUs_) / 1000000.0 / tau);
+  double work = work_ * decay - excludedWork;
+  sharesNum = sharesNum_ * decay - (excludedWork > 0.0 ? 1.0 : 0.0);
+
+  // no share for a while: about one share of work is done since the last
+  // one, or a miner which never finds a share would never be retargeted
+  if (nowUs - lastShareUs_ > 2 * (int64_t)shareAvgSeconds_ * 1000000) {
+    work      += curDiff_;
+    sharesNum += 1.0;
+  }
+  return std::max(work, 0.0) / (tau * (1.0 - exp(-elapsed / tau)));
+}
+
+bool EwmaDiffController::isOffTarget(const uint64 diff, const double sharesNum,
+                                     const double minRate) const {
+  // the estimate of n shares is off by about 1/sqrt(n), don't chase the noise
+  const double rate = std::max(minRate, 1.0 + 2.0 / sqrt(std::max(sharesNum, 1.0)));
+  return diff >= curDiff_ * rate || diff * rate <= curDiff_;
+}
+
+bool EwmaDiffController::isSampled(const int64_t nowUs) const {
+  return sharesSinceRetarget_ >= kMinShares_ ||
+         nowUs - lastRetargetUs_ >= (int64_t)kMinShares_ * shareAvgSeconds_ * 1000000;
+}
+
+uint64 EwmaDiffController::getTargetDiff(const double hashRate) const {
+  const double diff = hashRate * shareAvgSeconds_;
+  const uint64 minDiff = std::max(minDiff_, kMinDiff_);
+  if (diff <= (double)minDiff) {
+    return minDiff;
+  }
+  if (diff >= (double)kMaxDiff_) {
+    return kMaxDiff_;
+  }
+  return (uint64)diff;
+}
+
+uint64 EwmaDiffController::calcCurDiff(const int64_t nowUs) {
+  if (startUs_ == 0) {
+    start(nowUs);
+  }
+  else if (retargetDiff_ != 0) {
+    setCurDiff(retargetDiff_);
+    retargetDiff_        = 0;
+    sharesSinceRetarget_ = 0;
+    lastRetargetUs_      = nowUs;
+  }
+  else if (isSampled(nowUs)) {
+    double sharesNum;
+    const uint64 diff = getTargetDiff(getHashRate(nowUs, 0.0, sharesNum));
+    if (isOffTarget(diff, sharesNum, kJobRetargetRate_)) {
+      setCurDiff(diff);
+      sharesSinceRetarget_ = 0;
+      lastRetargetUs_      = nowUs;
+    }
+  }
+  return curDiff_ < minDiff_ ? minDiff_ : curDiff_;
+}
+
+bool EwmaDiffController::addAcceptedShare(const uint64 share,
+                                          const int64_t nowUs) {
+  if (startUs_ == 0) {
+    start(nowUs);
+  }
+  if (nowUs > workUs_) {
+    const double tau   = (double)kTauShares_ * shareAvgSeconds_;
+    const double decay = exp(-(nowUs - workUs_) / 1000000.0 / tau);
+    work_      *= decay;
+    sharesNum_ *= decay;
+    workUs_     = nowUs;
+  }
+  work_      += share;
+  sharesNum_ += 1.0;
+  lastShareUs_ = nowUs;
+  sharesSinceRetarget_++;
+
+  if (sharesSinceRetarget_ < kMinShares_) {
+    return false;
+  }
+  //
+  // the time is up to the latest share, count the work before it only.
+  // n shares in the time of n shares would overrate the hashrate by n/(n-1)
+  //
+  double sharesNum;
+  const uint64 diff = getTargetDiff(getHashRate(nowUs, (double)share, sharesNum));
+  if (isOffTarget(diff, sharesNum, kShareRetargetRate_)) {
+    retargetDiff_ = diff;  // applied by the next calcCurDiff()
+    return true;
+  }
+  return false;
+}
+
+void EwmaDiffController::resetCurDiff(uint64 curDiff) {
+  if (curDiff < kMinDiff_) {
+    curDiff = kMinDiff_;
+  }
+  setCurDiff(curDiff);
+
+  // start over, the next job starts the estimate
+  startUs_      = 0;
+  lastShareUs_  = 0;
+  work_         = 0.0;
+  sharesNum_    = 0.0;
+  retargetDiff_ = 0;
+  sharesSinceRetarget_ = 0;
+}
+
+void EwmaDiffController::saveVarDiff(HandoffWriter &writer) const {
+  writer.put(startUs_);
+  writer.put(workUs_);
+  writer.put(lastShareUs_);
+  writer.put(lastRetargetUs_);
+  writer.put(work_);
+  writer.put(sharesNum_);
+  writer.put(sharesSinceRetarget_);
+  writer.put(retargetDiff_);
+}
+
+bool EwmaDiffController::restoreVarDiff(HandoffReader &reader) {
+  return reader.get(startUs_) && reader.get(workUs_) &&
+         reader.get(lastShareUs_) && reader.get(lastRetargetUs_) &&
+         reader.get(work_) && reader.get(sharesNum_) &&
+         reader.get(sharesSinceRetarget_) && reader.get(retargetDiff_);
+}
+
+
+///////////////////////////////// LocalShareSet ////////////////////////////////
+//
+// shares are chosen by the miners, a random seed keeps them from making
+// collisions on purpose.
+//
+static const uint64_t kLocalShareHashSeed = ((uint64_t)std::random_device()() << 32) |
+                                            std::random_device()();
+
+uint64_t StratumSession::LocalShareSet::hash(const LocalShare &localShare) {
+  // splitmix64 finalizer
+  uint64_t h = localShare.exNonce2_ ^ kLocalShareHashSeed;
+  h ^= ((uint64_t)localShare.nonce_ << 32 | localShare.time_) * 0x9E3779B97F4A7C15ULL;
+  h ^= (uint64_t)localShare.versionBits_ * 0xC2B2AE3D27D4EB4FULL;
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  return h;
+}
+
+void StratumSession::LocalShareSet::grow() {
+  // most jobs only get a few shares, start small
+  const uint32_t capacity = (capacity_ == 0) ? 8 : capacity_ * 2;
+  std::unique_ptr<LocalShare[]> slots(new LocalShare[capacity]);
+  const size_t mask = capacity - 1;
+
+  for (uint32_t j = 0; j < capacity_; j++) {
+    const LocalShare &localShare = slots_[j];
+    if (localShare.isZero()) {
+      continue;
+    }
+    size_t i = hash(localShare) & mask;
+    while (!slots[i].isZero()) {
+      i = (i + 1) & mask;
+    }
+    slots[i] = localShare;
+  }
+  slots_.swap(slots);
+  capacity_ = capacity;
+}
+
+bool StratumSession::LocalShareSet::insert(const LocalShare &localShare) {
+  if (localShare.isZero()) {
+    if (hasZero_) {
+      return false;
+    }
+    hasZero_ = true;
+    return true;
+  }
+
+  // load factor <= 0.75
+  if ((size_ + 1) * 4 > capacity_ * 3) {
+    grow();
+  }
+
+  const size_t mask = capacity_ - 1;
+  size_t i = hash(localShare) & mask;
+  while (!slots_[i].isZero()) {
+    if (slots_[i] == localShare) {
+      return false;
+    }
+    i = (i + 1) & mask;
+  }
+  slots_[i] = localShare;
+  size_++;
+  return true;
+}
+
+bool StratumSession::LocalShareSet::contains(const LocalShare &localShare) const {
+  if (localShare.isZero()) {
+    return hasZero_;
+  }
+  if (capacity_ == 0) {
+    return false;
+  }
+
+  const size_t mask = capacity_ - 1;
+  size_t i = hash(localShare) & mask;
+  while (!slots_[i].isZero()) {
+    if (slots_[i] == localShare) {
+      return true;
+    }
+    i = (i + 1) & mask;
+  }
+  return false;
+}
+
+void StratumSession::LocalShareSet::getShares(vector<LocalShare> &shares) const {
+  shares.reserve(shares.size() + size());
+  if (hasZero_) {
+    shares.push_back(LocalShare());
+  }
+  for (uint32_t i = 0; i < capacity_; i++) {
+    if (!slots_[i].isZero()) {
+      shares.push_back(slots_[i]);
+    }
+  }
+}
+
 
 
 //////////////////////////////// StratumSession ////////////////////////////////
 StratumSession::StratumSession(evutil_socket_t fd, struct bufferevent *bev,
-                               Server *server, struct sockaddr *saddr,
+                               Server *server, Reactor *reactor,
+                               struct sockaddr *saddr,
                                const int32_t shareAvgSeconds,
                                const uint32_t extraNonce1) :
-shareAvgSeconds_(shareAvgSeconds), diffController_(shareAvgSeconds_),
+shareAvgSeconds_(shareAvgSeconds),
+diffController_(DiffController::create(server->varDiffType_, shareAvgSeconds)),
 shortJobIdIdx_(0), agentSessions_(nullptr), isDead_(false),
-invalidSharesCounter_(INVALID_SHARE_SLIDING_WINDOWS_SIZE),
-bev_(bev), fd_(fd), server_(server)
+pendingSharesNum_(0), isWaitingShares_(false), pendingAuthorize_(nullptr),
+isWaitingFirstJob_(false),
+outputBytes_(0), lastNotifyStart_(0), lastNotifyLen_(0),
+isLastNotifyClean_(false), overHighWaterJobs_(0),
+bev_(bev), fd_(fd), server_(server), reactor_(reactor)
 {
   state_ = CONNECTED;
   currDiff_    = 0U;
   extraNonce1_ = extraNonce1;
+  versionMask_ = 0U;
 
-  // usually stratum job interval is 30~60 seconds, 10 is enough for miners
-  // should <= 10, we use short_job_id,  range: [0 ~ 9]. do NOT change it.
-  kMaxNumLocalJobs_ = 10;
-  assert(kMaxNumLocalJobs_ <= 10);
-
-  inBuf_  = evbuffer_new();
   isLongTimeout_    = false;
   isNiceHashClient_ = false;
+  isBinary_         = false;
 
-  clientAgent_ = "unknown";
+  clientAgent_ = InternedString("unknown");
   // ipv4
-  clientIp_.resize(INET_ADDRSTRLEN);
   struct sockaddr_in *saddrin = (struct sockaddr_in *)saddr;
-  clientIp_ = inet_ntop(AF_INET, &saddrin->sin_addr,
-                        (char *)clientIp_.data(), (socklen_t)clientIp_.size());
   clientIpInt_ = saddrin->sin_addr.s_addr;
 
   setup();
 
-  LOG(INFO) << "client connect, ip: " << clientIp_;
+  LOG(INFO) << "client connect, ip: " << getClientIp();
 }
 
 StratumSession::~StratumSession() {
@@ -251,17 +583,25 @@ StratumSession::~StratumSession() {
     delete agentSessions_;
     agentSessions_ = nullptr;
   }
+  delete diffController_;
+  if (pendingAuthorize_ != nullptr) {
+    delete pendingAuthorize_;
+    pendingAuthorize_ = nullptr;
+  }
 
-  LOG(INFO) << "close stratum session, ip: " << clientIp_
-  << ", name: \"" << worker_.fullName_ << "\""
+  LOG(INFO) << "close stratum session, ip: " << getClientIp()
+  << ", name: \"" << worker_.getFullName() << "\""
   << ", agent: \"" << clientAgent_ << "\"";
 
 //  close(fd_);  // we don't need to close because we set 'BEV_OPT_CLOSE_ON_FREE'
-  evbuffer_free(inBuf_);
   bufferevent_free(bev_);
 }
 
 void StratumSession::markAsDead() {
+  // closed by the server first, e.g. banned
+  if (isDead_) {
+    return;
+  }
   // mark as dead
   isDead_ = true;
 
@@ -278,7 +618,7 @@ void StratumSession::markAsDead() {
                                 date("%F %T").c_str(),
                                 worker_.userId_, worker_.userName_.c_str(),
                                 worker_.workerName_.c_str(),
-                                clientAgent_.c_str(), clientIp_.c_str());
+                                clientAgent_.c_str(), getClientIp().c_str());
     server_->sendCommonEvents2Kafka(eventJson);
   }
 }
@@ -287,6 +627,44 @@ bool StratumSession::isDead() {
   return (isDead_ == true) ? true : false;
 }
 
+string StratumSession::getClientIp() const {
+  char ip[INET_ADDRSTRLEN];
+  struct in_addr addr;
+  addr.s_addr = clientIpInt_;
+  if (inet_ntop(AF_INET, &addr, ip, sizeof(ip)) == nullptr) {
+    return string();
+  }
+  return string(ip);
+}
+
+size_t StratumSession::getMemoryUsage() const {
+  size_t bytes = sizeof(*this) + diffController_->getMemoryUsage();
+
+  for (const LocalJob &ljob : localJobs_) {
+    bytes += ljob.submitShares_.memoryUsage();
+#ifdef USER_DEFINED_COINBASE
+    bytes += ljob.userCoinbaseInfo_.capacity();
+#endif
+  }
+  // the heap of the strings, short strings are in the objects
+  if (worker_.workerName_.capacity() > 15) {
+    bytes += worker_.workerName_.capacity() + 1;
+  }
+  if (lineBuf_.capacity() > 15) {
+    bytes += lineBuf_.capacity() + 1;
+  }
+  if (idStrBuf_.capacity() > 15) {
+    bytes += idStrBuf_.capacity() + 1;
+  }
+  if (pendingAuthorize_ != nullptr) {
+    bytes += sizeof(PendingAuthorize);
+  }
+  if (agentSessions_ != nullptr) {
+    bytes += agentSessions_->getMemoryUsage();
+  }
+  return bytes;
+}
+
 void StratumSession::setup() {
   // we set 15 seconds, will increase the timeout after sub & auth
   setReadTimeout(15);
@@ -302,27 +680,33 @@ void StratumSession::setReadTimeout(const int32_t timeout) {
   bufferevent_set_timeouts(bev_, &rtv, &wtv);
 }
 
-// if read success, will remove data from eventbuf
-bool StratumSession::tryReadLine(string &line) {
+// the line is copied, it's removed from eventbuf after handled
+bool StratumSession::tryPeekLine(string &line) {
   line.clear();
 
   // find eol
   struct evbuffer_ptr loc;
-  loc = evbuffer_search_eol(inBuf_, nullptr, nullptr, EVBUFFER_EOL_LF);
+  loc = evbuffer_search_eol(getInBuf(), nullptr, nullptr, EVBUFFER_EOL_LF);
   if (loc.pos == -1) {
     return false;  // not found
   }
 
-  // copies and removes the first datlen bytes from the front of buf
-  // into the memory at data
+  // copies the first datlen bytes from the front of buf into the memory
+  // at data
   line.resize(loc.pos + 1);  // containing "\n"
-  evbuffer_remove(inBuf_, (void *)line.data(), line.size());
+  evbuffer_copyout(getInBuf(), (void *)line.data(), line.size());
   return true;
 }
 
-void StratumSession::handleLine(const string &line) {
+void StratumSession::handleLine(const string &line, const MiningSubmit *submit) {
   DLOG(INFO) << "recv(" << line.size() << "): " << line;
 
+  if (submit != nullptr) {
+    submit->getIdStr(idStrBuf_);
+    handleRequest_Submit(idStrBuf_, *submit);
+    return;
+  }
+
   JsonNode jnode;
   if (!JsonNode::parse(line.data(), line.data() + line.size(), jnode)) {
     LOG(ERROR) << "decode line fail, not a json string";
@@ -351,6 +735,15 @@ void StratumSession::handleLine(const string &line) {
 }
 
 void StratumSession::responseError(const string &idStr, int errCode) {
+  if (isBinary_) {
+    BinaryStratum::Result result;
+    result.error_ = (uint8_t)errCode;
+    string s;
+    BinaryStratum::encode(result, s);
+    sendData(s);
+    return;
+  }
+
   //
   // {"id": 10, "result": null, "error":[21, "Job not found", null]}
   //
@@ -363,6 +756,10 @@ void StratumSession::responseError(const string &idStr, int errCode) {
 }
 
 void StratumSession::responseTrue(const string &idStr) {
+  if (isBinary_) {
+    responseError(idStr, StratumError::NO_ERROR);
+    return;
+  }
   const string s = "{\"id\":" + idStr + ",\"result\":true,\"error\":null}\n";
   sendData(s);
 }
@@ -371,13 +768,19 @@ void StratumSession::handleRequest(const string &idStr, const string &method,
                                    const JsonNode &jparams) {
   if (method == "mining.submit") {  // most of requests are 'mining.submit'
     handleRequest_Submit(idStr, jparams);
+    return;
   }
-  else if (method == "mining.subscribe") {
+
+  // other requests wait for the pending shares, see handleMessage()
+  if (method == "mining.subscribe") {
     handleRequest_Subscribe(idStr, jparams);
   }
   else if (method == "mining.authorize") {
     handleRequest_Authorize(idStr, jparams);
   }
+  else if (method == "mining.configure") {
+    handleRequest_Configure(idStr, jparams);
+  }
   else if (method == "mining.multi_version") {
     handleRequest_MultiVersion(idStr, jparams);
   }
@@ -389,7 +792,7 @@ void StratumSession::handleRequest(const string &idStr, const string &method,
   } else {
     // unrecognised method, just ignore it
     LOG(WARNING) << "unrecognised method: \"" << method << "\""
-    << ", client: " << clientIp_ << "/" << clientAgent_;
+    << ", client: " << getClientIp() << "/" << clientAgent_;
   }
 }
 
@@ -401,6 +804,60 @@ void StratumSession::handleRequest_MultiVersion(const string &idStr,
 //  sendData(s);
 }
 
+void StratumSession::handleRequest_Configure(const string &idStr,
+                                             const JsonNode &jparams) {
+  //
+  // BIP310, only the extension "version-rolling" is supported:
+  //   {"id":1,"method":"mining.configure","params":[["version-rolling"],
+  //    {"version-rolling.mask":"1fffe000","version-rolling.min-bit-count":2}]}
+  // the other extensions are left out of the result, as not supported.
+  //
+  if (jparams.type() != Utilities::JS::type::Array ||
+      jparams.children()->size() < 2 ||
+      jparams.children()->at(0).type() != Utilities::JS::type::Array ||
+      jparams.children()->at(1).type() != Utilities::JS::type::Obj) {
+    responseError(idStr, StratumError::ILLEGAL_PARARMS);
+    return;
+  }
+
+  bool isVersionRolling = false;
+  for (const JsonNode &jext : jparams.children()->at(0).array()) {
+    if (jext.type() == Utilities::JS::type::Str &&
+        jext.str() == "version-rolling") {
+      isVersionRolling = true;
+    }
+  }
+  if (!isVersionRolling) {
+    const string s = "{\"id\":" + idStr + ",\"result\":{},\"error\":null}\n";
+    sendData(s);
+    return;
+  }
+
+  // the miner may leave out the mask, it's "ffffffff" then
+  JsonNode jopts = jparams.children()->at(1);
+  JsonNode jmask = jopts["version-rolling.mask"];
+  uint32_t minerMask = 0xFFFFFFFFU;
+  if (jmask.type() == Utilities::JS::type::Str) {
+    minerMask = jmask.uint32_hex();
+  }
+  versionMask_ = server_->versionMask_ & minerMask;
+
+  string s;
+  if (versionMask_ == 0) {
+    s = Strings::Format("{\"id\":%s,\"result\":{\"version-rolling\":false}"
+                        ",\"error\":null}\n", idStr.c_str());
+  } else {
+    s = Strings::Format("{\"id\":%s,\"result\":{\"version-rolling\":true"
+                        ",\"version-rolling.mask\":\"%08x\"},\"error\":null}\n",
+                        idStr.c_str(), versionMask_);
+  }
+  sendData(s);
+
+  DLOG(INFO) << "version rolling mask: " << Strings::Format("%08x", versionMask_)
+  << ", miner's: " << Strings::Format("%08x", minerMask)
+  << ", client: " << getClientIp() << "/" << clientAgent_;
+}
+
 static
 bool _isNiceHashAgent(const string &clientAgent) {
   if (clientAgent.length() < 9) {
@@ -444,8 +901,8 @@ void StratumSession::handleRequest_Subscribe(const string &idStr,
 
   state_ = SUBSCRIBED;
 
-  clientAgent_ = jparams.children()->at(0).str().substr(0, 30);  // 30 is max len
-  clientAgent_ = filterWorkerName(clientAgent_);
+  // 30 is max len
+  clientAgent_ = InternedString(filterWorkerName(jparams.children()->at(0).str().substr(0, 30)));
 
   string extraNonce1Str = jparams.children()->at(1).str().substr(0, 8);  // 8 is max len
   sscanf(extraNonce1Str.c_str(), "%x", &extraNonce1_); // convert hex to int
@@ -453,13 +910,7 @@ void StratumSession::handleRequest_Subscribe(const string &idStr,
   // receive miner's IP from stratumSwitcher
   if (jparams.children()->size() >= 3) {
     clientIpInt_ = htonl(jparams.children()->at(2).uint32());
-
-    // ipv4
-    clientIp_.resize(INET_ADDRSTRLEN);
-    struct in_addr addr;
-    addr.s_addr = clientIpInt_;
-    clientIp_ = inet_ntop(AF_INET, &addr, (char *)clientIp_.data(), (socklen_t)clientIp_.size());
-    LOG(INFO) << "client real IP: " << clientIp_;
+    LOG(INFO) << "client real IP: " << getClientIp();
   }
 
 #else
@@ -474,8 +925,8 @@ void StratumSession::handleRequest_Subscribe(const string &idStr,
   //  {"id": 1, "method": "mining.subscribe", "params": ["bfgminer/4.4.0-32-gac4e9b3", "01ad557d"]}
   //
   if (jparams.children()->size() >= 1) {
-    clientAgent_ = jparams.children()->at(0).str().substr(0, 30);  // 30 is max len
-    clientAgent_ = filterWorkerName(clientAgent_);
+    // 30 is max len
+    clientAgent_ = InternedString(filterWorkerName(jparams.children()->at(0).str().substr(0, 30)));
   }
 
 #endif // WORK_WITH_STRATUM_SWITCHER
@@ -491,21 +942,22 @@ void StratumSession::handleRequest_Subscribe(const string &idStr,
                                    idStr.c_str(), extraNonce1_, extraNonce1_, extraNonce1_, kExtraNonce2Size_);
   sendData(s);
 
-  if (clientAgent_ == "__PoolWatcher__") {
+  const string &clientAgent = clientAgent_.str();
+  if (clientAgent == "__PoolWatcher__") {
     isLongTimeout_ = true;
   }
 
   // check if it's NinceHash/x.x.x
-  if (_isNiceHashAgent(clientAgent_))
+  if (_isNiceHashAgent(clientAgent))
     isNiceHashClient_ = true;
 
   //
   // check if it's BTCAgent
   //
-  if (strncmp(clientAgent_.c_str(), BTCCOM_MINER_AGENT_PREFIX,
-              std::min(clientAgent_.length(), strlen(BTCCOM_MINER_AGENT_PREFIX))) == 0) {
-    LOG(INFO) << "agent model, client: " << clientAgent_;
-    agentSessions_ = new AgentSessions(shareAvgSeconds_, this);
+  if (strncmp(clientAgent.c_str(), BTCCOM_MINER_AGENT_PREFIX,
+              std::min(clientAgent.length(), strlen(BTCCOM_MINER_AGENT_PREFIX))) == 0) {
+    LOG(INFO) << "agent model, client: " << clientAgent;
+    agentSessions_ = new AgentSessions(shareAvgSeconds_, server_->varDiffType_, this);
 
     isLongTimeout_ = true;  // will set long timeout
   }
@@ -543,12 +995,12 @@ void StratumSession::_handleRequest_AuthorizePassword(const string &password) {
 
   // set min diff first
   if (md >= DiffController::kMinDiff_) {
-    diffController_.setMinDiff(md);
+    diffController_->setMinDiff(md);
   }
 
   // than set current diff
   if (d >= DiffController::kMinDiff_) {
-    diffController_.resetCurDiff(d);
+    diffController_->resetCurDiff(d);
   }
 }
 
@@ -571,19 +1023,71 @@ void StratumSession::handleRequest_Authorize(const string &idStr,
     return;
   }
 
+  const string fullName = jparams.children()->at(0).str();
+  string password;
   if (jparams.children()->size() > 1) {
-    const string password = jparams.children()->at(1).str();
-    if (!password.empty()) {
-      _handleRequest_AuthorizePassword(password);
-    }
+    password = jparams.children()->at(1).str();
+  }
+
+  admitAuthorize(idStr, fullName, password);
+}
+
+void StratumSession::admitAuthorize(const string &idStr, const string &fullName,
+                                    const string &password) {
+  //
+  // reconnect storm: the authorize waits for the reactor's admission, the
+  // session reads nothing else meanwhile. see Reactor::runAdmission()
+  //
+  if (!reactor_->tryAdmitAuthorize()) {
+    pendingAuthorize_ = new PendingAuthorize();
+    pendingAuthorize_->idStr_    = idStr;
+    pendingAuthorize_->fullName_ = fullName;
+    pendingAuthorize_->password_ = password;
+
+    setReadTimeout(60*10);
+    reactor_->deferAuthorize(this);
+    return;
+  }
+
+  authorize(idStr, fullName, password);
+}
+
+void StratumSession::resumeAuthorize() {
+  if (pendingAuthorize_ == nullptr) {
+    return;
+  }
+  PendingAuthorize *pending = pendingAuthorize_;
+  pendingAuthorize_ = nullptr;
+
+  authorize(pending->idStr_, pending->fullName_, pending->password_);
+  delete pending;
+
+  // messages received while it was waiting
+  readBuf();
+}
+
+void StratumSession::authorize(const string &idStr, const string &fullName,
+                               const string &password) {
+  if (!password.empty()) {
+    _handleRequest_AuthorizePassword(password);
   }
 
-  const string fullName = jparams.children()->at(0).str();
   const string userName = worker_.getUserName(fullName);
 
   const int32_t userId = server_->userInfo_->getUserId(userName);
   if (userId <= 0) {
     responseError(idStr, StratumError::INVALID_USERNAME);
+    if (server_->ipReputation_.addEvent(clientIpInt_,
+                                        IpReputation::EVENT_AUTHORIZE_FAIL,
+                                        getMonotonicTimeUs())) {
+      closeBanned();
+    }
+    return;
+  }
+  // banned since it connected, e.g. by the other sessions of the ip
+  if (server_->ipReputation_.isBanned(clientIpInt_, getMonotonicTimeUs())) {
+    responseError(idStr, StratumError::IP_BANNED);
+    closeBanned();
     return;
   }
 
@@ -594,7 +1098,7 @@ void StratumSession::handleRequest_Authorize(const string &idStr,
   // set id & names, will filter workername in this func
   worker_.setUserIDAndNames(userId, fullName);
   server_->userInfo_->addWorker(worker_.userId_, worker_.workerHashId_,
-                                worker_.workerName_, clientAgent_);
+                                worker_.workerName_, clientAgent_.str());
   DLOG(INFO) << "userId: " << worker_.userId_
   << ", wokerHashId: " << worker_.workerHashId_ << ", workerName:" << worker_.workerName_;
 
@@ -602,8 +1106,13 @@ void StratumSession::handleRequest_Authorize(const string &idStr,
   // if it's a pool watcher, set timeout to a week
   setReadTimeout(isLongTimeout_ ? 86400*7 : 60*10);
   
-  // send latest stratum job
-  sendMiningNotify(server_->jobRepository_->getLatestStratumJobEx(), true/* is first job */);
+  // send latest stratum job, or let reactor_ send it in a batch of first jobs
+  if (server_->firstJobBatchSize_ > 0) {
+    isWaitingFirstJob_ = true;
+    reactor_->addFirstJob(this);
+  } else {
+    sendMiningNotify(server_->jobRepository_->getLatestStratumJobEx(), true/* is first job */);
+  }
 
   // sent events to kafka: miner_connect
   {
@@ -618,7 +1127,7 @@ void StratumSession::handleRequest_Authorize(const string &idStr,
                                 date("%F %T").c_str(),
                                 worker_.userId_, worker_.userName_.c_str(),
                                 worker_.workerName_.c_str(),
-                                clientAgent_.c_str(), clientIp_.c_str());
+                                clientAgent_.c_str(), getClientIp().c_str());
     server_->sendCommonEvents2Kafka(eventJson);
   }
 }
@@ -635,7 +1144,7 @@ void StratumSession::handleExMessage_AuthorizeAgentWorker(const int64_t workerId
 }
 
 void StratumSession::_handleRequest_SetDifficulty(uint64_t suggestDiff) {
-  diffController_.resetCurDiff(formatDifficulty(suggestDiff));
+  diffController_->resetCurDiff(formatDifficulty(suggestDiff));
 }
 
 void StratumSession::handleRequest_SuggestTarget(const string &idStr,
@@ -662,15 +1171,24 @@ void StratumSession::handleRequest_SuggestDifficulty(const string &idStr,
   _handleRequest_SetDifficulty(jparams.children()->at(0).uint64());
 }
 
-void StratumSession::handleRequest_Submit(const string &idStr,
-                                          const JsonNode &jparams) {
+bool StratumSession::checkSubmitState(const string &idStr) {
   if (state_ != AUTHENTICATED) {
     responseError(idStr, StratumError::UNAUTHORIZED);
 
     // there must be something wrong, send reconnect command
-    const string s = "{\"id\":null,\"method\":\"client.reconnect\",\"params\":[]}\n";
-    sendData(s);
+    if (!isBinary_) {
+      const string s = "{\"id\":null,\"method\":\"client.reconnect\",\"params\":[]}\n";
+      sendData(s);
+    }
+
+    return false;
+  }
+  return true;
+}
 
+void StratumSession::handleRequest_Submit(const string &idStr,
+                                          const JsonNode &jparams) {
+  if (!checkSubmitState(idStr)) {
     return;
   }
 
@@ -679,6 +1197,7 @@ void StratumSession::handleRequest_Submit(const string &idStr,
   //  params[2] = ExtraNonce 2
   //  params[3] = nTime
   //  params[4] = nonce
+  //  params[5] = version bits, optional (BIP310)
   if (jparams.children()->size() < 5) {
     responseError(idStr, StratumError::ILLEGAL_PARARMS);
     return;
@@ -693,9 +1212,38 @@ void StratumSession::handleRequest_Submit(const string &idStr,
   const uint64_t extraNonce2 = jparams.children()->at(2).uint64_hex();
   uint32_t nTime             = jparams.children()->at(3).uint32_hex();
   const uint32_t nonce       = jparams.children()->at(4).uint32_hex();
+  uint32_t versionBits = 0;
+  if (jparams.children()->size() >= 6) {
+    versionBits = jparams.children()->at(5).uint32_hex();
+  }
 
   handleRequest_Submit(idStr, shortJobId, extraNonce2, nonce, nTime,
-                       false /* not agent session */, nullptr);
+                       versionBits, false /* not agent session */, nullptr);
+}
+
+void StratumSession::handleRequest_Submit(const string &idStr,
+                                          const MiningSubmit &submit) {
+  if (!checkSubmitState(idStr)) {
+    return;
+  }
+
+  // the same conversions as JsonNode's
+  uint8_t shortJobId;
+  if (isNiceHashClient_) {
+    shortJobId = (uint8_t)(strtoull(submit.params_[1], nullptr, 10) % 10);
+  } else {
+    shortJobId = (uint8_t)(uint32_t)strtoul(submit.params_[1], nullptr, 10);
+  }
+  const uint64_t extraNonce2 = strtoull(submit.params_[2], nullptr, 16);
+  uint32_t nTime             = (uint32_t)strtoul(submit.params_[3], nullptr, 16);
+  const uint32_t nonce       = (uint32_t)strtoul(submit.params_[4], nullptr, 16);
+  uint32_t versionBits = 0;
+  if (submit.params_[5] != nullptr) {
+    versionBits = (uint32_t)strtoul(submit.params_[5], nullptr, 16);
+  }
+
+  handleRequest_Submit(idStr, shortJobId, extraNonce2, nonce, nTime,
+                       versionBits, false /* not agent session */, nullptr);
 }
 
 void StratumSession::handleRequest_Submit(const string &idStr,
@@ -703,8 +1251,14 @@ void StratumSession::handleRequest_Submit(const string &idStr,
                                           const uint64_t extraNonce2,
                                           const uint32_t nonce,
                                           uint32_t nTime,
+                                          const uint32_t versionBits,
                                           bool isAgentSession,
                                           DiffController *sessionDiffController) {
+  ShareTrace &trace = reactor_->getShareTrace();
+  if (trace.isTraced()) {
+    trace.parsedTime_ = getMonotonicTimeUs();
+  }
+
   //
   // if share is from agent session, we don't need to send reply json
   //
@@ -713,14 +1267,18 @@ void StratumSession::handleRequest_Submit(const string &idStr,
     return;
   }
 
-  const string extraNonce2Hex = Strings::Format("%016llx", extraNonce2);
-  assert(extraNonce2Hex.length()/2 == kExtraNonce2Size_);
-
   LocalJob *localJob = findLocalJob(shortJobId);
   if (localJob == nullptr) {
     // if can't find localJob, could do nothing
     if (isAgentSession == false)
-    	responseError(idStr, StratumError::JOB_NOT_FOUND);
+    	rejectSubmit(idStr, nullptr, StratumError::JOB_NOT_FOUND, false, nullptr);
+    return;
+  }
+
+  // only the bits of the negotiated mask may be rolled
+  if ((versionBits & ~versionMask_) != 0) {
+    if (isAgentSession == false)
+    	rejectSubmit(idStr, nullptr, StratumError::ILLEGAL_VERMASK, false, nullptr);
     return;
   }
 
@@ -753,61 +1311,207 @@ void StratumSession::handleRequest_Submit(const string &idStr,
     }
 
     // reset to agent session's diff
-    if (localJob->agentSessionsDiff2Exp_.size() < (size_t)sessionId + 1) {
+    if (localJob->agentSessionsDiff2Exp_ == nullptr) {
       LOG(ERROR) << "can't find agent session's diff, sessionId: " << sessionId;
       return;
     }
-    share.share_ = (uint64_t)exp2(localJob->agentSessionsDiff2Exp_[sessionId]);
+    share.share_ = (uint64_t)exp2(localJob->agentSessionsDiff2Exp_->getDiff2Exp(sessionId));
   }
 
   // calc jobTarget
-  uint256 jobTarget;
-  DiffToTarget(share.share_, jobTarget);
-
-  // we send share to kafka by default, but if there are lots of invalid
-  // shares in a short time, we just drop them.
-  bool isSendShareToKafka = true;
+  const uint256 &jobTarget = shareCheckCache_.getJobTarget(share.share_);
 
   int submitResult;
-  LocalShare localShare(extraNonce2, nonce, nTime);
-
-  // can't find local share
-  if (!localJob->addLocalShare(localShare)) {
-    if (isAgentSession == false)
-      responseError(idStr, StratumError::DUPLICATE_SHARE);
-
-    // add invalid share to counter
-    invalidSharesCounter_.insert((int64_t)time(nullptr), 1);
+  LocalShare localShare(extraNonce2, nonce, nTime, versionBits);
 
-    goto finish;
+  if (localJob->isLocalSharesFull()) {
+    // too many shares for one job, the miner should work on a new one
+    submitResult = StratumError::JOB_NOT_FOUND;
   }
+  // can't find local share
+  else if (!localJob->addLocalShare(localShare) ||
+           isSubmittedToOtherLocalJob(*localJob, localShare)) {
+    submitResult = StratumError::DUPLICATE_SHARE;
+  } else {
+    if (localJob->isLocalSharesFull()) {
+      LOG(WARNING) << "local shares of job " << localJob->jobId_ << " are full"
+      << ", later shares are stale, ip: " << getClientIp()
+      << ", worker: " << worker_.getFullName();
+    }
 
 #ifdef  USER_DEFINED_COINBASE
-  // check block header
-  submitResult = server_->checkShare(share, extraNonce1_, extraNonce2Hex,
-                                     nTime, nonce, jobTarget,
-                                     worker_.fullName_,
-                                     &localJob->userCoinbaseInfo_);
+    string *userCoinbaseInfo = &localJob->userCoinbaseInfo_;
 #else
-  // check block header
-  submitResult = server_->checkShare(share, extraNonce1_, extraNonce2Hex,
-                                     nTime, nonce, jobTarget,
-                                     worker_.fullName_);
+    string *userCoinbaseInfo = nullptr;
 #endif
+    shared_ptr<StratumJobEx> exJobPtr;
+    CoinbasePrefix *coinbasePrefix = shareCheckCache_.getCoinbasePrefix(localJob);
+    submitResult = server_->prepareShare(share, extraNonce1_, nTime,
+                                         coinbasePrefix, &exJobPtr,
+                                         userCoinbaseInfo);
+    if (submitResult == StratumError::NO_ERROR) {
+      //
+      // the block header will be hashed with other shares of the reactor,
+      // finishPendingShare() will be called then.
+      //
+      PendingShare pendingShare;
+      pendingShare.session_        = this;
+      pendingShare.idStr_          = idStr;
+      pendingShare.result_         = StratumError::NO_ERROR;
+      pendingShare.hasShare_       = true;
+      pendingShare.share_          = share;
+      pendingShare.isAgentSession_ = isAgentSession;
+      pendingShare.sessionDiffController_ = sessionDiffController;
+      pendingShare.extraNonce1_    = extraNonce1_;
+      pendingShare.extraNonce2_    = extraNonce2;
+      pendingShare.nTime_          = nTime;
+      pendingShare.nonce_          = nonce;
+      pendingShare.versionMask_    = versionMask_;
+      pendingShare.versionBits_    = versionBits;
+      pendingShare.jobTarget_      = jobTarget;
+      pendingShare.exJobPtr_       = exJobPtr;
+      pendingShare.coinbasePrefix_ = coinbasePrefix->midstate_;
+#ifdef  USER_DEFINED_COINBASE
+      pendingShare.userCoinbaseInfo_ = localJob->userCoinbaseInfo_;
+#endif
+      if (trace.isTraced()) {
+        pendingShare.trace_ = trace;
+        pendingShare.trace_.preparedTime_ = getMonotonicTimeUs();
+        trace.reset();  // one share per message
+      }
+      pendingSharesNum_++;
+      reactor_->addPendingShare(pendingShare);
+      return;
+    }
+  }
 
-  if (submitResult == StratumError::NO_ERROR) {
-    // accepted share
-    share.result_ = Share::Result::ACCEPT;
+  rejectSubmit(idStr, &share, submitResult, isAgentSession, sessionDiffController);
+}
 
-    // agent miner's diff controller
-    if (isAgentSession && sessionDiffController != nullptr) {
-      sessionDiffController->addAcceptedShare(share.share_);
+void StratumSession::rejectSubmit(const string &idStr, Share *share,
+                                  const int submitResult, bool isAgentSession,
+                                  DiffController *sessionDiffController) {
+  // the result is known now, but the previous shares should be answered first.
+  // agent sessions have no response
+  if (finishPendingShares() || isAgentSession) {
+    if (share != nullptr) {
+      finishSubmit(idStr, *share, submitResult, isAgentSession,
+                   sessionDiffController);
+    } else if (!isAgentSession) {
+      responseError(idStr, submitResult);
     }
+    return;
+  }
 
-    if (isAgentSession == false) {
-    	diffController_.addAcceptedShare(share.share_);
-      responseTrue(idStr);
-    }
+  // they are still being verified, see Reactor::finishVerifiedShares()
+  PendingShare pendingShare;
+  pendingShare.session_        = this;
+  pendingShare.idStr_          = idStr;
+  pendingShare.result_         = submitResult;
+  pendingShare.hasShare_       = (share != nullptr);
+  if (share != nullptr) {
+    pendingShare.share_        = *share;
+  }
+  pendingShare.isAgentSession_ = false;
+  pendingShare.sessionDiffController_ = nullptr;
+  pendingSharesNum_++;
+  reactor_->addPendingShare(pendingShare);
+}
+
+void StratumSession::finishPendingShare(PendingShare &pendingShare,
+                                        const ShareHashItem *item) {
+  assert(pendingSharesNum_ > 0);
+  pendingSharesNum_--;
+
+  if (item == nullptr) {
+    // rejected before hashing
+    if (pendingShare.hasShare_) {
+      finishSubmit(pendingShare.idStr_, pendingShare.share_,
+                   pendingShare.result_, pendingShare.isAgentSession_,
+                   pendingShare.sessionDiffController_);
+    } else {
+      responseError(pendingShare.idStr_, pendingShare.result_);
+    }
+  } else {
+    finishVerifiedShare(pendingShare, *item);
+  }
+
+  // the messages received after the shares
+  if (pendingSharesNum_ == 0 && isWaitingShares_) {
+    isWaitingShares_ = false;
+    if (!isDead()) {
+      readBuf();
+    }
+  }
+}
+
+void StratumSession::finishVerifiedShare(PendingShare &pendingShare,
+                                         const ShareHashItem &item) {
+  CBlockHeader header;
+  memcpy((uint8_t *)&header, item.header_, sizeof(item.header_));
+
+#ifdef  USER_DEFINED_COINBASE
+  string *userCoinbaseInfo = &pendingShare.userCoinbaseInfo_;
+#else
+  string *userCoinbaseInfo = nullptr;
+#endif
+  const ShareTrace &trace = pendingShare.trace_;
+  const int64_t checkTime = trace.isTraced() ? getMonotonicTimeUs() : 0;
+  const int submitResult = server_->finishShare(pendingShare.share_,
+                                                pendingShare.extraNonce1_,
+                                                pendingShare.extraNonce2_,
+                                                pendingShare.exJobPtr_,
+                                                header, item.hash_,
+                                                pendingShare.jobTarget_,
+                                                worker_, userCoinbaseInfo);
+  const int64_t checkedTime = trace.isTraced() ? getMonotonicTimeUs() : 0;
+  finishSubmit(pendingShare.idStr_, pendingShare.share_, submitResult,
+               pendingShare.isAgentSession_,
+               pendingShare.sessionDiffController_);
+
+  if (trace.isTraced()) {
+    server_->shareLatency_.recordTrace(trace, checkTime, checkedTime,
+                                       getMonotonicTimeUs(),
+                                       worker_.getFullName());
+  }
+}
+
+void StratumSession::flushPendingShares() {
+  if (pendingSharesNum_ > 0) {
+    reactor_->flushShares();
+  }
+}
+
+bool StratumSession::finishPendingShares() {
+  flushPendingShares();
+  return pendingSharesNum_ == 0;
+}
+
+void StratumSession::finishSubmit(const string &idStr, Share &share,
+                                  const int submitResult, bool isAgentSession,
+                                  DiffController *sessionDiffController) {
+  // we send share to kafka by default, but if there are lots of invalid
+  // shares in a short time, we just drop them.
+  bool isSendShareToKafka = true;
+
+  if (submitResult == StratumError::NO_ERROR) {
+    // accepted share
+    share.result_ = Share::Result::ACCEPT;
+
+    // agent miner's diff controller, the new diff is sent with the next job
+    if (isAgentSession && sessionDiffController != nullptr) {
+      sessionDiffController->addAcceptedShare(share.share_, getMonotonicTimeUs());
+    }
+
+    if (isAgentSession == false) {
+      const bool isRetarget =
+        diffController_->addAcceptedShare(share.share_, getMonotonicTimeUs());
+      responseTrue(idStr);
+
+      if (isRetarget) {
+        sendRetargetJob();
+      }
+    }
   } else {
     // reject share
     if (isAgentSession == false)
@@ -815,10 +1519,19 @@ void StratumSession::handleRequest_Submit(const string &idStr,
 
     // add invalid share to counter
     invalidSharesCounter_.insert((int64_t)time(nullptr), 1);
-  }
 
+    //
+    // the stale shares of a new block are not abuse. an agent's shares are
+    // of many miners behind it, the agent isn't banned for one of them
+    //
+    if (submitResult != StratumError::JOB_NOT_FOUND && !isAgentSession &&
+        server_->ipReputation_.addEvent(clientIpInt_,
+                                        IpReputation::EVENT_INVALID_SHARE,
+                                        getMonotonicTimeUs())) {
+      closeBanned();
+    }
+  }
 
-finish:
   DLOG(INFO) << share.toString();
 
   // check if thers is invalid share spamming
@@ -832,28 +1545,67 @@ finish:
       LOG(WARNING) << "invalid share spamming, diff: "
       << share.share_ << ", uid: " << worker_.userId_
       << ", uname: \""  << worker_.userName_ << "\", agent: \""
-      << clientAgent_ << "\", ip: " << clientIp_;
+      << clientAgent_ << "\", ip: " << getClientIp();
     }
   }
 
   if (isSendShareToKafka) {
-  	server_->sendShare2Kafka((const uint8_t *)&share, sizeof(Share));
+    reactor_->addShareLog(share);
   }
-  return;
 }
 
 StratumSession::LocalJob *StratumSession::findLocalJob(uint8_t shortJobId) {
-  for (auto rit = localJobs_.rbegin(); rit != localJobs_.rend(); ++rit) {
-    if (rit->shortJobId_ == shortJobId) {
-      return &(*rit);
+  if (shortJobId >= kMaxNumLocalJobs_ || localJobs_[shortJobId].jobId_ == 0) {
+    return nullptr;
+  }
+  return &localJobs_[shortJobId];
+}
+
+const StratumSession::LocalJob *StratumSession::getLatestLocalJob() const {
+  if (shortJobIdIdx_ == 0) {
+    return nullptr;
+  }
+  return &localJobs_[shortJobIdIdx_ - 1];
+}
+
+bool StratumSession::isSubmittedToOtherLocalJob(const LocalJob &localJob,
+                                                const LocalShare &localShare) const {
+  for (const LocalJob &ljob : localJobs_) {
+    if (&ljob != &localJob && ljob.jobId_ == localJob.jobId_ &&
+        ljob.submitShares_.contains(localShare)) {
+      return true;
     }
   }
-  return nullptr;
+  return false;
+}
+
+void StratumSession::sendRetargetJob() {
+  //
+  // the new diff is bound to a new local job: the latest stratum job is sent
+  // again with clean_jobs false, shares of the previous local jobs are still
+  // checked with their own diff.
+  //
+  shared_ptr<StratumJobEx> exJobPtr = server_->jobRepository_->getLatestStratumJobEx();
+  const LocalJob *latestJob = getLatestLocalJob();
+  if (exJobPtr == nullptr || latestJob == nullptr ||
+      latestJob->jobId_ != exJobPtr->sjob_->jobId_) {
+    return;  // a new job is on the way, it has the new diff
+  }
+  sendMiningNotify(exJobPtr, false, true/* is retarget */);
 }
 
 void StratumSession::sendSetDifficulty(const uint64_t difficulty) {
   string s;
-  if (!server_->isDevModeEnable_) {
+  if (isBinary_) {
+    // no fraction in binary, the difficulty of dev mode is at least 1
+    BinaryStratum::SetDiff setDiff;
+    setDiff.difficulty_ = difficulty;
+    if (server_->isDevModeEnable_) {
+      setDiff.difficulty_ = (uint64_t)std::max(1.0f, server_->minerDifficulty_);
+    }
+    BinaryStratum::encode(setDiff, s);
+  }
+  else if (!server_->isDevModeEnable_) {
     s = Strings::Format("{\"id\":null,\"method\":\"mining.set_difficulty\""
                          ",\"params\":[%" PRIu64"]}\n",
                          difficulty);
@@ -868,24 +1620,47 @@ void StratumSession::sendSetDifficulty(const uint64_t difficulty) {
 
 uint8_t StratumSession::allocShortJobId() {
   // return range: [0, 9]
-  if (shortJobIdIdx_ >= 10) {
+  if (shortJobIdIdx_ >= kMaxNumLocalJobs_) {
     shortJobIdIdx_ = 0;
   }
   return shortJobIdIdx_++;
 }
 
-void StratumSession::sendMiningNotify(shared_ptr<StratumJobEx> exJobPtr, bool isFirstJob) {
+void StratumSession::sendFirstJob(shared_ptr<StratumJobEx> exJobPtr) {
+  if (!isWaitingFirstJob_) {
+    return;
+  }
+  isWaitingFirstJob_ = false;
+  sendMiningNotify(exJobPtr, true/* is first job */);
+}
+
+void StratumSession::sendMiningNotify(shared_ptr<StratumJobEx> exJobPtr,
+                                      bool isFirstJob, bool isRetarget) {
   if (state_ < AUTHENTICATED || exJobPtr == nullptr) {
     return;
   }
+  // the first job queued in reactor_ is the latest one when it's sent
+  if (isWaitingFirstJob_ && !isFirstJob) {
+    return;
+  }
+  // the miner has the job of a retarget already, it must keep its work. a
+  // notify removed by reclaimOutput() is replaced by this one, it's sent as
+  // clean if the removed one was
+  bool isClean = isFirstJob || (exJobPtr->isClean_ && !isRetarget);
+  if (server_->outputHighWater_ > 0 && !reclaimOutput(&isClean)) {
+    return;
+  }
   StratumJob *sjob = exJobPtr->sjob_;
 
-  localJobs_.push_back(LocalJob());
-  LocalJob &ljob = *(localJobs_.rbegin());
+  // the new job takes the slot of the oldest one
+  const uint8_t shortJobId = allocShortJobId();
+  LocalJob &ljob = localJobs_[shortJobId];
+  ljob = LocalJob();
+  shareCheckCache_.invalidate(&ljob);
   ljob.blkBits_       = sjob->nBits_;
   ljob.jobId_         = sjob->jobId_;
-  ljob.shortJobId_    = allocShortJobId();
-  ljob.jobDifficulty_ = diffController_.calcCurDiff();
+  ljob.shortJobId_    = shortJobId;
+  ljob.jobDifficulty_ = diffController_->calcCurDiff(getMonotonicTimeUs());
 
 #ifdef USER_DEFINED_COINBASE
   // add the User's coinbaseInfo to the coinbase1's tail
@@ -895,12 +1670,13 @@ void StratumSession::sendMiningNotify(shared_ptr<StratumJobEx> exJobPtr, bool is
 
   if (agentSessions_ != nullptr)
   {
-    // calc diff and save to ljob
-    agentSessions_->calcSessionsJobDiff(ljob.agentSessionsDiff2Exp_);
+    // calc diff and save to ljob, it's shared with the previous job if
+    // nothing changed
+    ljob.agentSessionsDiff2Exp_ = agentSessions_->calcSessionsJobDiff();
 
     // get ex-message
     string exMessage;
-    agentSessions_->getSessionsChangedDiff(ljob.agentSessionsDiff2Exp_, exMessage);
+    agentSessions_->getSessionsChangedDiff(*ljob.agentSessionsDiff2Exp_, exMessage);
     if (exMessage.size())
     	sendData(exMessage);
   }
@@ -911,74 +1687,226 @@ void StratumSession::sendMiningNotify(shared_ptr<StratumJobEx> exJobPtr, bool is
     currDiff_ = ljob.jobDifficulty_;
   }
 
-  string notifyStr;
-  notifyStr.reserve(2048);
+  // the responses of the pending shares go before the notify
+  flushPendingShares();
+  const uint32_t notifyStart = outputBytes_;
 
-  // notify1
-  notifyStr.append(exJobPtr->miningNotify1_);
+  if (isBinary_) {
+    sendBinaryNotify(exJobPtr, ljob, isClean);
+  } else {
+    sendJsonNotify(exJobPtr, ljob, isClean);
+  }
 
+  lastNotifyStart_   = notifyStart;
+  lastNotifyLen_     = outputBytes_ - notifyStart;
+  isLastNotifyClean_ = isClean;
+}
+
+void StratumSession::sendJsonNotify(shared_ptr<StratumJobEx> exJobPtr,
+                                    const LocalJob &ljob, bool isClean) {
   // jobId
+  char jobIdStr[24];
   if (isNiceHashClient_) {
     //
     // we need to send unique JobID to NiceHash Client, they have problems with
     // short Job ID
     //
     const uint64_t niceHashJobId = (uint64_t)time(nullptr) * 10 + ljob.shortJobId_;
-    notifyStr.append(Strings::Format("% " PRIu64"", niceHashJobId));
+    snprintf(jobIdStr, sizeof(jobIdStr), "%" PRIu64, niceHashJobId);
   } else {
-    notifyStr.append(Strings::Format("%u", ljob.shortJobId_));  // short jobId
+    snprintf(jobIdStr, sizeof(jobIdStr), "%u", ljob.shortJobId_);  // short jobId
   }
 
+#ifdef USER_DEFINED_COINBASE
+  //
+  // coinbase1 is different for every user, can't share the payload
+  //
+  string notifyStr;
+  notifyStr.reserve(2048);
+
+  // notify1
+  notifyStr.append(exJobPtr->miningNotify1_);
+  notifyStr.append(jobIdStr);
+
   // notify2
   notifyStr.append(exJobPtr->miningNotify2_);
 
   string coinbase1 = exJobPtr->coinbase1_;
-
-#ifdef USER_DEFINED_COINBASE
   string userCoinbaseHex;
   Bin2Hex((const uint8_t *)ljob.userCoinbaseInfo_.c_str(), ljob.userCoinbaseInfo_.size(), userCoinbaseHex);
   // replace the last `userCoinbaseHex.size()` bytes to `userCoinbaseHex`
   coinbase1.replace(coinbase1.size()-userCoinbaseHex.size(), userCoinbaseHex.size(), userCoinbaseHex);
-#endif
 
   // coinbase1
   notifyStr.append(coinbase1);
 
   // notify3
-  if (isFirstJob)
+  if (isClean)
   	notifyStr.append(exJobPtr->miningNotify3Clean_);
   else
     notifyStr.append(exJobPtr->miningNotify3_);
 
   sendData(notifyStr);  // send notify string
+#else
+  //
+  // only the jobId is written, the rest are shared by reference
+  //
+  sendSharedData(exJobPtr->notifyHead_, jobIdStr, strlen(jobIdStr),
+                 isClean ? exJobPtr->notifyTailClean_ : exJobPtr->notifyTail_);
+#endif
+}
 
-  // clear localJobs_
-  while (localJobs_.size() >= kMaxNumLocalJobs_) {
-    localJobs_.pop_front();
+void StratumSession::sendBinaryNotify(shared_ptr<StratumJobEx> exJobPtr,
+                                      const LocalJob &ljob, bool isClean) {
+#ifdef USER_DEFINED_COINBASE
+  //
+  // coinbase1 is different for every user, can't share the payload
+  //
+  StratumJob *sjob = exJobPtr->sjob_;
+  BinaryStratum::Notify notify;
+  notify.shortJobId_ = ljob.shortJobId_;
+  notify.isClean_    = isClean;
+  notify.prevHash_   = sjob->prevHash_;
+  notify.nVersion_   = sjob->nVersion_;
+  notify.nBits_      = sjob->nBits_;
+  notify.nTime_      = sjob->nTime_;
+  notify.coinbase1_.assign(exJobPtr->coinbase1Bin_.begin(),
+                           exJobPtr->coinbase1Bin_.end());
+  // replace the last `userCoinbaseInfo_.size()` bytes to `userCoinbaseInfo_`
+  if (ljob.userCoinbaseInfo_.size() > 0 &&
+      ljob.userCoinbaseInfo_.size() <= notify.coinbase1_.size()) {
+    notify.coinbase1_.replace(notify.coinbase1_.size() - ljob.userCoinbaseInfo_.size(),
+                              ljob.userCoinbaseInfo_.size(), ljob.userCoinbaseInfo_);
+  }
+  notify.coinbase2_.assign(exJobPtr->coinbase2Bin_.begin(),
+                           exJobPtr->coinbase2Bin_.end());
+  notify.merkleBranch_ = sjob->merkleBranch_;
+
+  string notifyStr;
+  if (BinaryStratum::encode(notify, notifyStr)) {
+    sendData(notifyStr);
+  }
+#else
+  if (exJobPtr->binNotifyHead_ == nullptr) {
+    return;  // too large, it's logged when the job was made
   }
+  //
+  // only the short job id & clean are written, the rest are shared
+  //
+  const char sessionPart[BinaryStratum::kNotifySessionSize_] = {
+    (char)ljob.shortJobId_, (char)(isClean ? 1 : 0)
+  };
+  sendSharedData(exJobPtr->binNotifyHead_, sessionPart, sizeof(sessionPart),
+                 exJobPtr->binNotifyTail_);
+#endif
 }
 
 void StratumSession::sendData(const char *data, size_t len) {
+  // keep the order of responses, the submitted shares may be still pending.
+  // with ShareVerifier they are only sent to it, the responses of requests
+  // are still in order but a notify may be sent before the shares' results
+  flushPendingShares();
+
   // add data to a bufferevent’s output buffer
   // it is automatically locked so we don't need to lock
   bufferevent_write(bev_, data, len);
+  outputBytes_ += (uint32_t)len;
 //  DLOG(INFO) << "send(" << len << "): " << data;
 }
 
+void StratumSession::sendSharedData(SharedPayload *head,
+                                    const char *data, size_t len,
+                                    SharedPayload *tail) {
+  flushPendingShares();
+
+  // lock the bufferevent, the three parts must be contiguous
+  bufferevent_lock(bev_);
+  struct evbuffer *output = bufferevent_get_output(bev_);
+  if (!head->addToEvbuffer(output)) {
+    evbuffer_add(output, head->data(), head->size());
+  }
+  evbuffer_add(output, data, len);
+  if (!tail->addToEvbuffer(output)) {
+    evbuffer_add(output, tail->data(), tail->size());
+  }
+  bufferevent_unlock(bev_);
+  outputBytes_ += (uint32_t)(head->size() + len + tail->size());
+}
+
+bool StratumSession::reclaimOutput(bool *isClean) {
+  bufferevent_lock(bev_);
+  struct evbuffer *output = bufferevent_get_output(bev_);
+  size_t outputLen = evbuffer_get_length(output);
+  if (outputLen <= (size_t)server_->outputHighWater_) {
+    bufferevent_unlock(bev_);
+    overHighWaterJobs_ = 0;
+    return true;
+  }
+  // unfrozen while it's edited, see saveState()
+  evbuffer_unfreeze(output, 1);
+
+  //
+  // the bytes before the output were written to the socket already. the
+  // notify is kept if a part of it is gone, a miner can't use the rest.
+  //
+  if (lastNotifyLen_ > 0) {
+    const uint32_t writtenBytes = outputBytes_ - (uint32_t)outputLen;
+    const uint32_t pos = lastNotifyStart_ - writtenBytes;
+    if ((size_t)pos + lastNotifyLen_ <= outputLen &&
+        removeEvbufferRange(output, pos, lastNotifyLen_)) {
+      outputBytes_ -= lastNotifyLen_;
+      outputLen    -= lastNotifyLen_;
+      server_->outputDroppedBytes_ += lastNotifyLen_;
+      *isClean = *isClean || isLastNotifyClean_;
+    }
+    lastNotifyLen_ = 0;
+  }
+
+  if (outputLen <= (size_t)server_->outputHighWater_) {
+    evbuffer_freeze(output, 1);
+    bufferevent_unlock(bev_);
+    overHighWaterJobs_ = 0;
+    return true;
+  }
+  if (++overHighWaterJobs_ < server_->outputEvictJobs_) {
+    evbuffer_freeze(output, 1);
+    bufferevent_unlock(bev_);
+    return true;
+  }
+
+  // the queued data is released now, the session is deleted by reactor_
+  evbuffer_drain(output, outputLen);
+  evbuffer_freeze(output, 1);
+  bufferevent_disable(bev_, EV_READ|EV_WRITE);
+  bufferevent_unlock(bev_);
+  server_->outputEvictedSessions_++;
+  LOG(INFO) << "evict stratum session, output is over "
+  << server_->outputHighWater_ << " bytes for " << (int32_t)overHighWaterJobs_
+  << " jobs, ip: " << getClientIp() << ", name: \"" << worker_.getFullName() << "\"";
+  markAsDead();
+  return false;
+}
+
 // if read a message (ex-message or stratum) success should return true,
 // otherwise return false.
 bool StratumSession::handleMessage() {
+  // keep the order of the requests, the authorize is handled first
+  if (pendingAuthorize_ != nullptr) {
+    return false;
+  }
+
   //
   // handle ex-message
   //
-  const size_t evBufLen = evbuffer_get_length(inBuf_);
+  struct evbuffer *inBuf = getInBuf();
+  const size_t evBufLen = evbuffer_get_length(inBuf);
 
   // no matter what kind of messages, length should at least 4 bytes
   if (evBufLen < 4)
     return false;
 
   uint8_t buf[4];
-  evbuffer_copyout(inBuf_, buf, 4);
+  evbuffer_copyout(inBuf, buf, 4);
 
   // handle ex-message
   if (buf[0] == CMD_MAGIC_NUMBER) {
@@ -1001,13 +1929,46 @@ bool StratumSession::handleMessage() {
     if (evBufLen < exMessageLen)  // didn't received the whole message yet
       return false;
 
+    // the shares are pipelined, other messages wait for them: the responses
+    // keep the order and the agent's diff controllers are not changed
+    const bool isSubmit = (buf[1] == CMD_SUBMIT_SHARE ||
+                           buf[1] == CMD_SUBMIT_SHARE_WITH_TIME ||
+                           buf[1] == CMD_BIN_SUBMIT);
+    if (!isSubmit && !finishPendingShares()) {
+      isWaitingShares_ = true;  // read again by finishPendingShare()
+      return false;
+    }
+
     // copies and removes the first datlen bytes from the front of buf
-    // into the memory at data
-    string exMessage;
+    // into the memory at data. the buffer is reused, like the lines'
+    string &exMessage = lineBuf_;
     exMessage.resize(exMessageLen);
-    evbuffer_remove(inBuf_, (uint8_t *)exMessage.data(), exMessage.size());
+    evbuffer_remove(inBuf, (uint8_t *)exMessage.data(), exMessage.size());
+    if (reactor_->isTracing()) {
+      reactor_->beginShareTrace(isSubmit, getMonotonicTimeUs());
+    }
+
+    // the binary stratum is chosen by the first message, see BinaryStratum
+    if (buf[1] == CMD_BIN_SUBSCRIBE && state_ == CONNECTED) {
+      isBinary_ = true;
+    }
+    if (!isBinary_ && buf[1] >= CMD_BIN_SUBSCRIBE && buf[1] <= CMD_BIN_NOTIFY) {
+      LOG(ERROR) << "received binary stratum message in a json session, type: "
+      << std::hex << (int)buf[1] << ", client: " << getClientIp();
+      return true;
+    }
 
     switch (buf[1]) {
+      case CMD_BIN_SUBMIT:
+        handleBinMessage_Submit(&exMessage);
+        break;
+      case CMD_BIN_SUBSCRIBE:
+        handleBinMessage_Subscribe(&exMessage);
+        break;
+      case CMD_BIN_AUTHORIZE:
+        handleBinMessage_Authorize(&exMessage);
+        break;
+
       case CMD_SUBMIT_SHARE:
         handleExMessage_SubmitShare(&exMessage);
         break;
@@ -1029,24 +1990,55 @@ bool StratumSession::handleMessage() {
     return true;  // read message success, return true
   }
 
+  // no json lines in binary, drop the garbage
+  if (isBinary_) {
+    LOG(ERROR) << "received invalid binary stratum message, client: "
+    << getClientIp();
+    evbuffer_drain(inBuf, evBufLen);
+    return false;
+  }
+
   //
   // handle stratum message
   //
-  string line;
-  if (tryReadLine(line)) {
-    handleLine(line);
-    return true;
+  // the buffer is reused, it's not allocated for every line
+  if (!tryPeekLine(lineBuf_)) {
+    return false;  // read mesasge failure
+  }
+  const int64_t lineTime = reactor_->isTracing() ? getMonotonicTimeUs() : 0;
+
+  // most of the lines are mining.submit, try the fast path first. other
+  // requests wait for the pending shares, like the ex-messages
+  MiningSubmit submit;
+  const bool isSubmit = submit.parse(lineBuf_.data(),
+                                     lineBuf_.data() + lineBuf_.size());
+  if (!isSubmit && !finishPendingShares()) {
+    isWaitingShares_ = true;  // read again by finishPendingShare()
+    return false;
+  }
+  evbuffer_drain(inBuf, lineBuf_.size());
+  if (lineTime != 0) {
+    reactor_->beginShareTrace(isSubmit, lineTime);
   }
 
-  return false;  // read mesasge failure
+  handleLine(lineBuf_, isSubmit ? &submit : nullptr);
+  return true;
 }
 
-void StratumSession::readBuf(struct evbuffer *buf) {
-  // moves all data from src to the end of dst
-  evbuffer_add_buffer(inBuf_, buf);
+void StratumSession::readBuf() {
+  // messages are read from the input of bev_, the rest is kept there
+  while (!isDead() && handleMessage()) {
+  }
+}
 
-  while (handleMessage()) {
+void StratumSession::closeBanned() {
+  if (isDead()) {
+    return;
   }
+  LOG(INFO) << "ip is banned, close stratum session, ip: " << getClientIp()
+  << ", name: \"" << worker_.getFullName() << "\"";
+  bufferevent_disable(bev_, EV_READ);
+  markAsDead();
 }
 
 void StratumSession::handleExMessage_RegisterWorker(const string *exMessage) {
@@ -1079,34 +2071,390 @@ void StratumSession::handleExMessage_UnRegisterWorker(const string *exMessage) {
   agentSessions_->handleExMessage_UnRegisterWorker(exMessage);
 }
 
+void StratumSession::handleBinMessage_Subscribe(const string *binMessage) {
+  BinaryStratum::Subscribe request;
+  BinaryStratum::SubscribeResult result;
+  result.error_           = StratumError::NO_ERROR;
+  result.extraNonce1_     = extraNonce1_;
+  result.extraNonce2Size_ = kExtraNonce2Size_;
+  result.versionMask_     = 0;
+
+  if (state_ != CONNECTED) {
+    result.error_ = StratumError::UNKNOWN;
+  }
+  else if (!BinaryStratum::decode((const uint8_t *)binMessage->data(),
+                                  binMessage->size(), request) ||
+           request.version_ != BinaryStratum::kVersion_) {
+    result.error_ = StratumError::ILLEGAL_PARARMS;
+  }
+  else {
+#ifdef WORK_WITH_STRATUM_SWITCHER
+    // StratumSwitcher speaks json only
+    result.error_ = StratumError::ILLEGAL_METHOD;
+#else
+    state_ = SUBSCRIBED;
+    // 30 is max len
+    clientAgent_ = InternedString(filterWorkerName(request.clientAgent_.substr(0, 30)));
+    versionMask_ = server_->versionMask_ & request.versionMask_;
+    result.versionMask_ = versionMask_;
+#endif
+  }
+
+  string s;
+  BinaryStratum::encode(result, s);
+  sendData(s);
+}
+
+void StratumSession::handleBinMessage_Authorize(const string *binMessage) {
+  if (state_ != SUBSCRIBED) {
+    responseError("null", StratumError::NOT_SUBSCRIBED);
+    return;
+  }
+  BinaryStratum::Authorize request;
+  if (!BinaryStratum::decode((const uint8_t *)binMessage->data(),
+                             binMessage->size(), request)) {
+    responseError("null", StratumError::INVALID_USERNAME);
+    return;
+  }
+  admitAuthorize("null", request.fullName_, request.password_);
+}
+
+void StratumSession::handleBinMessage_Submit(const string *binMessage) {
+  if (!checkSubmitState("null")) {
+    return;
+  }
+  BinaryStratum::Submit request;
+  if (!BinaryStratum::decode((const uint8_t *)binMessage->data(),
+                             binMessage->size(), request)) {
+    rejectSubmit("null", nullptr, StratumError::ILLEGAL_PARARMS, false, nullptr);
+    return;
+  }
+  handleRequest_Submit("null", request.shortJobId_, request.extraNonce2_,
+                       request.nonce_, request.nTime_, request.versionBits_,
+                       false /* not agent session */, nullptr);
+}
+
 uint32_t StratumSession::getSessionId() const {
   return extraNonce1_;
 }
 
+// max length of a string of the state, the names are far shorter
+static const size_t kMaxStateStringLen = 4096;
+
+void StratumSession::saveState(string &state) const {
+  HandoffWriter writer(state);
+
+  writer.put(extraNonce1_);
+  writer.put((uint8_t)state_);
+  writer.put(worker_.userId_);
+  writer.put(worker_.workerHashId_);
+  writer.putString(worker_.userName_.str());
+  writer.putString(worker_.workerName_);
+  writer.putString(clientAgent_.str());
+  writer.put(clientIpInt_);
+  writer.put(versionMask_);
+  writer.put(currDiff_);
+  writer.put(isLongTimeout_);
+  writer.put(shortJobIdIdx_);
+  writer.put(isNiceHashClient_);
+  writer.put(isBinary_);
+  writer.put(isWaitingFirstJob_);
+  diffController_->saveState(writer);
+  invalidSharesCounter_.save(writer);
+
+  // the shares of the jobs are kept, a share can't be submitted twice
+  vector<LocalShare> shares;
+  for (const LocalJob &ljob : localJobs_) {
+    writer.put(ljob.jobId_);
+    writer.put(ljob.jobDifficulty_);
+    writer.put(ljob.blkBits_);
+    writer.put(ljob.shortJobId_);
+#ifdef USER_DEFINED_COINBASE
+    writer.putString(ljob.userCoinbaseInfo_);
+#endif
+    shares.clear();
+    ljob.submitShares_.getShares(shares);
+    // the set is in no order, sorted a state doesn't depend on the hash seed
+    std::sort(shares.begin(), shares.end());
+    writer.put((uint32_t)shares.size());
+    for (const LocalShare &share : shares) {
+      writer.put(share.exNonce2_);
+      writer.put(share.nonce_);
+      writer.put(share.time_);
+      writer.put(share.versionBits_);
+    }
+
+    const AgentDiffTable *table = ljob.agentSessionsDiff2Exp_.get();
+    writer.put(table != nullptr);
+    if (table != nullptr) {
+      writer.put(table->defaultDiff2Exp_);
+      writer.put((uint32_t)table->sessionIds_.size());
+      for (size_t i = 0; i < table->sessionIds_.size(); i++) {
+        writer.put(table->sessionIds_[i]);
+        writer.put(table->diff2Exps_[i]);
+      }
+    }
+  }
+
+  writer.put(pendingAuthorize_ != nullptr);
+  if (pendingAuthorize_ != nullptr) {
+    writer.putString(pendingAuthorize_->idStr_);
+    writer.putString(pendingAuthorize_->fullName_);
+    writer.putString(pendingAuthorize_->password_);
+  }
+
+  writer.put(agentSessions_ != nullptr);
+  if (agentSessions_ != nullptr) {
+    agentSessions_->saveState(writer);
+  }
+
+  // read but not handled yet, and not written to the socket yet
+  string buf;
+  struct evbuffer *input  = bufferevent_get_input(bev_);
+  struct evbuffer *output = bufferevent_get_output(bev_);
+  buf.resize(evbuffer_get_length(input));
+  evbuffer_copyout(input, (void *)buf.data(), buf.size());
+  writer.putString(buf);
+  // the start of a bufferevent's output is frozen, only it drains the output
+  bufferevent_lock(bev_);
+  evbuffer_unfreeze(output, 1);
+  buf.resize(evbuffer_get_length(output));
+  evbuffer_copyout(output, (void *)buf.data(), buf.size());
+  evbuffer_freeze(output, 1);
+  bufferevent_unlock(bev_);
+  writer.putString(buf);
+}
+
+bool StratumSession::restoreLocalJob(HandoffReader &reader, LocalJob &ljob,
+                                     shared_ptr<const AgentDiffTable> &lastDiffTable) {
+  uint32_t sharesNum = 0;
+  if (!reader.get(ljob.jobId_) || !reader.get(ljob.jobDifficulty_) ||
+      !reader.get(ljob.blkBits_) || !reader.get(ljob.shortJobId_) ||
+#ifdef USER_DEFINED_COINBASE
+      !reader.getString(ljob.userCoinbaseInfo_, kMaxStateStringLen) ||
+#endif
+      !reader.get(sharesNum) || sharesNum > LocalShareSet::kMaxShares_) {
+    return false;
+  }
+  for (uint32_t i = 0; i < sharesNum; i++) {
+    LocalShare share;
+    if (!reader.get(share.exNonce2_) || !reader.get(share.nonce_) ||
+        !reader.get(share.time_) || !reader.get(share.versionBits_)) {
+      return false;
+    }
+    ljob.addLocalShare(share);
+  }
+
+  bool hasTable = false;
+  if (!reader.get(hasTable)) {
+    return false;
+  }
+  if (!hasTable) {
+    return true;
+  }
+  uint8_t defaultDiff2Exp = 0;
+  uint32_t sessionsNum = 0;
+  if (!reader.get(defaultDiff2Exp) || !reader.get(sessionsNum) ||
+      sessionsNum > AGENT_MAX_SESSION_ID + 1) {
+    return false;
+  }
+  auto table = std::make_shared<AgentDiffTable>(defaultDiff2Exp);
+  table->sessionIds_.resize(sessionsNum);
+  table->diff2Exps_.resize(sessionsNum);
+  for (uint32_t i = 0; i < sessionsNum; i++) {
+    if (!reader.get(table->sessionIds_[i]) || !reader.get(table->diff2Exps_[i])) {
+      return false;
+    }
+  }
+  // the jobs share a table while the diffs don't change
+  if (lastDiffTable == nullptr || !lastDiffTable->isSame(*table)) {
+    lastDiffTable = table;
+  }
+  ljob.agentSessionsDiff2Exp_ = lastDiffTable;
+  return true;
+}
+
+bool StratumSession::restoreState(const string &state) {
+  HandoffReader reader((const uint8_t *)state.data(), state.size());
+
+  uint8_t st = 0;
+  string userName, agent;
+  if (!reader.get(extraNonce1_) || !reader.get(st) || st > AUTHENTICATED ||
+      !reader.get(worker_.userId_) || !reader.get(worker_.workerHashId_) ||
+      !reader.getString(userName, kMaxStateStringLen) ||
+      !reader.getString(worker_.workerName_, kMaxStateStringLen) ||
+      !reader.getString(agent, kMaxStateStringLen) ||
+      !reader.get(clientIpInt_) || !reader.get(versionMask_) ||
+      !reader.get(currDiff_) || !reader.get(isLongTimeout_) ||
+      !reader.get(shortJobIdIdx_) || shortJobIdIdx_ > kMaxNumLocalJobs_ ||
+      !reader.get(isNiceHashClient_) || !reader.get(isBinary_) ||
+      !reader.get(isWaitingFirstJob_) ||
+      !diffController_->restoreState(reader) ||
+      !invalidSharesCounter_.restore(reader)) {
+    return false;
+  }
+  state_ = (State)st;
+  worker_.userName_ = userName.empty() ? InternedString() : InternedString(userName);
+  clientAgent_      = InternedString(agent);
+
+  shared_ptr<const AgentDiffTable> lastDiffTable;
+  for (LocalJob &ljob : localJobs_) {
+    if (!restoreLocalJob(reader, ljob, lastDiffTable)) {
+      return false;
+    }
+  }
+
+  bool hasPendingAuthorize = false;
+  if (!reader.get(hasPendingAuthorize)) {
+    return false;
+  }
+  if (hasPendingAuthorize) {
+    pendingAuthorize_ = new PendingAuthorize();
+    if (!reader.getString(pendingAuthorize_->idStr_,    kMaxStateStringLen) ||
+        !reader.getString(pendingAuthorize_->fullName_, kMaxStateStringLen) ||
+        !reader.getString(pendingAuthorize_->password_, kMaxStateStringLen)) {
+      return false;
+    }
+  }
+
+  bool isAgent = false;
+  if (!reader.get(isAgent)) {
+    return false;
+  }
+  if (isAgent) {
+    agentSessions_ = new AgentSessions(shareAvgSeconds_, server_->varDiffType_, this);
+    if (!agentSessions_->restoreState(reader)) {
+      return false;
+    }
+  }
+
+  string input, output;
+  if (!reader.getString(input,  UINT32_MAX) ||
+      !reader.getString(output, UINT32_MAX) || !reader.isEnd()) {
+    return false;
+  }
+  // the end of a bufferevent's input is frozen, only it fills the input
+  struct evbuffer *inBuf = getInBuf();
+  bufferevent_lock(bev_);
+  evbuffer_unfreeze(inBuf, 0);
+  evbuffer_add(inBuf, input.data(), input.size());
+  evbuffer_freeze(inBuf, 0);
+  bufferevent_unlock(bev_);
+  if (!output.empty()) {
+    sendData(output);
+  }
+
+  if (state_ == AUTHENTICATED) {
+    setReadTimeout(isLongTimeout_ ? 86400*7 : 60*10);
+  }
+  return true;
+}
+
+void StratumSession::resumeHandoff() {
+  if (isWaitingFirstJob_) {
+    reactor_->addFirstJob(this);
+  }
+  if (pendingAuthorize_ != nullptr) {
+    reactor_->deferAuthorize(this);
+  }
+  // the messages read by the old process, the socket may not be readable
+  if (evbuffer_get_length(getInBuf()) > 0) {
+    readBuf();
+  }
+}
+
+
+//////////////////////////////// AgentDiffTable ////////////////////////////////
+uint8_t AgentDiffTable::getDiff2Exp(const uint16_t sessionId) const {
+  auto itr = std::lower_bound(sessionIds_.begin(), sessionIds_.end(), sessionId);
+  if (itr == sessionIds_.end() || *itr != sessionId) {
+    return defaultDiff2Exp_;
+  }
+  return diff2Exps_[itr - sessionIds_.begin()];
+}
+
 
 ///////////////////////////////// AgentSessions ////////////////////////////////
 AgentSessions::AgentSessions(const int32_t shareAvgSeconds,
+                             const DiffController::Type varDiffType,
                              StratumSession *stratumSession)
-:shareAvgSeconds_(shareAvgSeconds), stratumSession_(stratumSession)
+:shareAvgSeconds_(shareAvgSeconds), varDiffType_(varDiffType),
+stratumSession_(stratumSession)
 {
   kDefaultDiff2Exp_ = (uint8_t)log2(DiffController::kDefaultDiff_);
-
-  // we just pre-alloc all
-  workerIds_.resize(UINT16_MAX, 0);
-  diffControllers_.resize(UINT16_MAX, nullptr);
-  curDiff2ExpVec_.resize(UINT16_MAX, kDefaultDiff2Exp_);
 }
 
 AgentSessions::~AgentSessions() {
-  for (auto ptr : diffControllers_) {
-    if (ptr != nullptr) {
-      delete ptr;
-    }
+  for (auto &it : sessions_) {
+    delete it.second.diffController_;
+  }
+}
+
+size_t AgentSessions::getMemoryUsage() const {
+  // a node of the map is the value, three pointers and the color
+  const size_t kNodeSize = sizeof(std::pair<const uint16_t, AgentSession>) +
+                           4 * sizeof(void *);
+  size_t bytes = sizeof(*this) + sessions_.size() * kNodeSize;
+  for (const auto &it : sessions_) {
+    bytes += it.second.diffController_->getMemoryUsage();
+  }
+  if (lastDiffTable_ != nullptr) {
+    bytes += sizeof(AgentDiffTable) +
+             lastDiffTable_->sessionIds_.capacity() * sizeof(uint16_t) +
+             lastDiffTable_->diff2Exps_.capacity() * sizeof(uint8_t);
   }
+  return bytes;
 }
 
 int64_t AgentSessions::getWorkerId(const uint16_t sessionId) {
-  return workerIds_[sessionId];
+  auto itr = sessions_.find(sessionId);
+  return itr == sessions_.end() ? 0 : itr->second.workerId_;
+}
+
+DiffController *AgentSessions::getDiffController(const uint16_t sessionId) {
+  auto itr = sessions_.find(sessionId);
+  return itr == sessions_.end() ? nullptr : itr->second.diffController_;
+}
+
+void AgentSessions::saveState(HandoffWriter &writer) const {
+  writer.put((uint32_t)sessions_.size());
+  for (const auto &it : sessions_) {
+    writer.put(it.first);
+    writer.put(it.second.workerId_);
+    writer.put(it.second.curDiff2Exp_);
+    it.second.diffController_->saveState(writer);
+  }
+}
+
+bool AgentSessions::restoreState(HandoffReader &reader) {
+  uint32_t sessionsNum = 0;
+  if (!reader.get(sessionsNum) || sessionsNum > AGENT_MAX_SESSION_ID + 1) {
+    return false;
+  }
+  for (uint32_t i = 0; i < sessionsNum; i++) {
+    uint16_t sessionId = 0;
+    AgentSession session;
+    if (!reader.get(sessionId) || sessionId > AGENT_MAX_SESSION_ID ||
+        !reader.get(session.workerId_) || !reader.get(session.curDiff2Exp_)) {
+      return false;
+    }
+    session.diffController_ = DiffController::create(varDiffType_, shareAvgSeconds_);
+    removeSession(sessionId);
+    sessions_[sessionId] = session;
+    if (!session.diffController_->restoreState(reader)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void AgentSessions::removeSession(const uint16_t sessionId) {
+  auto itr = sessions_.find(sessionId);
+  if (itr == sessions_.end()) {
+    return;
+  }
+  delete itr->second.diffController_;
+  sessions_.erase(itr);
 }
 
 void AgentSessions::handleExMessage_RegisterWorker(const string *exMessage) {
@@ -1146,21 +2494,12 @@ void AgentSessions::handleExMessage_RegisterWorker(const string *exMessage) {
   << ", workerName: " << workerName << ", workerId: "
   << workerId << ", session id:" << sessionId;
 
-  // set sessionId -> workerId
-  workerIds_[sessionId] = workerId;
-
-  // deletes managed object
-  if (diffControllers_[sessionId] != nullptr) {
-    delete diffControllers_[sessionId];
-    diffControllers_[sessionId] = nullptr;
-  }
-
-  // acquires new pointer
-  assert(diffControllers_[sessionId] == nullptr);
-  diffControllers_[sessionId] = new DiffController(shareAvgSeconds_);
-
-  // set curr diff to default Diff
-  curDiff2ExpVec_[sessionId] = kDefaultDiff2Exp_;
+  // set sessionId -> workerId, a new diff controller and the default diff
+  removeSession(sessionId);
+  AgentSession &session = sessions_[sessionId];
+  session.workerId_       = workerId;
+  session.diffController_ = DiffController::create(varDiffType_, shareAvgSeconds_);
+  session.curDiff2Exp_    = kDefaultDiff2Exp_;
 
   // submit worker info to stratum session
   // ptr can't be nullptr, just make it easy for test
@@ -1201,8 +2540,9 @@ void AgentSessions::handleExMessage_SubmitShare(const string *exMessage,
   if (stratumSession_ != nullptr)
     stratumSession_->handleRequest_Submit("null", shortJobId,
                                           fullExtraNonce2, nonce, time,
+                                          0 /* no version rolling */,
                                           true /* submit by agent's miner */,
-                                          diffControllers_[sessionId]);
+                                          getDiffController(sessionId));
 }
 
 void AgentSessions::handleExMessage_UnRegisterWorker(const string *exMessage) {
@@ -1220,54 +2560,43 @@ void AgentSessions::handleExMessage_UnRegisterWorker(const string *exMessage) {
 
   DLOG(INFO) << "[agent] sessionId: " << sessionId;
 
-  // un-register worker
-  workerIds_[sessionId] = 0;
+  // un-register worker, release diff controller
+  removeSession(sessionId);
+}
 
-  // set curr diff to default Diff
-  curDiff2ExpVec_[sessionId] = kDefaultDiff2Exp_;
+shared_ptr<const AgentDiffTable> AgentSessions::calcSessionsJobDiff() {
+  auto table = std::make_shared<AgentDiffTable>(kDefaultDiff2Exp_);
+  table->sessionIds_.reserve(sessions_.size());
+  table->diff2Exps_.reserve(sessions_.size());
 
-  // release diff controller
-  if (diffControllers_[sessionId] != nullptr) {
-    delete diffControllers_[sessionId];
-    diffControllers_[sessionId] = nullptr;
+  // sessions_ is ordered by session id, agents use 2^N diffs only
+  const int64_t now = getMonotonicTimeUs();
+  for (auto &it : sessions_) {
+    const uint64_t diff = it.second.diffController_->calcCurDiff(now);
+    table->sessionIds_.push_back(it.first);
+    table->diff2Exps_.push_back((uint8_t)log2(diff));
   }
-}
 
-void AgentSessions::calcSessionsJobDiff(vector<uint8_t> &sessionsDiff2Exp) {
-  sessionsDiff2Exp.clear();
-  sessionsDiff2Exp.resize(UINT16_MAX, kDefaultDiff2Exp_);
-
-  for (size_t i = 0; i < diffControllers_.size(); i++) {
-    if (diffControllers_[i] == nullptr) {
-      continue;
-    }
-    const uint64_t diff = diffControllers_[i]->calcCurDiff();
-    sessionsDiff2Exp[i] = (uint8_t)log2(diff);
+  if (lastDiffTable_ == nullptr || !lastDiffTable_->isSame(*table)) {
+    lastDiffTable_ = table;
   }
+  return lastDiffTable_;
 }
 
-void AgentSessions::getSessionsChangedDiff(const vector<uint8_t> &sessionsDiff2Exp,
+void AgentSessions::getSessionsChangedDiff(const AgentDiffTable &sessionsDiff2Exp,
                                            string &data) {
-  vector<uint32_t> changedDiff2Exp;
-  changedDiff2Exp.resize(UINT16_MAX, 0u);
-  assert(curDiff2ExpVec_.size() == sessionsDiff2Exp.size());
-
-  // get changed diff and set to new diff
-  for (size_t i = 0; i < curDiff2ExpVec_.size(); i++) {
-    if (curDiff2ExpVec_[i] == sessionsDiff2Exp[i]) {
-      continue;
-    }
-    changedDiff2Exp[i] = sessionsDiff2Exp[i];
-    curDiff2ExpVec_[i] = sessionsDiff2Exp[i];  // set new diff
-  }
-
   // diff_2exp -> session_id | session_id | ... | session_id
   map<uint8_t, vector<uint16_t> > diffSessionIds;
-  for (uint32_t i = 0; i < changedDiff2Exp.size(); i++) {
-    if (changedDiff2Exp[i] == 0u) {
+
+  // get changed diff and set to new diff
+  for (size_t i = 0; i < sessionsDiff2Exp.sessionIds_.size(); i++) {
+    auto itr = sessions_.find(sessionsDiff2Exp.sessionIds_[i]);
+    if (itr == sessions_.end() ||
+        itr->second.curDiff2Exp_ == sessionsDiff2Exp.diff2Exps_[i]) {
       continue;
     }
-    diffSessionIds[changedDiff2Exp[i]].push_back((uint16_t)i);
+    itr->second.curDiff2Exp_ = sessionsDiff2Exp.diff2Exps_[i];  // set new diff
+    diffSessionIds[itr->second.curDiff2Exp_].push_back(itr->first);
   }
 
   getSetDiffCommand(diffSessionIds, data);
@@ -39,10 +39,10 @@
 #include "utilities_js.hpp"
 #include "Stratum.h"
 #include "Statistics.h"
+#include "Sha256Batch.h"
 
 
-#define CMD_MAGIC_NUMBER      0x7Fu
-// types
+// ex-message types of btcagent, CMD_MAGIC_NUMBER is in Stratum.h
 #define CMD_REGISTER_WORKER   0x01u             // Agent -> Pool
 #define CMD_SUBMIT_SHARE      0x02u             // Agent -> Pool, without block time
 #define CMD_SUBMIT_SHARE_WITH_TIME  0x03u       // Agent -> Pool
@@ -59,27 +59,86 @@
 #define INVALID_SHARE_SLIDING_WINDOWS_MAX_LIMIT  20  // max number
 
 class Server;
+class Reactor;
 class StratumJobEx;
+class SharedPayload;
 class DiffController;
 class StratumSession;
 class AgentSessions;
 
+///////////////////////////////// HandoffState /////////////////////////////////
+//
+// the state of a session handed over to the next sserver by hot restart, see
+// HotRestart. values are in the native byte order, both processes run on the
+// same host, and the format is versioned by HotRestart::kVersion_.
+//
+class HandoffWriter {
+  string &out_;
+
+public:
+  explicit HandoffWriter(string &out): out_(out) {}
+
+  template <typename T> void put(const T &v) {
+    out_.append((const char *)&v, sizeof(T));
+  }
+  void putString(const string &str) {
+    put((uint32_t)str.size());
+    out_.append(str);
+  }
+};
+
+class HandoffReader {
+  const uint8_t *p_;
+  const uint8_t *end_;
+
+public:
+  HandoffReader(const uint8_t *p, const size_t len): p_(p), end_(p + len) {}
+
+  // false if there is no more
+  template <typename T> bool get(T &v) {
+    if ((size_t)(end_ - p_) < sizeof(T)) {
+      return false;
+    }
+    memcpy(&v, p_, sizeof(T));
+    p_ += sizeof(T);
+    return true;
+  }
+  bool getString(string &str, const size_t maxLen) {
+    uint32_t len = 0;
+    if (!get(len) || len > maxLen || (size_t)(end_ - p_) < len) {
+      return false;
+    }
+    str.assign((const char *)p_, len);
+    p_ += len;
+    return true;
+  }
+  inline bool isEnd() const { return p_ == end_; }
+};
+
+
 //////////////////////////////// DiffController ////////////////////////////////
+//
+// vardiff of a miner. the session asks it for the difficulty of every new job
+// and feeds it the accepted shares. times are monotonic, in microseconds.
+//
 class DiffController {
 public:
+  enum Type {
+    TYPE_WINDOW = 0,  // WindowDiffController
+    TYPE_EWMA   = 1   // EwmaDiffController
+  };
+
   //
   // max diff: 2^62
   //
   // Cannot large than 2^62.
   // If `kMaxDiff_` be 2^63, user can set `minDiff_` equals 2^63,
   // then `minDiff_*2` will be zero when next difficulty decrease and
-  // DiffController::_calcCurDiff() will infinite loop.
+  // WindowDiffController::_calcCurDiff() will infinite loop.
   static const uint64 kMaxDiff_ = 4611686018427387904ull;
   // min diff
   static const uint64 kMinDiff_ = 64;
 
-  static const time_t kDiffWindow_    = 900;   // time window, seconds, 60*N
-  static const time_t kRecordSeconds_ = 10;    // every N seconds as a record
 #ifdef NDEBUG
   // If not debugging, set default to 16384
   static const uint64 kDefaultDiff_   = 16384;  // default diff, 2^N
@@ -88,18 +147,68 @@ public:
   static const uint64 kDefaultDiff_   = 128;  // default diff, 2^N
 #endif	/* NDEBUG */
 
-private:
-  time_t startTime_;  // first job send time
+protected:
   uint64  minDiff_;
   uint64  curDiff_;
   int32_t shareAvgSeconds_;
+
+  void setCurDiff(uint64 curDiff); // set current diff with bounds checking
+
+  // the state of the subclass, see saveState()
+  virtual void saveVarDiff(HandoffWriter &writer) const = 0;
+  virtual bool restoreVarDiff(HandoffReader &reader) = 0;
+
+public:
+  DiffController(const int32_t shareAvgSeconds);
+  virtual ~DiffController() {}
+
+  // "window" or "ewma"
+  static bool parseType(const string &name, Type &type);
+  static DiffController *create(const Type type, const int32_t shareAvgSeconds);
+
+  // recalc miner's diff before send an new stratum job
+  virtual uint64 calcCurDiff(const int64_t nowUs) = 0;
+
+  // we need to add every share, so we can calc worker's hashrate.
+  // return true if the diff should be changed before the next job.
+  virtual bool addAcceptedShare(const uint64 share, const int64_t nowUs) = 0;
+
+  // maybe worker has it's own min diff
+  void setMinDiff(uint64 minDiff);
+
+  // use when handle cmd: mining.suggest_difficulty & mining.suggest_target
+  virtual void resetCurDiff(uint64 curDiff) = 0;
+
+  // the state is fixed size, no allocation
+  virtual size_t getMemoryUsage() const = 0;
+  virtual Type getType() const = 0;
+
+  // hot restart, the times are monotonic and so the same in the next process.
+  // if the type is changed by sserver.vardiff, only the diff is restored
+  void saveState(HandoffWriter &writer) const;
+  bool restoreState(HandoffReader &reader);
+};
+
+
+///////////////////////////// WindowDiffController /////////////////////////////
+//
+// counts the shares in a 900 seconds window, the diff is changed by power of
+// 2 when a new job is sent.
+//
+class WindowDiffController : public DiffController {
+public:
+  static const time_t kDiffWindow_    = 900;   // time window, seconds, 60*N
+  static const time_t kRecordSeconds_ = 10;    // every N seconds as a record
+  static const int32_t kRecords_ = kDiffWindow_ / kRecordSeconds_;
+
+private:
+  time_t startTime_;  // first job send time
   int32_t curHashRateLevel_;
 
-  StatsWindow<double> sharesNum_;  // share count
-  StatsWindow<uint64> shares_;     // share
+  FixedStatsWindow<double, kRecords_> sharesNum_;  // share count
+  FixedStatsWindow<uint64, kRecords_> shares_;     // share
 
-  void setCurDiff(uint64 curDiff); // set current diff with bounds checking
-  uint64 _calcCurDiff();
+  uint64 _calcCurDiff(const time_t now);
   int adjustHashRateLevel(const double hashRateT);
   double minerCoefficient(const time_t now, const int64_t idx);
 
@@ -107,37 +216,169 @@ private:
     return now >= startTime_ + kDiffWindow_;
   }
 
+  void saveVarDiff(HandoffWriter &writer) const;
+  bool restoreVarDiff(HandoffReader &reader);
+
 public:
-  DiffController(const int32_t shareAvgSeconds) :
-  startTime_(0),
-  minDiff_(kMinDiff_), curDiff_(kDefaultDiff_), curHashRateLevel_(0),
-  sharesNum_(kDiffWindow_/kRecordSeconds_), /* every N seconds as a record */
-  shares_   (kDiffWindow_/kRecordSeconds_)
+  WindowDiffController(const int32_t shareAvgSeconds) :
+  DiffController(shareAvgSeconds),
+  startTime_(0), curHashRateLevel_(0)
   {
-    if (shareAvgSeconds >= 1 && shareAvgSeconds <= 60) {
-      shareAvgSeconds_ = shareAvgSeconds;
-    } else {
-      shareAvgSeconds_ = 8;
-    }
   }
 
-  ~DiffController() {}
+  uint64 calcCurDiff(const int64_t nowUs);
+  bool addAcceptedShare(const uint64 share, const int64_t nowUs);
+  void resetCurDiff(uint64 curDiff);
+  size_t getMemoryUsage() const { return sizeof(*this); }
+  Type getType() const { return TYPE_WINDOW; }
+};
 
-  // recalc miner's diff before send an new stratum job
-  uint64 calcCurDiff();
 
-  // we need to add every share, so we can calc worker's hashrate
-  void addAcceptedShare(const uint64 share);
+////////////////////////////// EwmaDiffController //////////////////////////////
+//
+// estimates the hashrate with exponentially decayed sums of the share diffs
+// and of the time, the time constant is kTauShares_ share intervals:
+//
+//   hashrate = sum(diff * e^(-age/tau)) / integral(e^(-age/tau))
+//
+// the estimate doesn't depend on the diff the shares were found at, so it's
+// kept across retargets and any integer diff can be used. a few shares are
+// enough to retarget, a miner far from the target doesn't wait for the next
+// job (see addAcceptedShare()).
+//
+class EwmaDiffController : public DiffController {
+public:
+  static const int32_t kTauShares_ = 16;
+  // shares since the last retarget before the next one
+  static const int32_t kMinShares_ = 4;
+
+private:
+  int64_t startUs_;          // first job send time, 0 means not started
+  int64_t workUs_;           // time of work_
+  int64_t lastShareUs_;
+  int64_t lastRetargetUs_;
+  double  work_;             // decayed sum of the share diffs
+  double  sharesNum_;        // decayed count of the shares
+  int32_t sharesSinceRetarget_;
+  uint64  retargetDiff_;     // asked by addAcceptedShare(), 0 means none
+
+  void start(const int64_t nowUs);
+  bool isSampled(const int64_t nowUs) const;
+  double getHashRate(const int64_t nowUs, const double excludedWork,
+                     double &sharesNum) const;
+  uint64 getTargetDiff(const double hashRate) const;
+  bool isOffTarget(const uint64 diff, const double sharesNum,
+                   const double minRate) const;
+
+  void saveVarDiff(HandoffWriter &writer) const;
+  bool restoreVarDiff(HandoffReader &reader);
 
-  // maybe worker has it's own min diff
-  void setMinDiff(uint64 minDiff);
+public:
+  // retarget if the target diff is off by this rate, at a job / between jobs
+  static const double kJobRetargetRate_;
+  static const double kShareRetargetRate_;
 
-  // use when handle cmd: mining.suggest_difficulty & mining.suggest_target
+  EwmaDiffController(const int32_t shareAvgSeconds);
+
+  uint64 calcCurDiff(const int64_t nowUs);
+  bool addAcceptedShare(const uint64 share, const int64_t nowUs);
   void resetCurDiff(uint64 curDiff);
+  size_t getMemoryUsage() const { return sizeof(*this); }
+  Type getType() const { return TYPE_EWMA; }
+
+  // diff per second
+  double getHashRate(const int64_t nowUs) const;
 };
 
 
 
+//////////////////////////////// CoinbasePrefix ////////////////////////////////
+//
+// SHA256 midstate of coinbase1 + extraNonce1, it's the same for all shares
+// of a session's job. see StratumJobEx::initCoinbasePrefix()
+//
+struct CoinbasePrefix {
+  bool isReady_;
+  SHA256Midstate midstate_;
+
+  CoinbasePrefix(): isReady_(false) {}
+};
+
+
+////////////////////////////////// ShareTrace //////////////////////////////////
+//
+// timestamps of a sampled share through sserver, microseconds. the share's
+// reactor starts it, see Reactor::beginShareTrace() and ShareLatency
+//
+struct ShareTrace {
+  int64_t readTime_;      // the socket is readable, 0: the share isn't traced
+  int64_t lineTime_;      // the message is read out of the input
+  int64_t parsedTime_;    // the submit's fields are parsed
+  int64_t preparedTime_;  // the jobs are looked up, queued for hashing
+  int64_t hashTime_;      // its batch starts hashing
+  int64_t hashedTime_;
+
+  ShareTrace() { reset(); }
+  void reset() {
+    readTime_ = lineTime_ = parsedTime_ = preparedTime_ = 0;
+    hashTime_ = hashedTime_ = 0;
+  }
+  inline bool isTraced() const { return readTime_ != 0; }
+};
+
+
+///////////////////////////////// PendingShare /////////////////////////////////
+//
+// a share waiting in its reactor for the batch hashing. it holds copies,
+// the session's local job may be gone when the batch is flushed.
+//
+// a submit rejected before hashing is queued too if the session's previous
+// shares are still being verified, it's answered in order then.
+//
+struct PendingShare {
+  StratumSession *session_;
+  string   idStr_;
+  int32_t  result_;    // NO_ERROR: to be hashed, otherwise rejected already
+  bool     hasShare_;  // false: only an error response, e.g. job not found
+  Share    share_;
+  bool     isAgentSession_;
+  DiffController *sessionDiffController_;
+  uint32_t extraNonce1_;
+  uint64_t extraNonce2_;
+  uint32_t nTime_;
+  uint32_t nonce_;
+  uint32_t versionMask_;  // the session's BIP310 mask
+  uint32_t versionBits_;
+  uint256  jobTarget_;
+  shared_ptr<StratumJobEx> exJobPtr_;
+  SHA256Midstate coinbasePrefix_;
+#ifdef USER_DEFINED_COINBASE
+  string   userCoinbaseInfo_;
+#endif
+  ShareTrace trace_;
+};
+
+
+//////////////////////////////// AgentDiffTable ////////////////////////////////
+//
+// job difficulties (2^N) of the agent's sessions, sorted by session id.
+// immutable once made, jobs share it while the difficulties don't change.
+//
+struct AgentDiffTable {
+  vector<uint16_t> sessionIds_;
+  vector<uint8_t>  diff2Exps_;
+  uint8_t defaultDiff2Exp_;  // sessions not in the table
+
+  explicit AgentDiffTable(const uint8_t defaultDiff2Exp):
+  defaultDiff2Exp_(defaultDiff2Exp) {}
+
+  uint8_t getDiff2Exp(const uint16_t sessionId) const;
+  bool isSame(const AgentDiffTable &r) const {
+    return sessionIds_ == r.sessionIds_ && diff2Exps_ == r.diff2Exps_;
+  }
+};
+
+
 //////////////////////////////// StratumSession ////////////////////////////////
 class StratumSession {
 public:
@@ -153,28 +394,71 @@ public:
     uint64_t exNonce2_;  // extra nonce2 fixed 8 bytes
     uint32_t nonce_;     // nonce in block header
     uint32_t time_;      // nTime in block header
+    uint32_t versionBits_;  // rolled nVersion bits (BIP310), 0 if not rolled
 
-    LocalShare(uint64_t exNonce2, uint32_t nonce, uint32_t time):
-    exNonce2_(exNonce2), nonce_(nonce), time_(time) {}
+    LocalShare(): exNonce2_(0), nonce_(0), time_(0), versionBits_(0) {}
+    LocalShare(uint64_t exNonce2, uint32_t nonce, uint32_t time,
+               uint32_t versionBits = 0):
+    exNonce2_(exNonce2), nonce_(nonce), time_(time), versionBits_(versionBits) {}
+
+    bool isZero() const {
+      return exNonce2_ == 0 && nonce_ == 0 && time_ == 0 && versionBits_ == 0;
+    }
+    bool operator==(const LocalShare &r) const {
+      return exNonce2_ == r.exNonce2_ && nonce_ == r.nonce_ && time_ == r.time_ &&
+             versionBits_ == r.versionBits_;
+    }
 
     LocalShare & operator=(const LocalShare &other) {
-      exNonce2_ = other.exNonce2_;
-      nonce_    = other.nonce_;
-      time_     = other.time_;
+      exNonce2_    = other.exNonce2_;
+      nonce_       = other.nonce_;
+      time_        = other.time_;
+      versionBits_ = other.versionBits_;
       return *this;
     }
 
     bool operator<(const LocalShare &r) const {
-      if (exNonce2_ < r.exNonce2_ ||
-          (exNonce2_ == r.exNonce2_ && nonce_ < r.nonce_) ||
-          (exNonce2_ == r.exNonce2_ && nonce_ == r.nonce_ && time_ < r.time_)) {
-        return true;
-      }
-      return false;
+      if (exNonce2_ != r.exNonce2_) { return exNonce2_ < r.exNonce2_; }
+      if (nonce_    != r.nonce_)    { return nonce_    < r.nonce_;    }
+      if (time_     != r.time_)     { return time_     < r.time_;     }
+      return versionBits_ < r.versionBits_;
+    }
+  };
+
+  //
+  // open addressing (linear probing) hash set of LocalShare. all shares are
+  // in one flat array, no allocation per share. the zero share marks empty
+  // slots, so it's kept aside in hasZero_.
+  //
+  class LocalShareSet {
+    std::unique_ptr<LocalShare[]> slots_;
+    uint32_t capacity_;  // 0 or power of 2
+    uint32_t size_;
+    bool hasZero_;
+
+    static uint64_t hash(const LocalShare &localShare);
+    void grow();
+
+  public:
+    // memory cap of a job: 64K shares, the table is at most 3 MiB
+    static const uint32_t kMaxShares_ = 65536;
+
+    LocalShareSet(): capacity_(0), size_(0), hasZero_(false) {}
+
+    // return false if it's already in the set
+    bool insert(const LocalShare &localShare);
+    bool contains(const LocalShare &localShare) const;
+
+    inline uint32_t size() const { return size_ + (hasZero_ ? 1 : 0); }
+    // all shares of the set, in no order
+    void getShares(vector<LocalShare> &shares) const;
+    inline bool isFull() const { return size() >= kMaxShares_; }
+    inline size_t memoryUsage() const {
+      return capacity_ * sizeof(LocalShare);
     }
   };
 
-  // latest stratum jobs of this session
+  // latest stratum jobs of this session, jobId_ 0 means an unused slot
   struct LocalJob {
     uint64_t jobId_;
     uint64_t jobDifficulty_;     // difficulty of this job
@@ -183,103 +467,255 @@ public:
 #ifdef USER_DEFINED_COINBASE
     string   userCoinbaseInfo_;
 #endif
-    std::set<LocalShare> submitShares_;
-    std::vector<uint8_t> agentSessionsDiff2Exp_;
+    LocalShareSet submitShares_;
+    shared_ptr<const AgentDiffTable> agentSessionsDiff2Exp_;
 
     LocalJob(): jobId_(0), jobDifficulty_(0), blkBits_(0), shortJobId_(0) {}
 
+    // return false if it's already exist
     bool addLocalShare(const LocalShare &localShare) {
-      auto itr = submitShares_.find(localShare);
-      if (itr != submitShares_.end()) {
-        return false;  // already exist
+      return submitShares_.insert(localShare);
+    }
+    bool isLocalSharesFull() const {
+      return submitShares_.isFull();
+    }
+  };
+
+  //
+  // caches for share checking. there is one per session instead of one per
+  // local job, miners almost always submit to the latest job.
+  //
+  struct ShareCheckCache {
+    const LocalJob *localJob_;  // the job of coinbasePrefix_
+    CoinbasePrefix coinbasePrefix_;
+    uint64_t jobTargetDiff_;
+    uint256  jobTarget_;
+
+    ShareCheckCache(): localJob_(nullptr), jobTargetDiff_(0) {}
+
+    CoinbasePrefix *getCoinbasePrefix(const LocalJob *localJob) {
+      if (localJob != localJob_) {
+        coinbasePrefix_.isReady_ = false;
+        localJob_ = localJob;
+      }
+      return &coinbasePrefix_;
+    }
+    const uint256 &getJobTarget(const uint64_t diff) {
+      if (diff != jobTargetDiff_) {
+        DiffToTarget(diff, jobTarget_);
+        jobTargetDiff_ = diff;
       }
-      submitShares_.insert(localShare);
-      return true;
+      return jobTarget_;
     }
+    // the slot of the job is reused
+    void invalidate(const LocalJob *localJob) {
+      if (localJob == localJob_) {
+        localJob_ = nullptr;
+      }
+    }
+  };
+
+  // mining.authorize waiting for the admission of the reactor
+  struct PendingAuthorize {
+    string idStr_;
+    string fullName_;
+    string password_;
   };
 
   //----------------------
 private:
+  //
+  // the layout is kept compact, a server holds 100K+ sessions: names are
+  // interned, local jobs are a fixed ring, the vardiff state is fixed size,
+  // and messages are read from the input buffer of bev_ directly.
+  // see getMemoryUsage().
+  //
   int32_t shareAvgSeconds_;
-  DiffController diffController_;
+  DiffController *diffController_;
   State state_;
   StratumWorker worker_;
-  string   clientAgent_;  // eg. bfgminer/4.4.0-32-gac4e9b3
-  string   clientIp_;
-  uint32_t clientIpInt_;
+  InternedString clientAgent_;  // eg. bfgminer/4.4.0-32-gac4e9b3
+  uint32_t clientIpInt_;   // ipv4, network byte order
 
   uint32_t extraNonce1_;   // MUST be unique across all servers
+  // nVersion bits the miner may roll, negotiated by mining.configure (BIP310).
+  // 0: version rolling is off
+  uint32_t versionMask_;
   static const int kExtraNonce2Size_ = 8;  // extraNonce2 size is always 8 bytes
 
   uint64_t currDiff_;
-  std::deque<LocalJob> localJobs_;
-  size_t kMaxNumLocalJobs_;
 
-  struct evbuffer *inBuf_;
+  // usually stratum job interval is 30~60 seconds, 10 is enough for miners.
+  // the short job id is the index of the ring, range: [0 ~ 9]. do NOT change it.
+  static const uint8_t kMaxNumLocalJobs_ = 10;
+  LocalJob localJobs_[kMaxNumLocalJobs_];
+  ShareCheckCache shareCheckCache_;
+
   bool   isLongTimeout_;
-  uint8_t shortJobIdIdx_;
+  uint8_t shortJobIdIdx_;  // short job id of the next job
 
   // nicehash has can't use short JobID
   bool isNiceHashClient_;
 
+  // the first message is CMD_BIN_SUBSCRIBE, see BinaryStratum
+  bool isBinary_;
+
   AgentSessions *agentSessions_;
 
   atomic<bool> isDead_;
 
   // invalid share counter
-  StatsWindow<int64_t> invalidSharesCounter_;
+  FixedStatsWindow<uint16_t, INVALID_SHARE_SLIDING_WINDOWS_SIZE> invalidSharesCounter_;
+
+  // reused by every line, avoid allocating
+  string lineBuf_;
+  string idStrBuf_;
+
+  // shares waiting in reactor_'s batch or being verified, responses must
+  // keep the order
+  uint32_t pendingSharesNum_;
+  // a message waits for the pending shares, see handleMessage()
+  bool isWaitingShares_;
+
+  // not nullptr while the authorize is deferred, messages after it wait
+  PendingAuthorize *pendingAuthorize_;
+  // authorized, the first job is queued by reactor_
+  bool isWaitingFirstJob_;
+
+  //
+  // the output of bev_ for Server::outputHighWater_, see reclaimOutput().
+  // the offsets wrap around, the output is far less than 4 GiB
+  //
+  uint32_t outputBytes_;       // written to the output so far
+  uint32_t lastNotifyStart_;   // offset of the latest notify
+  uint32_t lastNotifyLen_;     // 0: none, or it's dropped already
+  bool     isLastNotifyClean_;
+  uint8_t  overHighWaterJobs_; // jobs in a row the output was over the mark
 
   uint8_t allocShortJobId();
+  // the notify of json / BinaryStratum, called by sendMiningNotify()
+  void sendJsonNotify  (shared_ptr<StratumJobEx> exJobPtr,
+                        const LocalJob &ljob, bool isClean);
+  void sendBinaryNotify(shared_ptr<StratumJobEx> exJobPtr,
+                        const LocalJob &ljob, bool isClean);
+  // nullptr if no job is sent yet
+  const LocalJob *getLatestLocalJob() const;
 
   void setup();
   void setReadTimeout(const int32_t timeout);
+  //
+  // called before a new job if the output is over the high-water mark: the
+  // latest notify is removed if it's still queued as a whole, the new job
+  // supersedes it. *isClean is set if the removed one was clean. false if
+  // the session has been over the mark too long and is evicted.
+  //
+  bool reclaimOutput(bool *isClean);
+
+  bool restoreLocalJob(HandoffReader &reader, LocalJob &ljob,
+                       shared_ptr<const AgentDiffTable> &lastDiffTable);
 
   bool handleMessage();  // handle all messages: ex-message and stratum message
+  inline struct evbuffer *getInBuf() const { return bufferevent_get_input(bev_); }
 
   void responseError(const string &idStr, int code);
   void responseTrue(const string &idStr);
 
-  bool tryReadLine(string &line);
-  void handleLine(const string &line);
+  // the line is left in the input buffer
+  bool tryPeekLine(string &line);
+  // submit: parsed by the fast path already, or nullptr
+  void handleLine(const string &line, const MiningSubmit *submit);
   void handleRequest(const string &idStr, const string &method, const JsonNode &jparams);
 
   void handleRequest_Subscribe        (const string &idStr, const JsonNode &jparams);
   void handleRequest_Authorize        (const string &idStr, const JsonNode &jparams);
+  // the authorize may wait for the admission of reactor_
+  void admitAuthorize(const string &idStr, const string &fullName,
+                      const string &password);
+  void authorize(const string &idStr, const string &fullName,
+                 const string &password);
+  // the ip is banned by Server::ipReputation_, the replies are flushed
+  // before reactor_ deletes the session
+  void closeBanned();
   void handleRequest_Submit           (const string &idStr, const JsonNode &jparams);
+  void handleRequest_Submit           (const string &idStr, const MiningSubmit &submit);
+  bool checkSubmitState(const string &idStr);
   void handleRequest_SuggestTarget    (const string &idStr, const JsonNode &jparams);
   void handleRequest_SuggestDifficulty(const string &idStr, const JsonNode &jparams);
   void handleRequest_MultiVersion     (const string &idStr, const JsonNode &jparams);
+  void handleRequest_Configure        (const string &idStr, const JsonNode &jparams);
   void _handleRequest_SetDifficulty(uint64_t suggestDiff);
   void _handleRequest_AuthorizePassword(const string &password);
 
   LocalJob *findLocalJob(uint8_t shortJobId);
+  // the same stratum job may be sent again with a new diff
+  bool isSubmittedToOtherLocalJob(const LocalJob &localJob,
+                                  const LocalShare &localShare) const;
+  // the diff controller asks for a new diff before the next job
+  void sendRetargetJob();
+
+  void flushPendingShares();
+  // flushes the pending shares, false if they are still being verified
+  bool finishPendingShares();
+  void finishVerifiedShare(PendingShare &pendingShare, const ShareHashItem &item);
+  // the submit is rejected before hashing, share is nullptr if there is no
+  // share to finish. it's answered after the pending shares
+  void rejectSubmit(const string &idStr, Share *share, const int submitResult,
+                    bool isAgentSession, DiffController *sessionDiffController);
+  void finishSubmit(const string &idStr, Share &share, const int submitResult,
+                    bool isAgentSession, DiffController *sessionDiffController);
 
   void handleExMessage_RegisterWorker     (const string *exMessage);
   void handleExMessage_UnRegisterWorker   (const string *exMessage);
   void handleExMessage_SubmitShare        (const string *exMessage);
   void handleExMessage_SubmitShareWithTime(const string *exMessage);
 
+  void handleBinMessage_Subscribe(const string *binMessage);
+  void handleBinMessage_Authorize(const string *binMessage);
+  void handleBinMessage_Submit   (const string *binMessage);
+
 public:
   struct bufferevent* bev_;
   evutil_socket_t fd_;
   Server *server_;
+  Reactor *reactor_;  // the event loop this session belongs to
 
 public:
   StratumSession(evutil_socket_t fd, struct bufferevent *bev,
-                 Server *server, struct sockaddr *saddr,
+                 Server *server, Reactor *reactor, struct sockaddr *saddr,
                  const int32_t shareAvgSeconds, const uint32_t extraNonce1);
   ~StratumSession();
 
   void markAsDead();
   bool isDead();
 
+  string getClientIp() const;
+  inline bool isBinary() const { return isBinary_; }
+  // bytes of the session, the shared data (jobs, interned names) are not
+  // included
+  size_t getMemoryUsage() const;
+  // jobs are paced in this order, the higher first. the difficulty follows
+  // the hashrate, an agent carries many miners and goes first
+  inline uint64_t getNotifyPriority() const {
+    return agentSessions_ != nullptr ? UINT64_MAX : currDiff_;
+  }
+
   void sendSetDifficulty(const uint64_t difficulty);
-  void sendMiningNotify(shared_ptr<StratumJobEx> exJobPtr, bool isFirstJob=false);
+  // a retarget sends the latest job again with the new diff, never clean
+  void sendMiningNotify(shared_ptr<StratumJobEx> exJobPtr, bool isFirstJob=false,
+                        bool isRetarget=false);
+  // called by reactor_, see Reactor::addFirstJob()
+  void sendFirstJob(shared_ptr<StratumJobEx> exJobPtr);
+  // called by reactor_ when the deferred authorize is admitted
+  void resumeAuthorize();
   void sendData(const char *data, size_t len);
   inline void sendData(const string &str) {
     sendData(str.data(), str.size());
   }
-  void readBuf(struct evbuffer *buf);
+  // head and tail are added by reference, data is copied
+  void sendSharedData(SharedPayload *head, const char *data, size_t len,
+                      SharedPayload *tail);
+  // handle the messages in the input buffer of bev_
+  void readBuf();
 
   void handleExMessage_AuthorizeAgentWorker(const int64_t workerId,
                                             const string &clientAgent,
@@ -287,28 +723,56 @@ public:
   void handleRequest_Submit(const string &idStr,
                             const uint8_t shortJobId, const uint64_t extraNonce2,
                             const uint32_t nonce, uint32_t nTime,
+                            const uint32_t versionBits,
                             bool isAgentSession,
                             DiffController *sessionDiffController);
+  // called by reactor_ when the share's block hash is ready
+  // item is nullptr if the share was rejected before hashing
+  void finishPendingShare(PendingShare &pendingShare, const ShareHashItem *item);
+  inline bool hasPendingShares() const { return pendingSharesNum_ > 0; }
   uint32_t getSessionId() const;
+
+  //
+  // hot restart, see HotRestart. the state includes the bytes left in the
+  // input and the output, the shares must be finished before saving. a new
+  // session of the handed over socket restores it, and resumes once it's
+  // added to reactor_: the queues of reactor_ it was waiting in, and the
+  // messages read by the old process.
+  //
+  void saveState(string &state) const;
+  bool restoreState(const string &state);
+  void resumeHandoff();
 };
 
 
 ///////////////////////////////// AgentSessions ////////////////////////////////
 class AgentSessions {
+  struct AgentSession {
+    int64_t workerId_;
+    DiffController *diffController_;
+    uint8_t curDiff2Exp_;  // the diff sent to the agent
+  };
+
   //
-  // sessionId is vector's index
+  // registered sessions only, session ID range: [0, 65534]. the memory and
+  // the work of a notify depend on the number of workers behind the agent.
   //
-  // session ID range: [0, 65535], so vector max size is 65536
-  vector<int64_t> workerIds_;
-  vector<DiffController *> diffControllers_;
-  vector<uint8_t> curDiff2ExpVec_;
+  std::map<uint16_t, AgentSession> sessions_;
   int32_t shareAvgSeconds_;
+  DiffController::Type varDiffType_;
   uint8_t kDefaultDiff2Exp_;
 
+  // the table of the latest job, shared if the next one is the same
+  shared_ptr<const AgentDiffTable> lastDiffTable_;
+
   StratumSession *stratumSession_;
 
+  void removeSession(const uint16_t sessionId);
+
 public:
-  AgentSessions(const int32_t shareAvgSeconds, StratumSession *stratumSession);
+  AgentSessions(const int32_t shareAvgSeconds,
+                const DiffController::Type varDiffType,
+                StratumSession *stratumSession);
   ~AgentSessions();
 
   int64_t getWorkerId(const uint16_t sessionId);
@@ -317,8 +781,16 @@ public:
   void handleExMessage_RegisterWorker  (const string *exMessage);
   void handleExMessage_UnRegisterWorker(const string *exMessage);
 
-  void calcSessionsJobDiff(vector<uint8_t> &sessionsDiff2Exp);
-  void getSessionsChangedDiff(const vector<uint8_t> &sessionsDiff2Exp,
+  inline size_t getSessionsCount() const { return sessions_.size(); }
+  DiffController *getDiffController(const uint16_t sessionId);
+  // hot restart, see StratumSession::saveState()
+  void saveState(HandoffWriter &writer) const;
+  bool restoreState(HandoffReader &reader);
+  // bytes of the agent and its sessions
+  size_t getMemoryUsage() const;
+
+  shared_ptr<const AgentDiffTable> calcSessionsJobDiff();
+  void getSessionsChangedDiff(const AgentDiffTable &sessionsDiff2Exp,
                               string &data);
   void getSetDiffCommand(map<uint8_t, vector<uint16_t> > &diffSessionIds,
                          string &data);
@@ -288,6 +288,12 @@ void writeTime2File(const char *filename, uint32_t t) {
   fclose(fp);
 }
 
+int64_t getMonotonicTimeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 string Strings::Format(const char * fmt, ...) {
   char tmp[512];
   string dest;
@@ -326,6 +332,107 @@ void Strings::Append(string & dest, const char * fmt, ...) {
   }
 }
 
+struct InternedString::Entry {
+  const string *str_;  // the key of the pool
+  int64_t refs_;
+};
+
+namespace {
+struct InternedStringPool {
+  mutex lock_;
+  std::unordered_map<string, InternedString::Entry> entries_;
+  size_t memory_;
+
+  InternedStringPool(): memory_(0) {}
+
+  static size_t getEntryMemory(const string &str) {
+    // the node of the hash table, the string's heap and the bucket
+    const size_t heap = (str.capacity() > 15) ? str.capacity() + 1 : 0;
+    return sizeof(string) + sizeof(InternedString::Entry) + heap +
+           3 * sizeof(void *);
+  }
+};
+
+// never destroyed, sessions may be freed after the static destructors
+InternedStringPool &getInternedStringPool() {
+  static InternedStringPool *pool = new InternedStringPool();
+  return *pool;
+}
+}
+
+InternedString::InternedString(const string &str): entry_(nullptr) {
+  if (str.empty()) {
+    return;
+  }
+  InternedStringPool &pool = getInternedStringPool();
+  ScopeLock sl(pool.lock_);
+
+  auto itr = pool.entries_.find(str);
+  if (itr == pool.entries_.end()) {
+    itr = pool.entries_.insert(std::make_pair(str, Entry())).first;
+    itr->second.str_  = &itr->first;
+    itr->second.refs_ = 0;
+    pool.memory_ += InternedStringPool::getEntryMemory(itr->first);
+  }
+  entry_ = &itr->second;
+  entry_->refs_++;
+}
+
+InternedString::InternedString(const InternedString &r): entry_(r.entry_) {
+  if (entry_ != nullptr) {
+    ScopeLock sl(getInternedStringPool().lock_);
+    entry_->refs_++;
+  }
+}
+
+InternedString &InternedString::operator=(const InternedString &r) {
+  if (entry_ == r.entry_) {
+    return *this;
+  }
+  release();
+  entry_ = r.entry_;
+  if (entry_ != nullptr) {
+    ScopeLock sl(getInternedStringPool().lock_);
+    entry_->refs_++;
+  }
+  return *this;
+}
+
+void InternedString::release() {
+  if (entry_ == nullptr) {
+    return;
+  }
+  InternedStringPool &pool = getInternedStringPool();
+  ScopeLock sl(pool.lock_);
+
+  if (--entry_->refs_ == 0) {
+    pool.memory_ -= InternedStringPool::getEntryMemory(*entry_->str_);
+    pool.entries_.erase(pool.entries_.find(*entry_->str_));
+  }
+  entry_ = nullptr;
+}
+
+void InternedString::clear() {
+  release();
+}
+
+const string &InternedString::str() const {
+  static const string kEmpty;
+  return (entry_ == nullptr) ? kEmpty : *entry_->str_;
+}
+
+size_t InternedString::getEntriesNum() {
+  InternedStringPool &pool = getInternedStringPool();
+  ScopeLock sl(pool.lock_);
+  return pool.entries_.size();
+}
+
+size_t InternedString::getEntriesMemoryUsage() {
+  InternedStringPool &pool = getInternedStringPool();
+  ScopeLock sl(pool.lock_);
+  return pool.memory_ + pool.entries_.bucket_count() * sizeof(void *);
+}
+
 string score2Str(double s) {
   if (s <= 0.0) {
     return "0";
@@ -70,12 +70,53 @@ inline time_t str2time(const char *str) {
 
 void writeTime2File(const char *filename, uint32_t t);
 
+// monotonic clock, for measuring intervals only
+int64_t getMonotonicTimeUs();
+
 class Strings {
 public:
   static string Format(const char * fmt, ...);
   static void Append(string & dest, const char * fmt, ...);
 };
 
+//
+// a string shared by all of its copies, equal strings have the same entry.
+// it's for the names which are repeated in many sessions, eg. user names and
+// client agents. thread safe, an entry is freed with its last copy.
+//
+class InternedString {
+public:
+  struct Entry;  // an entry of the pool
+
+private:
+  Entry *entry_;  // nullptr is the empty string
+
+  void release();
+
+public:
+  InternedString(): entry_(nullptr) {}
+  explicit InternedString(const string &str);
+  InternedString(const InternedString &r);
+  InternedString &operator=(const InternedString &r);
+  ~InternedString() { release(); }
+
+  const string &str() const;
+  inline const char *c_str() const { return str().c_str(); }
+  inline bool empty() const { return entry_ == nullptr; }
+  void clear();
+
+  inline bool operator==(const InternedString &r) const { return entry_ == r.entry_; }
+  inline bool operator!=(const InternedString &r) const { return entry_ != r.entry_; }
+
+  // the number and the memory of the entries of all strings
+  static size_t getEntriesNum();
+  static size_t getEntriesMemoryUsage();
+};
+
+inline std::ostream &operator<<(std::ostream &os, const InternedString &s) {
+  return os << s.str();
+}
+
 string score2Str(double s);
 
 // we use G, so never overflow
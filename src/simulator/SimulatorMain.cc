@@ -121,6 +121,12 @@ int main(int argc, char **argv) {
 
     int32_t numConns = 3333;
     cfg.lookupValue("simulator.number_clients", numConns);
+    bool isStopWhenAllMining = false;
+    int32_t timeout = 0;
+    cfg.lookupValue("simulator.stop_when_all_mining", isStopWhenAllMining);
+    cfg.lookupValue("simulator.timeout", timeout);
+    bool isBinary = false;
+    cfg.lookupValue("simulator.binary", isBinary);
 
     evthread_use_pthreads();
 
@@ -129,7 +135,11 @@ int main(int argc, char **argv) {
                                         (unsigned short)port, numConns,
                                         cfg.lookup("simulator.username"),
                                         cfg.lookup("simulator.minername_prefix"));
+    gWrapper->setStopCondition(isStopWhenAllMining, timeout);
+    gWrapper->setBinaryProtocol(isBinary);
     gWrapper->run();
+    LOG(INFO) << "mining clients: " << gWrapper->getMiningNum() << "/" << numConns
+    << ", time-to-all-mining: " << gWrapper->getTimeToAllMiningMs() << "ms";
 
     delete gWrapper;
   }
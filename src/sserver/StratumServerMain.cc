@@ -139,6 +139,120 @@ int main(int argc, char **argv) {
     if (cfg.exists("sserver.share_avg_seconds")) {
     	cfg.lookupValue("sserver.share_avg_seconds", shareAvgSeconds);
     }
+    int32_t nThreads = 1;
+    cfg.lookupValue("sserver.threads", nThreads);
+    if (nThreads < 1 || nThreads > 256) {
+      LOG(FATAL) << "invalid sserver.threads, range: [1, 256]";
+      return(EXIT_FAILURE);
+    }
+    int32_t shareLogBatchSize = 1;
+    int32_t shareLogBatchMs   = 0;
+    cfg.lookupValue("sserver.share_log_batch_size", shareLogBatchSize);
+    cfg.lookupValue("sserver.share_log_batch_ms",   shareLogBatchMs);
+    if (shareLogBatchSize < 1 || shareLogBatchSize > ShareLogBatch::kMaxCount_) {
+      LOG(FATAL) << "invalid sserver.share_log_batch_size, range: [1, "
+      << ShareLogBatch::kMaxCount_ << "]";
+      return(EXIT_FAILURE);
+    }
+    if (shareLogBatchMs < 0 || shareLogBatchMs > 10000) {
+      LOG(FATAL) << "invalid sserver.share_log_batch_ms, range: [0, 10000]";
+      return(EXIT_FAILURE);
+    }
+    int32_t maxAcceptsPerSecond    = 0;
+    int32_t maxAuthorizesPerSecond = 0;
+    int32_t firstJobBatchSize      = 0;
+    cfg.lookupValue("sserver.max_accepts_per_second",    maxAcceptsPerSecond);
+    cfg.lookupValue("sserver.max_authorizes_per_second", maxAuthorizesPerSecond);
+    cfg.lookupValue("sserver.first_job_batch_size",      firstJobBatchSize);
+    if (maxAcceptsPerSecond < 0 || maxAuthorizesPerSecond < 0) {
+      LOG(FATAL) << "invalid sserver.max_accepts_per_second or "
+      << "sserver.max_authorizes_per_second, should >= 0";
+      return(EXIT_FAILURE);
+    }
+    if (firstJobBatchSize < 0) {
+      LOG(FATAL) << "invalid sserver.first_job_batch_size, should >= 0";
+      return(EXIT_FAILURE);
+    }
+    int32_t workerUpdateBatchSize = 1;
+    cfg.lookupValue("sserver.worker_update_batch_size", workerUpdateBatchSize);
+    if (workerUpdateBatchSize < 1 ||
+        workerUpdateBatchSize > (int32_t)WorkerUpdateBatch::kMaxEventSize_) {
+      LOG(FATAL) << "invalid sserver.worker_update_batch_size, range: [1, "
+      << WorkerUpdateBatch::kMaxEventSize_ << "]";
+      return(EXIT_FAILURE);
+    }
+    string varDiff = "window";
+    DiffController::Type varDiffType;
+    cfg.lookupValue("sserver.vardiff", varDiff);
+    if (!DiffController::parseType(varDiff, varDiffType)) {
+      LOG(FATAL) << "invalid sserver.vardiff: " << varDiff
+      << ", should be \"window\" or \"ewma\"";
+      return(EXIT_FAILURE);
+    }
+    string versionMaskHex = "1fffe000";
+    cfg.lookupValue("sserver.version_mask", versionMaskHex);
+    if (versionMaskHex.empty() || versionMaskHex.size() > 8 ||
+        versionMaskHex.find_first_not_of("0123456789abcdefABCDEF") != string::npos) {
+      LOG(FATAL) << "invalid sserver.version_mask: " << versionMaskHex
+      << ", should be hex, e.g. \"1fffe000\"";
+      return(EXIT_FAILURE);
+    }
+    const uint32_t versionMask = (uint32_t)strtoul(versionMaskHex.c_str(), nullptr, 16);
+    int32_t verifyThreads   = 0;
+    int32_t verifyQueueSize = 65536;
+    cfg.lookupValue("sserver.verify_threads",    verifyThreads);
+    cfg.lookupValue("sserver.verify_queue_size", verifyQueueSize);
+    if (verifyThreads < 0 || verifyThreads > 256) {
+      LOG(FATAL) << "invalid sserver.verify_threads, range: [0, 256]";
+      return(EXIT_FAILURE);
+    }
+    if (verifyQueueSize < 1) {
+      LOG(FATAL) << "invalid sserver.verify_queue_size, should >= 1";
+      return(EXIT_FAILURE);
+    }
+    int32_t notifyPacingMs = 0;
+    cfg.lookupValue("sserver.notify_pacing_ms", notifyPacingMs);
+    if (notifyPacingMs < 0 || notifyPacingMs > 20000) {
+      LOG(FATAL) << "invalid sserver.notify_pacing_ms, range: [0, 20000]";
+      return(EXIT_FAILURE);
+    }
+    int32_t outputHighWater = 0;
+    int32_t outputEvictJobs = 3;
+    cfg.lookupValue("sserver.output_high_water", outputHighWater);
+    cfg.lookupValue("sserver.output_evict_jobs", outputEvictJobs);
+    if (outputHighWater < 0) {
+      LOG(FATAL) << "invalid sserver.output_high_water, should >= 0";
+      return(EXIT_FAILURE);
+    }
+    if (outputEvictJobs < 1 || outputEvictJobs > 100) {
+      LOG(FATAL) << "invalid sserver.output_evict_jobs, range: [1, 100]";
+      return(EXIT_FAILURE);
+    }
+    int32_t shareLatencySampleRate = 0;
+    int32_t statsHttpPort = 0;
+    cfg.lookupValue("sserver.share_latency_sample_rate", shareLatencySampleRate);
+    cfg.lookupValue("sserver.stats_http_port", statsHttpPort);
+    if (shareLatencySampleRate < 0) {
+      LOG(FATAL) << "invalid sserver.share_latency_sample_rate, should >= 0";
+      return(EXIT_FAILURE);
+    }
+    if (statsHttpPort < 0 || statsHttpPort > 65535) {
+      LOG(FATAL) << "invalid sserver.stats_http_port, range: [0, 65535]";
+      return(EXIT_FAILURE);
+    }
+    string handoffSocket;
+    cfg.lookupValue("sserver.handoff_socket", handoffSocket);
+    int32_t ipBanScore = 0;
+    int32_t ipBanSeconds = 600;
+    int32_t ipBanHalfLife = 60;
+    cfg.lookupValue("sserver.ip_ban_score", ipBanScore);
+    cfg.lookupValue("sserver.ip_ban_seconds", ipBanSeconds);
+    cfg.lookupValue("sserver.ip_ban_half_life", ipBanHalfLife);
+    if (ipBanScore < 0 || ipBanSeconds <= 0 || ipBanHalfLife <= 0) {
+      LOG(FATAL) << "invalid sserver.ip_ban_score, ip_ban_seconds or "
+      << "ip_ban_half_life, should >= 0, > 0, > 0";
+      return(EXIT_FAILURE);
+    }
 
 
     bool isEnableSimulator = false;
@@ -154,6 +268,9 @@ int main(int argc, char **argv) {
     string fileLastMiningNotifyTime;
     cfg.lookupValue("sserver.file_last_notify_time", fileLastMiningNotifyTime);
 
+    string usersCacheFile;
+    cfg.lookupValue("users.cache_file", usersCacheFile);
+
     evthread_use_pthreads();
 
     // new StratumServer
@@ -161,13 +278,34 @@ int main(int argc, char **argv) {
                                        (unsigned short)port,
                                        cfg.lookup("kafka.brokers").c_str(),
                                        cfg.lookup("users.list_id_api_url"),
+                                       usersCacheFile,
                                        serverId,
                                        fileLastMiningNotifyTime,
                                        isEnableSimulator,
                                        isSubmitInvalidBlock,
                                        isDevModeEnabled,
                                        minerDifficulty,
-                                       shareAvgSeconds);
+                                       shareAvgSeconds,
+                                       nThreads,
+                                       shareLogBatchSize,
+                                       shareLogBatchMs,
+                                       maxAcceptsPerSecond,
+                                       maxAuthorizesPerSecond,
+                                       firstJobBatchSize,
+                                       workerUpdateBatchSize,
+                                       varDiffType,
+                                       versionMask,
+                                       verifyThreads,
+                                       verifyQueueSize,
+                                       notifyPacingMs,
+                                       outputHighWater,
+                                       outputEvictJobs,
+                                       shareLatencySampleRate,
+                                       statsHttpPort,
+                                       handoffSocket,
+                                       ipBanScore,
+                                       ipBanSeconds,
+                                       ipBanHalfLife);
 
     if (!gStratumServer->init()) {
       LOG(FATAL) << "init failure";
@@ -0,0 +1,173 @@
+/*
+ The MIT License (MIT)
+
+ Copyright (c) [2016] [BTC.COM]
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ */
+
+#include "gtest/gtest.h"
+#include "Common.h"
+#include "Utils.h"
+#include "Sha256Batch.h"
+
+#include <crypto/sha256.h>
+#include <hash.h>
+
+#include <glog/logging.h>
+
+static vector<SHA256Batch::Impl> getSupportedImpls() {
+  vector<SHA256Batch::Impl> impls;
+  for (int i = SHA256Batch::IMPL_SCALAR; i <= SHA256Batch::IMPL_AVX2; i++) {
+    if (SHA256Batch::isImplSupported((SHA256Batch::Impl)i)) {
+      impls.push_back((SHA256Batch::Impl)i);
+    }
+  }
+  return impls;
+}
+
+static uint256 SHA256d(const uint8_t *data, size_t len) {
+  uint256 hash;
+  uint8_t buf[CSHA256::OUTPUT_SIZE];
+  CSHA256().Write(data, len).Finalize(buf);
+  CSHA256().Write(buf, sizeof(buf)).Finalize(hash.begin());
+  return hash;
+}
+
+////////////////////////////////  SHA256Batch  /////////////////////////////////
+TEST(SHA256Batch, Midstate) {
+  const SHA256Batch::Impl defaultImpl = SHA256Batch::getImpl();
+  std::mt19937 gen(1);
+
+  for (auto impl : getSupportedImpls()) {
+    ASSERT_EQ(SHA256Batch::setImpl(impl), true);
+
+    for (size_t len = 0; len < 300; len++) {
+      vector<uint8_t> data(len);
+      for (auto &c : data) { c = (uint8_t)gen(); }
+
+      // write in two parts
+      const size_t part = (len > 0) ? gen() % len : 0;
+      SHA256Midstate midstate;
+      midstate.write(data.data(), part);
+      midstate.write(data.data() + part, len - part);
+
+      uint8_t hash1[32], hash2[32];
+      midstate.finalize(hash1);
+      CSHA256().Write(data.data(), len).Finalize(hash2);
+      ASSERT_EQ(memcmp(hash1, hash2, 32), 0) << SHA256Batch::getImplName()
+      << ", len: " << len;
+    }
+  }
+  SHA256Batch::setImpl(defaultImpl);
+}
+
+TEST(SHA256Batch, HashShares) {
+  const SHA256Batch::Impl defaultImpl = SHA256Batch::getImpl();
+  std::mt19937 gen(2);
+
+  // more than kMaxBatchSize_, and not a multiple of lanes
+  const size_t n = SHA256Batch::kMaxBatchSize_ + 13;
+  vector<vector<uint8_t> > coinbase1(n), coinbase2(n);
+  vector<vector<uint256> > branches(n);
+  vector<SHA256Midstate> prefixes(n);
+  vector<ShareHashItem> items(n);
+
+  for (size_t i = 0; i < n; i++) {
+    coinbase1[i].resize(gen() % 200);
+    coinbase2[i].resize(gen() % 300);
+    branches[i].resize(gen() % 13);
+    for (auto &c : coinbase1[i]) { c = (uint8_t)gen(); }
+    for (auto &c : coinbase2[i]) { c = (uint8_t)gen(); }
+    for (auto &step : branches[i]) {
+      for (auto itr = step.begin(); itr != step.end(); itr++) { *itr = (uint8_t)gen(); }
+    }
+    prefixes[i].write(coinbase1[i].data(), coinbase1[i].size());
+  }
+
+  for (auto impl : getSupportedImpls()) {
+    ASSERT_EQ(SHA256Batch::setImpl(impl), true);
+
+    for (size_t i = 0; i < n; i++) {
+      ShareHashItem &item = items[i];
+      item.coinbasePrefix_   = &prefixes[i];
+      item.coinbase2_        = coinbase2[i].data();
+      item.coinbase2Len_     = coinbase2[i].size();
+      item.merkleBranch_     = branches[i].data();
+      item.merkleBranchSize_ = branches[i].size();
+      for (auto &c : item.extraNonce2_) { c = (uint8_t)gen(); }
+      for (auto &c : item.header_)      { c = (uint8_t)gen(); }
+    }
+    SHA256Batch::hashShares(items.data(), n);
+
+    for (size_t i = 0; i < n; i++) {
+      const ShareHashItem &item = items[i];
+      vector<uint8_t> coinbase = coinbase1[i];
+      coinbase.insert(coinbase.end(), item.extraNonce2_, item.extraNonce2_ + 8);
+      coinbase.insert(coinbase.end(), coinbase2[i].begin(), coinbase2[i].end());
+
+      uint256 merkleRoot = SHA256d(coinbase.data(), coinbase.size());
+      for (const uint256 &step : branches[i]) {
+        merkleRoot = Hash(merkleRoot.begin(), merkleRoot.end(),
+                          step.begin(), step.end());
+      }
+      ASSERT_EQ(memcmp(item.header_ + 36, merkleRoot.begin(), 32), 0)
+      << SHA256Batch::getImplName() << ", item: " << i;
+      ASSERT_EQ(item.hash_, SHA256d(item.header_, sizeof(item.header_)))
+      << SHA256Batch::getImplName() << ", item: " << i;
+    }
+  }
+  SHA256Batch::setImpl(defaultImpl);
+}
+
+TEST(SHA256Batch, Benchmark) {
+  const SHA256Batch::Impl defaultImpl = SHA256Batch::getImpl();
+  const size_t n = 64;
+  const int32_t kRounds = 300;
+
+  // a typical job: ~100 bytes coinbase2, 11 merkle branches
+  vector<uint8_t> coinbase1(100, 0x11), coinbase2(110, 0x22);
+  vector<uint256> branch(11);
+  SHA256Midstate prefix;
+  prefix.write(coinbase1.data(), coinbase1.size());
+
+  vector<ShareHashItem> items(n);
+  for (size_t i = 0; i < n; i++) {
+    ShareHashItem &item = items[i];
+    item.coinbasePrefix_   = &prefix;
+    item.coinbase2_        = coinbase2.data();
+    item.coinbase2Len_     = coinbase2.size();
+    item.merkleBranch_     = branch.data();
+    item.merkleBranchSize_ = branch.size();
+    memset(item.extraNonce2_, (int)i, sizeof(item.extraNonce2_));
+    memset(item.header_, (int)i, sizeof(item.header_));
+  }
+
+  for (auto impl : getSupportedImpls()) {
+    SHA256Batch::setImpl(impl);
+    const int64_t begin = getMonotonicTimeUs();
+    for (int32_t r = 0; r < kRounds; r++) {
+      SHA256Batch::hashShares(items.data(), n);
+    }
+    const int64_t us = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+    LOG(INFO) << "hash shares, " << SHA256Batch::getImplName()
+    << ", shares/sec per core: " << n * kRounds * 1000000LL / us;
+  }
+  SHA256Batch::setImpl(defaultImpl);
+}
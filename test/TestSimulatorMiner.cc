@@ -223,5 +223,277 @@ TEST(SIMULATOR, miner) {
 
 }
 
+//
+// BIP310 version rolling against a running sserver with the default
+// sserver.version_mask "1fffe000" and sserver.enable_simulator
+//
+TEST(SIMULATOR, versionRolling) {
+  const char *conf = "simulator.cfg";
+  libconfig::Config cfg;
+  try
+  {
+    cfg.readFile(conf);
+  } catch(const FileIOException &fioex) {
+    std::cerr << "I/O error while reading file: " << conf << std::endl;
+    return;
+  } catch(const ParseException &pex) {
+    std::cerr << "Parse error at " << pex.getFile() << ":" << pex.getLine()
+    << " - " << pex.getError() << std::endl;
+    return;
+  }
+
+  int32_t ssPort = 3333;
+  cfg.lookupValue("simulator.ss_port", ssPort);
+  string ssHost = cfg.lookup("simulator.ss_ip");
+  string userName = cfg.lookup("simulator.username");
+
+  uint32_t nTime = time(nullptr), nNonce = time(nullptr);
+  uint64_t extraNonce2 = 0ull;
+  uint32_t versionMask = 0u;
+  string latestJobId;
+  JsonNode jnode, jresult, jparams;
+
+  string sbuf, line;
+  TCPClientWrapper conn;
+  ASSERT_TRUE(conn.connect(ssHost.c_str(), ssPort));
+
+  // req: mining.configure, the miner asks for more bits than the pool's
+  //   {"id":1,"result":{"version-rolling":true,
+  //                     "version-rolling.mask":"1fffe000"},"error":null}
+  {
+    sbuf = "{\"id\":1,\"method\":\"mining.configure\",\"params\":[[\"version-rolling\"],"
+           "{\"version-rolling.mask\":\"ffffffff\",\"version-rolling.min-bit-count\":2}]}\n";
+    conn.send(sbuf);
+    conn.getLine(line);
+    ASSERT_TRUE(JsonNode::parse(line.data(), line.data() + line.size(), jnode));
+    ASSERT_EQ(jnode["error"].type(), Utilities::JS::type::Null);
+    jresult = jnode["result"];
+    ASSERT_TRUE(jresult["version-rolling"].boolean());
+    versionMask = jresult["version-rolling.mask"].uint32_hex();
+    LOG(INFO) << "version mask: " << Strings::Format("%08x", versionMask);
+    ASSERT_NE(versionMask, 0u);
+    ASSERT_EQ(versionMask & ~0x1fffe000u, 0u);
+  }
+
+  // req: mining.subscribe & mining.authorize
+  {
+    sbuf = "{\"id\":2,\"method\":\"mining.subscribe\",\"params\":[\"__simulator__/0.1\"]}\n";
+    conn.send(sbuf);
+    conn.getLine(line);
+
+    sbuf = Strings::Format("{\"id\":3,\"method\":\"mining.authorize\","
+                           "\"params\":[\"%s.simulator_test\",\"\"]}\n",
+                           userName.c_str());
+    conn.send(sbuf);
+    conn.getLine(line);
+    ASSERT_TRUE(JsonNode::parse(line.data(), line.data() + line.size(), jnode));
+    ASSERT_TRUE(jnode["result"].boolean());
+  }
+
+  // rep: mining.set_difficulty & mining.notify
+  {
+    conn.getLine(line);
+    conn.getLine(line);
+    ASSERT_TRUE(JsonNode::parse(line.data(), line.data() + line.size(), jnode));
+    ASSERT_EQ(jnode["method"].str(), "mining.notify");
+    jparams = jnode["params"];
+    latestJobId = jparams.array()[0].str();
+  }
+
+  // req: mining.submit, rolled bits in the mask
+  {
+    sbuf = Strings::Format("{\"params\":[\"%s.simulator_test\",\"%s\",\"%016llx\",\"%08x\",\"%08x\",\"%08x\"]"
+                           ",\"id\":4,\"method\":\"mining.submit\"}\n",
+                           userName.c_str(), latestJobId.c_str(),
+                           extraNonce2, nTime, nNonce, versionMask);
+    conn.send(sbuf);
+    conn.getLine(line);
+    ASSERT_TRUE(JsonNode::parse(line.data(), line.data() + line.size(), jnode));
+    ASSERT_TRUE(jnode["result"].boolean());
+    ASSERT_EQ(jnode["error"].type(), Utilities::JS::type::Null);
+  }
+
+  // req: mining.submit, the same share with other bits is not a duplicate
+  {
+    sbuf = Strings::Format("{\"params\":[\"%s.simulator_test\",\"%s\",\"%016llx\",\"%08x\",\"%08x\",\"%08x\"]"
+                           ",\"id\":5,\"method\":\"mining.submit\"}\n",
+                           userName.c_str(), latestJobId.c_str(),
+                           extraNonce2, nTime, nNonce, 0u);
+    conn.send(sbuf);
+    conn.getLine(line);
+    ASSERT_TRUE(JsonNode::parse(line.data(), line.data() + line.size(), jnode));
+    ASSERT_TRUE(jnode["result"].boolean());
+  }
+
+  // req: mining.submit, bits out of the mask
+  //   {"id":6,"result":null,"error":[33,"Invalid version mask",null]}
+  {
+    sbuf = Strings::Format("{\"params\":[\"%s.simulator_test\",\"%s\",\"%016llx\",\"%08x\",\"%08x\",\"%08x\"]"
+                           ",\"id\":6,\"method\":\"mining.submit\"}\n",
+                           userName.c_str(), latestJobId.c_str(),
+                           ++extraNonce2, nTime, nNonce, ~versionMask);
+    conn.send(sbuf);
+    conn.getLine(line);
+    ASSERT_TRUE(JsonNode::parse(line.data(), line.data() + line.size(), jnode));
+    ASSERT_EQ(jnode["error"].type(), Utilities::JS::type::Array);
+    ASSERT_EQ(jnode["error"].array()[0].int32(), (int32_t)StratumError::ILLEGAL_VERMASK);
+  }
+}
 
 
+//
+// reconnect storm against a running sserver, e.g. with
+// sserver.max_authorizes_per_second set. skipped if simulator.storm_clients
+// is 0. 50k clients need enough ephemeral ports and `ulimit -n`.
+//
+TEST(SIMULATOR, reconnectStorm) {
+  const char *conf = "simulator.cfg";
+  libconfig::Config cfg;
+  try
+  {
+    cfg.readFile(conf);
+  } catch(const FileIOException &fioex) {
+    std::cerr << "I/O error while reading file: " << conf << std::endl;
+    return;
+  } catch(const ParseException &pex) {
+    std::cerr << "Parse error at " << pex.getFile() << ":" << pex.getLine()
+    << " - " << pex.getError() << std::endl;
+    return;
+  }
+
+  int32_t stormClients = 0;
+  cfg.lookupValue("simulator.storm_clients", stormClients);
+  if (stormClients <= 0) {
+    return;
+  }
+  int32_t ssPort = 3333;
+  int32_t timeout = 120;
+  cfg.lookupValue("simulator.ss_port", ssPort);
+  cfg.lookupValue("simulator.timeout", timeout);
+  if (timeout <= 0) {
+    timeout = 120;
+  }
+
+  StratumClientWrapper wrapper(cfg.lookup("simulator.ss_ip").c_str(),
+                               (unsigned short)ssPort, (uint32_t)stormClients,
+                               cfg.lookup("simulator.username"), "storm");
+  wrapper.setStopCondition(true, timeout);
+  wrapper.run();
+
+  LOG(INFO) << "reconnect storm, mining clients: " << wrapper.getMiningNum()
+  << "/" << stormClients << ", time-to-all-mining: "
+  << wrapper.getTimeToAllMiningMs() << "ms";
+  ASSERT_EQ(wrapper.getMiningNum(), (uint32_t)stormClients);
+  ASSERT_GE(wrapper.getTimeToAllMiningMs(), 0);
+}
+
+//
+// run it against a sserver with notify_pacing_ms = 0 and then > 0, and
+// compare the peak to average egress and the widths of the notify bursts
+//
+TEST(SIMULATOR, notifyPacing) {
+  const char *conf = "simulator.cfg";
+  libconfig::Config cfg;
+  try
+  {
+    cfg.readFile(conf);
+  } catch(const FileIOException &fioex) {
+    std::cerr << "I/O error while reading file: " << conf << std::endl;
+    return;
+  } catch(const ParseException &pex) {
+    std::cerr << "Parse error at " << pex.getFile() << ":" << pex.getLine()
+    << " - " << pex.getError() << std::endl;
+    return;
+  }
+
+  int32_t pacingClients = 0;
+  cfg.lookupValue("simulator.pacing_clients", pacingClients);
+  if (pacingClients <= 0) {
+    return;
+  }
+  int32_t ssPort = 3333;
+  int32_t seconds = 120;
+  cfg.lookupValue("simulator.ss_port", ssPort);
+  cfg.lookupValue("simulator.pacing_seconds", seconds);
+  if (seconds <= 0) {
+    seconds = 120;
+  }
+
+  StratumClientWrapper wrapper(cfg.lookup("simulator.ss_ip").c_str(),
+                               (unsigned short)ssPort, (uint32_t)pacingClients,
+                               cfg.lookup("simulator.username"), "pacing");
+  wrapper.setStopCondition(false, seconds);
+  wrapper.run();
+
+  const vector<int64_t> bursts = wrapper.getNotifyBurstsMs();
+  string widths;
+  for (const int64_t width : bursts) {
+    widths += Strings::Format("%s%" PRId64, widths.empty() ? "" : ", ", width);
+  }
+  LOG(INFO) << "notify pacing, mining clients: " << wrapper.getMiningNum()
+  << "/" << pacingClients << ", egress peak/avg per 10ms: "
+  << Strings::Format("%.2f", wrapper.getRecvPeakToAvg())
+  << ", notify bursts(ms): [" << widths << "]";
+  ASSERT_EQ(wrapper.getMiningNum(), (uint32_t)pacingClients);
+  ASSERT_GT(bursts.size(), 0u);
+}
+
+//
+// hot restart of a running sserver with sserver.handoff_socket and
+// sserver.enable_simulator: handoff_command starts the new sserver after
+// handoff_delay seconds, no client may be disconnected or see a share
+// rejected. skipped if simulator.handoff_clients is 0.
+//
+TEST(SIMULATOR, hotRestart) {
+  const char *conf = "simulator.cfg";
+  libconfig::Config cfg;
+  try
+  {
+    cfg.readFile(conf);
+  } catch(const FileIOException &fioex) {
+    std::cerr << "I/O error while reading file: " << conf << std::endl;
+    return;
+  } catch(const ParseException &pex) {
+    std::cerr << "Parse error at " << pex.getFile() << ":" << pex.getLine()
+    << " - " << pex.getError() << std::endl;
+    return;
+  }
+
+  int32_t handoffClients = 0;
+  cfg.lookupValue("simulator.handoff_clients", handoffClients);
+  if (handoffClients <= 0) {
+    return;
+  }
+  string command;
+  int32_t ssPort  = 3333;
+  int32_t delay   = 10;
+  int32_t seconds = 60;
+  cfg.lookupValue("simulator.handoff_command", command);
+  cfg.lookupValue("simulator.ss_port", ssPort);
+  cfg.lookupValue("simulator.handoff_delay", delay);
+  cfg.lookupValue("simulator.handoff_seconds", seconds);
+  ASSERT_FALSE(command.empty());
+  ASSERT_GT(seconds, delay);
+
+  StratumClientWrapper wrapper(cfg.lookup("simulator.ss_ip").c_str(),
+                               (unsigned short)ssPort, (uint32_t)handoffClients,
+                               cfg.lookup("simulator.username"), "handoff");
+  wrapper.setStopCondition(false, seconds);
+
+  int commandStatus = -1;
+  thread restart([&]() {
+    std::this_thread::sleep_for(std::chrono::seconds(delay));
+    LOG(INFO) << "hot restart: " << command;
+    commandStatus = system(command.c_str());
+  });
+  wrapper.run();
+  restart.join();
+
+  LOG(INFO) << "hot restart, mining clients: " << wrapper.getMiningNum()
+  << "/" << handoffClients << ", disconnects: " << wrapper.getDisconnectsNum()
+  << ", rejected shares: " << wrapper.getRejectsNum();
+  ASSERT_EQ(commandStatus, 0);
+  ASSERT_EQ(wrapper.getMiningNum(), (uint32_t)handoffClients);
+  ASSERT_EQ(wrapper.getDisconnectsNum(), 0u);
+  ASSERT_EQ(wrapper.getRejectsNum(), 0u);
+}
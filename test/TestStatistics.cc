@@ -25,6 +25,9 @@
 #include "gtest/gtest.h"
 #include "Common.h"
 #include "Statistics.h"
+#include "Utils.h"
+
+#include <random>
 
 
 ////////////////////////////////  StatsWindow  /////////////////////////////////
@@ -158,6 +161,362 @@ TEST(StatsWindow, map) {
 }
 
 
+// the implementation before the running sums, every sum() walks the slots
+template <typename T>
+class RefStatsWindow {
+  int64_t maxRingIdx_;
+  int32_t windowSize_;
+  std::vector<T> elements_;
+
+public:
+  RefStatsWindow(const int windowSize):
+  maxRingIdx_(-1), windowSize_(windowSize), elements_(windowSize) {}
+
+  void clear() {
+    maxRingIdx_ = -1;
+    elements_.clear();
+    elements_.resize(windowSize_);
+  }
+
+  bool insert(const int64_t curRingIdx, const T val) {
+    if (maxRingIdx_ > curRingIdx + windowSize_) {
+      return false;
+    }
+    if (maxRingIdx_ == -1 || curRingIdx - maxRingIdx_ > windowSize_) {
+      clear();
+      maxRingIdx_ = curRingIdx;
+    }
+    while (maxRingIdx_ < curRingIdx) {
+      maxRingIdx_++;
+      elements_[maxRingIdx_ % windowSize_] = 0;
+    }
+    elements_[curRingIdx % windowSize_] += val;
+    return true;
+  }
+
+  T sum(int64_t beginRingIdx, int len) {
+    T sum = 0;
+    len = std::min(len, windowSize_);
+    if (len <= 0 || beginRingIdx - len >= maxRingIdx_) {
+      return 0;
+    }
+    int64_t endRingIdx = beginRingIdx - len;
+    if (beginRingIdx > maxRingIdx_) {
+      beginRingIdx = maxRingIdx_;
+    }
+    while (beginRingIdx > endRingIdx) {
+      sum += elements_[beginRingIdx % windowSize_];
+      beginRingIdx--;
+    }
+    return sum;
+  }
+
+  void mapMultiply(const T val) {
+    for (int32_t i = 0; i < windowSize_; i++) {
+      elements_[i] *= val;
+    }
+  }
+
+  void mapDivide(const T val) {
+    for (int32_t i = 0; i < windowSize_; i++) {
+      elements_[i] /= val;
+    }
+  }
+};
+
+//
+// random inserts: in order, late, too late, gaps and jumps over the whole
+// window, then sums of every shape. values of double are small integers and
+// the scales are powers of 2, as DiffController uses them, so they are exact.
+// W is StatsWindow<T> or FixedStatsWindow<T, windowSize>.
+//
+template <typename T, typename W>
+static void compareWithRef(W &sw, const int windowSize, const uint32_t seed) {
+  std::mt19937 gen(seed);
+  RefStatsWindow<T> ref(windowSize);
+  int64_t idx = 10000;  // ring idx are never negative
+  int32_t scaleExp = 0;  // keep the values far from overflow
+
+  for (int32_t round = 0; round < 5000; round++) {
+    const uint32_t op = gen() % 100;
+    if (op < 60) {
+      idx += gen() % 3;
+    } else if (op < 62) {
+      idx += gen() % (2 * windowSize + 2);
+    }
+
+    int64_t ringIdx = idx;
+    if (op >= 62 && op < 80) {
+      ringIdx = idx - (int64_t)(gen() % (windowSize + 3));
+    }
+    const T val = (T)(gen() % 1000);
+    ASSERT_EQ(sw.insert(ringIdx, val), ref.insert(ringIdx, val));
+
+    if (op == 90 && scaleExp < 8) {
+      scaleExp++;
+      sw.mapMultiply(2);
+      ref.mapMultiply(2);
+    } else if (op == 91 && scaleExp > -8) {
+      scaleExp--;
+      sw.mapDivide(2);
+      ref.mapDivide(2);
+    } else if (op == 92 && gen() % 20 == 0) {
+      sw.mapMultiply(0);
+      ref.mapMultiply(0);
+    } else if (op == 93 && gen() % 20 == 0) {
+      sw.clear();
+      ref.clear();
+    }
+
+    for (int32_t j = 0; j < 4; j++) {
+      const int64_t begin = idx + (int64_t)(gen() % (windowSize + 3)) - windowSize;
+      const int len = (int)(gen() % (windowSize + 3)) - 1;
+      ASSERT_EQ(sw.sum(begin, len), ref.sum(begin, len));
+    }
+    ASSERT_EQ(sw.sum(idx), ref.sum(idx, windowSize));
+    ASSERT_EQ(sw.sum(idx, 60), ref.sum(idx, 60));
+  }
+}
+
+template <typename T>
+static void compareWithRef(const int windowSize, const uint32_t seed) {
+  StatsWindow<T> sw(windowSize);
+  compareWithRef<T>(sw, windowSize, seed);
+}
+
+TEST(StatsWindow, sameAsRef) {
+  for (uint32_t seed = 1; seed <= 3; seed++) {
+    compareWithRef<int64 >(5,    seed);
+    compareWithRef<int64 >(60,   seed);
+    compareWithRef<uint64>(3600, seed);
+    compareWithRef<double>(10,   seed);
+    compareWithRef<double>(900,  seed);
+  }
+}
+
+TEST(StatsWindow, lazyScale) {
+  StatsWindow<double> sw(10);
+  for (int i = 0; i < 10; i++) {
+    sw.insert(i, 1.0);
+  }
+  // far beyond the range which the scale is kept lazily
+  for (int i = 0; i < 100; i++) {
+    sw.mapMultiply(2.0);
+  }
+  ASSERT_EQ(sw.sum(9), 10.0 * pow(2.0, 100));
+  for (int i = 0; i < 100; i++) {
+    sw.mapDivide(2.0);
+  }
+  ASSERT_EQ(sw.sum(9), 10.0);
+
+  sw.mapDivide(4.0);
+  sw.insert(10, 1.0);
+  ASSERT_EQ(sw.sum(10, 1), 1.0);
+  ASSERT_EQ(sw.sum(10), 9 * 0.25 + 1.0);
+}
+
+TEST(StatsWindow, benchmark) {
+  //
+  // WorkerShares::getWorkerStatus(): a share every second, six sums
+  //
+  const int kWindow = STATS_SLIDING_WINDOW_SECONDS;
+  const int64_t kRounds = 100000;
+  const int64_t kNow = 1500000000;
+  StatsWindow<uint64> sw(kWindow), swMin(kWindow / 60);
+  RefStatsWindow<uint64> ref(kWindow), refMin(kWindow / 60);
+  uint64 total = 0, refTotal = 0;
+
+  int64_t begin = getMonotonicTimeUs();
+  for (int64_t i = 0; i < kRounds; i++) {
+    const int64_t now = kNow + i;
+    sw.insert(now, 1);
+    swMin.insert(now / 60, 1);
+    total += sw.sum(now, 60) + sw.sum(now, 300) + sw.sum(now, 900) + sw.sum(now, 3600);
+    total += swMin.sum(now / 60, 15) + swMin.sum(now / 60, 60);
+  }
+  const int64_t us = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  begin = getMonotonicTimeUs();
+  for (int64_t i = 0; i < kRounds / 100; i++) {
+    const int64_t now = kNow + i;
+    ref.insert(now, 1);
+    refMin.insert(now / 60, 1);
+    refTotal += ref.sum(now, 60) + ref.sum(now, 300) + ref.sum(now, 900) + ref.sum(now, 3600);
+    refTotal += refMin.sum(now / 60, 15) + refMin.sum(now / 60, 60);
+  }
+  const int64_t refUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+  ASSERT_GT(total, refTotal);
+
+  LOG(INFO) << "StatsWindow(" << kWindow << ") insert + 6 sums, running sums: "
+  << us * 1000 / kRounds << " ns; walking the slots: "
+  << refUs * 1000 / (kRounds / 100) << " ns";
+
+  //
+  // WindowDiffController::_calcCurDiff(): mapMultiply / mapDivide per share
+  //
+  StatsWindow<double> sharesNum(900);
+  begin = getMonotonicTimeUs();
+  for (int64_t i = 0; i < kRounds; i++) {
+    sharesNum.insert(i / 10, 1.0);
+    sharesNum.mapMultiply(2.0);
+    sharesNum.mapDivide(2.0);
+  }
+  const int64_t mapUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+  LOG(INFO) << "StatsWindow(900) insert + mapMultiply + mapDivide: "
+  << mapUs * 1000 / kRounds << " ns";
+}
+
+//////////////////////////////  FixedStatsWindow  //////////////////////////////
+TEST(FixedStatsWindow, sameAsRef) {
+  for (uint32_t seed = 1; seed <= 3; seed++) {
+    FixedStatsWindow<int64, 5> sw5;
+    compareWithRef<int64>(sw5, 5, seed);
+    FixedStatsWindow<int64, 60> sw60;
+    compareWithRef<int64>(sw60, 60, seed);
+    FixedStatsWindow<double, 90> sw90;
+    compareWithRef<double>(sw90, 90, seed);
+    FixedStatsWindow<uint64, 90> swu90;
+    compareWithRef<uint64>(swu90, 90, seed);
+    // small integers and powers of 2 are exact in float too
+    FixedStatsWindow<float, 90> swf90;
+    compareWithRef<float>(swf90, 90, seed);
+  }
+}
+
+TEST(FixedStatsWindow, size) {
+  // no allocation, the elements and the running sums are in the object
+  ASSERT_LE(sizeof(FixedStatsWindow<uint64, 90>), 24 + 2 * 91 * sizeof(uint64));
+  ASSERT_LE(sizeof(FixedStatsWindow<uint16_t, 60>), 24 + 2 * 61 * sizeof(uint16_t));
+
+  FixedStatsWindow<uint16_t, 60> sw;
+  ASSERT_EQ(sw.sum(100), 0);
+  sw.insert(100, 1);
+  sw.insert(100, 1);
+  sw.insert(130, 1);
+  ASSERT_EQ(sw.sum(130), 3);
+  ASSERT_EQ(sw.sum(159), 3);
+  ASSERT_EQ(sw.sum(160), 1);
+  sw.insert(300, 1);  // all data expired
+  ASSERT_EQ(sw.sum(300), 1);
+  ASSERT_EQ(sw.insert(200, 1), false);
+}
+
+TEST(FixedStatsWindow, lazyScale) {
+  FixedStatsWindow<double, 10> sw;
+  for (int i = 0; i < 10; i++) {
+    sw.insert(i, 1.0);
+  }
+  for (int i = 0; i < 100; i++) {
+    sw.mapMultiply(2.0);
+  }
+  ASSERT_EQ(sw.sum(9), 10.0 * pow(2.0, 100));
+  for (int i = 0; i < 100; i++) {
+    sw.mapDivide(2.0);
+  }
+  ASSERT_EQ(sw.sum(9), 10.0);
+
+  sw.mapDivide(4.0);
+  sw.insert(10, 1.0);
+  ASSERT_EQ(sw.sum(10, 1), 1.0);
+  ASSERT_EQ(sw.sum(10), 9 * 0.25 + 1.0);
+}
+
+// put(v) / get(v) of the handoff state
+struct TestSlotsIO {
+  vector<double> slots_;
+  size_t pos_ = 0;
+
+  template <typename V> void put(const V v) { slots_.push_back((double)v); }
+  template <typename V> bool get(V &v) {
+    if (pos_ >= slots_.size()) {
+      return false;
+    }
+    v = (V)slots_[pos_++];
+    return true;
+  }
+};
+
+TEST(FixedStatsWindow, saveRestore) {
+  FixedStatsWindow<double, 90> sw, sw2;
+  for (int i = 0; i < 200; i++) {
+    sw.insert(1000 + i, (double)(i % 7));
+    if (i % 50 == 0) {
+      sw.mapDivide(2.0);  // saved scaled
+    }
+  }
+  TestSlotsIO io;
+  sw.save(io);
+  ASSERT_EQ(sw2.restore(io), true);
+  for (int len = 0; len <= 90; len++) {
+    ASSERT_EQ(sw2.sum(1199, len), sw.sum(1199, len));
+  }
+  // late and new inserts after it
+  sw.insert(1150, 3.0);
+  sw2.insert(1150, 3.0);
+  sw.insert(1210, 5.0);
+  sw2.insert(1210, 5.0);
+  ASSERT_EQ(sw2.sum(1210), sw.sum(1210));
+  ASSERT_EQ(sw2.sum(1209, 30), sw.sum(1209, 30));
+
+  TestSlotsIO empty;
+  ASSERT_EQ(sw2.restore(empty), false);
+}
+
+//////////////////////////////  LatencyHistogram  //////////////////////////////
+TEST(LatencyHistogram, bucket) {
+  ASSERT_EQ(LatencyHistogram::getBucketIdx(0), 0);
+  ASSERT_EQ(LatencyHistogram::getBucketIdx(1), 1);
+  ASSERT_EQ(LatencyHistogram::getBucketIdx(2), 2);
+  ASSERT_EQ(LatencyHistogram::getBucketIdx(3), 2);
+  ASSERT_EQ(LatencyHistogram::getBucketIdx(4), 3);
+  ASSERT_EQ(LatencyHistogram::getBucketIdx(1023), 10);
+  ASSERT_EQ(LatencyHistogram::getBucketIdx(1024), 11);
+  ASSERT_EQ(LatencyHistogram::getBucketIdx(UINT64_MAX),
+            LatencyHistogram::kBuckets_ - 1);
+}
+
+TEST(LatencyHistogram, percentile) {
+  LatencyHistogram h;
+  ASSERT_EQ(h.getCount(), 0u);
+  ASSERT_EQ(h.getPercentile(0.5), 0u);
+
+  // 90 fast, 10 slow
+  for (int i = 0; i < 90; i++) {
+    h.record(100);   // bucket [64, 128)
+  }
+  for (int i = 0; i < 10; i++) {
+    h.record(5000);  // bucket [4096, 8192)
+  }
+  ASSERT_EQ(h.getCount(), 100u);
+  ASSERT_EQ(h.getMax(),  5000u);
+  ASSERT_EQ(h.getMean(), (90 * 100 + 10 * 5000) / 100u);
+  ASSERT_EQ(h.getPercentile(0.5),  127u);
+  ASSERT_EQ(h.getPercentile(0.9),  127u);
+  ASSERT_EQ(h.getPercentile(0.99), 5000u);  // bounded by max
+
+  h.reset();
+  ASSERT_EQ(h.getCount(), 0u);
+  ASSERT_EQ(h.getMax(),   0u);
+}
+
+TEST(LatencyHistogram, threads) {
+  LatencyHistogram h;
+  vector<thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.push_back(thread([&h, t]() {
+      for (int i = 0; i < 10000; i++) {
+        h.record(t * 10000 + i);
+      }
+    }));
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(h.getCount(), 40000u);
+  ASSERT_EQ(h.getMax(),   39999u);
+}
+
+
 ////////////////////////////////  ShareStatsDay  ///////////////////////////////
 TEST(ShareStatsDay, ShareStatsDay) {
 
@@ -88,6 +88,8 @@ TEST(Stratum, StratumWorker) {
   uint64_t u;
   int64_t workerId;
 
+  ASSERT_EQ(w.getFullName(), "");
+
   ASSERT_EQ(w.getUserName("abcd"), "abcd");
   ASSERT_EQ(w.getUserName("abcdabcdabcdabcdabcdabcdabcd"), "abcdabcdabcdabcdabcdabcdabcd");
   ASSERT_EQ(w.getUserName("abcd."), "abcd");
@@ -98,9 +100,9 @@ TEST(Stratum, StratumWorker) {
   // echo -n '123' |openssl dgst -sha256 -binary |openssl dgst -sha256
   //
   w.setUserIDAndNames(INT32_MAX, "abcd.123");
-  ASSERT_EQ(w.fullName_,   "abcd.123");
+  ASSERT_EQ(w.getFullName(), "abcd.123");
   ASSERT_EQ(w.userId_,     INT32_MAX);
-  ASSERT_EQ(w.userName_,   "abcd");
+  ASSERT_EQ(w.userName_.str(), "abcd");
   ASSERT_EQ(w.workerName_, "123");
   // '123' dsha256 : 5a77d1e9612d350b3734f6282259b7ff0a3f87d62cfef5f35e91a5604c0490a3
   //       uint256 : a390044c60a5915ef3f5fe2cd6873f0affb7592228f634370b352d61e9d1775a
@@ -110,9 +112,9 @@ TEST(Stratum, StratumWorker) {
 
 
   w.setUserIDAndNames(0, "abcdefg");
-  ASSERT_EQ(w.fullName_,   "abcdefg.__default__");
+  ASSERT_EQ(w.getFullName(), "abcdefg.__default__");
   ASSERT_EQ(w.userId_,     0);
-  ASSERT_EQ(w.userName_,   "abcdefg");
+  ASSERT_EQ(w.userName_.str(), "abcdefg");
   ASSERT_EQ(w.workerName_, "__default__");
   // '__default__' dsha256 : e00f302bc411fde77d954283be6904911742f2ac76c8e79abef5dff4e6a19770
   //               uint256 : 7097a1e6f4dff5be
@@ -123,17 +125,640 @@ TEST(Stratum, StratumWorker) {
   // check allow chars
   w.setUserIDAndNames(0, "abcdefg.azAZ09-._:|^/");
   ASSERT_EQ(w.workerName_, "azAZ09-._:|^/");
-  ASSERT_EQ(w.fullName_,   "abcdefg.azAZ09-._:|^/");
+  ASSERT_EQ(w.getFullName(), "abcdefg.azAZ09-._:|^/");
 
   // some of them are bad chars
   w.setUserIDAndNames(0, "abcdefg.~!@#$%^&*()+={}|[]\\<>?,./");
   ASSERT_EQ(w.workerName_, "^|./");
-  ASSERT_EQ(w.fullName_,   "abcdefg.^|./");
+  ASSERT_EQ(w.getFullName(), "abcdefg.^|./");
 
   // all bad chars
   w.setUserIDAndNames(0, "abcdefg.~!@#$%&*()+={}[]\\<>?,");
   ASSERT_EQ(w.workerName_, "__default__");
-  ASSERT_EQ(w.fullName_,   "abcdefg.__default__");
+  ASSERT_EQ(w.getFullName(), "abcdefg.__default__");
+
+  // the user name is shared by the workers of the user
+  StratumWorker w2;
+  w2.setUserIDAndNames(0, "abcdefg.w2");
+  ASSERT_TRUE(w2.userName_ == w.userName_);
+  ASSERT_EQ(w2.getFullName(), "abcdefg.w2");
+}
+
+// the fields of mining.submit as StratumSession got them from JsonNode
+struct SubmitFields {
+  string   idStr_;
+  uint32_t jobId_;
+  uint64_t extraNonce2_;
+  uint32_t nTime_;
+  uint32_t nonce_;
+  uint32_t versionBits_;
+
+  bool operator==(const SubmitFields &r) const {
+    return idStr_ == r.idStr_ && jobId_ == r.jobId_ &&
+           extraNonce2_ == r.extraNonce2_ && nTime_ == r.nTime_ &&
+           nonce_ == r.nonce_ && versionBits_ == r.versionBits_;
+  }
+};
+
+static bool getSubmitFieldsByJsonNode(const string &line, SubmitFields &f) {
+  JsonNode jnode;
+  if (!JsonNode::parse(line.data(), line.data() + line.size(), jnode)) {
+    return false;
+  }
+  JsonNode jid = jnode["id"];
+  JsonNode jmethod = jnode["method"];
+  JsonNode jparams = jnode["params"];
+
+  f.idStr_ = "null";
+  if (jid.type() == Utilities::JS::type::Int) {
+    f.idStr_ = jid.str();
+  } else if (jid.type() == Utilities::JS::type::Str) {
+    f.idStr_ = "\"" + jnode["id"].str() + "\"";
+  }
+  if (jmethod.type() != Utilities::JS::type::Str || jmethod.str() != "mining.submit" ||
+      jparams.type() != Utilities::JS::type::Array ||
+      jparams.children()->size() < 5) {
+    return false;
+  }
+  f.jobId_       = jparams.children()->at(1).uint32();
+  f.extraNonce2_ = jparams.children()->at(2).uint64_hex();
+  f.nTime_       = jparams.children()->at(3).uint32_hex();
+  f.nonce_       = jparams.children()->at(4).uint32_hex();
+  f.versionBits_ = 0;
+  if (jparams.children()->size() >= 6) {
+    f.versionBits_ = jparams.children()->at(5).uint32_hex();
+  }
+  return true;
+}
+
+static bool getSubmitFieldsByMiningSubmit(const string &line, SubmitFields &f) {
+  MiningSubmit submit;
+  if (!submit.parse(line.data(), line.data() + line.size())) {
+    return false;
+  }
+  submit.getIdStr(f.idStr_);
+  f.jobId_       = (uint32_t)strtoul(submit.params_[1], nullptr, 10);
+  f.extraNonce2_ = strtoull(submit.params_[2], nullptr, 16);
+  f.nTime_       = (uint32_t)strtoul(submit.params_[3], nullptr, 16);
+  f.nonce_       = (uint32_t)strtoul(submit.params_[4], nullptr, 16);
+  f.versionBits_ = 0;
+  if (submit.params_[5] != nullptr) {
+    f.versionBits_ = (uint32_t)strtoul(submit.params_[5], nullptr, 16);
+  }
+  return true;
+}
+
+TEST(Stratum, MiningSubmit) {
+  SubmitFields f;
+  MiningSubmit submit;
+  string line;
+
+  line = "{\"params\": [\"user.worker\", \"3\", \"0000000a00000001\", \"5a7c3a8b\", \"e1a4c05f\"], \"id\": 4, \"method\": \"mining.submit\"}\n";
+  ASSERT_EQ(getSubmitFieldsByMiningSubmit(line, f), true);
+  ASSERT_EQ(f.idStr_, "4");
+  ASSERT_EQ(f.jobId_, 3u);
+  ASSERT_EQ(f.extraNonce2_, 0x0000000a00000001ull);
+  ASSERT_EQ(f.nTime_, 0x5a7c3a8bu);
+  ASSERT_EQ(f.nonce_, 0xe1a4c05fu);
+  ASSERT_EQ(f.versionBits_, 0u);
+
+  // string id, other key order, unknown key, version bits param
+  line = "{\"id\":\"a1\",\"jsonrpc\":\"2.0\",\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\",\"03\",\"1fffe000\"]}";
+  ASSERT_EQ(getSubmitFieldsByMiningSubmit(line, f), true);
+  ASSERT_EQ(f.idStr_, "\"a1\"");
+  ASSERT_EQ(f.nonce_, 3u);
+  ASSERT_EQ(f.versionBits_, 0x1fffe000u);
+
+  // the params after version bits are ignored
+  line = "{\"id\":1,\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\",\"03\",\"00002000\",\"x\"]}";
+  ASSERT_EQ(getSubmitFieldsByMiningSubmit(line, f), true);
+  ASSERT_EQ(f.versionBits_, 0x2000u);
+
+  line = "{\"id\":null,\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\",\"03\"]}";
+  ASSERT_EQ(getSubmitFieldsByMiningSubmit(line, f), true);
+  ASSERT_EQ(f.idStr_, "null");
+
+  // not in the common shape: use JsonNode
+  const char *others[] = {
+    "{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}",
+    "{\"id\":1,\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\"]}",
+    "{\"id\":1,\"method\":\"mining.submit\",\"params\":[\"w\",0,\"01\",\"02\",\"03\"]}",
+    "{\"id\":1.5,\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\",\"03\"]}",
+    "{\"id\":\"\\\"\",\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\",\"03\"]}",
+    "{\"id\":1,\"id\":2,\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\",\"03\"]}",
+    "{\"id\":1,\"x\":{},\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\",\"03\"]}",
+    "{\"id\":1,\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\",\"03\"]} x",
+    "{\"id\":1,\"method\":\"mining.submit\",\"params\":[\"w\",\"0\",\"01\",\"02\",\"03\"]",
+    "",
+  };
+  for (const char *other : others) {
+    ASSERT_EQ(submit.parse(other, other + strlen(other)), false) << other;
+  }
+}
+
+TEST(Stratum, MiningSubmitFuzz) {
+  std::mt19937 gen(1);
+  const char *chars = "{}[]\":, \t\r\n-.0123456789abcdefxnulltrue\\";
+  const char *ids[] = {"0", "12345", "-7", "\"abc\"", "\"\"", "null", "007"};
+  const char *extraKeys[] = {"", "\"jsonrpc\":\"2.0\",", "\"x\":-1.5e+3,",
+                             "\"y\":true,", "\"z\":null, "};
+  size_t fastCount = 0;
+
+  for (int i = 0; i < 200000; i++) {
+    const string sp = (gen() % 4 == 0) ? " " : "";
+    string params = Strings::Format("[\"worker.%u\",%s\"%u\",%s\"%016llx\",\"%08x\",%s\"%08x\"%s]",
+                                    gen() % 100, sp.c_str(), gen() % 10, sp.c_str(),
+                                    ((uint64_t)gen() << 32) | gen(), gen(), sp.c_str(),
+                                    gen(), (gen() % 4 == 0) ? ",\"1fffe000\"" : "");
+    string kv[3] = {
+      "\"id\":" + sp + ids[gen() % (sizeof(ids) / sizeof(ids[0]))],
+      "\"method\":" + sp + "\"mining.submit\"",
+      "\"params\":" + sp + params
+    };
+    std::shuffle(kv, kv + 3, gen);
+    string line = "{" + sp + extraKeys[gen() % (sizeof(extraKeys) / sizeof(extraKeys[0]))] +
+                  kv[0] + "," + sp + kv[1] + "," + kv[2] + sp + "}\n";
+
+    // mutations: replace, insert, erase, truncate
+    const int mutations = gen() % 3;
+    for (int m = 0; m < mutations && line.size() > 0; m++) {
+      const size_t pos = gen() % line.size();
+      const char c = chars[gen() % strlen(chars)];
+      switch (gen() % 4) {
+        case 0: line[pos] = c; break;
+        case 1: line.insert(pos, 1, c); break;
+        case 2: line.erase(pos, 1); break;
+        case 3: line.resize(pos); break;
+      }
+    }
+
+    SubmitFields fast, ref;
+    if (!getSubmitFieldsByMiningSubmit(line, fast)) {
+      continue;
+    }
+    fastCount++;
+    // whatever the fast path accepts, JsonNode must get the same
+    ASSERT_EQ(getSubmitFieldsByJsonNode(line, ref), true) << line;
+    ASSERT_EQ(fast == ref, true) << line;
+  }
+  ASSERT_GT(fastCount, 50000u);
+}
+
+TEST(Stratum, MiningSubmitBenchmark) {
+  const string line = "{\"params\": [\"user.worker\", \"3\", \"0000000a00000001\", \"5a7c3a8b\", \"e1a4c05f\"], \"id\": 4, \"method\": \"mining.submit\"}\n";
+  const int32_t kLines = 200000;
+  SubmitFields f;
+  uint64_t dummy = 0;
+
+  int64_t begin = getMonotonicTimeUs();
+  for (int32_t i = 0; i < kLines; i++) {
+    getSubmitFieldsByJsonNode(line, f);
+    dummy += f.nonce_;
+  }
+  const int64_t jsonNodeUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  begin = getMonotonicTimeUs();
+  for (int32_t i = 0; i < kLines; i++) {
+    getSubmitFieldsByMiningSubmit(line, f);
+    dummy += f.nonce_;
+  }
+  const int64_t fastUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  LOG(INFO) << "parse mining.submit, lines/sec, JsonNode: "
+  << kLines * 1000000LL / jsonNodeUs << ", MiningSubmit: "
+  << kLines * 1000000LL / fastUs << " (" << dummy << ")";
+}
+
+TEST(Stratum, BinaryStratum) {
+  string s;
+  const uint8_t *p;
+
+  // submit: fixed size, fixed offsets
+  BinaryStratum::Submit submit, submit2;
+  submit.shortJobId_  = 7;
+  submit.extraNonce2_ = 0x0102030405060708ull;
+  submit.nTime_       = 0x5a7c3a8bu;
+  submit.nonce_       = 0xe1a4c05fu;
+  submit.versionBits_ = 0x00006000u;
+  ASSERT_EQ(BinaryStratum::encode(submit, s), true);
+  ASSERT_EQ(s.size(), 25u);
+  p = (const uint8_t *)s.data();
+  ASSERT_EQ(p[0], CMD_MAGIC_NUMBER);
+  ASSERT_EQ(p[1], CMD_BIN_SUBMIT);
+  ASSERT_EQ(p[2], 25);
+  ASSERT_EQ(p[3], 0);
+  ASSERT_EQ(BinaryStratum::decode(p, s.size(), submit2), true);
+  ASSERT_EQ(submit2.shortJobId_,  submit.shortJobId_);
+  ASSERT_EQ(submit2.extraNonce2_, submit.extraNonce2_);
+  ASSERT_EQ(submit2.nTime_,       submit.nTime_);
+  ASSERT_EQ(submit2.nonce_,       submit.nonce_);
+  ASSERT_EQ(submit2.versionBits_, submit.versionBits_);
+  // truncated, wrong length, wrong cmd, wrong magic
+  ASSERT_EQ(BinaryStratum::decode(p, s.size() - 1, submit2), false);
+  s[2] = 24;
+  ASSERT_EQ(BinaryStratum::decode(p, s.size(), submit2), false);
+  s[2] = 25;
+  s[1] = CMD_BIN_RESULT;
+  ASSERT_EQ(BinaryStratum::decode(p, s.size(), submit2), false);
+  s[1] = CMD_BIN_SUBMIT;
+  s[0] = 0x7E;
+  ASSERT_EQ(BinaryStratum::decode(p, s.size(), submit2), false);
+
+  // subscribe, the agent is cut at kMaxAgentLen_
+  BinaryStratum::Subscribe subscribe, subscribe2;
+  subscribe.version_     = BinaryStratum::kVersion_;
+  subscribe.versionMask_ = 0x1fffe000u;
+  subscribe.clientAgent_ = "cgminer/4.10.0";
+  s.clear();
+  ASSERT_EQ(BinaryStratum::encode(subscribe, s), true);
+  ASSERT_EQ(BinaryStratum::decode((const uint8_t *)s.data(), s.size(), subscribe2), true);
+  ASSERT_EQ(subscribe2.version_,     subscribe.version_);
+  ASSERT_EQ(subscribe2.versionMask_, subscribe.versionMask_);
+  ASSERT_EQ(subscribe2.clientAgent_, subscribe.clientAgent_);
+  subscribe.clientAgent_.assign(100, 'a');
+  s.clear();
+  ASSERT_EQ(BinaryStratum::encode(subscribe, s), true);
+  ASSERT_EQ(BinaryStratum::decode((const uint8_t *)s.data(), s.size(), subscribe2), true);
+  ASSERT_EQ(subscribe2.clientAgent_.size(), BinaryStratum::kMaxAgentLen_);
+
+  // authorize
+  BinaryStratum::Authorize authorize, authorize2;
+  authorize.fullName_ = "btccom.worker-1";
+  authorize.password_ = "x";
+  s.clear();
+  ASSERT_EQ(BinaryStratum::encode(authorize, s), true);
+  p = (const uint8_t *)s.data();
+  ASSERT_EQ(BinaryStratum::decode(p, s.size(), authorize2), true);
+  ASSERT_EQ(authorize2.fullName_, authorize.fullName_);
+  ASSERT_EQ(authorize2.password_, authorize.password_);
+  // the name is longer than the frame
+  s[4] = 100;
+  ASSERT_EQ(BinaryStratum::decode(p, s.size(), authorize2), false);
+
+  // subscribe result, result, set diff
+  BinaryStratum::SubscribeResult sres, sres2;
+  sres.error_           = StratumError::NO_ERROR;
+  sres.extraNonce1_     = 0x01020304u;
+  sres.extraNonce2Size_ = 8;
+  sres.versionMask_     = 0x1fffe000u;
+  s.clear();
+  ASSERT_EQ(BinaryStratum::encode(sres, s), true);
+  ASSERT_EQ(s.size(), 14u);
+  ASSERT_EQ(BinaryStratum::decode((const uint8_t *)s.data(), s.size(), sres2), true);
+  ASSERT_EQ(sres2.extraNonce1_,     sres.extraNonce1_);
+  ASSERT_EQ(sres2.extraNonce2Size_, sres.extraNonce2Size_);
+  ASSERT_EQ(sres2.versionMask_,     sres.versionMask_);
+
+  BinaryStratum::Result res, res2;
+  res.error_ = StratumError::LOW_DIFFICULTY;
+  s.clear();
+  ASSERT_EQ(BinaryStratum::encode(res, s), true);
+  ASSERT_EQ(s.size(), 5u);
+  ASSERT_EQ(BinaryStratum::decode((const uint8_t *)s.data(), s.size(), res2), true);
+  ASSERT_EQ(res2.error_, res.error_);
+
+  BinaryStratum::SetDiff diff, diff2;
+  diff.difficulty_ = 1ull << 40;
+  s.clear();
+  ASSERT_EQ(BinaryStratum::encode(diff, s), true);
+  ASSERT_EQ(s.size(), 12u);
+  ASSERT_EQ(BinaryStratum::decode((const uint8_t *)s.data(), s.size(), diff2), true);
+  ASSERT_EQ(diff2.difficulty_, diff.difficulty_);
+
+  // notify
+  BinaryStratum::Notify notify, notify2;
+  notify.shortJobId_ = 200;
+  notify.isClean_    = true;
+  notify.prevHash_   = uint256S("000000004f2ea239532b2e77bb46c03b86643caac3fe92959a31fd2d03979c34");
+  notify.nVersion_   = 0x20000000;
+  notify.nBits_      = 0x1a0377aeu;
+  notify.nTime_      = 0x583d3602u;
+  notify.coinbase1_  = string("\x01\x00\x02", 3);
+  notify.coinbase2_  = string("\xff\xff", 2);
+  for (int i = 0; i < 3; i++) {
+    uint256 step;
+    memset(step.begin(), i + 1, step.size());
+    notify.merkleBranch_.push_back(step);
+  }
+  s.clear();
+  ASSERT_EQ(BinaryStratum::encode(notify, s), true);
+  ASSERT_EQ(s.size(), 55u + 3 + 2 + 3 * 32);
+  p = (const uint8_t *)s.data();
+  ASSERT_EQ(p[BinaryStratum::kNotifySessionOffset_], 200);
+  ASSERT_EQ(BinaryStratum::decode(p, s.size(), notify2), true);
+  ASSERT_EQ(notify2.shortJobId_, notify.shortJobId_);
+  ASSERT_EQ(notify2.isClean_,    notify.isClean_);
+  ASSERT_EQ(notify2.prevHash_,   notify.prevHash_);
+  ASSERT_EQ(notify2.nVersion_,   notify.nVersion_);
+  ASSERT_EQ(notify2.nBits_,      notify.nBits_);
+  ASSERT_EQ(notify2.nTime_,      notify.nTime_);
+  ASSERT_EQ(notify2.coinbase1_,  notify.coinbase1_);
+  ASSERT_EQ(notify2.coinbase2_,  notify.coinbase2_);
+  ASSERT_EQ(notify2.merkleBranch_ == notify.merkleBranch_, true);
+  // every truncated frame is rejected, even with a fixed-up length
+  for (size_t len = 0; len < s.size(); len++) {
+    string t = s.substr(0, len);
+    ASSERT_EQ(BinaryStratum::decode((const uint8_t *)t.data(), t.size(), notify2), false);
+    if (len >= BinaryStratum::kHeaderSize_) {
+      t[2] = (char)(len & 0xff);
+      t[3] = (char)(len >> 8);
+      ASSERT_EQ(BinaryStratum::decode((const uint8_t *)t.data(), t.size(), notify2), false);
+    }
+  }
+  // too many branches
+  notify.merkleBranch_.resize(256);
+  s.clear();
+  ASSERT_EQ(BinaryStratum::encode(notify, s), false);
+
+  // several frames in one buffer
+  s.clear();
+  BinaryStratum::encode(res, s);
+  BinaryStratum::encode(diff, s);
+  uint8_t cmd;
+  uint16_t len;
+  p = (const uint8_t *)s.data();
+  ASSERT_EQ(BinaryStratum::parseHeader(p, &cmd, &len), true);
+  ASSERT_EQ(cmd, CMD_BIN_RESULT);
+  ASSERT_EQ(len, 5);
+  ASSERT_EQ(BinaryStratum::parseHeader(p + len, &cmd, &len), true);
+  ASSERT_EQ(cmd, CMD_BIN_SET_DIFF);
+  ASSERT_EQ(len, 12);
+}
+
+TEST(Stratum, BinaryStratumBenchmark) {
+  const string line = "{\"params\": [\"user.worker\", \"3\", \"0000000a00000001\", \"5a7c3a8b\", \"e1a4c05f\"], \"id\": 4, \"method\": \"mining.submit\"}\n";
+  BinaryStratum::Submit submit;
+  submit.shortJobId_  = 3;
+  submit.extraNonce2_ = 0x0000000a00000001ull;
+  submit.nTime_       = 0x5a7c3a8bu;
+  submit.nonce_       = 0xe1a4c05fu;
+  submit.versionBits_ = 0;
+  string bin;
+  BinaryStratum::encode(submit, bin);
+  const string response = "{\"id\":4,\"result\":true,\"error\":null}\n";
+  BinaryStratum::Result result;
+  result.error_ = StratumError::NO_ERROR;
+  string binResponse;
+  BinaryStratum::encode(result, binResponse);
+
+  const int32_t kLines = 200000;
+  SubmitFields f;
+  uint64_t dummy = 0;
+
+  int64_t begin = getMonotonicTimeUs();
+  for (int32_t i = 0; i < kLines; i++) {
+    getSubmitFieldsByJsonNode(line, f);
+    dummy += f.nonce_;
+  }
+  const int64_t jsonNodeUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  begin = getMonotonicTimeUs();
+  for (int32_t i = 0; i < kLines; i++) {
+    getSubmitFieldsByMiningSubmit(line, f);
+    dummy += f.nonce_;
+  }
+  const int64_t fastUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  BinaryStratum::Submit submit2;
+  begin = getMonotonicTimeUs();
+  for (int32_t i = 0; i < kLines; i++) {
+    BinaryStratum::decode((const uint8_t *)bin.data(), bin.size(), submit2);
+    dummy += submit2.nonce_;
+  }
+  const int64_t binUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  ASSERT_LT(bin.size() * 4, line.size());
+  ASSERT_LT(binResponse.size() * 4, response.size());
+  LOG(INFO) << "submit bytes, json: " << line.size() << "+" << response.size()
+  << ", binary: " << bin.size() << "+" << binResponse.size();
+  LOG(INFO) << "parse submit, lines/sec, JsonNode: "
+  << kLines * 1000000LL / jsonNodeUs << ", MiningSubmit: "
+  << kLines * 1000000LL / fastUs << ", BinaryStratum: "
+  << kLines * 1000000LL / binUs << " (" << dummy << ")";
+}
+
+static Share makeTestShare(const uint32_t i) {
+  Share share;
+  share.jobId_        = 0x5a7c3a8b00000000ull + i;
+  share.workerHashId_ = 1000 + i;
+  share.ip_           = 0x0100007fu;
+  share.userId_       = 1 + (i % 100);
+  share.share_        = 1024 + i;
+  share.timestamp_    = 1518091000u + i;
+  share.blkBits_      = 0x1d00ffffu;
+  share.result_       = Share::ACCEPT;
+  return share;
+}
+
+static bool isSameShare(const Share &a, const Share &b) {
+  return memcmp(&a, &b, sizeof(Share)) == 0;
+}
+
+TEST(Stratum, ShareLogBatch) {
+  // the old format, one share
+  {
+    const Share share = makeTestShare(1);
+    vector<Share> shares;
+    ASSERT_TRUE(ShareLogBatch::decode((const uint8_t *)&share, sizeof(Share), shares));
+    ASSERT_EQ(shares.size(), 1u);
+    ASSERT_TRUE(isSameShare(shares[0], share));
+  }
+
+  // batches, shares are appended
+  {
+    ShareLogBatch batch;
+    vector<Share> shares;
+    ASSERT_TRUE(batch.empty());
+
+    for (uint32_t n : {1u, 2u, 100u, (uint32_t)ShareLogBatch::kMaxCount_}) {
+      batch.clear();
+      for (uint32_t i = 0; i < n; i++) {
+        batch.add(makeTestShare(i));
+      }
+      ASSERT_EQ(batch.count(), n);
+
+      const string &message = batch.getMessage();
+      ASSERT_EQ(message.size(), ShareLogBatch::kHeaderSize_ + n * sizeof(Share));
+      ASSERT_NE(message.size(), sizeof(Share));
+
+      const size_t oldSize = shares.size();
+      ASSERT_TRUE(ShareLogBatch::decode((const uint8_t *)message.data(),
+                                        message.size(), shares));
+      ASSERT_EQ(shares.size(), oldSize + n);
+      for (uint32_t i = 0; i < n; i++) {
+        ASSERT_TRUE(isSameShare(shares[oldSize + i], makeTestShare(i)));
+      }
+    }
+
+    // empty batch
+    batch.clear();
+    const string &message = batch.getMessage();
+    shares.clear();
+    ASSERT_TRUE(ShareLogBatch::decode((const uint8_t *)message.data(),
+                                      message.size(), shares));
+    ASSERT_EQ(shares.size(), 0u);
+  }
+
+  // invalid messages
+  {
+    ShareLogBatch batch;
+    batch.add(makeTestShare(1));
+    batch.add(makeTestShare(2));
+    const string message = batch.getMessage();
+    vector<Share> shares;
+
+    // truncated
+    for (size_t len = 0; len < message.size(); len++) {
+      if (len == sizeof(Share)) {
+        continue;  // the old format
+      }
+      ASSERT_FALSE(ShareLogBatch::decode((const uint8_t *)message.data(), len, shares));
+    }
+    // trailing bytes
+    string m = message + "x";
+    ASSERT_FALSE(ShareLogBatch::decode((const uint8_t *)m.data(), m.size(), shares));
+    // bad magic
+    m = message;
+    m[0] ^= 0x01;
+    ASSERT_FALSE(ShareLogBatch::decode((const uint8_t *)m.data(), m.size(), shares));
+    // bad version
+    m = message;
+    m[4] ^= 0x01;
+    ASSERT_FALSE(ShareLogBatch::decode((const uint8_t *)m.data(), m.size(), shares));
+    // bad count
+    m = message;
+    m[6] ^= 0x01;
+    ASSERT_FALSE(ShareLogBatch::decode((const uint8_t *)m.data(), m.size(), shares));
+
+    ASSERT_EQ(shares.size(), 0u);
+  }
+}
+
+TEST(Stratum, ShareLogBatchBenchmark) {
+  //
+  // every kafka message has an overhead besides its payload: offset(8),
+  // size(4), crc(4), magic(1), attributes(1), timestamp(8), key(4), value(4)
+  //
+  const size_t kMsgOverhead = 34;
+  const uint32_t kShares = 1000000;
+  const uint32_t kBatchSize = 1000;
+
+  vector<Share> source(kBatchSize);
+  for (uint32_t i = 0; i < kBatchSize; i++) {
+    source[i] = makeTestShare(i);
+  }
+  vector<Share> shares;
+  shares.reserve(kBatchSize);
+  uint64_t dummy = 0;
+
+  // the old format, one share per message
+  int64_t begin = getMonotonicTimeUs();
+  for (uint32_t i = 0; i < kShares; i++) {
+    shares.clear();
+    ShareLogBatch::decode((const uint8_t *)&source[i % kBatchSize],
+                          sizeof(Share), shares);
+    dummy += shares[0].isValid() ? 1 : 0;
+  }
+  const int64_t singleUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  // batches
+  ShareLogBatch batch;
+  for (const auto &share : source) {
+    batch.add(share);
+  }
+  const string message = batch.getMessage();
+
+  begin = getMonotonicTimeUs();
+  for (uint32_t i = 0; i < kShares / kBatchSize; i++) {
+    shares.clear();
+    ShareLogBatch::decode((const uint8_t *)message.data(), message.size(), shares);
+    for (const auto &share : shares) {
+      dummy += share.isValid() ? 1 : 0;
+    }
+  }
+  const int64_t batchUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  LOG(INFO) << "sharelog, broker bytes/share, single: "
+  << (sizeof(Share) + kMsgOverhead) << ", batch(" << kBatchSize << "): "
+  << (double)(message.size() + kMsgOverhead) / kBatchSize;
+  LOG(INFO) << "sharelog decode, ns/share, single: "
+  << singleUs * 1000.0 / kShares << ", batch(" << kBatchSize << "): "
+  << batchUs * 1000.0 / kShares << " (" << dummy << ")";
+}
+
+TEST(Stratum, WorkerUpdateBatch) {
+  WorkerUpdateBatch batch;
+  ASSERT_EQ(batch.empty(), true);
+
+  // a reconnect storm: every worker twice, the latest one wins
+  for (int round = 0; round < 2; round++) {
+    for (int32_t i = 0; i < 2500; i++) {
+      batch.add(i % 10 + 1, (int64_t)i * 1000, Strings::Format("w%d", i),
+                round == 0 ? "old/1.0" : "new/2.0");
+    }
+  }
+  ASSERT_EQ(batch.size(), 2500u);
+  ASSERT_EQ(batch.getItems()[7].userId_, 8);
+  ASSERT_EQ(batch.getItems()[7].workerId_, 7000);
+  ASSERT_EQ(batch.getItems()[7].workerName_, "w7");
+  ASSERT_EQ(batch.getItems()[7].minerAgent_, "new/2.0");
+
+  // batches: 1000 + 1000 + 500
+  vector<string> events;
+  batch.getEvents(WorkerUpdateBatch::kMaxEventSize_, events);
+  ASSERT_EQ(events.size(), 3u);
+
+  WorkerUpdateBatch decoded;
+  for (const auto &event : events) {
+    JsonNode r;
+    ASSERT_TRUE(JsonNode::parse(event.data(), event.data() + event.size(), r));
+    ASSERT_EQ(r["type"].str(), "worker_update_batch");
+    JsonNode content = r["content"];
+    ASSERT_TRUE(decoded.addEvent(r["type"].str(), content));
+  }
+  ASSERT_EQ(decoded.size(), batch.size());
+  for (size_t i = 0; i < batch.size(); i++) {
+    const auto &a = batch.getItems()[i];
+    const auto &b = decoded.getItems()[i];
+    ASSERT_EQ(a.userId_,     b.userId_);
+    ASSERT_EQ(a.workerId_,   b.workerId_);
+    ASSERT_EQ(a.workerName_, b.workerName_);
+    ASSERT_EQ(a.minerAgent_, b.minerAgent_);
+  }
+
+  // the old format
+  events.clear();
+  batch.clear();
+  batch.add(3, -5, "a1", "cgminer/4.9");
+  batch.add(4, 6, "b2", "bmminer/2.0");
+  batch.getEvents(1, events);
+  ASSERT_EQ(events.size(), 2u);
+  {
+    JsonNode r;
+    ASSERT_TRUE(JsonNode::parse(events[0].data(), events[0].data() + events[0].size(), r));
+    ASSERT_EQ(r["type"].str(), "worker_update");
+    ASSERT_EQ(r["content"]["user_id"].int32(), 3);
+    ASSERT_EQ(r["content"]["worker_id"].int64(), -5);
+    ASSERT_EQ(r["content"]["worker_name"].str(), "a1");
+    ASSERT_EQ(r["content"]["miner_agent"].str(), "cgminer/4.9");
+
+    decoded.clear();
+    JsonNode content = r["content"];
+    ASSERT_TRUE(decoded.addEvent("worker_update", content));
+    ASSERT_EQ(decoded.size(), 1u);
+    ASSERT_EQ(decoded.getItems()[0].workerId_, -5);
+  }
+
+  // invalid
+  {
+    const string event = "{\"type\":\"worker_update_batch\","
+                         "\"content\":{\"workers\":[{\"user_id\":1}]}}";
+    JsonNode r;
+    ASSERT_TRUE(JsonNode::parse(event.data(), event.data() + event.size(), r));
+    JsonNode content = r["content"];
+    ASSERT_FALSE(decoded.addEvent("worker_update_batch", content));
+    ASSERT_FALSE(decoded.addEvent("miner_connect", content));
+  }
 }
 
 TEST(JobMaker, BitcoinAddress) {
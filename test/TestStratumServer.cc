@@ -28,6 +28,11 @@
 
 #include "StratumServer.h"
 
+#include <event2/thread.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 
 #ifndef WORK_WITH_STRATUM_SWITCHER
 
@@ -58,6 +63,1838 @@ TEST(StratumServer, SessionIDManager) {
   ASSERT_EQ(m.allocSessionId(&sessionID), true);
   ASSERT_EQ(sessionID, j);
   ASSERT_EQ(m.ifFull(), true);
+
+  // free ids in different words, they are allocated in turn from the cursor
+  const uint32_t freeIdx[] = {100, 64 * 64 * 64 + 7, 5000000, 16000000, 3};
+  for (uint32_t idx : freeIdx) {
+    m.freeSessionId((0xFFu << 24) | idx);
+  }
+  for (uint32_t idx : {3u, 100u, 64u * 64 * 64 + 7, 5000000u, 16000000u}) {
+    ASSERT_EQ(m.allocSessionId(&sessionID), true);
+    ASSERT_EQ(sessionID, (0xFFu << 24) | idx);
+  }
+  ASSERT_EQ(m.ifFull(), true);
+
+  // the cursor is after 16000000, wraps around to find 10
+  m.freeSessionId((0xFFu << 24) | 10);
+  m.freeSessionId((0xFFu << 24) | 16000001);
+  ASSERT_EQ(m.allocSessionId(&sessionID), true);
+  ASSERT_EQ(sessionID, (0xFFu << 24) | 16000001);
+  ASSERT_EQ(m.allocSessionId(&sessionID), true);
+  ASSERT_EQ(sessionID, (0xFFu << 24) | 10);
+  ASSERT_EQ(m.ifFull(), true);
+  ASSERT_EQ(m.allocSessionId(&sessionID), false);
+}
+
+TEST(StratumServer, SessionIDManagerBenchmark) {
+  const uint32_t kIds = MAX_SESSION_INDEX_SERVER + 1;
+  std::mt19937 gen(1234);
+
+  for (double occupancy : {0.5, 0.9, 0.99}) {
+    SessionIDManager m(0x01U);
+    vector<uint32_t> used;
+    used.reserve(kIds);
+    uint32_t sessionID;
+
+    const uint32_t n = (uint32_t)(kIds * occupancy);
+    for (uint32_t i = 0; i < kIds; i++) {
+      ASSERT_EQ(m.allocSessionId(&sessionID), true);
+      used.push_back(sessionID);
+    }
+    // free randomly down to the occupancy
+    std::shuffle(used.begin(), used.end(), gen);
+    while (used.size() > n) {
+      m.freeSessionId(used.back());
+      used.pop_back();
+    }
+
+    // reconnections: one session leaves, another comes
+    const int32_t kRounds = 1000000;
+    const int64_t begin = getMonotonicTimeUs();
+    for (int32_t i = 0; i < kRounds; i++) {
+      const size_t k = gen() % used.size();
+      m.freeSessionId(used[k]);
+      ASSERT_EQ(m.allocSessionId(&sessionID), true);
+      used[k] = sessionID;
+    }
+    const int64_t us = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+    LOG(INFO) << "session id, occupancy: " << occupancy * 100 << "%, "
+    << "free + alloc: " << us * 1000.0 / kRounds << " ns";
+  }
 }
 
 #endif // #ifndef WORK_WITH_STRATUM_SWITCHER
+
+TEST(StratumServer, UserDirectory) {
+  UserDirectory d;
+  ASSERT_EQ(d.getUserId("jack", 4), 0);
+
+  d.addUser("jack", 1, false);
+  d.addUser("terry", 2, false);
+  ASSERT_EQ(d.size(), 2u);
+  ASSERT_EQ(d.getUserId("jack", 4), 1);
+  ASSERT_EQ(d.getUserId("terry", 5), 2);
+  ASSERT_EQ(d.getUserId("terry.worker", 5), 2);
+  ASSERT_EQ(d.getUserId("jac", 3), 0);
+  ASSERT_EQ(d.getUserId("", 0), 0);
+
+  // keep or replace the existing one
+  d.addUser("jack", 3, false);
+  ASSERT_EQ(d.getUserId("jack", 4), 1);
+  d.addUser("jack", 3, true);
+  ASSERT_EQ(d.getUserId("jack", 4), 3);
+  ASSERT_EQ(d.size(), 2u);
+  ASSERT_EQ(d.getMaxUserId(), 3);
+
+  // grow, the copy is independent
+  UserDirectory d2(d);
+  const int32_t kUsers = 100000;
+  for (int32_t i = 1; i <= kUsers; i++) {
+    d2.addUser(Strings::Format("user%d", i), 100 + i, false);
+  }
+  ASSERT_EQ(d2.size(), (size_t)kUsers + 2);
+  ASSERT_EQ(d.size(), 2u);
+  for (int32_t i = 1; i <= kUsers; i++) {
+    const string name = Strings::Format("user%d", i);
+    ASSERT_EQ(d2.getUserId(name.data(), name.size()), 100 + i);
+    ASSERT_EQ(d.getUserId(name.data(), name.size()), 0);
+  }
+  ASSERT_EQ(d2.getUserId("jack", 4), 3);
+  ASSERT_EQ(d2.getMaxUserId(), 100 + kUsers);
+
+#ifdef USER_DEFINED_COINBASE
+  d2.setCoinbaseInfo(3, string("\x00\x01 jack", 7));
+#endif
+
+  // save & load. the names which would break the file aren't saved
+  d2.addUser("bad\tname", 50, false);
+  d2.addUser("bad\nname", 51, false);
+  const string file = Strings::Format("/tmp/btcpool_test_users_%d.txt", (int)getpid());
+  ASSERT_EQ(d2.saveToFile(file, 1518091000), true);
+
+  UserDirectory d3;
+  int64_t lastTime = 0;
+  ASSERT_EQ(d3.loadFromFile(file, &lastTime), true);
+  ASSERT_EQ(lastTime, 1518091000);
+  ASSERT_EQ(d3.size(), d2.size() - 2);
+  ASSERT_EQ(d3.getUserId("bad\tname", 8), 0);
+  ASSERT_EQ(d3.getUserId("bad\nname", 8), 0);
+  ASSERT_EQ(d3.getUserId("bad", 3), 0);
+  ASSERT_EQ(d3.getMaxUserId(), d2.getMaxUserId());
+  for (int32_t i = 1; i <= kUsers; i++) {
+    const string name = Strings::Format("user%d", i);
+    ASSERT_EQ(d3.getUserId(name.data(), name.size()), 100 + i);
+  }
+  ASSERT_EQ(d3.getUserId("jack", 4), 3);
+#ifdef USER_DEFINED_COINBASE
+  ASSERT_NE(d3.getCoinbaseInfo(3), nullptr);
+  ASSERT_EQ(*d3.getCoinbaseInfo(3), string("\x00\x01 jack", 7));
+  ASSERT_EQ(d3.getCoinbaseInfo(1), nullptr);
+#endif
+  unlink(file.c_str());
+
+  // invalid file
+  UserDirectory d4;
+  ASSERT_EQ(d4.loadFromFile(file, &lastTime), false);
+}
+
+TEST(StratumServer, SharedPayload) {
+  const string head = "{\"id\":null,\"method\":\"mining.notify\",\"params\":[\"";
+  const string tail = "\",\"0000\",true]}\n";
+
+  SharedPayload *h = SharedPayload::create(head);
+  SharedPayload *t = SharedPayload::create(tail);
+  ASSERT_EQ(h->size(), head.size());
+
+  struct evbuffer *buf1 = evbuffer_new();
+  struct evbuffer *buf2 = evbuffer_new();
+  for (struct evbuffer *buf : {buf1, buf2}) {
+    ASSERT_EQ(h->addToEvbuffer(buf), true);
+    evbuffer_add(buf, "1", 1);
+    ASSERT_EQ(t->addToEvbuffer(buf), true);
+  }
+
+  // evbuffers keep the payloads alive after the creator released them
+  h->unref();
+  t->unref();
+
+  const string expected = head + "1" + tail;
+  for (struct evbuffer *buf : {buf1, buf2}) {
+    const size_t len = evbuffer_get_length(buf);
+    ASSERT_EQ(len, expected.size());
+    string out((const char *)evbuffer_pullup(buf, len), len);
+    ASSERT_EQ(out, expected);
+  }
+
+  evbuffer_free(buf1);
+  evbuffer_free(buf2);
+}
+
+TEST(StratumServer, RemoveEvbufferRange) {
+  const string head = "{\"id\":null,\"method\":\"mining.notify\",\"params\":[\"";
+  const string tail = "\",\"0000\",false]}\n";
+  const string resp = "{\"id\":1,\"result\":true,\"error\":null}\n";
+
+  SharedPayload *h = SharedPayload::create(head);
+  SharedPayload *t = SharedPayload::create(tail);
+
+  // a response, a notify of job 1, a response, a notify of job 2
+  struct evbuffer *buf = evbuffer_new();
+  evbuffer_add(buf, resp.data(), resp.size());
+  const size_t notifyPos = evbuffer_get_length(buf);
+  ASSERT_EQ(h->addToEvbuffer(buf), true);
+  evbuffer_add(buf, "1", 1);
+  ASSERT_EQ(t->addToEvbuffer(buf), true);
+  const size_t notifyLen = evbuffer_get_length(buf) - notifyPos;
+  evbuffer_add(buf, resp.data(), resp.size());
+  ASSERT_EQ(h->addToEvbuffer(buf), true);
+  evbuffer_add(buf, "2", 1);
+  ASSERT_EQ(t->addToEvbuffer(buf), true);
+  h->unref();
+  t->unref();
+
+  // out of the buffer, and frozen like the output of a bufferevent
+  const size_t len = evbuffer_get_length(buf);
+  ASSERT_EQ(removeEvbufferRange(buf, len - 1, 2), false);
+  ASSERT_EQ(evbuffer_get_length(buf), len);
+  evbuffer_freeze(buf, 1);
+  ASSERT_EQ(removeEvbufferRange(buf, notifyPos, notifyLen), false);
+  ASSERT_EQ(evbuffer_get_length(buf), len);
+  evbuffer_unfreeze(buf, 1);
+
+  // the notify of job 1 is superseded
+  ASSERT_EQ(removeEvbufferRange(buf, notifyPos, notifyLen), true);
+  string expected = resp + resp + head + "2" + tail;
+  ASSERT_EQ(evbuffer_get_length(buf), expected.size());
+  string out((const char *)evbuffer_pullup(buf, -1), expected.size());
+  ASSERT_EQ(out, expected);
+
+  // a range splitting the chains, and the whole buffer
+  ASSERT_EQ(removeEvbufferRange(buf, 3, resp.size()), true);
+  expected = expected.substr(0, 3) + expected.substr(3 + resp.size());
+  out.assign((const char *)evbuffer_pullup(buf, -1), evbuffer_get_length(buf));
+  ASSERT_EQ(out, expected);
+  ASSERT_EQ(removeEvbufferRange(buf, 0, expected.size()), true);
+  ASSERT_EQ(evbuffer_get_length(buf), 0u);
+
+  evbuffer_free(buf);
+}
+
+TEST(StratumServer, TokenBucket) {
+  TokenBucket b;
+  ASSERT_EQ(b.isUnlimited(), true);
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_EQ(b.tryConsume(1000000), true);
+  }
+  ASSERT_EQ(b.getWaitUs(1000000), 0);
+
+  // 100/s, burst 10
+  b.setup(100, 10);
+  int64_t now = 1000000;
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(b.tryConsume(now), true);
+  }
+  ASSERT_EQ(b.tryConsume(now), false);
+  ASSERT_EQ(b.getWaitUs(now), 10001);
+
+  now += 10000;
+  ASSERT_EQ(b.getWaitUs(now), 0);
+  ASSERT_EQ(b.tryConsume(now), true);
+  ASSERT_EQ(b.tryConsume(now), false);
+
+  // never more than the burst
+  now += 1000000 * 60;
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(b.tryConsume(now), true);
+  }
+  ASSERT_EQ(b.tryConsume(now), false);
+
+  // burst is at least 1
+  b.setup(0.5, 0);
+  ASSERT_EQ(b.tryConsume(now), true);
+  ASSERT_EQ(b.tryConsume(now), false);
+  ASSERT_EQ(b.getWaitUs(now), 2000001);
+}
+
+TEST(StratumServer, IpReputation) {
+  const int64_t kSecond = 1000000;
+  const int64_t kStart  = 1000000 * kSecond;
+  const uint32_t ip1 = inet_addr("10.0.1.1");
+  const uint32_t ip2 = inet_addr("10.0.1.2");
+  const uint32_t ip3 = inet_addr("10.0.2.1");
+
+  // off
+  {
+    IpReputation r;
+    ASSERT_EQ(r.isEnabled(), false);
+    for (int i = 0; i < 1000; i++) {
+      ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_AUTHORIZE_FAIL, kStart), false);
+    }
+    ASSERT_EQ(r.getEntriesNum(), 0u);
+  }
+
+  //
+  // reconnect flood of an ip: banned at the score, not its neighbours. it's
+  // banned again if it keeps flooding, and recovers once it stops.
+  //
+  {
+    IpReputation r;
+    r.setup(100, 600, 60);
+    int64_t now = kStart;
+    for (int i = 0; i < 99; i++) {
+      ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_CONNECT, now), false);
+    }
+    ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_CONNECT, now), true);
+    ASSERT_EQ(r.isBanned(ip1, now), true);
+    ASSERT_EQ(r.isBanned(ip2, now), false);
+    ASSERT_EQ(r.addEvent(ip2, IpReputation::EVENT_CONNECT, now), false);
+    ASSERT_EQ(r.getBansNum(), 1u);
+
+    // reconnecting all the time, 2/s. the rejected connects are not counted
+    // to the subnet, a neighbour is still admitted
+    for (int i = 0; i < 1200; i++) {
+      now += kSecond / 2;
+      ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_CONNECT, now), true);
+    }
+    ASSERT_EQ(r.getBansNum(), 2u);
+    ASSERT_EQ(r.isBanned(ip2, now), false);
+    ASSERT_EQ(r.addEvent(ip2, IpReputation::EVENT_CONNECT, now), false);
+
+    // stops, the ban expires and the score decays
+    now += 600 * kSecond;
+    ASSERT_EQ(r.isBanned(ip1, now), false);
+    ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_CONNECT, now), false);
+    ASSERT_EQ(r.getBannedEventsNum(), 1201u);
+  }
+
+  //
+  // a single ip floods at once, far over the subnet's score: only it is
+  // banned, the second host of the /24 is admitted
+  //
+  {
+    IpReputation r;
+    r.setup(100, 600, 60);
+    const int64_t now = kStart;
+    for (int i = 0; i < 10000; i++) {
+      ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_CONNECT, now), i >= 99);
+    }
+    ASSERT_EQ(r.getBansNum(), 1u);
+    ASSERT_EQ(r.isBanned(ip2, now), false);
+    for (int i = 0; i < 99; i++) {
+      ASSERT_EQ(r.addEvent(ip2, IpReputation::EVENT_CONNECT, now), false);
+    }
+    ASSERT_EQ(r.getBansNum(), 1u);
+  }
+
+  // a slow and steady reconnect is never banned: 1 per 2s scores ~43
+  {
+    IpReputation r;
+    r.setup(100, 600, 60);
+    int64_t now = kStart;
+    for (int i = 0; i < 3600; i++) {
+      now += 2 * kSecond;
+      ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_CONNECT, now), false);
+    }
+  }
+
+  // failed authorizes and invalid shares
+  {
+    IpReputation r;
+    r.setup(100, 600, 60);
+    for (int i = 0; i < 9; i++) {
+      ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_AUTHORIZE_FAIL, kStart), false);
+    }
+    ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_AUTHORIZE_FAIL, kStart), true);
+
+    for (int i = 0; i < 99; i++) {
+      ASSERT_EQ(r.addEvent(ip3, IpReputation::EVENT_INVALID_SHARE, kStart), false);
+    }
+    ASSERT_EQ(r.addEvent(ip3, IpReputation::EVENT_INVALID_SHARE, kStart), true);
+  }
+
+  //
+  // a flood of many ips of a /24: the subnet is banned at 4 times the score,
+  // a new ip of it is banned at once, the other subnets are not
+  //
+  {
+    IpReputation r;
+    r.setup(100, 600, 60);
+    const int64_t now = kStart;
+    int32_t eventsNum = 0;
+    for (uint32_t host = 1; host <= 5 && eventsNum < 399; host++) {
+      const uint32_t ip = htonl(0x0A000100u + host);
+      for (int i = 0; i < 90 && eventsNum < 399; i++, eventsNum++) {
+        ASSERT_EQ(r.addEvent(ip, IpReputation::EVENT_CONNECT, now), false);
+      }
+    }
+    ASSERT_EQ(r.addEvent(htonl(0x0A000105u), IpReputation::EVENT_CONNECT, now), true);
+    ASSERT_EQ(r.isBanned(htonl(0x0A0001FEu), now), true);
+    ASSERT_EQ(r.addEvent(htonl(0x0A0001FEu), IpReputation::EVENT_CONNECT, now), true);
+    ASSERT_EQ(r.isBanned(ip3, now), false);
+    ASSERT_EQ(r.addEvent(ip3, IpReputation::EVENT_CONNECT, now), false);
+    ASSERT_EQ(r.isBanned(ip1, now + 601 * kSecond), false);
+  }
+
+  //
+  // a flood of distinct ips: the table is bounded, and the peers decayed to
+  // nothing make room for the new ones
+  //
+  {
+    IpReputation r;
+    r.setup(100, 600, 60);
+    const size_t kMaxEntries = IpReputation::kShards_ * IpReputation::kMaxShardEntries_;
+    int64_t now = kStart;
+    for (uint32_t i = 0; i < 400000; i++) {
+      r.addEvent(htonl(0x0B000000u + (i << 8)), IpReputation::EVENT_CONNECT, now);
+    }
+    ASSERT_LE(r.getEntriesNum(), kMaxEntries);
+    ASSERT_GT(r.getEntriesNum(), kMaxEntries * 9 / 10);
+
+    now += 3600 * kSecond;
+    for (int i = 0; i < 99; i++) {
+      ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_CONNECT, now), false);
+    }
+    ASSERT_EQ(r.addEvent(ip1, IpReputation::EVENT_CONNECT, now), true);
+    ASSERT_LT(r.getEntriesNum(), kMaxEntries);
+  }
+}
+
+static StratumJob *makeTestStratumJob() {
+  StratumJob *sjob = new StratumJob();
+  sjob->jobId_    = 1;
+  sjob->prevHash_ = uint256S("000000004f2ea239532b2e77bb46c03b86643caac3fe92959a31fd2d03979c34");
+  sjob->prevHashBeStr_ = "03979c349a31fd2dc3fe929586643caabb46c03b532b2e774f2ea23900000000";
+  sjob->coinbase1_ = "02000000010000000000000000000000000000000000000000000000000000000000000000ffffffff1e03b7b50d0402363d582f4254432e434f4d2f";
+  sjob->coinbase2_ = "ffffffff01c7cea212000000001976a914ca560088c0fb5e6f028faa11085e643e343a8f5c88ac00000000";
+  for (int i = 0; i < 12; i++) {
+    uint256 step;
+    memset(step.begin(), i + 1, step.size());
+    sjob->merkleBranch_.push_back(step);
+  }
+  sjob->nVersion_ = 0x20000000;
+  sjob->nBits_    = 0x1a0377aeu;
+  sjob->nTime_    = 0x583d3602u;
+  return sjob;
+}
+
+//
+// the state of a handed over session, see StratumSession::saveState(). the
+// local jobs are empty, the tests send the jobs
+//
+struct TestSessionState {
+  uint32_t extraNonce1_;
+  uint8_t  state_;
+  uint64_t currDiff_;
+  bool     isWaitingFirstJob_;
+  bool     hasPendingAuthorize_;
+  string   userName_;
+  bool     isAgent_;
+  vector<uint16_t> agentSessionIds_;  // registered workers of the agent
+  string   input_;   // read, not handled yet
+  string   output_;  // not written to the socket yet
+
+  // the session id is of server 1, see TestReactor
+  TestSessionState(const uint32_t sessionIndex, const uint64_t currDiff):
+  extraNonce1_((1u << 24) | sessionIndex), state_(StratumSession::AUTHENTICATED),
+  currDiff_(currDiff), isWaitingFirstJob_(false),
+  hasPendingAuthorize_(false), userName_("test"), isAgent_(false) {}
+
+  string serialize() const {
+    string state;
+    HandoffWriter writer(state);
+    writer.put(extraNonce1_);
+    writer.put(state_);
+    writer.put((int32_t)0);  // userId, no kafka events
+    writer.put((int64_t)extraNonce1_);
+    writer.putString(state_ == StratumSession::AUTHENTICATED ? userName_ : "");
+    writer.putString(state_ == StratumSession::AUTHENTICATED ? "w1" : "");
+    writer.putString("cgminer/4.9.0");
+    writer.put((uint32_t)htonl(INADDR_LOOPBACK));
+    writer.put((uint32_t)0);  // versionMask
+    writer.put(currDiff_);
+    writer.put(false);        // isLongTimeout
+    writer.put((uint8_t)0);   // shortJobIdIdx
+    writer.put(false);        // isNiceHashClient
+    writer.put(false);        // isBinary
+    writer.put(isWaitingFirstJob_);
+    putDiffController(writer, currDiff_);
+    FixedStatsWindow<uint16_t, INVALID_SHARE_SLIDING_WINDOWS_SIZE> invalidShares;
+    invalidShares.save(writer);
+
+    for (int i = 0; i < 10; i++) {
+      writer.put((uint64_t)0);  // jobId, unused
+      writer.put((uint64_t)0);
+      writer.put((uint32_t)0);
+      writer.put((uint8_t)0);
+#ifdef USER_DEFINED_COINBASE
+      writer.putString("");
+#endif
+      writer.put((uint32_t)0);  // shares
+      writer.put(false);        // diff table
+    }
+
+    writer.put(hasPendingAuthorize_);
+    if (hasPendingAuthorize_) {
+      writer.putString("2");
+      writer.putString("test.w2");
+      writer.putString("x");
+    }
+    writer.put(isAgent_);
+    if (isAgent_) {
+      writer.put((uint32_t)agentSessionIds_.size());
+      for (const uint16_t sessionId : agentSessionIds_) {
+        writer.put(sessionId);
+        writer.put((int64_t)(sessionId + 1));  // workerId
+        writer.put((uint8_t)10);              // curDiff2Exp
+        putDiffController(writer, 1024);
+      }
+    }
+    writer.putString(input_);
+    writer.putString(output_);
+    return state;
+  }
+
+  // a type no controller has, the diff is reset to curDiff
+  static void putDiffController(HandoffWriter &writer, const uint64_t curDiff) {
+    writer.put((uint8_t)0xff);
+    writer.put((uint64_t)0);  // minDiff
+    writer.put(curDiff);
+    writer.putString("");
+  }
+};
+
+//
+// sessions on a real Reactor, the miner's side is a socketpair. they are
+// restored from TestSessionState like the handed over ones, and the test
+// runs the loop by runLoop().
+//
+class TestReactor {
+public:
+  Server  server_;
+  Reactor reactor_;
+  vector<int> clientFds_;
+  shared_ptr<StratumJobEx> latestJob_;
+
+  TestReactor(): server_(10), reactor_(&server_, 0) {}
+
+  ~TestReactor() {
+    // the sessions are closed by the miners, then deleted by the next job.
+    // the miners read all first, a write to a closed socket raises SIGPIPE
+    runLoop(2);
+    for (const int fd : clientFds_) {
+      readClient(fd);
+      close(fd);
+    }
+    runLoop(2);
+    if (latestJob_ != nullptr) {
+      reactor_.postMiningNotify(std::make_shared<MiningNotifyTask>(latestJob_, 1));
+      runLoop(2);
+    }
+  }
+
+  bool setup() {
+    evthread_use_pthreads();
+#ifndef WORK_WITH_STRATUM_SWITCHER
+    server_.sessionIDManager_ = new SessionIDManager(1);
+#endif
+    server_.jobRepository_ = new JobRepository("", "", &server_);
+    // the sharelog is never flushed, there's no kafka. a handover flushes
+    // it, the sessions must not have accepted shares then
+    server_.shareLogBatchSize_ = 1000000;
+    server_.shareLogBatchMs_   = 3600 * 1000;
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port        = 0;
+    return reactor_.setup(sin, 1);
+  }
+
+  // it's the latest job of the repository
+  shared_ptr<StratumJobEx> addJob(const uint64_t jobId, const bool isClean) {
+    StratumJob *sjob = makeTestStratumJob();
+    sjob->jobId_ = jobId;
+    server_.jobRepository_->restoreJob(sjob, isClean, false);
+    latestJob_ = server_.jobRepository_->getLatestStratumJobEx();
+    return latestJob_;
+  }
+
+  // a new session on a socketpair, it's not added to the reactor. the
+  // caller closes clientFd
+  StratumSession *newSession(int *clientFd) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      return nullptr;
+    }
+    evutil_make_socket_nonblocking(fds[0]);
+    evutil_make_socket_nonblocking(fds[1]);
+    *clientFd = fds[1];
+
+    struct sockaddr_in saddr;
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family      = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct bufferevent *bev = bufferevent_socket_new(reactor_.getBase(), fds[0],
+                                                     BEV_OPT_CLOSE_ON_FREE|BEV_OPT_THREADSAFE);
+    return new StratumSession(fds[0], bev, &server_, &reactor_,
+                              (struct sockaddr *)&saddr,
+                              server_.kShareAvgSeconds_, 0);
+  }
+
+  // the same as Reactor::restoreSession(), nullptr if the state is invalid
+  StratumSession *addSession(const string &state, int *clientFd) {
+    StratumSession *session = newSession(clientFd);
+    if (session == nullptr) {
+      return nullptr;
+    }
+    clientFds_.push_back(*clientFd);
+    if (!session->restoreState(state)) {
+      delete session;
+      return nullptr;
+    }
+#ifndef WORK_WITH_STRATUM_SWITCHER
+    server_.sessionIDManager_->reserveSessionId(session->getSessionId());
+#endif
+    bufferevent_setcb(session->bev_, Server::readCallback, nullptr,
+                      Server::eventCallback, (void *)session);
+    bufferevent_enable(session->bev_, EV_READ|EV_WRITE);
+    reactor_.addConnection(session->fd_, session);
+    session->resumeHandoff();
+    return session;
+  }
+  inline StratumSession *addSession(const TestSessionState &state, int *clientFd) {
+    return addSession(state.serialize(), clientFd);
+  }
+
+  // n iterations of the reactor's loop, each polls the sockets once
+  void runLoop(const int32_t n = 1) {
+    for (int32_t i = 0; i < n; i++) {
+      event_base_loop(reactor_.getBase(), EVLOOP_ONCE|EVLOOP_NONBLOCK);
+    }
+  }
+
+  // what the miner received so far
+  static string readClient(const int fd) {
+    string data;
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+      data.append(buf, n);
+    }
+    return data;
+  }
+
+  static void writeClient(const int fd, const string &data) {
+    ASSERT_EQ(send(fd, data.data(), data.size(), 0), (ssize_t)data.size());
+  }
+};
+
+// the notify lines of the received data
+static vector<string> getNotifyLines(const string &data) {
+  vector<string> lines;
+  size_t pos = 0, end;
+  while ((end = data.find('\n', pos)) != string::npos) {
+    const string line = data.substr(pos, end - pos);
+    if (line.find("\"mining.notify\"") != string::npos) {
+      lines.push_back(line);
+    }
+    pos = end + 1;
+  }
+  return lines;
+}
+
+static bool isCleanNotify(const string &line) {
+  return line.size() > 7 && line.compare(line.size() - 7, 7, ",true]}") == 0;
+}
+
+TEST(StratumServer, CoinbasePrefix) {
+  StratumJobEx exJob(makeTestStratumJob(), true);
+  StratumJob *sjob = exJob.sjob_;
+
+  for (uint32_t i = 0; i < 100; i++) {
+    const uint32_t extraNonce1 = 0x01020304u * (i + 1);
+    const uint64_t extraNonce2 = 0x0102030405060708ull * (i + 7);
+    const uint32_t nTime = sjob->nTime_ + i;
+    const uint32_t nonce = 0xdeadbeefu + i;
+
+    // the old way: hex -> binary coinbase -> double sha
+    CBlockHeader header1;
+    std::vector<char> coinbaseBin;
+    exJob.generateBlockHeader(&header1, &coinbaseBin, extraNonce1,
+                              Strings::Format("%016llx", extraNonce2),
+                              sjob->merkleBranch_, sjob->prevHash_,
+                              sjob->nBits_, sjob->nVersion_, nTime, nonce);
+
+    // with the coinbase prefix midstate
+    CBlockHeader header2;
+    uint256 blkHash2;
+    CoinbasePrefix prefix;
+    exJob.initCoinbasePrefix(&prefix, extraNonce1);
+    ASSERT_EQ(prefix.isReady_, true);
+    exJob.generateBlockHeader(&header2, &blkHash2, prefix, extraNonce2,
+                              nTime, nonce);
+
+    ASSERT_EQ(header1.hashMerkleRoot, header2.hashMerkleRoot);
+    ASSERT_EQ(header1.GetHash(), header2.GetHash());
+    ASSERT_EQ(header1.GetHash(), blkHash2);
+  }
+}
+
+TEST(StratumServer, VersionRolling) {
+  StratumJobEx exJob(makeTestStratumJob(), true);
+  StratumJob *sjob = exJob.sjob_;
+  const uint32_t extraNonce1 = 0x01020304u;
+  const uint64_t extraNonce2 = 0x0102030405060708ull;
+  const uint32_t versionMask = 0x1fffe000u;
+
+  CoinbasePrefix prefix;
+  exJob.initCoinbasePrefix(&prefix, extraNonce1);
+
+  // no mask, the job's nVersion
+  CBlockHeader header;
+  uint256 blkHash;
+  exJob.generateBlockHeader(&header, &blkHash, prefix, extraNonce2,
+                            sjob->nTime_, 0, 0, 0xffffffffu);
+  ASSERT_EQ((uint32_t)header.nVersion, 0x20000000u);
+
+  // only the bits of the mask are taken from the miner
+  exJob.generateBlockHeader(&header, &blkHash, prefix, extraNonce2,
+                            sjob->nTime_, 0, versionMask, 0xe0006000u);
+  ASSERT_EQ((uint32_t)header.nVersion, 0x20006000u);
+  ASSERT_EQ(header.GetHash(), blkHash);
+
+  // the same block as the full coinbase way with the rolled nVersion
+  CBlockHeader fullHeader;
+  std::vector<char> coinbaseBin;
+  exJob.generateBlockHeader(&fullHeader, &coinbaseBin, extraNonce1,
+                            Strings::Format("%016llx", extraNonce2),
+                            sjob->merkleBranch_, sjob->prevHash_,
+                            sjob->nBits_, header.nVersion, sjob->nTime_, 0);
+  ASSERT_EQ(fullHeader.GetHash(), blkHash);
+
+  // the rolled share is another share
+  StratumSession::LocalJob ljob;
+  ASSERT_EQ(ljob.addLocalShare(StratumSession::LocalShare(1, 2, 3)), true);
+  ASSERT_EQ(ljob.addLocalShare(StratumSession::LocalShare(1, 2, 3, 0x2000u)), true);
+  ASSERT_EQ(ljob.addLocalShare(StratumSession::LocalShare(1, 2, 3, 0x2000u)), false);
+}
+
+TEST(StratumServer, BinaryNotify) {
+  StratumJobEx exJob(makeTestStratumJob(), true);
+  StratumJob *sjob = exJob.sjob_;
+  ASSERT_NE(exJob.binNotifyHead_, nullptr);
+  ASSERT_NE(exJob.binNotifyTail_, nullptr);
+
+  // what the session sends: head + <shortJobId, clean> + tail
+  string bin(exJob.binNotifyHead_->data(), exJob.binNotifyHead_->size());
+  bin.push_back((char)5);
+  bin.push_back((char)1);
+  bin.append(exJob.binNotifyTail_->data(), exJob.binNotifyTail_->size());
+
+  BinaryStratum::Notify notify;
+  ASSERT_EQ(BinaryStratum::decode((const uint8_t *)bin.data(), bin.size(), notify), true);
+  ASSERT_EQ(notify.shortJobId_, 5);
+  ASSERT_EQ(notify.isClean_, true);
+  ASSERT_EQ(notify.prevHash_, sjob->prevHash_);
+  ASSERT_EQ(notify.nVersion_, sjob->nVersion_);
+  ASSERT_EQ(notify.nBits_, sjob->nBits_);
+  ASSERT_EQ(notify.nTime_, sjob->nTime_);
+  ASSERT_EQ(notify.merkleBranch_ == sjob->merkleBranch_, true);
+  string coinbase1, coinbase2;
+  Bin2Hex((const uint8_t *)notify.coinbase1_.data(), notify.coinbase1_.size(), coinbase1);
+  Bin2Hex((const uint8_t *)notify.coinbase2_.data(), notify.coinbase2_.size(), coinbase2);
+  ASSERT_EQ(coinbase1, sjob->coinbase1_);
+  ASSERT_EQ(coinbase2, sjob->coinbase2_);
+
+  // the json one
+  string json(exJob.notifyHead_->data(), exJob.notifyHead_->size());
+  json.append("5");
+  json.append(exJob.notifyTailClean_->data(), exJob.notifyTailClean_->size());
+  ASSERT_LT(bin.size() * 2, json.size());
+
+  // decode on the client side
+  const int32_t kNotifies = 50000;
+  uint64_t dummy = 0;
+  int64_t begin = getMonotonicTimeUs();
+  for (int32_t i = 0; i < kNotifies; i++) {
+    JsonNode jnode;
+    JsonNode::parse(json.data(), json.data() + json.size(), jnode);
+    dummy += jnode["params"].array().size();
+  }
+  const int64_t jsonUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  begin = getMonotonicTimeUs();
+  for (int32_t i = 0; i < kNotifies; i++) {
+    BinaryStratum::decode((const uint8_t *)bin.data(), bin.size(), notify);
+    dummy += notify.merkleBranch_.size();
+  }
+  const int64_t binUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  LOG(INFO) << "mining.notify bytes, json: " << json.size()
+  << ", binary: " << bin.size();
+  LOG(INFO) << "decode notify, notifies/sec, JsonNode: "
+  << kNotifies * 1000000LL / jsonUs << ", BinaryStratum: "
+  << kNotifies * 1000000LL / binUs << " (" << dummy << ")";
+}
+
+TEST(StratumServer, ShareVerifier) {
+  evthread_use_pthreads();
+  shared_ptr<StratumJobEx> exJob = std::make_shared<StratumJobEx>(makeTestStratumJob(), true);
+  StratumJob *sjob = exJob->sjob_;
+  CoinbasePrefix prefix;
+  exJob->initCoinbasePrefix(&prefix, 0x01020304u);
+
+  // the verified batches go back to the reactor
+  Server server(10);
+  Reactor reactor(&server, 0);
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family      = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port        = 0;
+  ASSERT_EQ(reactor.setup(sin, 1), true);
+
+  // 100 shares per batch, at most 2 batches are queued
+  ShareVerifier verifier(2, 200);
+  vector<VerifyBatch *> batches;
+  for (uint32_t b = 0; b < 8; b++) {
+    VerifyBatch *batch = new VerifyBatch(&reactor);
+    for (uint32_t i = 0; i < 100; i++) {
+      PendingShare ps;
+      ps.session_  = nullptr;
+      // rejected before hashing, only kept in order
+      ps.result_   = (i % 10 == 9) ? StratumError::DUPLICATE_SHARE : StratumError::NO_ERROR;
+      ps.hasShare_ = true;
+      ps.extraNonce2_    = b * 100 + i;
+      ps.nTime_          = sjob->nTime_;
+      ps.nonce_          = i;
+      ps.versionMask_    = 0;
+      ps.versionBits_    = 0;
+      ps.exJobPtr_       = exJob;
+      ps.coinbasePrefix_ = prefix.midstate_;
+      batch->shares_.push_back(ps);
+    }
+    batch->postTime_ = getMonotonicTimeUs();
+    if (!verifier.post(batch)) {
+      // full, hashed by the caller like Reactor::flushShares()
+      batch->hash();
+      verifier.recordOverflow(*batch);
+      batch->isDone_ = true;
+    }
+    batches.push_back(batch);
+  }
+
+  for (VerifyBatch *batch : batches) {
+    for (int i = 0; i < 5000 && !batch->isDone_; i++) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(batch->isDone_, true);
+
+    size_t n = 0;
+    for (const PendingShare &ps : batch->shares_) {
+      if (ps.result_ != StratumError::NO_ERROR) {
+        continue;
+      }
+      CBlockHeader header;
+      uint256 blkHash;
+      exJob->generateBlockHeader(&header, &blkHash, prefix, ps.extraNonce2_,
+                                 ps.nTime_, ps.nonce_);
+      ASSERT_EQ(batch->items_[n].hash_, blkHash);
+      n++;
+    }
+    ASSERT_EQ(n, 90u);
+  }
+  ASSERT_LE(verifier.getMaxQueuedShares(), 200u);
+  ASSERT_EQ(verifier.getQueuedShares(), 0u);
+  ASSERT_EQ(verifier.getLatency().getCount(), 8u);
+
+  verifier.stop();
+  // no more batches after stopping
+  ASSERT_EQ(verifier.post(batches[0]), false);
+  for (VerifyBatch *batch : batches) {
+    delete batch;
+  }
+}
+
+static string makeSubmit(const uint32_t id, const uint8_t shortJobId,
+                         const uint64_t extraNonce2, const uint32_t nTime,
+                         const uint32_t nonce) {
+  return Strings::Format("{\"id\":%u,\"method\":\"mining.submit\",\"params\":"
+                         "[\"test.w1\",\"%u\",\"%016llx\",\"%08x\",\"%08x\"]}\n",
+                         id, (uint32_t)shortJobId, extraNonce2, nTime, nonce);
+}
+
+TEST(StratumSession, RetargetJob) {
+  TestReactor t;
+  ASSERT_EQ(t.setup(), true);
+  t.server_.isEnableSimulator_ = true;
+  t.server_.varDiffType_ = DiffController::TYPE_EWMA;
+  shared_ptr<StratumJobEx> exJob = t.addJob(1, true);
+
+  int fd = -1;
+  StratumSession *session = t.addSession(TestSessionState(1, 1024), &fd);
+  ASSERT_NE(session, nullptr);
+  session->sendMiningNotify(exJob);
+  t.runLoop();
+  vector<string> notifies = getNotifyLines(TestReactor::readClient(fd));
+  ASSERT_EQ(notifies.size(), 1u);
+  ASSERT_EQ(isCleanNotify(notifies[0]), true);
+
+  // the shares are far faster than the diff, the latest job is sent again
+  // with a new diff. the miner keeps its work, it's not clean
+  for (uint32_t i = 0; i < 4; i++) {
+    TestReactor::writeClient(fd, makeSubmit(i + 10, 0, i, exJob->sjob_->nTime_, i));
+    t.runLoop(3);
+  }
+  const string data = TestReactor::readClient(fd);
+  ASSERT_EQ(std::count(data.begin(), data.end(), '\n'), 6);
+  ASSERT_NE(data.find("\"mining.set_difficulty\""), string::npos);
+  notifies = getNotifyLines(data);
+  ASSERT_EQ(notifies.size(), 1u);
+  ASSERT_EQ(isCleanNotify(notifies[0]), false);
+  ASSERT_EQ(notifies[0].compare(notifies[0].size() - 8, 8, ",false]}"), 0);
+  ASSERT_EQ(exJob->isClean_, true);
+
+  // a new clean job is still clean
+  shared_ptr<StratumJobEx> exJob2 = t.addJob(2, true);
+  session->sendMiningNotify(exJob2);
+  t.runLoop();
+  notifies = getNotifyLines(TestReactor::readClient(fd));
+  ASSERT_EQ(notifies.size(), 1u);
+  ASSERT_EQ(isCleanNotify(notifies[0]), true);
+}
+
+static size_t countLines(const string &data, const string &pattern) {
+  size_t n = 0;
+  for (size_t pos = data.find(pattern); pos != string::npos;
+       pos = data.find(pattern, pos + pattern.size())) {
+    n++;
+  }
+  return n;
+}
+
+// the state of a new session restored from it, "" if it's invalid
+static string restoreAndSave(TestReactor &t, const string &state) {
+  int fd = -1;
+  StratumSession *session = t.newSession(&fd);
+  string saved;
+  if (session->restoreState(state)) {
+    session->saveState(saved);
+  }
+  delete session;
+  close(fd);
+  return saved;
+}
+
+TEST(StratumSession, HandoffState) {
+  TestReactor t;
+  ASSERT_EQ(t.setup(), true);
+  t.server_.isEnableSimulator_ = true;
+  shared_ptr<StratumJobEx> exJob = t.addJob(1, true);
+
+  // an agent with its workers: the local jobs have shares and diff tables
+  TestSessionState agentState(1, 1024);
+  agentState.isAgent_ = true;
+  agentState.agentSessionIds_ = {1, 2, 5};
+  int fd = -1;
+  StratumSession *agent = t.addSession(agentState, &fd);
+  ASSERT_NE(agent, nullptr);
+  agent->sendMiningNotify(exJob);
+  for (uint32_t i = 0; i < 3; i++) {
+    TestReactor::writeClient(fd, makeSubmit(i + 10, 0, i, exJob->sjob_->nTime_, i));
+  }
+  t.runLoop(3);
+  // a message not finished yet, and a notify not written yet
+  TestReactor::writeClient(fd, "{\"id\":20,\"method\":\"mining.sub");
+  t.runLoop(2);
+  ASSERT_EQ(countLines(TestReactor::readClient(fd), "\"result\":true"), 3u);
+  agent->sendMiningNotify(t.addJob(2, false));
+
+  string state;
+  agent->saveState(state);
+  ASSERT_NE(state.find("{\"id\":20,\"method\":\"mining.sub"), string::npos);
+  ASSERT_NE(state.find("\"mining.notify\""), string::npos);
+  ASSERT_EQ(restoreAndSave(t, state) == state, true);
+
+  // the restored one is the same session
+  int fd2 = -1;
+  StratumSession *agent2 = t.newSession(&fd2);
+  ASSERT_EQ(agent2->restoreState(state), true);
+  ASSERT_EQ(agent2->getSessionId(), agent->getSessionId());
+  ASSERT_EQ(agent2->getNotifyPriority(), UINT64_MAX);
+  delete agent2;
+  close(fd2);
+
+  // an authorize waiting for the admission, and the replies before it
+  TestSessionState authState(2, 1024);
+  authState.state_ = StratumSession::SUBSCRIBED;
+  authState.hasPendingAuthorize_ = true;
+  authState.input_  = "{\"id\":3,\"method\":\"mining.suggest_difficulty\",\"params\":[4096]}\n";
+  authState.output_ = "{\"id\":1,\"result\":[[[\"mining.set_difficulty\",\"01000002\"]],\"01000002\",8],\"error\":null}\n";
+  const string authSaved = restoreAndSave(t, authState.serialize());
+  ASSERT_NE(authSaved.find("test.w2"), string::npos);
+  ASSERT_NE(authSaved.find(authState.input_), string::npos);
+  ASSERT_NE(authSaved.find(authState.output_), string::npos);
+  ASSERT_EQ(restoreAndSave(t, authSaved) == authSaved, true);
+
+  // truncated anywhere
+  for (size_t len = 0; len < state.size(); len++) {
+    ASSERT_EQ(restoreAndSave(t, state.substr(0, len)), "");
+  }
+  for (size_t len = 0; len < authSaved.size(); len++) {
+    ASSERT_EQ(restoreAndSave(t, authSaved.substr(0, len)), "");
+  }
+
+  // more than a state
+  ASSERT_EQ(restoreAndSave(t, state + "x"), "");
+  // a name is 4 KiB at most
+  TestSessionState longName(3, 1024);
+  longName.userName_ = string(4096, 'a');
+  ASSERT_NE(restoreAndSave(t, longName.serialize()), "");
+  longName.userName_ = string(4097, 'a');
+  ASSERT_EQ(restoreAndSave(t, longName.serialize()), "");
+  // too many workers of an agent
+  TestSessionState manyWorkers(4, 1024);
+  manyWorkers.isAgent_ = true;
+  for (uint32_t i = 0; i < AGENT_MAX_SESSION_ID + 2; i++) {
+    manyWorkers.agentSessionIds_.push_back((uint16_t)i);
+  }
+  ASSERT_EQ(restoreAndSave(t, manyWorkers.serialize()), "");
+  manyWorkers.agentSessionIds_.resize(AGENT_MAX_SESSION_ID + 1);
+  ASSERT_NE(restoreAndSave(t, manyWorkers.serialize()), "");
+}
+
+TEST(StratumSession, HandoffResume) {
+  TestReactor t;
+  ASSERT_EQ(t.setup(), true);
+  t.server_.isEnableSimulator_ = true;
+  shared_ptr<StratumJobEx> exJob = t.addJob(1, true);
+
+  int fd = -1;
+  StratumSession *session = t.addSession(TestSessionState(1, 1024), &fd);
+  ASSERT_NE(session, nullptr);
+  session->sendMiningNotify(exJob);
+  t.runLoop(2);
+  ASSERT_EQ(getNotifyLines(TestReactor::readClient(fd)).size(), 1u);
+
+  // a submit is half read when the reactor is frozen
+  const string submit = makeSubmit(10, 0, 1, exJob->sjob_->nTime_, 1);
+  TestReactor::writeClient(fd, submit.substr(0, 40));
+  t.runLoop(2);
+  shared_ptr<HandoffTask> task = std::make_shared<HandoffTask>(1);
+  t.reactor_.postHandoff(task);
+  t.runLoop(2);
+  ASSERT_EQ(task->wait(0), true);
+  ASSERT_EQ(task->sessions_.size(), 1u);
+  ASSERT_EQ(t.reactor_.getConnectionsCount(), 0u);
+
+  // the handover fails, the sessions go back, see Server::resumeHandoff()
+  vector<HandoffSession> sessions;
+  task->cancel(sessions);
+  ASSERT_EQ(task->isCancelled(), true);
+  ASSERT_EQ(sessions.size(), 1u);
+  ASSERT_EQ(task->sessions_.size(), 0u);
+  t.reactor_.postRestore(sessions);
+  t.runLoop(2);
+  ASSERT_EQ(t.reactor_.getConnectionsCount(), 1u);
+
+  // the rest of the submit, then the same share again: the job is kept
+  TestReactor::writeClient(fd, submit.substr(40));
+  t.runLoop(2);
+  TestReactor::writeClient(fd, makeSubmit(11, 0, 1, exJob->sjob_->nTime_, 1));
+  t.runLoop(2);
+  const string data = TestReactor::readClient(fd);
+  ASSERT_NE(data.find("{\"id\":10,\"result\":true"), string::npos);
+  ASSERT_NE(data.find(Strings::Format("{\"id\":11,\"result\":null,\"error\":[%d,",
+                                      (int)StratumError::DUPLICATE_SHARE)),
+            string::npos);
+}
+
+// a client connected to the reactor's listener, not accepted yet
+static int connectReactor(const Reactor &reactor) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(reactor.getListenerFd(), (struct sockaddr *)&addr, &len) != 0) {
+    return -1;
+  }
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, len) != 0) {
+    close(fd);
+    return -1;
+  }
+  evutil_make_socket_nonblocking(fd);
+  return fd;
+}
+
+//
+// a reconnect storm against a reactor: the accepts and the authorizes are
+// paced by the limits, the deferred authorizes are admitted in order, and
+// the first jobs are sent a batch per loop iteration
+//
+TEST(StratumServer, ReconnectStorm) {
+  const size_t kClients = 40;
+  const int64_t kSecond = 1000000;
+  TestReactor t;
+  t.server_.maxAcceptsPerSecond_    = 200;  // burst of 20
+  t.server_.maxAuthorizesPerSecond_ = 100;  // burst of 10
+  t.server_.firstJobBatchSize_      = 4;
+  // no users, the authorizes fail
+  t.server_.userInfo_ = new UserInfo("", "", &t.server_);
+  ASSERT_EQ(t.setup(), true);
+  t.addJob(1, true);
+
+  // the listener is paused once the burst is used up
+  vector<int> clients;
+  for (size_t i = 0; i < kClients; i++) {
+    const int fd = connectReactor(t.reactor_);
+    ASSERT_GE(fd, 0);
+    clients.push_back(fd);
+    t.clientFds_.push_back(fd);
+  }
+  int64_t begin = getMonotonicTimeUs();
+  t.runLoop();
+  ASSERT_LE(t.reactor_.getConnectionsCount(), 21u);
+  while (t.reactor_.getConnectionsCount() < kClients &&
+         getMonotonicTimeUs() - begin < 10 * kSecond) {
+    usleep(1000);
+    t.runLoop();
+  }
+  ASSERT_EQ(t.reactor_.getConnectionsCount(), kClients);
+  // the ones over the burst at 200/s
+  ASSERT_GE(getMonotonicTimeUs() - begin, kSecond * (int64_t)(kClients - 21) / 200 / 2);
+
+  // the authorizes over the burst wait, and they are admitted in order
+  const string authorize = "{\"id\":1,\"method\":\"mining.subscribe\",\"params\":[]}\n"
+                           "{\"id\":2,\"method\":\"mining.authorize\",\"params\":[\"nobody.w1\",\"x\"]}\n";
+  begin = getMonotonicTimeUs();
+  for (const int fd : clients) {
+    TestReactor::writeClient(fd, authorize);
+    t.runLoop();
+  }
+  ASSERT_GE(t.reactor_.getPendingAuthorizesNum(), kClients - 12);
+
+  vector<string> received(kClients);
+  vector<int32_t> repliedLoop(kClients, -1);
+  size_t repliedNum = 0;
+  for (int32_t loop = 0; repliedNum < kClients &&
+       getMonotonicTimeUs() - begin < 10 * kSecond; loop++) {
+    usleep(1000);
+    t.runLoop();
+    for (size_t i = 0; i < kClients; i++) {
+      received[i] += TestReactor::readClient(clients[i]);
+      if (repliedLoop[i] < 0 && received[i].find("{\"id\":2,") != string::npos) {
+        repliedLoop[i] = loop;
+        repliedNum++;
+      }
+    }
+  }
+  ASSERT_EQ(repliedNum, kClients);
+  ASSERT_EQ(t.reactor_.getPendingAuthorizesNum(), 0u);
+  ASSERT_GE(getMonotonicTimeUs() - begin, kSecond * (int64_t)(kClients - 10) / 100 / 2);
+  for (size_t i = 1; i < kClients; i++) {
+    ASSERT_LE(repliedLoop[i - 1], repliedLoop[i]);
+  }
+  for (size_t i = 0; i < kClients; i++) {
+    ASSERT_NE(received[i].find(Strings::Format("{\"id\":2,\"result\":null,\"error\":[%d,",
+                                               (int)StratumError::INVALID_USERNAME)),
+              string::npos);
+  }
+
+  // authorized at once, e.g. by a handover: 4 first jobs per loop iteration
+  vector<int> miners;
+  for (uint32_t i = 0; i < 10; i++) {
+    TestSessionState state(1000 + i, 1024);
+    state.isWaitingFirstJob_ = true;
+    int fd = -1;
+    ASSERT_NE(t.addSession(state, &fd), nullptr);
+    miners.push_back(fd);
+  }
+  ASSERT_EQ(t.reactor_.getPendingFirstJobsNum(), 10u);
+  t.runLoop();
+  ASSERT_EQ(t.reactor_.getPendingFirstJobsNum(), 6u);
+  t.runLoop();
+  ASSERT_EQ(t.reactor_.getPendingFirstJobsNum(), 2u);
+  t.runLoop();
+  ASSERT_EQ(t.reactor_.getPendingFirstJobsNum(), 0u);
+  t.runLoop(2);
+  for (const int fd : miners) {
+    const vector<string> lines = getNotifyLines(TestReactor::readClient(fd));
+    ASSERT_EQ(lines.size(), 1u);
+    ASSERT_EQ(isCleanNotify(lines[0]), true);
+  }
+}
+
+// Reactor::kPacingSlotMs_
+static const int64_t kTestPacingSlotUs = 10 * 1000;
+
+// Server::pacingClock_ of the tests, stepped by hand
+static int64_t gTestPacingTimeUs = 1000000;
+static int64_t getTestPacingTimeUs() {
+  return gTestPacingTimeUs;
+}
+
+//
+// a non-clean job is paced over the slots, the sessions of higher priority
+// first. a clean job goes to all at once, and a new job ends the round.
+// the tasks are of 2 reactors: 1 is left once this one finished its round.
+//
+TEST(StratumServer, PacedNotify) {
+  const int64_t kSlotsNum = 5;
+  TestReactor t;
+  t.server_.notifyPacingMs_ = (int32_t)(kSlotsNum * kTestPacingSlotUs / 1000);
+  t.server_.pacingClock_    = getTestPacingTimeUs;
+  ASSERT_EQ(t.setup(), true);
+  t.addJob(1, true);
+
+  // an agent goes first, then the higher difficulty
+  const uint32_t diffShifts[] = {3, 8, 0, 5, 1, 7, 2, 6, 4};
+  const size_t kSessions = 1 + sizeof(diffShifts) / sizeof(diffShifts[0]);
+  vector<std::pair<uint64_t, int> > clients;
+  TestSessionState agentState(1, 1024);
+  agentState.isAgent_ = true;
+  agentState.agentSessionIds_ = {1};
+  int fd = -1;
+  ASSERT_NE(t.addSession(agentState, &fd), nullptr);
+  clients.push_back(std::make_pair(UINT64_MAX, fd));
+  for (uint32_t i = 0; i + 1 < kSessions; i++) {
+    const uint64_t diff = 1024ull << diffShifts[i];
+    ASSERT_NE(t.addSession(TestSessionState(2 + i, diff), &fd), nullptr);
+    clients.push_back(std::make_pair(diff, fd));
+  }
+  std::stable_sort(clients.begin(), clients.end(),
+                   [](const std::pair<uint64_t, int> &a,
+                      const std::pair<uint64_t, int> &b) {
+                     return a.first > b.first;
+                   });
+
+  // the sessions with a notify so far, they must be the first ones
+  vector<vector<string> > notifies(kSessions);
+  auto readNotifies = [&]() -> size_t {
+    size_t notified = 0;
+    for (size_t i = 0; i < kSessions; i++) {
+      for (const string &line : getNotifyLines(TestReactor::readClient(clients[i].second))) {
+        notifies[i].push_back(line);
+      }
+      if (!notifies[i].empty()) {
+        EXPECT_EQ(notified, i);
+        notified++;
+      }
+    }
+    return notified;
+  };
+  // the timer of the next slot is real, it's waited for. the clock doesn't
+  // move meanwhile, so no more than the slot's sessions are sent
+  auto waitNotified = [&](const size_t n) -> size_t {
+    const int64_t begin = getMonotonicTimeUs();
+    size_t notified = readNotifies();
+    while (notified < n && getMonotonicTimeUs() - begin < 5000000) {
+      usleep(1000);
+      t.runLoop();
+      notified = readNotifies();
+    }
+    t.runLoop(2);
+    return readNotifies();
+  };
+
+  // 2 sessions per slot. slot 1 at once, a late timer catches up to its
+  // slot, then the rest
+  shared_ptr<MiningNotifyTask> task = std::make_shared<MiningNotifyTask>(t.addJob(2, false), 2);
+  t.reactor_.postMiningNotify(task);
+  ASSERT_EQ(waitNotified(2), 2u);
+  ASSERT_EQ(task->pendingReactors_.load(), 2);
+
+  gTestPacingTimeUs += 3 * kTestPacingSlotUs + kTestPacingSlotUs / 2;  // slot 4
+  ASSERT_EQ(waitNotified(8), 8u);
+  ASSERT_EQ(task->pendingReactors_.load(), 2);
+
+  gTestPacingTimeUs += 2 * kTestPacingSlotUs;  // after the window
+  ASSERT_EQ(waitNotified(kSessions), kSessions);
+  ASSERT_EQ(task->pendingReactors_.load(), 1);
+  ASSERT_EQ(task->sessionsCount_.load(), (int64_t)kSessions);
+  for (size_t i = 0; i < kSessions; i++) {
+    ASSERT_EQ(notifies[i].size(), 1u);
+    ASSERT_EQ(isCleanNotify(notifies[i][0]), false);
+    notifies[i].clear();
+  }
+
+  // a clean job in one slot
+  task = std::make_shared<MiningNotifyTask>(t.addJob(3, true), 2);
+  t.reactor_.postMiningNotify(task);
+  t.runLoop(2);
+  ASSERT_EQ(task->pendingReactors_.load(), 1);
+  ASSERT_EQ(task->sessionsCount_.load(), (int64_t)kSessions);
+  ASSERT_EQ(readNotifies(), kSessions);
+  for (size_t i = 0; i < kSessions; i++) {
+    ASSERT_EQ(notifies[i].size(), 1u);
+    ASSERT_EQ(isCleanNotify(notifies[i][0]), true);
+    notifies[i].clear();
+  }
+
+  // a new job ends the round in slot 1, the sessions not reached get only
+  // the new one
+  task = std::make_shared<MiningNotifyTask>(t.addJob(4, false), 2);
+  t.reactor_.postMiningNotify(task);
+  t.runLoop();
+  shared_ptr<MiningNotifyTask> nextTask = std::make_shared<MiningNotifyTask>(t.addJob(5, false), 2);
+  t.reactor_.postMiningNotify(nextTask);
+  t.runLoop();
+  ASSERT_EQ(task->pendingReactors_.load(), 1);
+  ASSERT_EQ(task->sessionsCount_.load(), 2);
+
+  gTestPacingTimeUs += kSlotsNum * kTestPacingSlotUs;
+  ASSERT_EQ(waitNotified(kSessions), kSessions);
+  ASSERT_EQ(nextTask->pendingReactors_.load(), 1);
+  ASSERT_EQ(nextTask->sessionsCount_.load(), (int64_t)kSessions);
+  for (size_t i = 0; i < kSessions; i++) {
+    ASSERT_EQ(notifies[i].size(), i < 2 ? 2u : 1u);
+  }
+
+  // nothing is left of the rounds
+  gTestPacingTimeUs += kSlotsNum * kTestPacingSlotUs;
+  t.runLoop(3);
+  ASSERT_EQ(readNotifies(), kSessions);
+  ASSERT_EQ(task->pendingReactors_.load(), 1);
+  ASSERT_EQ(nextTask->pendingReactors_.load(), 1);
+  for (size_t i = 0; i < kSessions; i++) {
+    ASSERT_EQ(notifies[i].size(), i < 2 ? 2u : 1u);
+  }
+}
+
+static int64_t getThreadCpuTimeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//
+// the sessions per slot and the cpu time of the reactor per slot, a
+// non-clean job to 1000 sessions at once and paced over 10 slots. the
+// peak/avg of the sessions per slot is the egress burst of the job.
+//
+TEST(StratumServer, PacedNotifyBenchmark) {
+  const int64_t kSlotsNum = 10;
+  const size_t kSessions = 1000;
+  TestReactor t;
+  t.server_.pacingClock_ = getTestPacingTimeUs;
+  ASSERT_EQ(t.setup(), true);
+  t.addJob(1, true);
+
+  vector<int> clients;
+  for (size_t i = 0; i < kSessions; i++) {
+    int fd = -1;
+    ASSERT_NE(t.addSession(TestSessionState(1 + i, 1024), &fd), nullptr);
+    clients.push_back(fd);
+  }
+  auto readNotifies = [&]() -> size_t {
+    size_t notified = 0;
+    for (const int fd : clients) {
+      notified += getNotifyLines(TestReactor::readClient(fd)).size();
+    }
+    return notified;
+  };
+  // the sessions sent in a slot and the cpu time the loop took for them
+  auto runSlot = [&](const size_t n, int64_t *cpuUs) -> size_t {
+    const int64_t begin = getMonotonicTimeUs();
+    size_t notified = 0;
+    *cpuUs = 0;
+    while (notified < n && getMonotonicTimeUs() - begin < 5000000) {
+      const int64_t cpuBegin = getThreadCpuTimeUs();
+      t.runLoop();
+      *cpuUs += getThreadCpuTimeUs() - cpuBegin;
+      notified += readNotifies();
+      if (notified < n) {
+        usleep(500);
+      }
+    }
+    return notified;
+  };
+
+  // at once: all of the sessions in one slot
+  int64_t cpuUs = 0;
+  t.reactor_.postMiningNotify(std::make_shared<MiningNotifyTask>(t.addJob(2, false), 1));
+  ASSERT_EQ(runSlot(kSessions, &cpuUs), kSessions);
+  const double peakToAvg = (double)kSessions * kSlotsNum / kSessions;
+  const int64_t burstUs = cpuUs;
+
+  // paced: a slot of the window at a time
+  t.server_.notifyPacingMs_ = (int32_t)(kSlotsNum * kTestPacingSlotUs / 1000);
+  t.reactor_.postMiningNotify(std::make_shared<MiningNotifyTask>(t.addJob(3, false), 1));
+  size_t maxSlotSent = 0, sent = 0;
+  int64_t maxSlotCpuUs = 0;
+  for (int64_t slot = 1; slot <= kSlotsNum; slot++) {
+    const size_t slotSent = runSlot(kSessions * slot / kSlotsNum - sent, &cpuUs);
+    ASSERT_EQ(slotSent, kSessions / kSlotsNum);
+    sent += slotSent;
+    maxSlotSent  = std::max(maxSlotSent, slotSent);
+    maxSlotCpuUs = std::max(maxSlotCpuUs, cpuUs);
+    gTestPacingTimeUs += kTestPacingSlotUs;
+  }
+  ASSERT_EQ(sent, kSessions);
+  const double pacedPeakToAvg = (double)maxSlotSent * kSlotsNum / kSessions;
+  ASSERT_EQ(pacedPeakToAvg, 1.0);
+
+  LOG(INFO) << "mining notify to " << kSessions << " sessions over "
+  << kSlotsNum << " slots. at once: peak/avg " << peakToAvg
+  << ", cpu burst " << burstUs << " us; paced: peak/avg " << pacedPeakToAvg
+  << ", max cpu per slot " << maxSlotCpuUs << " us";
+}
+
+//
+// a miner not reading: the superseded notify is removed from the output of
+// the session, the replacement is clean if the removed one was, and the
+// session is evicted after outputEvictJobs_ jobs over the mark
+//
+TEST(StratumSession, ReclaimOutput) {
+  TestReactor t;
+  ASSERT_EQ(t.setup(), true);
+  t.server_.outputEvictJobs_ = 3;
+  uint32_t jobId = 1;
+  shared_ptr<StratumJobEx> exJob = t.addJob(jobId++, true);
+
+  int fd = -1;
+  StratumSession *session = t.addSession(TestSessionState(1, 1024), &fd);
+  ASSERT_NE(session, nullptr);
+  struct evbuffer *output = bufferevent_get_output(session->bev_);
+  const int sndbuf = 4096;
+  ASSERT_EQ(setsockopt(session->fd_, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)), 0);
+
+  // the socket is full, the rest waits in the output
+  session->sendMiningNotify(exJob);
+  size_t sentNum = 1;
+  t.runLoop(2);
+  while (evbuffer_get_length(output) == 0 && sentNum < 10000) {
+    session->sendMiningNotify(t.addJob(jobId++, false));
+    sentNum++;
+    t.runLoop(2);
+  }
+  ASSERT_GT(evbuffer_get_length(output), 0u);
+
+  // the output isn't written meanwhile, only the latest notify is over the
+  // mark. it's replaced, none of the bytes before it
+  const size_t baseLen = evbuffer_get_length(output);
+  t.server_.outputHighWater_ = (int32_t)baseLen;
+  session->sendMiningNotify(t.addJob(jobId++, false));
+  size_t notifyLen = evbuffer_get_length(output) - baseLen;
+  uint64_t droppedBytes = t.server_.outputDroppedBytes_;
+  session->sendMiningNotify(t.addJob(jobId++, false));
+  ASSERT_EQ(t.server_.outputDroppedBytes_ - droppedBytes, notifyLen);
+  notifyLen = evbuffer_get_length(output) - baseLen;
+
+  // a clean job replaces it
+  droppedBytes = t.server_.outputDroppedBytes_;
+  session->sendMiningNotify(t.addJob(jobId++, true));
+  ASSERT_EQ(t.server_.outputDroppedBytes_ - droppedBytes, notifyLen);
+  notifyLen = evbuffer_get_length(output) - baseLen;
+
+  // the clean one is replaced, the new job is sent as clean
+  droppedBytes = t.server_.outputDroppedBytes_;
+  session->sendMiningNotify(t.addJob(jobId++, false));
+  ASSERT_EQ(t.server_.outputDroppedBytes_ - droppedBytes, notifyLen);
+  ASSERT_EQ(t.server_.outputEvictedSessions_.load(), 0u);
+
+  // the miner gets the jobs sent so far, then the last one only. every
+  // notify is whole
+  string received;
+  for (int i = 0; i < 1000 && evbuffer_get_length(output) > 0; i++) {
+    received += TestReactor::readClient(fd);
+    t.runLoop();
+  }
+  received += TestReactor::readClient(fd);
+  ASSERT_EQ(evbuffer_get_length(output), 0u);
+  const vector<string> lines = getNotifyLines(received);
+  ASSERT_EQ(lines.size(), sentNum + 1);
+  const string notifyBegin = "{\"id\":null,\"method\":\"mining.notify\",";
+  size_t len = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    ASSERT_EQ(lines[i].compare(0, notifyBegin.size(), notifyBegin), 0);
+    ASSERT_EQ(isCleanNotify(lines[i]), i == 0 || i == sentNum);
+    len += lines[i].size() + 1;
+  }
+  ASSERT_EQ(len, received.size());
+
+  // the output stays over the mark: evicted at the 3rd job
+  t.server_.outputHighWater_ = 0;
+  for (int i = 0; i < 100; i++) {
+    session->sendMiningNotify(t.addJob(jobId++, false));
+  }
+  t.runLoop(2);
+  ASSERT_GT(evbuffer_get_length(output), 0u);
+  t.server_.outputHighWater_ = 1;
+  session->sendMiningNotify(t.addJob(jobId++, false));
+  session->sendMiningNotify(t.addJob(jobId++, false));
+  ASSERT_EQ(session->isDead(), false);
+  ASSERT_EQ(t.server_.outputEvictedSessions_.load(), 0u);
+  session->sendMiningNotify(t.addJob(jobId++, false));
+  ASSERT_EQ(session->isDead(), true);
+  ASSERT_EQ(t.server_.outputEvictedSessions_.load(), 1u);
+  ASSERT_EQ(evbuffer_get_length(output), 0u);
+}
+
+TEST(StratumServer, ShareLatency) {
+  ShareLatency latency;
+  ASSERT_EQ(latency.getSampleRate(), 0u);
+  ASSERT_STREQ(ShareLatency::getStageName(ShareLatency::STAGE_READ), "read");
+  ASSERT_STREQ(ShareLatency::getStageName(ShareLatency::STAGE_SOLVED_QUEUE),
+               "solved_queue");
+  ASSERT_STREQ(ShareLatency::getStageName(ShareLatency::STAGES_NUM), "unknown");
+
+  // only the traced shares of a batch are stamped
+  shared_ptr<StratumJobEx> exJob = std::make_shared<StratumJobEx>(makeTestStratumJob(), true);
+  CoinbasePrefix prefix;
+  exJob->initCoinbasePrefix(&prefix, 0x01020304u);
+  VerifyBatch batch(nullptr);
+  for (uint32_t i = 0; i < 4; i++) {
+    PendingShare ps;
+    ps.session_        = nullptr;
+    ps.result_         = StratumError::NO_ERROR;
+    ps.hasShare_       = true;
+    ps.extraNonce2_    = i;
+    ps.nTime_          = exJob->sjob_->nTime_;
+    ps.nonce_          = i;
+    ps.versionMask_    = 0;
+    ps.versionBits_    = 0;
+    ps.exJobPtr_       = exJob;
+    ps.coinbasePrefix_ = prefix.midstate_;
+    if (i == 2) {
+      ps.trace_.readTime_     = 1000;
+      ps.trace_.lineTime_     = 1010;
+      ps.trace_.parsedTime_   = 1030;
+      ps.trace_.preparedTime_ = 1060;
+    }
+    batch.shares_.push_back(ps);
+  }
+  batch.hash();
+  for (uint32_t i = 0; i < 4; i++) {
+    const ShareTrace &trace = batch.shares_[i].trace_;
+    ASSERT_EQ(trace.isTraced(), i == 2);
+    if (i == 2) {
+      ASSERT_GT(trace.hashTime_, 0);
+      ASSERT_GE(trace.hashedTime_, trace.hashTime_);
+    } else {
+      ASSERT_EQ(trace.hashTime_, 0);
+      ASSERT_EQ(trace.hashedTime_, 0);
+    }
+  }
+
+  // the stages of a trace
+  ShareTrace trace;
+  trace.readTime_     = 1000;
+  trace.lineTime_     = 1010;
+  trace.parsedTime_   = 1030;
+  trace.preparedTime_ = 1060;
+  trace.hashTime_     = 1100;
+  trace.hashedTime_   = 1150;
+  latency.recordTrace(trace, 1210, 1280, 1360, "user.worker");
+  const int64_t expected[] = {10, 20, 30, 40, 50, 60, 70, 80, 360};
+  for (int32_t i = 0; i <= ShareLatency::STAGE_TOTAL; i++) {
+    const LatencyHistogram &h = latency.getStage((ShareLatency::Stage)i);
+    ASSERT_EQ(h.getCount(), 1u);
+    ASSERT_EQ(h.getMax(), (uint64_t)expected[i]);
+  }
+  ASSERT_EQ(latency.getStage(ShareLatency::STAGE_SHARELOG_QUEUE).getCount(), 0u);
+
+  // the sharelog's queue is only recorded while tracing, solved shares always
+  ShareLatency::sharelogDelivered(500, &latency);
+  ShareLatency::solvedShareDelivered(500, &latency);
+  ASSERT_EQ(latency.getStage(ShareLatency::STAGE_SHARELOG_QUEUE).getCount(), 0u);
+  ASSERT_EQ(latency.getStage(ShareLatency::STAGE_SOLVED_QUEUE).getCount(), 1u);
+  latency.setSampleRate(100);
+  ShareLatency::sharelogDelivered(500, &latency);
+  ASSERT_EQ(latency.getStage(ShareLatency::STAGE_SHARELOG_QUEUE).getCount(), 1u);
+
+  // a clock going backwards is 0
+  latency.record(ShareLatency::STAGE_SOLVED_PRODUCE, -5);
+  ASSERT_EQ(latency.getStage(ShareLatency::STAGE_SOLVED_PRODUCE).getMax(), 0u);
+
+  const string json = latency.toJson();
+  ASSERT_NE(json.find("\"sample_rate\":100,\"log_trace\":false"), string::npos);
+  ASSERT_NE(json.find("\"total\":{\"count\":1,\"mean\":360,"), string::npos);
+  ASSERT_NE(json.find("\"solved_queue\":{\"count\":1,"), string::npos);
+  JsonNode jnode;
+  ASSERT_EQ(JsonNode::parse(json.data(), json.data() + json.size(), jnode), true);
+
+  latency.reset();
+  for (int32_t i = 0; i < ShareLatency::STAGES_NUM; i++) {
+    ASSERT_EQ(latency.getStage((ShareLatency::Stage)i).getCount(), 0u);
+  }
+}
+
+TEST(StratumServer, CoinbasePrefixBenchmark) {
+  StratumJobEx exJob(makeTestStratumJob(), true);
+  StratumJob *sjob = exJob.sjob_;
+  const uint32_t extraNonce1 = 0x01020304u;
+  const int32_t kShares = 20000;
+  uint256 target;
+  uint32_t dummy = 0;
+
+  // old: build the coinbase from hex and calc the job target for every share
+  int64_t begin = getMonotonicTimeUs();
+  for (int32_t i = 0; i < kShares; i++) {
+    CBlockHeader header;
+    std::vector<char> coinbaseBin;
+    DiffToTarget(1024, target);
+    exJob.generateBlockHeader(&header, &coinbaseBin, extraNonce1,
+                              Strings::Format("%016llx", (uint64_t)i),
+                              sjob->merkleBranch_, sjob->prevHash_,
+                              sjob->nBits_, sjob->nVersion_, sjob->nTime_, i);
+    dummy += *header.GetHash().begin();
+  }
+  const int64_t oldUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  // new: midstate and job target are cached by the session
+  begin = getMonotonicTimeUs();
+  StratumSession::LocalJob ljob;
+  StratumSession::ShareCheckCache cache;
+  for (int32_t i = 0; i < kShares; i++) {
+    CBlockHeader header;
+    uint256 blkHash;
+    cache.getJobTarget(1024);
+    CoinbasePrefix *prefix = cache.getCoinbasePrefix(&ljob);
+    if (!prefix->isReady_) {
+      exJob.initCoinbasePrefix(prefix, extraNonce1);
+    }
+    exJob.generateBlockHeader(&header, &blkHash, *prefix,
+                              (uint64_t)i, sjob->nTime_, i);
+    dummy += *blkHash.begin();
+  }
+  const int64_t newUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  LOG(INFO) << "check share, shares/sec per core, old: "
+  << kShares * 1000000LL / oldUs << ", with coinbase prefix: "
+  << kShares * 1000000LL / newUs << " (" << dummy << ")";
+}
+
+//
+// the old sserver of a handover: it hands over one session and waits for
+// ACK. ack is the record it got, 0 if the new one closed the connection
+//
+static void runOldSServer(const int listenSock, const int sessionFd,
+                          atomic<uint32_t> *ack) {
+  const int sock = accept(listenSock, nullptr, nullptr);
+  uint32_t type = 0;
+  evutil_socket_t fd = -1;
+  string payload;
+  if (sock < 0 || !HotRestart::recvRecord(sock, &type, &fd, &payload) ||
+      type != HotRestart::RECORD_HELLO ||
+      !HotRestart::sendRecord(sock, HotRestart::RECORD_SESSION, sessionFd, "state") ||
+      !HotRestart::sendRecord(sock, HotRestart::RECORD_END, -1, "")) {
+    *ack = 0;
+  } else {
+    *ack = HotRestart::recvRecord(sock, &type, &fd, &payload) ? type : 0;
+  }
+  if (sock >= 0) {
+    close(sock);
+  }
+}
+
+TEST(StratumServer, HotRestartTakeOver) {
+  Server server(10);
+  JobRepository jobRepository("", "", &server);
+  const string path = Strings::Format("/tmp/sserver_handoff_test_%d.sock", (int)getpid());
+
+  for (int i = 0; i < 2; i++) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    const int listenSock = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(::bind(listenSock, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(listenSock, 1), 0);
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    atomic<uint32_t> ack(UINT32_MAX);
+    thread oldSServer(runOldSServer, listenSock, fds[0], &ack);
+    {
+      HotRestart hotRestart(&server, path, 1);
+      vector<evutil_socket_t> listenFds;
+      vector<HandoffSession> sessions;
+      ASSERT_EQ(hotRestart.takeOver(&jobRepository, listenFds, sessions), true);
+      ASSERT_EQ(listenFds.size(), 0u);
+      ASSERT_EQ(sessions.size(), 1u);
+      ASSERT_EQ(sessions[0].state_, "state");
+      close(sessions[0].fd_);
+
+      // the old sserver keeps the sessions until the new one is set up
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      ASSERT_EQ(ack.load(), UINT32_MAX);
+      if (i == 0) {
+        ASSERT_EQ(hotRestart.setup(), true);
+        ASSERT_EQ(hotRestart.finishTakeOver(), true);
+      }
+      // i == 1: the new sserver fails, the connection is closed without ACK
+    }
+    oldSServer.join();
+    ASSERT_EQ(ack.load(), i == 0 ? (uint32_t)HotRestart::RECORD_ACK : 0u);
+    close(listenSock);
+    close(fds[0]);
+    close(fds[1]);
+  }
+  unlink(path.c_str());
+}
+
+// raw bytes of a record, the fd goes with them if it's not -1
+static bool sendRecordBytes(const int sock, const void *data, const size_t len,
+                            const int fd) {
+  struct iovec iov;
+  iov.iov_base = (void *)data;
+  iov.iov_len  = len;
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov    = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0) {
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len;
+}
+
+static bool isFdOpen(const int fd) {
+  return fcntl(fd, F_GETFD) != -1;
+}
+
+TEST(StratumServer, HotRestartRecord) {
+  int socks[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, socks), 0);
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  uint32_t type = 0;
+  evutil_socket_t fd = -1;
+  string payload;
+
+  // a record with a fd, it's a dup of the sent one
+  ASSERT_EQ(HotRestart::sendRecord(socks[0], HotRestart::RECORD_SESSION, fds[0], "state"), true);
+  ASSERT_EQ(HotRestart::recvRecord(socks[1], &type, &fd, &payload), true);
+  ASSERT_EQ(type, (uint32_t)HotRestart::RECORD_SESSION);
+  ASSERT_EQ(payload, "state");
+  ASSERT_NE(fd, -1);
+  ASSERT_NE(fd, fds[0]);
+  ASSERT_EQ(write(fd, "ping", 4), 4);
+  char buf[4];
+  ASSERT_EQ(read(fds[1], buf, sizeof(buf)), 4);
+  ASSERT_EQ(string(buf, 4), "ping");
+  close(fd);
+
+  // an empty one
+  ASSERT_EQ(HotRestart::sendRecord(socks[0], HotRestart::RECORD_END, -1, ""), true);
+  ASSERT_EQ(HotRestart::recvRecord(socks[1], &type, &fd, &payload), true);
+  ASSERT_EQ(type, (uint32_t)HotRestart::RECORD_END);
+  ASSERT_EQ(payload, "");
+  ASSERT_EQ(fd, -1);
+
+  // larger than the socket's buffer, it's sent while it's read
+  const string large(4 * 1024 * 1024, 'x');
+  bool isSent = false;
+  thread sender([&] {
+    isSent = HotRestart::sendRecord(socks[0], HotRestart::RECORD_JOB, -1, large);
+  });
+  ASSERT_EQ(HotRestart::recvRecord(socks[1], &type, &fd, &payload), true);
+  sender.join();
+  ASSERT_EQ(isSent, true);
+  ASSERT_EQ(type, (uint32_t)HotRestart::RECORD_JOB);
+  ASSERT_EQ(payload == large, true);
+
+  // the header and the payload come in pieces, the fd with the first one
+  const uint32_t header[2] = {HotRestart::RECORD_LISTEN, 5};
+  thread slowSender([&] {
+    const char *p = (const char *)header;
+    sendRecordBytes(socks[0], p, 3, fds[0]);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    sendRecordBytes(socks[0], p + 3, sizeof(header) - 3, -1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    sendRecordBytes(socks[0], "hel", 3, -1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    sendRecordBytes(socks[0], "lo", 2, -1);
+  });
+  ASSERT_EQ(HotRestart::recvRecord(socks[1], &type, &fd, &payload), true);
+  slowSender.join();
+  ASSERT_EQ(type, (uint32_t)HotRestart::RECORD_LISTEN);
+  ASSERT_EQ(payload, "hello");
+  ASSERT_NE(fd, -1);
+  close(fd);
+
+  // too large, the fd is closed
+  const uint32_t tooLarge[2] = {HotRestart::RECORD_SESSION,
+                                HotRestart::kMaxRecordSize_ + 1};
+  ASSERT_EQ(sendRecordBytes(socks[0], tooLarge, sizeof(tooLarge), fds[0]), true);
+  const int nextFd = dup(fds[0]);
+  close(nextFd);  // the fd the received one would get
+  ASSERT_EQ(HotRestart::recvRecord(socks[1], &type, &fd, &payload), false);
+  ASSERT_EQ(fd, -1);
+  ASSERT_EQ(isFdOpen(nextFd), false);
+
+  // closed by the peer in a record, and before one
+  ASSERT_EQ(sendRecordBytes(socks[0], header, sizeof(header), -1), true);
+  close(socks[0]);
+  ASSERT_EQ(HotRestart::recvRecord(socks[1], &type, &fd, &payload), false);
+  ASSERT_EQ(HotRestart::recvRecord(socks[1], &type, &fd, &payload), false);
+  ASSERT_EQ(fd, -1);
+
+  close(socks[1]);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(StratumServer, HandoffTask) {
+  vector<HandoffSession> sessions(2);
+  sessions[0].fd_ = 10;
+  sessions[1].fd_ = 11;
+
+  // two reactors, both finish
+  {
+    HandoffTask task(2);
+    ASSERT_EQ(task.finishReactor(sessions), true);
+    ASSERT_EQ(sessions.size(), 0u);
+    ASSERT_EQ(task.wait(0), false);
+
+    vector<HandoffSession> others(1);
+    others[0].fd_ = 12;
+    thread reactor([&] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      task.finishReactor(others);
+    });
+    ASSERT_EQ(task.wait(5000), true);
+    reactor.join();
+    ASSERT_EQ(task.isCancelled(), false);
+    ASSERT_EQ(task.sessions_.size(), 3u);
+    ASSERT_EQ(task.sessions_[2].fd_, 12);
+    sessions.swap(task.sessions_);
+  }
+
+  // one reactor is late, the taken sessions are returned by cancel() and
+  // the late one keeps its sessions
+  {
+    HandoffTask task(2);
+    vector<HandoffSession> late(1);
+    late[0].fd_ = 13;
+    ASSERT_EQ(task.finishReactor(sessions), true);
+    ASSERT_EQ(task.wait(10), false);
+
+    vector<HandoffSession> taken;
+    task.cancel(taken);
+    ASSERT_EQ(task.isCancelled(), true);
+    ASSERT_EQ(taken.size(), 3u);
+    ASSERT_EQ(taken[0].fd_, 10);
+    ASSERT_EQ(task.sessions_.size(), 0u);
+
+    ASSERT_EQ(task.finishReactor(late), false);
+    ASSERT_EQ(late.size(), 1u);
+    ASSERT_EQ(late[0].fd_, 13);
+    ASSERT_EQ(task.sessions_.size(), 0u);
+    ASSERT_EQ(task.wait(0), false);
+  }
+}
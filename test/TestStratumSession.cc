@@ -87,8 +87,112 @@ TEST(StratumSession, LocalJob) {
   }
 }
 
+TEST(StratumSession, LocalShareSet) {
+  StratumSession::LocalShareSet shares;
+  std::set<StratumSession::LocalShare> expected;
+  std::mt19937 gen(1);
+
+  for (int i = 0; i < 50000; i++) {
+    // small ranges to get duplicates, and the zero share
+    StratumSession::LocalShare ls(gen() % 64, gen() % 64, gen() % 16);
+    if (i % 1000 == 0) {
+      ls = StratumSession::LocalShare(0, 0, 0);
+    }
+    const bool isNew = (expected.insert(ls).second);
+    ASSERT_EQ(shares.insert(ls), isNew);
+    ASSERT_EQ(shares.contains(ls), true);
+  }
+  ASSERT_EQ(shares.size(), expected.size());
+
+  for (int i = 0; i < 10000; i++) {
+    StratumSession::LocalShare ls(gen() % 128, gen() % 128, gen() % 32);
+    ASSERT_EQ(shares.contains(ls), expected.count(ls) > 0);
+  }
+}
+
+TEST(StratumSession, LocalShareSetFull) {
+  StratumSession::LocalJob lj;
+  const uint32_t kMax = StratumSession::LocalShareSet::kMaxShares_;
+
+  for (uint32_t i = 0; i < kMax; i++) {
+    ASSERT_EQ(lj.isLocalSharesFull(), false);
+    ASSERT_EQ(lj.addLocalShare(StratumSession::LocalShare(i, i, i)), true);
+  }
+  ASSERT_EQ(lj.isLocalSharesFull(), true);
+  ASSERT_LE(lj.submitShares_.memoryUsage(),
+            2 * kMax * sizeof(StratumSession::LocalShare));
+}
+
+TEST(StratumSession, MemoryLayout) {
+  // a job without shares allocates nothing, a few shares take a small table
+  StratumSession::LocalJob lj;
+  ASSERT_EQ(lj.submitShares_.memoryUsage(), 0u);
+  for (uint32_t i = 1; i <= 3; i++) {
+    lj.addLocalShare(StratumSession::LocalShare(i, i, i));
+  }
+  ASSERT_EQ(lj.submitShares_.memoryUsage(), 8 * sizeof(StratumSession::LocalShare));
+
+  // the local jobs are a fixed ring in the session
+  ASSERT_LE(sizeof(StratumSession::LocalJob), 64u);
+
+  // the vardiff states are fixed size
+  WindowDiffController window(10);
+  EwmaDiffController ewma(10);
+  // the window vardiff keeps the running sums of its records for O(1) sums
+  ASSERT_LE(window.getMemoryUsage(), 3072u);
+  ASSERT_LE(ewma.getMemoryUsage(), 128u);
+
+  // a session before its first share is under 2 KB with the ewma vardiff
+  ASSERT_LE(sizeof(StratumSession) + ewma.getMemoryUsage(), 2048u);
+  ASSERT_LE(sizeof(StratumSession) + window.getMemoryUsage(), 2048u + 3072u);
+}
+
+TEST(StratumSession, LocalShareSetBenchmark) {
+  //
+  // an agent submits 100 shares/sec, a new job every 30 seconds,
+  // the session keeps 10 jobs
+  //
+  const int32_t kJobs = 10;
+  const int32_t kSharesPerJob = 100 * 30;
+  std::mt19937_64 gen(1);
+  vector<StratumSession::LocalShare> submits;
+  for (int32_t i = 0; i < kJobs * kSharesPerJob; i++) {
+    // agent: session id in the high bits of extra nonce2
+    submits.push_back(StratumSession::LocalShare((gen() % 1000) << 32 | (uint32_t)gen(),
+                                                 (uint32_t)gen(), 1500000000u + i / 100));
+  }
+
+  int64_t begin = getMonotonicTimeUs();
+  vector<std::set<StratumSession::LocalShare> > sets(kJobs);
+  for (size_t i = 0; i < submits.size(); i++) {
+    std::set<StratumSession::LocalShare> &s = sets[i / kSharesPerJob];
+    if (s.find(submits[i]) == s.end()) {
+      s.insert(submits[i]);
+    }
+  }
+  const int64_t setUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+  // rb-tree node: 3 pointers + color + LocalShare, malloc overhead
+  const size_t setBytes = submits.size() * (32 + sizeof(StratumSession::LocalShare) + 16);
+
+  begin = getMonotonicTimeUs();
+  vector<StratumSession::LocalShareSet> flatSets(kJobs);
+  for (size_t i = 0; i < submits.size(); i++) {
+    flatSets[i / kSharesPerJob].insert(submits[i]);
+  }
+  const int64_t flatUs = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+  size_t flatBytes = 0;
+  for (const auto &s : flatSets) {
+    flatBytes += s.memoryUsage();
+  }
+
+  LOG(INFO) << "local shares of " << submits.size() << " shares, std::set: "
+  << setBytes / 1024 << " KiB, " << setUs * 1000 / (int64_t)submits.size()
+  << " ns/share; LocalShareSet: " << flatBytes / 1024 << " KiB, "
+  << flatUs * 1000 / (int64_t)submits.size() << " ns/share";
+}
+
 TEST(StratumSession, AgentSessions_RegisterWorker) {
-  AgentSessions agent(10, nullptr);
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
 
   // | magic_number(1) | cmd(1) | len (2) | session_id(2) | clientAgent | worker_name |
   string exMessage;
@@ -126,7 +230,7 @@ TEST(StratumSession, AgentSessions_RegisterWorker) {
 }
 
 TEST(StratumSession, AgentSessions_RegisterWorker2) {
-  AgentSessions agent(10, nullptr);
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
 
   // | magic_number(1) | cmd(1) | len (2) | session_id(2) | clientAgent | worker_name |
   string exMessage;
@@ -164,7 +268,7 @@ TEST(StratumSession, AgentSessions_RegisterWorker2) {
 }
 
 TEST(StratumSession, AgentSessions_RegisterWorker3) {
-  AgentSessions agent(10, nullptr);
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
 
   // | magic_number(1) | cmd(1) | len (2) | session_id(2) | clientAgent | worker_name |
   string exMessage;
@@ -202,7 +306,7 @@ TEST(StratumSession, AgentSessions_RegisterWorker3) {
 }
 
 TEST(StratumSession, AgentSessions_RegisterWorker4) {
-  AgentSessions agent(10, nullptr);
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
 
   // | magic_number(1) | cmd(1) | len (2) | session_id(2) | clientAgent | worker_name |
   string exMessage;
@@ -290,7 +394,7 @@ TEST(StratumSession, AgentSessions_RegisterWorker4) {
 }
 
 TEST(StratumSession, AgentSessions_SubmitShare) {
-  AgentSessions agent(10, nullptr);
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
 
   //
   // CMD_SUBMIT_SHARE / CMD_SUBMIT_SHARE_WITH_TIME:
@@ -330,7 +434,7 @@ TEST(StratumSession, AgentSessions_SubmitShare) {
 }
 
 TEST(StratumSession, AgentSessions_SubmitShare_with_time) {
-  AgentSessions agent(10, nullptr);
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
 
   //
   // CMD_SUBMIT_SHARE / CMD_SUBMIT_SHARE_WITH_TIME:
@@ -373,7 +477,7 @@ TEST(StratumSession, AgentSessions_SubmitShare_with_time) {
 }
 
 TEST(StratumSession, AgentSessions_UNREGISTER_WORKER) {
-  AgentSessions agent(10, nullptr);
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
   //
   // CMD_UNREGISTER_WORKER:
   // | magic_number(1) | cmd(1) | len(2) | session_id(2) |
@@ -399,7 +503,7 @@ TEST(StratumSession, AgentSessions_UNREGISTER_WORKER) {
 }
 
 TEST(StratumSession, AgentSessions) {
-  AgentSessions agent(10, nullptr);
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
 
   map<uint8_t, vector<uint16_t> > diffSessionIds;
   string data;
@@ -466,6 +570,123 @@ TEST(StratumSession, AgentSessions) {
   }
 }
 
+static void registerAgentWorker(AgentSessions &agent, const uint16_t sessionId,
+                                const string &workerName) {
+  // | magic_number(1) | cmd(1) | len (2) | session_id(2) | clientAgent | worker_name |
+  const string clientAgent = "cgminer/4.9";
+  string exMessage;
+  exMessage.resize(1+1+2+2 + clientAgent.length() + 1 + workerName.length() + 1, 0);
+
+  uint8_t *p = (uint8_t *)exMessage.data();
+  *p++ = CMD_MAGIC_NUMBER;
+  *p++ = CMD_REGISTER_WORKER;
+  *(uint16_t *)p = (uint16_t)exMessage.size();
+  p += 2;
+  *(uint16_t *)p = sessionId;
+  p += 2;
+  strcpy((char *)p, clientAgent.c_str());
+  p += clientAgent.length() + 1;
+  strcpy((char *)p, workerName.c_str());
+
+  agent.handleExMessage_RegisterWorker(&exMessage);
+}
+
+static void unregisterAgentWorker(AgentSessions &agent, const uint16_t sessionId) {
+  // | magic_number(1) | cmd(1) | len(2) | session_id(2) |
+  string exMessage;
+  exMessage.resize(6, 0);
+  uint8_t *p = (uint8_t *)exMessage.data();
+  *p++ = CMD_MAGIC_NUMBER;
+  *p++ = CMD_UNREGISTER_WORKER;
+  *(uint16_t *)p = (uint16_t)exMessage.size();
+  p += 2;
+  *(uint16_t *)p = sessionId;
+
+  agent.handleExMessage_UnRegisterWorker(&exMessage);
+}
+
+TEST(StratumSession, AgentSessions_DiffTable) {
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
+  const uint8_t kDefault = (uint8_t)log2(DiffController::kDefaultDiff_);
+  string data;
+
+  registerAgentWorker(agent, AGENT_MAX_SESSION_ID, "w0");
+  registerAgentWorker(agent, 7, "w1");
+  registerAgentWorker(agent, 300, "w2");
+  ASSERT_EQ(agent.getSessionsCount(), 3u);
+  ASSERT_EQ(agent.getWorkerId(7), StratumWorker::calcWorkerId("w1"));
+  ASSERT_EQ(agent.getWorkerId(8), 0);
+  ASSERT_EQ(agent.getDiffController(8), nullptr);
+  ASSERT_NE(agent.getDiffController(300), nullptr);
+
+  // all of them have the default diff
+  shared_ptr<const AgentDiffTable> t1 = agent.calcSessionsJobDiff();
+  ASSERT_EQ(t1->sessionIds_.size(), 3u);
+  ASSERT_EQ(t1->sessionIds_[0], 7);
+  ASSERT_EQ(t1->sessionIds_[2], AGENT_MAX_SESSION_ID);
+  ASSERT_EQ(t1->getDiff2Exp(300), kDefault);
+  ASSERT_EQ(t1->getDiff2Exp(8),   kDefault);  // not registered
+  agent.getSessionsChangedDiff(*t1, data);
+  ASSERT_EQ(data.size(), 0u);
+
+  // nothing changed, the table is shared
+  shared_ptr<const AgentDiffTable> t2 = agent.calcSessionsJobDiff();
+  ASSERT_EQ(t1.get(), t2.get());
+
+  // one session's diff is changed
+  agent.getDiffController(300)->resetCurDiff(1 << 20);
+  shared_ptr<const AgentDiffTable> t3 = agent.calcSessionsJobDiff();
+  ASSERT_NE(t2.get(), t3.get());
+  ASSERT_EQ(t3->getDiff2Exp(300), 20);
+  ASSERT_EQ(t3->getDiff2Exp(7),   kDefault);
+  ASSERT_EQ(t2->getDiff2Exp(300), kDefault);  // the old job keeps its diff
+
+  // | magic_number(1) | cmd(1) | len (2) | diff_2_exp(1) | count(2) | session_id (2) ... |
+  agent.getSessionsChangedDiff(*t3, data);
+  ASSERT_EQ(data.size(), 9u);
+  ASSERT_EQ(*(uint8_t  *)(data.data() + 4), 20);
+  ASSERT_EQ(*(uint16_t *)(data.data() + 5), 1);
+  ASSERT_EQ(*(uint16_t *)(data.data() + 7), 300);
+  agent.getSessionsChangedDiff(*t3, data);
+  ASSERT_EQ(data.size(), 0u);
+
+  // un-register
+  unregisterAgentWorker(agent, 7);
+  ASSERT_EQ(agent.getSessionsCount(), 2u);
+  ASSERT_EQ(agent.getWorkerId(7), 0);
+  shared_ptr<const AgentDiffTable> t4 = agent.calcSessionsJobDiff();
+  ASSERT_EQ(t4->sessionIds_.size(), 2u);
+  ASSERT_EQ(t3->getDiff2Exp(7), kDefault);
+
+  // re-register gets a new diff controller with the default diff
+  registerAgentWorker(agent, 300, "w3");
+  ASSERT_EQ(agent.getSessionsCount(), 2u);
+  ASSERT_EQ(agent.getWorkerId(300), StratumWorker::calcWorkerId("w3"));
+  ASSERT_EQ(agent.calcSessionsJobDiff()->getDiff2Exp(300), kDefault);
+}
+
+TEST(StratumSession, AgentSessionsBenchmark) {
+  // an agent with 100 workers, the old tables had 65535 slots
+  AgentSessions agent(10, DiffController::TYPE_WINDOW, nullptr);
+  for (uint16_t i = 0; i < 100; i++) {
+    registerAgentWorker(agent, i * 3, Strings::Format("w%u", i));
+  }
+
+  const int32_t kNotifies = 10000;
+  string data;
+  size_t dummy = 0;
+  const int64_t begin = getMonotonicTimeUs();
+  for (int32_t i = 0; i < kNotifies; i++) {
+    shared_ptr<const AgentDiffTable> table = agent.calcSessionsJobDiff();
+    agent.getSessionsChangedDiff(*table, data);
+    dummy += data.size() + table->getDiff2Exp(i % 300);
+  }
+  const int64_t us = std::max<int64_t>(getMonotonicTimeUs() - begin, 1);
+
+  LOG(INFO) << "agent sessions, 100 workers, ns/notify: "
+  << us * 1000 / kNotifies << " (" << dummy << ")";
+}
+
 TEST(StratumSession, SetDiff) {
   using namespace boost::algorithm;
 
@@ -603,3 +824,333 @@ TEST(StratumSession, SetDiff) {
     }
   }
 }
+
+
+//////////////////////////////// DiffController ////////////////////////////////
+TEST(DiffController, Type) {
+  DiffController::Type type;
+  ASSERT_EQ(DiffController::parseType("window", type), true);
+  ASSERT_EQ(type, DiffController::TYPE_WINDOW);
+  ASSERT_EQ(DiffController::parseType("ewma", type), true);
+  ASSERT_EQ(type, DiffController::TYPE_EWMA);
+  ASSERT_EQ(DiffController::parseType("EWMA", type), false);
+
+  std::unique_ptr<DiffController> window(DiffController::create(DiffController::TYPE_WINDOW, 10));
+  std::unique_ptr<DiffController> ewma  (DiffController::create(DiffController::TYPE_EWMA,   10));
+  ASSERT_NE(dynamic_cast<WindowDiffController *>(window.get()), nullptr);
+  ASSERT_NE(dynamic_cast<EwmaDiffController *>(ewma.get()), nullptr);
+}
+
+TEST(DiffController, HandoffState) {
+  const int64_t kSecond = 1000000;
+  const int64_t kStart  = 1000000 * kSecond;
+  const int32_t kShareAvgSeconds = 10;
+
+  for (const DiffController::Type type : {DiffController::TYPE_WINDOW,
+                                          DiffController::TYPE_EWMA}) {
+    std::unique_ptr<DiffController> dc(DiffController::create(type, kShareAvgSeconds));
+    dc->setMinDiff(DiffController::kMinDiff_);
+    int64_t now = kStart;
+    uint64_t diff = dc->calcCurDiff(now);
+    for (int32_t i = 0; i < 50; i++) {
+      now += kSecond;
+      if (dc->addAcceptedShare(diff, now)) {
+        diff = dc->calcCurDiff(now);
+      }
+    }
+
+    string state;
+    HandoffWriter writer(state);
+    dc->saveState(writer);
+
+    // the same controller in the next process
+    std::unique_ptr<DiffController> restored(DiffController::create(type, kShareAvgSeconds));
+    HandoffReader reader((const uint8_t *)state.data(), state.size());
+    ASSERT_TRUE(restored->restoreState(reader));
+    ASSERT_TRUE(reader.isEnd());
+    for (int32_t i = 0; i < 50; i++) {
+      now += 3 * kSecond;
+      ASSERT_EQ(restored->addAcceptedShare(diff, now), dc->addAcceptedShare(diff, now));
+      ASSERT_EQ(restored->calcCurDiff(now), dc->calcCurDiff(now));
+      diff = dc->calcCurDiff(now);
+    }
+
+    // another type keeps the diff only
+    const DiffController::Type other = (type == DiffController::TYPE_WINDOW) ?
+                                       DiffController::TYPE_EWMA :
+                                       DiffController::TYPE_WINDOW;
+    state.clear();
+    dc->saveState(writer);
+    std::unique_ptr<DiffController> changed(DiffController::create(other, kShareAvgSeconds));
+    HandoffReader reader2((const uint8_t *)state.data(), state.size());
+    ASSERT_TRUE(changed->restoreState(reader2));
+    ASSERT_TRUE(reader2.isEnd());
+    ASSERT_EQ(changed->getType(), other);
+    ASSERT_EQ(changed->calcCurDiff(now), diff);
+
+    // truncated
+    HandoffReader reader3((const uint8_t *)state.data(), state.size() - 1);
+    std::unique_ptr<DiffController> broken(DiffController::create(type, kShareAvgSeconds));
+    ASSERT_FALSE(broken->restoreState(reader3));
+  }
+}
+
+TEST(DiffController, Ewma) {
+  const int64_t kSecond = 1000000;
+  const int64_t kStart  = 1000000 * kSecond;
+  const int32_t kShareAvgSeconds = 10;
+
+  //
+  // too fast: 2^20 diff per second, shares at the default diff
+  //
+  {
+    EwmaDiffController dc(kShareAvgSeconds);
+    const uint64_t kTarget = (1 << 20) * kShareAvgSeconds;
+    uint64_t diff = dc.calcCurDiff(kStart);
+    ASSERT_EQ(diff, (uint64_t)DiffController::kDefaultDiff_);
+
+    const int64_t interval = kSecond * (int64_t)diff / (1 << 20);
+    int64_t now = kStart;
+    bool isRetarget = false;
+    for (int32_t i = 0; i < EwmaDiffController::kMinShares_; i++) {
+      ASSERT_EQ(isRetarget, false);
+      now += interval;
+      isRetarget = dc.addAcceptedShare(diff, now);
+    }
+    ASSERT_EQ(isRetarget, true);  // doesn't wait for the next job
+
+    // n shares in the time of n intervals, the hashrate before the last one
+    diff = dc.calcCurDiff(now);
+    const uint64_t kEstimated = kTarget * (EwmaDiffController::kMinShares_ - 1) /
+                                EwmaDiffController::kMinShares_;
+    ASSERT_GE(diff, kEstimated * 99 / 100);
+    ASSERT_LE(diff, kEstimated * 101 / 100);
+
+    // at the right diff, nothing changes
+    for (int32_t i = 0; i < 100; i++) {
+      now += kShareAvgSeconds * kSecond;
+      ASSERT_EQ(dc.addAcceptedShare(diff, now), false);
+    }
+    ASSERT_EQ(dc.calcCurDiff(now), diff);
+  }
+
+  //
+  // too slow: no share at all, the diff goes down by the time
+  //
+  {
+    EwmaDiffController dc(kShareAvgSeconds);
+    dc.setMinDiff(DiffController::kMinDiff_);
+    dc.resetCurDiff(1 << 20);
+    uint64_t diff = dc.calcCurDiff(kStart);
+    ASSERT_EQ(diff, 1u << 20);
+
+    // not enough time to know
+    int64_t now = kStart + kShareAvgSeconds * kSecond;
+    ASSERT_EQ(dc.calcCurDiff(now), diff);
+
+    for (int32_t i = 0; i < 20; i++) {
+      now += 30 * kSecond;  // a job every 30 seconds
+      const uint64_t newDiff = dc.calcCurDiff(now);
+      ASSERT_LE(newDiff, diff);
+      diff = newDiff;
+    }
+    ASSERT_EQ(diff, (uint64_t)DiffController::kMinDiff_);
+  }
+
+  //
+  // min diff of the worker
+  //
+  {
+    EwmaDiffController dc(kShareAvgSeconds);
+    dc.setMinDiff(1 << 16);
+    dc.resetCurDiff(DiffController::kMinDiff_);
+    ASSERT_EQ(dc.calcCurDiff(kStart), 1u << 16);
+    ASSERT_EQ(dc.calcCurDiff(kStart + 3600 * kSecond), 1u << 16);
+  }
+}
+
+//
+// miners with Poisson distributed shares. a job every 30 seconds, the diff is
+// also changed when addAcceptedShare() asks for it, as the session does.
+//
+struct VarDiffSimResult {
+  double  convergeSeconds_;  // since then the diff is in [1/2, 2] of the target
+  int64_t convergeShares_;   // shares before it, the flood of a new miner
+  double  shareRateCV_;      // of the shares per minute after the warm up
+  double  diffCV_;           // of the diff to the target after the warm up
+  int32_t diffChanges_;
+};
+
+static VarDiffSimResult simulateVarDiff(const DiffController::Type type,
+                                        const double hashRate,
+                                        const double newHashRate,
+                                        const double changeSeconds,
+                                        const double totalSeconds,
+                                        const uint32_t seed) {
+  const int32_t kShareAvgSeconds = 10;
+  const double  kJobSeconds      = 30.0;
+  const double  kWarmUpSeconds   = 1800.0;
+  const int64_t kStart           = 1000000LL * 1000000;  // us
+
+  std::unique_ptr<DiffController> dc(DiffController::create(type, kShareAvgSeconds));
+  dc->resetCurDiff(16384);  // the default diff of the release build
+  std::mt19937_64 gen(seed);
+  std::exponential_distribution<double> expDist(1.0);
+
+  VarDiffSimResult res;
+  res.convergeSeconds_ = -1.0;
+  res.convergeShares_  = 0;
+  res.diffChanges_     = 0;
+
+  double t = 0.0, nextJob = kJobSeconds, rate = hashRate;
+  uint64_t diff = dc->calcCurDiff(kStart);
+  int64_t shares = 0, sharesAtChange = 0;
+  std::vector<double> sharesPerMinute;
+  double diffErrSum = 0.0, diffErrSum2 = 0.0;
+  int64_t diffErrCount = 0;
+
+  auto setDiff = [&](const uint64_t newDiff) {
+    if (newDiff != diff) {
+      res.diffChanges_++;
+    }
+    diff = newDiff;
+    const double target = rate * kShareAvgSeconds / 4294967296.0;
+    if (diff * 2.0 < target || diff > target * 2.0) {
+      res.convergeSeconds_ = -1.0;
+    } else if (res.convergeSeconds_ < 0) {
+      res.convergeSeconds_ = t;
+      res.convergeShares_  = shares - sharesAtChange;
+    }
+  };
+  setDiff(diff);
+
+  while (t < totalSeconds) {
+    if (t >= changeSeconds && rate != newHashRate) {
+      rate = newHashRate;
+      sharesAtChange = shares;
+      setDiff(diff);
+    }
+    // shares are memoryless, draw again after every change
+    const double nextShare = t + expDist(gen) * diff * 4294967296.0 / rate;
+    const double nextChange = (t < changeSeconds) ? changeSeconds : totalSeconds;
+
+    if (nextJob <= nextShare && nextJob <= nextChange) {
+      t = nextJob;
+      nextJob += kJobSeconds;
+      setDiff(dc->calcCurDiff(kStart + (int64_t)(t * 1000000)));
+    }
+    else if (nextChange <= nextShare) {
+      t = nextChange;
+    }
+    else {
+      t = nextShare;
+      shares++;
+      const int64_t now = kStart + (int64_t)(t * 1000000);
+      if (dc->addAcceptedShare(diff, now)) {
+        setDiff(dc->calcCurDiff(now));
+      }
+      if (t >= kWarmUpSeconds && t < totalSeconds) {
+        const size_t idx = (size_t)((t - kWarmUpSeconds) / 60);
+        if (sharesPerMinute.size() <= idx) {
+          sharesPerMinute.resize(idx + 1, 0.0);
+        }
+        sharesPerMinute[idx] += 1.0;
+
+        const double target = rate * kShareAvgSeconds / 4294967296.0;
+        const double err = diff / target;
+        diffErrSum  += err;
+        diffErrSum2 += err * err;
+        diffErrCount++;
+      }
+    }
+  }
+
+  double sum = 0.0, sum2 = 0.0;
+  for (double n : sharesPerMinute) {
+    sum  += n;
+    sum2 += n * n;
+  }
+  const double n = std::max<double>(sharesPerMinute.size(), 1);
+  const double mean = sum / n;
+  res.shareRateCV_ = mean > 0 ? sqrt(std::max(sum2 / n - mean * mean, 0.0)) / mean : 0.0;
+
+  const double errMean = diffErrSum / std::max<int64_t>(diffErrCount, 1);
+  res.diffCV_ = errMean > 0 ?
+    sqrt(std::max(diffErrSum2 / std::max<int64_t>(diffErrCount, 1) - errMean * errMean, 0.0)) / errMean : 0.0;
+  return res;
+}
+
+//
+// medians of the convergence, means of the rest, over the seeds
+//
+static VarDiffSimResult simulateVarDiffSeeds(const DiffController::Type type,
+                                             const double hashRate,
+                                             const double newHashRate,
+                                             const double changeSeconds,
+                                             const double totalSeconds,
+                                             const int32_t seeds) {
+  std::vector<double>  convergeSeconds;
+  std::vector<int64_t> convergeShares;
+  VarDiffSimResult avg;
+  avg.shareRateCV_ = 0.0;
+  avg.diffCV_      = 0.0;
+  avg.diffChanges_ = 0;
+
+  for (int32_t seed = 1; seed <= seeds; seed++) {
+    const VarDiffSimResult r = simulateVarDiff(type, hashRate, newHashRate,
+                                               changeSeconds, totalSeconds, seed);
+    // never converged counts as the whole run
+    convergeSeconds.push_back(r.convergeSeconds_ < 0 ? totalSeconds :
+                              r.convergeSeconds_ - changeSeconds);
+    convergeShares.push_back(r.convergeShares_);
+    avg.shareRateCV_ += r.shareRateCV_ / seeds;
+    avg.diffCV_      += r.diffCV_ / seeds;
+    avg.diffChanges_ += r.diffChanges_;
+  }
+  std::sort(convergeSeconds.begin(), convergeSeconds.end());
+  std::sort(convergeShares.begin(),  convergeShares.end());
+  avg.convergeSeconds_ = convergeSeconds[seeds / 2];
+  avg.convergeShares_  = convergeShares[seeds / 2];
+  avg.diffChanges_    /= seeds;
+  return avg;
+}
+
+TEST(DiffController, Simulation) {
+  struct Case {
+    const char *name_;
+    double hashRate_;
+    double newHashRate_;
+    double changeSeconds_;
+  };
+  const Case cases[] = {
+    {"100 TH/s, new",          100e12, 100e12,    0},
+    {" 14 TH/s, new",           14e12,  14e12,    0},
+    {"100 GH/s, new",          100e9,  100e9,     0},
+    {"100 TH/s -> 25 TH/s",    100e12,  25e12, 7200},
+    {" 14 TH/s -> 56 TH/s",     14e12,  56e12, 7200},
+  };
+  const double  kTotalSeconds = 4 * 3600;
+  const int32_t kSeeds = 20;
+
+  for (const Case &c : cases) {
+    const VarDiffSimResult w = simulateVarDiffSeeds(DiffController::TYPE_WINDOW, c.hashRate_,
+                                                    c.newHashRate_, c.changeSeconds_,
+                                                    kTotalSeconds, kSeeds);
+    const VarDiffSimResult e = simulateVarDiffSeeds(DiffController::TYPE_EWMA, c.hashRate_,
+                                                    c.newHashRate_, c.changeSeconds_,
+                                                    kTotalSeconds, kSeeds);
+    LOG(INFO) << "vardiff " << c.name_
+    << " | window: converge " << w.convergeSeconds_ << " s / " << w.convergeShares_
+    << " shares, share rate cv " << w.shareRateCV_ << ", diff cv " << w.diffCV_
+    << ", changes " << w.diffChanges_
+    << " | ewma: converge " << e.convergeSeconds_ << " s / " << e.convergeShares_
+    << " shares, share rate cv " << e.shareRateCV_ << ", diff cv " << e.diffCV_
+    << ", changes " << e.diffChanges_;
+
+    // ewma converges in a few shares
+    ASSERT_LE(e.convergeSeconds_, std::max(w.convergeSeconds_, 120.0));
+    ASSERT_LE(e.convergeShares_, std::max<int64_t>(w.convergeShares_, 20));
+    // and keeps the share rate about as steady as Poisson (1/sqrt(6) ~ 0.41)
+    ASSERT_LE(e.shareRateCV_, 0.6);
+  }
+}
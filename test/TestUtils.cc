@@ -68,4 +68,56 @@ TEST(Utils, share2HashrateG) {
   // hashrate will 0.429497 Ghs ~ 429 Mhs
   h = share2HashrateG(1, 10);
   ASSERT_EQ((int64_t)(h*1000), 429);
-}
\ No newline at end of file
+}
+TEST(Utils, InternedString) {
+  const size_t entriesNum = InternedString::getEntriesNum();
+
+  InternedString empty;
+  ASSERT_TRUE(empty.empty());
+  ASSERT_EQ(empty.str(), "");
+  ASSERT_TRUE(InternedString("") == empty);
+
+  {
+    InternedString a("bfgminer/4.4.0-32-gac4e9b3");
+    InternedString b(string("bfgminer/4.4.0-32-gac4e9b3"));
+    InternedString c("cgminer/4.9.0");
+    ASSERT_EQ(a.str(), "bfgminer/4.4.0-32-gac4e9b3");
+    ASSERT_TRUE(a == b);
+    ASSERT_TRUE(a != c);
+    ASSERT_EQ(a.c_str(), b.c_str());  // the same entry
+    ASSERT_EQ(InternedString::getEntriesNum(), entriesNum + 2);
+
+    InternedString d(a);
+    d = c;
+    ASSERT_TRUE(d == c);
+    c.clear();
+    ASSERT_TRUE(c.empty());
+    ASSERT_EQ(d.str(), "cgminer/4.9.0");
+    ASSERT_EQ(InternedString::getEntriesNum(), entriesNum + 2);
+
+    std::ostringstream os;
+    os << a;
+    ASSERT_EQ(os.str(), "bfgminer/4.4.0-32-gac4e9b3");
+  }
+  // freed with the last copy
+  ASSERT_EQ(InternedString::getEntriesNum(), entriesNum);
+}
+
+TEST(Utils, InternedStringThreads) {
+  const size_t entriesNum = InternedString::getEntriesNum();
+
+  vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([]() {
+      for (int i = 0; i < 10000; i++) {
+        InternedString s(Strings::Format("user%d", i % 100));
+        InternedString copy(s);
+        ASSERT_TRUE(copy == s);
+      }
+    }));
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(InternedString::getEntriesNum(), entriesNum);
+}